@@ -60,6 +60,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // Align the address of a variable to a certain value
 #define ALIGNED(a, x) x __attribute__((__aligned__(a)))
 
+// Gives each thread its own copy of a variable
+#define THREAD_LOCAL __thread
+
 // Shared library function import/export
 #ifdef _WIN32
 #define DLLEXPORT __attribute__((__dllexport__))
@@ -161,6 +164,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PRINTF_TRANSLATE_ARG(a)
 #define MALLOC_LIKE __declspec(restrict)
 #define ALIGNED(a,x) __declspec(align(a)) x
+#define THREAD_LOCAL __declspec(thread)
 #define DLLEXPORT __declspec(dllexport)
 #define DLLIMPORT __declspec(dllimport)
 #define OVERRIDE override
@@ -183,6 +187,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PRINTF_TRANSLATE_ARG(a)
 #define MALLOC_LIKE
 #define ALIGNED(a,x) x
+#define THREAD_LOCAL
 #define DLLEXPORT
 #define DLLIMPORT
 
@@ -197,6 +202,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define PRINTF_TRANSLATE_ARG(a)
 #define MALLOC_LIKE
 #define ALIGNED(a,x) x
+#define THREAD_LOCAL
 #define DLLEXPORT
 #define DLLIMPORT
 #endif
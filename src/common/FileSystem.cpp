@@ -651,8 +651,9 @@ static File FileFromIPC(Util::optional<IPC::FileHandle> ipcFile, openMode_t mode
 #endif
 
 #ifdef BUILD_ENGINE
-// Convert a File object to an ipc file handle
-static IPC::FileHandle FileToIPC(File file, openMode_t mode)
+// Convert a File object to an ipc file handle, which doesn't own the handle:
+// the file must stay open until the message holding it is sent
+static IPC::FileHandle FileToIPC(const File& file, openMode_t mode)
 {
 	if (!file)
 		return IPC::FileHandle();
@@ -2321,13 +2322,16 @@ void HandleFileSystemSyscall(int minor, IPC::Reader& reader, IPC::Channel& chann
 		});
 		break;
 
-	case VM::FS_HOMEPATH_OPENMODE:
-		IPC::HandleMsg<VM::FSHomePathOpenModeMsg>(channel, std::move(reader), [](std::string path, uint32_t mode, Util::optional<IPC::FileHandle>& out) {
+	case VM::FS_HOMEPATH_OPENMODE: {
+		File file; // closed once the reply sent the VM its own handle
+		IPC::HandleMsg<VM::FSHomePathOpenModeMsg>(channel, std::move(reader), [&file](std::string path, uint32_t mode, Util::optional<IPC::FileHandle>& out) {
 			try {
-				out = FileToIPC(HomePath::OpenMode(path, static_cast<openMode_t>(mode), throws()), static_cast<openMode_t>(mode));
+				file = HomePath::OpenMode(path, static_cast<openMode_t>(mode), throws());
+				out = FileToIPC(file, static_cast<openMode_t>(mode));
 			} catch (std::system_error& err) {}
 		});
 		break;
+	}
 
 	case VM::FS_HOMEPATH_FILEEXISTS:
 		IPC::HandleMsg<VM::FSHomePathFileExistsMsg>(channel, std::move(reader), [](std::string path, bool& out) {
@@ -2344,7 +2348,7 @@ void HandleFileSystemSyscall(int minor, IPC::Reader& reader, IPC::Channel& chann
 		break;
 
 	case VM::FS_HOMEPATH_MOVEFILE:
-		IPC::HandleMsg<VM::FSHomePathMoveFileMsg>(channel, std::move(reader), [](std::string dest, std::string src, bool success) {
+		IPC::HandleMsg<VM::FSHomePathMoveFileMsg>(channel, std::move(reader), [](std::string dest, std::string src, bool& success) {
 			try {
 				HomePath::MoveFile(dest, src);
 				success = true;
@@ -2355,7 +2359,7 @@ void HandleFileSystemSyscall(int minor, IPC::Reader& reader, IPC::Channel& chann
 		break;
 
 	case VM::FS_HOMEPATH_DELETEFILE:
-		IPC::HandleMsg<VM::FSHomePathDeleteFileMsg>(channel, std::move(reader), [](std::string path, bool success) {
+		IPC::HandleMsg<VM::FSHomePathDeleteFileMsg>(channel, std::move(reader), [](std::string path, bool& success) {
 			try {
 				HomePath::DeleteFile(path);
 				success = true;
@@ -2387,8 +2391,9 @@ void HandleFileSystemSyscall(int minor, IPC::Reader& reader, IPC::Channel& chann
 		});
 		break;
 
-	case VM::FS_PAKPATH_OPEN:
-		IPC::HandleMsg<VM::FSPakPathOpenMsg>(channel, std::move(reader), [](uint32_t pakIndex, std::string path, Util::optional<IPC::FileHandle>& out) {
+	case VM::FS_PAKPATH_OPEN: {
+		File file; // closed once the reply sent the VM its own handle
+		IPC::HandleMsg<VM::FSPakPathOpenMsg>(channel, std::move(reader), [&file](uint32_t pakIndex, std::string path, Util::optional<IPC::FileHandle>& out) {
 			auto& loadedPaks = FS::PakPath::GetLoadedPaks();
 			if (loadedPaks.size() <= pakIndex)
 				return;
@@ -2397,10 +2402,12 @@ void HandleFileSystemSyscall(int minor, IPC::Reader& reader, IPC::Channel& chann
 			if (!Path::IsValid(path, false))
 				return;
 			try {
-				out = FileToIPC(RawPath::OpenRead(Path::Build(loadedPaks[pakIndex].path, path)), MODE_READ);
+				file = RawPath::OpenRead(Path::Build(loadedPaks[pakIndex].path, path));
+				out = FileToIPC(file, MODE_READ);
 			} catch (std::system_error& err) {}
 		});
 		break;
+	}
 
 	case VM::FS_PAKPATH_TIMESTAMP:
 		IPC::HandleMsg<VM::FSPakPathTimestampMsg>(channel, std::move(reader), [](uint32_t pakIndex, std::string path, Util::optional<uint64_t>& out) {
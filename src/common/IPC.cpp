@@ -30,6 +30,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "Common.h"
 
+#include <atomic>
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -38,6 +40,15 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 #endif
 
+#if defined(__linux__) && !defined(__native_client__)
+#define USE_SHARED_RINGS
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 #undef INLINE
 #undef DLLEXPORT
 #undef NORETURN
@@ -327,12 +338,11 @@ static void FreeHandles(const NaClHandle* h)
 }
 #endif
 
-bool InternalRecvMsg(OSHandleType handle, Reader& reader)
+bool InternalRecvMsg(OSHandleType handle, Reader& reader, char* recvBuffer)
 {
 	NaClMessageHeader hdr;
 	NaClIOVec iov[2];
 	NaClHandle h[NACL_ABI_IMC_DESC_MAX];
-	std::unique_ptr<char[]> recvBuffer(new char[NACL_ABI_IMC_BYTES_MAX]);
 
 	for (size_t i = 0; i < NACL_ABI_IMC_DESC_MAX; i++)
 		h[i] = NACL_INVALID_HANDLE;
@@ -343,7 +353,7 @@ bool InternalRecvMsg(OSHandleType handle, Reader& reader)
 	hdr.handles = h;
 	hdr.handle_count = NACL_ABI_IMC_DESC_MAX;
 	hdr.flags = 0;
-	iov[0].base = recvBuffer.get();
+	iov[0].base = recvBuffer;
 	iov[0].length = NACL_ABI_IMC_BYTES_MAX;
 
 	int result = NaClReceiveDatagram(handle, &hdr, 0);
@@ -448,10 +458,18 @@ bool InternalRecvMsg(OSHandleType handle, Reader& reader)
 #endif
 }
 
-Reader Socket::RecvMsg() const
+Reader Socket::RecvMsg(const std::shared_ptr<BufferPool>& pool) const
 {
-	Reader out;
-	while (InternalRecvMsg(handle, out)) {}
+	if (!pool) {
+		Reader out;
+		std::unique_ptr<char[]> recvBuffer(new char[NACL_ABI_IMC_BYTES_MAX]);
+		while (InternalRecvMsg(handle, out, recvBuffer.get())) {}
+		return out;
+	}
+
+	Reader out(pool);
+	char* recvBuffer = pool->GetScratch(NACL_ABI_IMC_BYTES_MAX);
+	while (InternalRecvMsg(handle, out, recvBuffer)) {}
 	return out;
 }
 
@@ -554,4 +572,294 @@ SharedMemory SharedMemory::Create(size_t size)
 	return out;
 }
 
+// Layout of a ring at the start of its area, the indexes are free running
+// byte counts and each message is a 32-bit length followed by the data,
+// padded to 4 bytes. Each side only writes to its own cache line.
+struct SharedRings::RingHeader {
+	// Written by the producer
+	std::atomic<uint32_t> head;
+	std::atomic<uint32_t> dataSeq;
+	std::atomic<uint32_t> producerWaiting;
+	char pad1[64 - 3 * sizeof(uint32_t)];
+
+	// Written by the consumer
+	std::atomic<uint32_t> tail;
+	std::atomic<uint32_t> spaceSeq;
+	std::atomic<uint32_t> consumerWaiting;
+	char pad2[64 - 3 * sizeof(uint32_t)];
+};
+
+// Length of the marker announcing a message sent through the socket
+static const uint32_t RING_SOCKET_MARKER = 0xffffffff;
+
+// Number of times to poll a ring before sleeping, a round trip to a busy
+// peer usually completes within that time. There is no point in spinning
+// when both ends share a single CPU.
+static const int RING_SPIN_COUNT = 4000;
+
+bool SharedRings::Supported()
+{
+#ifdef USE_SHARED_RINGS
+	return true;
+#else
+	return false;
+#endif
+}
+
+SharedRings SharedRings::Create(size_t ringSize)
+{
+	if (!Supported())
+		Com_Error(ERR_DROP, "IPC: Shared memory rings are not supported on this platform");
+
+	// Round to a power of two so that the indexes can wrap around
+	size_t size = 4096;
+	while (size < ringSize)
+		size <<= 1;
+
+	SharedRings out;
+	out.shm = SharedMemory::Create(2 * (sizeof(RingHeader) + size));
+	memset(out.shm.GetBase(), 0, out.shm.GetSize());
+	out.Init(true);
+	return out;
+}
+
+SharedRings SharedRings::FromSharedMemory(SharedMemory shm)
+{
+	if (!Supported())
+		Com_Error(ERR_DROP, "IPC: Shared memory rings are not supported on this platform");
+
+	SharedRings out;
+	out.shm = std::move(shm);
+	out.Init(false);
+	return out;
+}
+
+void SharedRings::Init(bool creator)
+{
+	// Both rings have the same size, rounded to a power of two by the creator
+	size_t ringSize = shm.GetSize() / 2 - sizeof(RingHeader);
+	size_t size = 4096;
+	while (size * 2 <= ringSize)
+		size <<= 1;
+	if (size > ringSize)
+		Com_Error(ERR_DROP, "IPC: Shared memory area too small for the rings");
+
+	char* base = static_cast<char*>(shm.GetBase());
+	RingHeader* first = reinterpret_cast<RingHeader*>(base);
+	RingHeader* second = reinterpret_cast<RingHeader*>(base + shm.GetSize() / 2);
+
+	sendRing = creator ? first : second;
+	recvRing = creator ? second : first;
+	sendData = reinterpret_cast<char*>(sendRing + 1);
+	recvData = reinterpret_cast<char*>(recvRing + 1);
+	mask = size - 1;
+}
+
+#ifdef USE_SHARED_RINGS
+static void FutexWait(std::atomic<uint32_t>& word, uint32_t value)
+{
+	// Wake up regularly to notice if the other end died
+	struct timespec timeout = {0, 100 * 1000 * 1000};
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+static void FutexWake(std::atomic<uint32_t>& word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+static void CheckPeer(const Socket& socket)
+{
+	struct pollfd pfd;
+	pfd.fd = socket.GetHandle();
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+		Com_Error(ERR_DROP, "IPC: Socket closed by remote end");
+}
+
+static int RingSpinCount()
+{
+	static int count = -1;
+	if (count < 0) {
+		cpu_set_t cpus;
+		bool multicore = sched_getaffinity(0, sizeof(cpus), &cpus) != 0 || CPU_COUNT(&cpus) > 1;
+		count = multicore ? RING_SPIN_COUNT : 0;
+	}
+	return count;
+}
+
+static inline void CpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+// Wait until the ring position changes from the given value, the sequence
+// word is bumped by the other side whenever it moves the position
+static uint32_t RingWait(const std::atomic<uint32_t>& pos, uint32_t value, std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, const Socket& socket)
+{
+	uint32_t current;
+	int spinCount = RingSpinCount();
+	for (int i = 0; i < spinCount; i++) {
+		current = pos.load(std::memory_order_acquire);
+		if (current != value)
+			return current;
+		CpuRelax();
+	}
+
+	while (true) {
+		uint32_t seqValue = seq.load(std::memory_order_seq_cst);
+		waiting.store(1, std::memory_order_seq_cst);
+		current = pos.load(std::memory_order_seq_cst);
+		if (current != value) {
+			waiting.store(0, std::memory_order_relaxed);
+			return current;
+		}
+		FutexWait(seq, seqValue);
+		waiting.store(0, std::memory_order_relaxed);
+		current = pos.load(std::memory_order_acquire);
+		if (current != value)
+			return current;
+		CheckPeer(socket);
+	}
+}
+
+// Publish a new ring position and wake the other side if it sleeps
+static void RingPublish(std::atomic<uint32_t>& pos, uint32_t value, std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting)
+{
+	pos.store(value, std::memory_order_seq_cst);
+	if (waiting.load(std::memory_order_seq_cst)) {
+		seq.fetch_add(1, std::memory_order_seq_cst);
+		FutexWake(seq);
+	}
+}
+#endif
+
+void SharedRings::SendMsg(const Socket& socket, const Writer& writer) const
+{
+#ifdef USE_SHARED_RINGS
+	const std::vector<char>& data = writer.GetData();
+	bool viaSocket = !writer.GetHandles().empty() || data.size() > mask / 2;
+	uint32_t length = viaSocket ? RING_SOCKET_MARKER : data.size();
+	uint32_t needed = sizeof(uint32_t) + (viaSocket ? 0 : (data.size() + 3) & ~3);
+
+	// Wait for enough space
+	uint32_t head = sendRing->head.load(std::memory_order_relaxed);
+	uint32_t tail = sendRing->tail.load(std::memory_order_acquire);
+	while (mask + 1 - (head - tail) < needed)
+		tail = RingWait(sendRing->tail, tail, sendRing->spaceSeq, sendRing->producerWaiting, socket);
+
+	// Copy the length and the message, wrapping around the end of the ring
+	auto copyIn = [this](uint32_t pos, const void* src, size_t len) {
+		size_t offset = pos & mask;
+		size_t first = std::min<size_t>(len, mask + 1 - offset);
+		memcpy(sendData + offset, src, first);
+		memcpy(sendData, static_cast<const char*>(src) + first, len - first);
+	};
+	copyIn(head, &length, sizeof(uint32_t));
+	if (!viaSocket)
+		copyIn(head + sizeof(uint32_t), data.data(), data.size());
+
+	RingPublish(sendRing->head, head + needed, sendRing->dataSeq, sendRing->consumerWaiting);
+
+	if (viaSocket)
+		socket.SendMsg(writer);
+#else
+	Q_UNUSED(writer);
+	Q_UNUSED(socket);
+#endif
+}
+
+Reader SharedRings::RecvMsg(const Socket& socket, const std::shared_ptr<BufferPool>& pool) const
+{
+	Reader out = pool ? Reader(pool) : Reader();
+#ifdef USE_SHARED_RINGS
+	uint32_t tail = recvRing->tail.load(std::memory_order_relaxed);
+	uint32_t head = recvRing->head.load(std::memory_order_acquire);
+	if (head == tail)
+		head = RingWait(recvRing->head, head, recvRing->dataSeq, recvRing->consumerWaiting, socket);
+
+	auto copyOut = [this](uint32_t pos, void* dest, size_t len) {
+		size_t offset = pos & mask;
+		size_t first = std::min<size_t>(len, mask + 1 - offset);
+		memcpy(dest, recvData + offset, first);
+		memcpy(static_cast<char*>(dest) + first, recvData, len - first);
+	};
+
+	uint32_t length;
+	copyOut(tail, &length, sizeof(uint32_t));
+	if (length == RING_SOCKET_MARKER) {
+		RingPublish(recvRing->tail, tail + sizeof(uint32_t), recvRing->spaceSeq, recvRing->producerWaiting);
+		return socket.RecvMsg(pool);
+	}
+
+	uint32_t available = head - tail - sizeof(uint32_t);
+	if (head - tail > mask + 1 || length > available)
+		Com_Error(ERR_DROP, "IPC: Invalid message length in shared memory ring");
+
+	out.GetData().resize(length);
+	copyOut(tail + sizeof(uint32_t), out.GetData().data(), length);
+	RingPublish(recvRing->tail, tail + sizeof(uint32_t) + ((length + 3) & ~3), recvRing->spaceSeq, recvRing->producerWaiting);
+#else
+	Q_UNUSED(socket);
+	Q_UNUSED(pool);
+#endif
+	return out;
+}
+
+// The receiver of a direct message owns its handles, like with a socket
+static Desc DuplicateDesc(const Desc& desc)
+{
+#ifdef __native_client__
+	Q_UNUSED(desc);
+	Com_Error(ERR_DROP, "IPC: Direct channels are not supported in NaCl");
+#else
+	Desc out = desc;
+#ifdef _WIN32
+	if (!DuplicateHandle(GetCurrentProcess(), desc.handle, GetCurrentProcess(), &out.handle, 0, FALSE, DUPLICATE_SAME_ACCESS))
+		Com_Error(ERR_DROP, "IPC: Failed to duplicate handle: %s", Win32StrError(GetLastError()));
+#else
+	out.handle = dup(desc.handle);
+	if (out.handle == -1)
+		Com_Error(ERR_DROP, "IPC: Failed to duplicate handle: %s", strerror(errno));
+#endif
+	return out;
+#endif
+}
+
+void Channel::SendDirect(const Writer& writer) const
+{
+	std::vector<Desc> handles;
+	handles.reserve(writer.GetHandles().size());
+	for (const Desc& desc: writer.GetHandles())
+		handles.push_back(DuplicateDesc(desc));
+
+	peer.deliver(peer.channel, writer.GetData().data(), writer.GetData().size(), handles.data(), handles.size());
+}
+
+void Channel::DeliverDirect(void* channel, const char* data, size_t size, const Desc* handles, size_t numHandles)
+{
+	Channel& self = *static_cast<Channel*>(channel);
+	Reader reader(self.pool);
+	reader.GetData().assign(data, data + size);
+	reader.GetHandles().assign(handles, handles + numHandles);
+	self.stats.receives++;
+
+	uint32_t id = 0;
+	if (size >= sizeof(uint32_t))
+		memcpy(&id, data, sizeof(uint32_t));
+
+	// Replies are picked up by the SendMsg waiting for them further up the stack
+	if (id == ID_RETURN || !self.directHandler) {
+		self.pending.push_back(std::move(reader));
+		return;
+	}
+
+	self.stats.messages++;
+	reader.Read<uint32_t>();
+	self.directHandler(id, std::move(reader));
+}
+
 } // namespace IPC
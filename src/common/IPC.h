@@ -95,6 +95,7 @@ private:
 // Message-based socket through which data and handles can be passed.
 class Reader;
 class Writer;
+class BufferPool;
 class Socket {
 public:
 	Socket()
@@ -136,7 +137,7 @@ public:
 	static Socket FromHandle(OSHandleType handle);
 
 	void SendMsg(const Writer& writer) const;
-	Reader RecvMsg() const;
+	Reader RecvMsg(const std::shared_ptr<BufferPool>& pool = std::shared_ptr<BufferPool>()) const;
 
 	static std::pair<Socket, Socket> CreatePair();
 
@@ -193,6 +194,49 @@ private:
 	size_t size;
 };
 
+// Pair of single producer, single consumer message rings in a shared memory
+// area, which a Channel can use instead of its socket to avoid a system call
+// pair per message. Messages carrying handles, and those too big for a ring,
+// still go through the socket and are announced by a marker in the ring so
+// that the message order is kept. Only available for native Linux processes,
+// the waits use futexes on the shared memory.
+class SharedRings {
+public:
+	SharedRings()
+		: sendRing(nullptr), recvRing(nullptr), sendData(nullptr), recvData(nullptr), mask(0) {}
+	explicit operator bool() const
+	{
+		return bool(shm);
+	}
+
+	static bool Supported();
+
+	// Create the rings, the other end must use FromSharedMemory on the same area
+	static SharedRings Create(size_t ringSize);
+	static SharedRings FromSharedMemory(SharedMemory shm);
+
+	const SharedMemory& GetSharedMemory() const
+	{
+		return shm;
+	}
+
+	// The socket is used for the messages which can't go through the rings
+	// and to notice when the other end goes away
+	void SendMsg(const Socket& socket, const Writer& writer) const;
+	Reader RecvMsg(const Socket& socket, const std::shared_ptr<BufferPool>& pool) const;
+
+private:
+	struct RingHeader;
+	void Init(bool creator);
+
+	SharedMemory shm;
+	RingHeader* sendRing;
+	RingHeader* recvRing;
+	char* sendData;
+	char* recvData;
+	uint32_t mask;
+};
+
 // Base type for serialization traits.
 template<typename T, typename = void> struct SerializeTraits {};
 
@@ -218,6 +262,19 @@ public:
 		handles.push_back(h);
 	}
 
+	// Empty the writer but keep its memory to write another message
+	void Clear()
+	{
+		data.clear();
+		handles.clear();
+	}
+
+	// Overwrite data which was already written, such as a count only known at the end
+	void PatchData(size_t offset, const void* p, size_t len)
+	{
+		memcpy(data.data() + offset, p, len);
+	}
+
 	const std::vector<char>& GetData() const
 	{
 		return data;
@@ -232,19 +289,57 @@ private:
 	std::vector<Desc> handles;
 };
 
+// Buffers for the messages received on a channel. The readers give their
+// buffer back when they are destroyed so that receiving messages doesn't
+// allocate once the channel is warmed up.
+class BufferPool {
+public:
+	std::vector<char> GetBuffer()
+	{
+		if (buffers.empty())
+			return std::vector<char>();
+		std::vector<char> out = std::move(buffers.back());
+		buffers.pop_back();
+		return out;
+	}
+	void PutBuffer(std::vector<char>&& buffer)
+	{
+		// Don't keep the buffers of exceptionally big messages around
+		if (buffers.size() < 16 && buffer.capacity() <= 256 * 1024) {
+			buffer.clear();
+			buffers.push_back(std::move(buffer));
+		}
+	}
+
+	// Scratch space to receive socket datagrams into
+	char* GetScratch(size_t size)
+	{
+		if (!scratch)
+			scratch.reset(new char[size]);
+		return scratch.get();
+	}
+
+private:
+	std::vector<std::vector<char>> buffers;
+	std::unique_ptr<char[]> scratch;
+};
+
 // Class to read messages
 class Reader {
 public:
 	Reader()
 		: pos(0), handles_pos(0) {}
+	explicit Reader(std::shared_ptr<BufferPool> pool)
+		: data(pool->GetBuffer()), pos(0), handles_pos(0), pool(std::move(pool)) {}
 	Reader(Reader&& other) NOEXCEPT
-		: data(std::move(other.data)), handles(std::move(other.handles)), pos(other.pos), handles_pos(other.handles_pos) {}
+		: data(std::move(other.data)), handles(std::move(other.handles)), pos(other.pos), handles_pos(other.handles_pos), pool(std::move(other.pool)) {}
 	Reader& operator=(Reader&& other) NOEXCEPT
 	{
 		std::swap(data, other.data);
 		std::swap(handles, other.handles);
 		std::swap(pos, other.pos);
 		std::swap(handles_pos, other.handles_pos);
+		std::swap(pool, other.pool);
 		return *this;
 	}
 	~Reader()
@@ -252,6 +347,9 @@ public:
 		// Close any handles that weren't read
 		for (size_t i = handles_pos; i < handles.size(); i++)
 			CloseDesc(handles[i]);
+
+		if (pool)
+			pool->PutBuffer(std::move(data));
 	}
 
 	void ReadData(void* p, size_t len)
@@ -306,6 +404,7 @@ private:
 	std::vector<Desc> handles;
 	size_t pos;
 	size_t handles_pos;
+	std::shared_ptr<BufferPool> pool;
 };
 
 // Simple implementation for POD types
@@ -424,6 +523,26 @@ template<> struct SerializeTraits<std::string> {
 	}
 };
 
+// Str::StringRef, read as a view into the message which is only valid as
+// long as the Reader. For the replies of synchronous messages this is until
+// the next synchronous message on the channel. It is sent with its
+// terminating null so that c_str() can be used on the view.
+template<> struct SerializeTraits<Str::StringRef> {
+	static void Write(Writer& stream, Str::StringRef value)
+	{
+		stream.WriteSize(value.size());
+		stream.WriteData(value.c_str(), value.size() + 1);
+	}
+	static Str::StringRef Read(Reader& stream)
+	{
+		size_t size = stream.ReadSize<char>();
+		const char* p = static_cast<const char*>(stream.ReadInline(size));
+		if (*static_cast<const char*>(stream.ReadInline(1)) != '\0')
+			Com_Error(ERR_DROP, "IPC: Unterminated string in message");
+		return Str::StringRef(p, size);
+	}
+};
+
 // std::map and std::unordered_map
 template<typename T, typename U>
 struct SerializeTraits<std::map<T, U>> {
@@ -531,6 +650,26 @@ template<> struct SerializeTraits<SharedMemory> {
 // Message ID to indicate an RPC return
 const uint32_t ID_RETURN = 0xffffffff;
 
+// Message ID used by a Channel to switch the other end to shared memory rings
+const uint32_t ID_SHARED_RINGS = 0xfffffffe;
+
+// Message ID of a frame holding several asynchronous messages
+const uint32_t ID_BATCH = 0xfffffffd;
+
+// Batches are sent early when they reach this size
+const size_t MAX_BATCH_SIZE = 64 * 1024;
+
+// Counters of the messages received by a channel
+struct ChannelStats {
+	ChannelStats()
+		: messages(0), receives(0), batches(0), batchedMessages(0) {}
+
+	uint64_t messages; // including the ones in batches
+	uint64_t receives; // messages actually read from the transport
+	uint64_t batches;
+	uint64_t batchedMessages;
+};
+
 // Combine a major and minor ID into a single number
 template<uint16_t Major, uint16_t Minor> struct Id {
 	enum {
@@ -538,34 +677,199 @@ template<uint16_t Major, uint16_t Minor> struct Id {
 	};
 };
 
+// The other end of a direct channel, living in the same process. Messages are
+// handed to it by calling deliver with its channel, the handles in them are
+// duplicated for the receiver.
+struct DirectPeer {
+	void (*deliver)(void* channel, const char* data, size_t size, const Desc* handles, size_t numHandles);
+	void* channel;
+};
+
 // An IPC channel wraps a socket and provides additional support for sending
 // synchronous typed messages over it.
 class Channel {
 public:
 	Channel()
-		: counter(0) {}
+		: peer{nullptr, nullptr}, counter(0), batching(false), batchCount(0), pool(std::make_shared<BufferPool>()) {}
 	Channel(Socket socket)
-		: socket(std::move(socket)), counter(0) {}
+		: socket(std::move(socket)), peer{nullptr, nullptr}, counter(0), batching(false), batchCount(0), pool(std::make_shared<BufferPool>()) {}
 	Channel(Channel&& other)
-		: socket(std::move(other.socket)) {}
+		: socket(std::move(other.socket)), rings(std::move(other.rings)), peer(other.peer), directHandler(std::move(other.directHandler)),
+		  counter(0), batching(other.batching), batch(std::move(other.batch)), batchCount(other.batchCount), pending(std::move(other.pending)),
+		  pool(std::move(other.pool)), writers(std::move(other.writers)), lastReply(std::move(other.lastReply)) {}
 	Channel& operator=(Channel&& other)
 	{
 		std::swap(socket, other.socket);
+		std::swap(rings, other.rings);
+		std::swap(peer, other.peer);
+		std::swap(directHandler, other.directHandler);
+		std::swap(batching, other.batching);
+		std::swap(batch, other.batch);
+		std::swap(batchCount, other.batchCount);
+		std::swap(pending, other.pending);
+		std::swap(pool, other.pool);
+		std::swap(writers, other.writers);
+		std::swap(lastReply, other.lastReply);
 		return *this;
 	}
 	explicit operator bool() const
 	{
-		return bool(socket);
+		return bool(socket) || IsDirect();
 	}
 
-	// Wrappers around socket functions
-	void SendMsg(const Writer& writer) const
+	// Wrappers around socket functions, going through the shared memory
+	// rings once they are set up. Any queued message is sent first.
+	void SendMsg(const Writer& writer)
 	{
+		FlushBatch();
+		SendMsgNow(writer);
+	}
+	Reader RecvMsg()
+	{
+		if (!pending.empty())
+			return PopPending();
+
+		// The peer already ran to completion, it can't send anything more
+		if (IsDirect())
+			Com_Error(ERR_DROP, "IPC: Expected a message from the direct peer");
+
+		while (true) {
+			Reader reader = rings ? rings.RecvMsg(socket, pool) : socket.RecvMsg(pool);
+			stats.receives++;
+
+			uint32_t id = 0;
+			if (reader.GetData().size() >= sizeof(uint32_t))
+				memcpy(&id, reader.GetData().data(), sizeof(uint32_t));
+
+			// The other end moved the channel to shared memory rings
+			if (id == ID_SHARED_RINGS && !rings && reader.GetData().size() == sizeof(uint32_t) && reader.GetHandles().size() == 1) {
+				reader.Read<uint32_t>();
+				rings = SharedRings::FromSharedMemory(reader.Read<SharedMemory>());
+				continue;
+			}
+
+			// Split a batch into its messages, in order
+			if (id == ID_BATCH && reader.GetHandles().empty()) {
+				reader.Read<uint32_t>();
+				size_t numMessages = reader.ReadSize<char>();
+				for (size_t i = 0; i < numMessages; i++) {
+					size_t size = reader.ReadSize<char>();
+					const char* data = static_cast<const char*>(reader.ReadInline(size));
+					pending.emplace_back(pool);
+					pending.back().GetData().assign(data, data + size);
+				}
+				stats.batches++;
+				stats.batchedMessages += numMessages;
+				if (pending.empty())
+					continue;
+				return PopPending();
+			}
+
+			stats.messages++;
+			return reader;
+		}
+	}
+
+	// Asynchronous messages can be queued and sent together in a single frame,
+	// which goes out before the next message that can't wait or when it gets
+	// too big. Messages carrying handles are never queued.
+	void SetBatching(bool enable)
+	{
+		if (!enable)
+			FlushBatch();
+		batching = enable;
+	}
+	void QueueMsg(const Writer& writer)
+	{
+		if (!batching || IsDirect() || !writer.GetHandles().empty()) {
+			SendMsg(writer);
+			return;
+		}
+		if (batchCount == 0) {
+			batch.Clear();
+			batch.Write<uint32_t>(ID_BATCH);
+			batch.Write<uint32_t>(0);
+		}
+		batch.WriteSize(writer.GetData().size());
+		batch.WriteData(writer.GetData().data(), writer.GetData().size());
+		batchCount++;
+		if (batch.GetData().size() >= MAX_BATCH_SIZE)
+			FlushBatch();
+	}
+	void FlushBatch()
+	{
+		if (batchCount == 0)
+			return;
+		batch.PatchData(sizeof(uint32_t), &batchCount, sizeof(uint32_t));
+		batchCount = 0;
+		SendMsgNow(batch);
+	}
+
+	const ChannelStats& GetStats() const
+	{
+		return stats;
+	}
+
+	// Writers are reused to avoid allocating memory for every message
+	Writer GetWriter()
+	{
+		if (writers.empty())
+			return Writer();
+		Writer out = std::move(writers.back());
+		writers.pop_back();
+		return out;
+	}
+	void RecycleWriter(Writer writer)
+	{
+		if (writers.size() < 4) {
+			writer.Clear();
+			writers.push_back(std::move(writer));
+		}
+	}
+
+	// Keep the reply of the last synchronous message alive, the views read
+	// from it remain valid until the next one
+	void KeepReply(Reader reader)
+	{
+		lastReply = std::move(reader);
+	}
+
+	// Move the channel to shared memory rings. The other end must be waiting
+	// for a message and must not have any message in flight, it switches
+	// when it receives the rings.
+	void UseSharedRings(size_t ringSize)
+	{
+		SharedRings newRings = SharedRings::Create(ringSize);
+		Writer writer;
+		writer.Write<uint32_t>(ID_SHARED_RINGS);
+		writer.Write<SharedMemory>(newRings.GetSharedMemory());
 		socket.SendMsg(writer);
+		rings = std::move(newRings);
+	}
+	bool UsesSharedRings() const
+	{
+		return bool(rings);
+	}
+
+	// Connect the channel to another one in the same process. Sending a
+	// message then runs the handler of the peer on the calling thread, with
+	// the same serialization but no socket and no thread switch. Replies and
+	// the messages received before a handler is set are kept for RecvMsg.
+	DirectPeer GetDirectPeer()
+	{
+		return {&Channel::DeliverDirect, this};
+	}
+	void ConnectDirect(DirectPeer directPeer)
+	{
+		peer = directPeer;
+	}
+	void SetDirectHandler(std::function<void(uint32_t, Reader)> handler)
+	{
+		directHandler = std::move(handler);
 	}
-	Reader RecvMsg() const
+	bool IsDirect() const
 	{
-		return socket.RecvMsg();
+		return peer.deliver != nullptr;
 	}
 
 	// Generate a unique message key to match messages with replies
@@ -605,9 +909,46 @@ public:
 	}
 
 private:
+	void SendMsgNow(const Writer& writer) const
+	{
+		if (IsDirect())
+			SendDirect(writer);
+		else if (rings)
+			rings.SendMsg(socket, writer);
+		else
+			socket.SendMsg(writer);
+	}
+	Reader PopPending()
+	{
+		Reader reader = std::move(pending.front());
+		pending.pop_front();
+		stats.messages++;
+		return reader;
+	}
+	void SendDirect(const Writer& writer) const;
+	static void DeliverDirect(void* channel, const char* data, size_t size, const Desc* handles, size_t numHandles);
+
 	Socket socket;
+	SharedRings rings;
+
+	// Direct channels
+	DirectPeer peer;
+	std::function<void(uint32_t, Reader)> directHandler;
+
 	uint32_t counter;
 	std::unordered_map<uint32_t, Reader> replies;
+
+	// Batching of the asynchronous messages
+	bool batching;
+	Writer batch;
+	uint32_t batchCount;
+	std::deque<Reader> pending;
+	ChannelStats stats;
+
+	// Memory reused between messages
+	std::shared_ptr<BufferPool> pool;
+	std::vector<Writer> writers;
+	Reader lastReply;
 };
 
 // Asynchronous message which does not wait for a reply
@@ -673,22 +1014,24 @@ template<typename Func, typename Id, typename... MsgArgs, typename... Args> void
 	typedef Message<Id, MsgArgs...> Message;
 	static_assert(sizeof...(Args) == std::tuple_size<typename Message::Inputs>::value, "Incorrect number of arguments for IPC::SendMsg");
 
-	Writer writer;
+	Writer writer = channel.GetWriter();
 	writer.Write<uint32_t>(Message::id);
 	SerializeArgs(Util::TypeListFromTuple<typename Message::Inputs>(), writer, std::forward<Args>(args)...);
-	channel.SendMsg(writer);
+	channel.QueueMsg(writer);
+	channel.RecycleWriter(std::move(writer));
 }
 template<typename Func, typename Msg, typename Reply, typename... Args> void SendMsg(Channel& channel, Func&& messageHandler, SyncMessage<Msg, Reply>, Args&&... args)
 {
 	typedef SyncMessage<Msg, Reply> Message;
 	static_assert(sizeof...(Args) == std::tuple_size<typename Message::Inputs>::value + std::tuple_size<typename Message::Outputs>::value, "Incorrect number of arguments for IPC::SendMsg");
 
-	Writer writer;
+	Writer writer = channel.GetWriter();
 	writer.Write<uint32_t>(Message::id);
 	uint32_t key = channel.GenMsgKey();
 	writer.Write<uint32_t>(key);
 	SerializeArgs(Util::TypeListFromTuple<typename Message::Inputs>(), writer, std::forward<Args>(args)...);
 	channel.SendMsg(writer);
+	channel.RecycleWriter(std::move(writer));
 
 	while (true) {
 		Reader reader;
@@ -697,6 +1040,7 @@ template<typename Func, typename Msg, typename Reply, typename... Args> void Sen
 		if (id == ID_RETURN) {
 			auto out = std::forward_as_tuple(std::forward<Args>(args)...);
 			FillTuple<std::tuple_size<typename Message::Inputs>::value>(Util::TypeListFromTuple<typename Message::Outputs>(), out, reader);
+			channel.KeepReply(std::move(reader));
 			return;
 		}
 		messageHandler(id, std::move(reader));
@@ -722,11 +1066,12 @@ template<typename Func, typename Msg, typename Reply> void HandleMsg(Channel& ch
 	FillTuple<0>(Util::TypeListFromTuple<typename Message::Inputs>(), inputs, reader);
 	Util::apply(std::forward<Func>(func), std::tuple_cat(Util::ref_tuple(std::move(inputs)), Util::ref_tuple(outputs)));
 
-	Writer writer;
+	Writer writer = channel.GetWriter();
 	writer.Write<uint32_t>(ID_RETURN);
 	writer.Write<uint32_t>(key);
 	SerializeTuple(Util::TypeListFromTuple<typename Message::Outputs>(), writer, std::move(outputs));
 	channel.SendMsg(writer);
+	channel.RecycleWriter(std::move(writer));
 }
 
 } // namespace detail
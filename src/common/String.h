@@ -39,6 +39,15 @@ namespace Str {
     public:
         static const size_t npos = -1;
 
+        BasicStringRef()
+        {
+            static const T empty[1] = {};
+            ptr = empty;
+            len = 0;
+        }
+        // The string must still be null terminated at ptr[len]
+        BasicStringRef(const T* ptr, size_t len)
+            : ptr(ptr), len(len) {}
         BasicStringRef(const std::basic_string<T>& other)
         {
             ptr = other.c_str();
@@ -0,0 +1,521 @@
+/*
+===========================================================================
+
+Daemon GPL Source Code
+Copyright (C) 1999-2010 id Software LLC, a ZeniMax Media company.
+
+This file is part of the Daemon GPL Source Code (Daemon Source Code).
+
+Daemon Source Code is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Daemon Source Code is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Daemon Source Code.  If not, see <http://www.gnu.org/licenses/>.
+
+In addition, the Daemon Source Code is also subject to certain additional terms.
+You should have received a copy of these additional terms immediately following the
+terms and conditions of the GNU General Public License which accompanied the Daemon
+Source Code.  If not, please request a copy in writing from id Software at the address
+below.
+
+If you have questions concerning this license or the applicable additional terms, you
+may contact in writing id Software LLC, c/o ZeniMax Media Inc., Suite 120, Rockville,
+Maryland 20850 USA.
+
+===========================================================================
+*/
+
+// cm_cache.cpp -- keeps the collision data derived from a map in a file
+// next to the home path, so that loading the same map again skips building
+// the brush edges and the patch and triangle soup facets
+
+#include "cm_local.h"
+
+static Cvar::Cvar<bool> cm_collisionCache(VM_STRING_PREFIX "cm_collisionCache", "keep the collision data derived from maps in cache files", Cvar::NONE, true);
+
+#define CACHE_IDENT   ( ( 'C' << 24 ) + ( 'L' << 16 ) + ( 'C' << 8 ) + 'D' ) // little-endian "DCLC"
+#define CACHE_VERSION 1
+#define CACHE_ALIGN   16
+
+// the file is the header followed by these arrays, in this order, each
+// starting on a CACHE_ALIGN boundary, so that once the file is in memory
+// the edges, planes and facets are used where they are
+enum
+{
+  CACHE_BRUSHES, // cacheBrush_t[ numBrushes ]
+  CACHE_SURFACES, // cacheSurface_t[ numSurfaces ]
+  CACHE_EDGES, // cbrushedge_t[ numEdges ]
+  CACHE_PLANES, // cPlane_t[ numPlanes ]
+  CACHE_FACETS, // cFacet_t[ numFacets ]
+  CACHE_NUM_ARRAYS
+};
+
+typedef struct
+{
+	int      ident;
+	int      version;
+	uint64_t key; // see CM_CacheKey
+	uint64_t checksum; // of everything after the header
+	int      size; // of the whole file
+	int      counts[ CACHE_NUM_ARRAYS ];
+} cacheHeader_t;
+
+typedef struct
+{
+	int firstEdge;
+	int numEdges;
+} cacheBrush_t;
+
+typedef struct
+{
+	vec3_t bounds[ 2 ];
+	int    firstPlane;
+	int    numPlanes; // -1 for surfaces without collision data
+	int    firstFacet;
+	int    numFacets;
+} cacheSurface_t;
+
+static const size_t cacheSizes[ CACHE_NUM_ARRAYS ] =
+{
+	sizeof( cacheBrush_t ),
+	sizeof( cacheSurface_t ),
+	sizeof( cbrushedge_t ),
+	sizeof( cPlane_t ),
+	sizeof( cFacet_t )
+};
+
+// surface collision data of the map being loaded, from the cache
+static cSurfaceCollide_t **cachedCollides;
+
+/*
+================
+CM_CacheHash
+
+A fast hash to tell files apart, not meant to resist tampering
+================
+*/
+static uint64_t CM_CacheHash( const void *data, size_t length, uint64_t hash )
+{
+	const byte *p = ( const byte * ) data;
+	uint64_t   word;
+
+	for ( ; length >= sizeof( word ); length -= sizeof( word ), p += sizeof( word ) )
+	{
+		memcpy( &word, p, sizeof( word ) );
+		hash = ( hash ^ word ) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+
+	for ( ; length; length--, p++ )
+	{
+		hash = ( hash ^ *p ) * 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+================
+CM_CacheKey
+
+Covers everything the cached data is built from: the lumps of the map, how
+triangle soups are handled and the layout of the structures
+================
+*/
+static uint64_t CM_CacheKey( const dheader_t *header )
+{
+	static const int lumps[] =
+	{
+		LUMP_PLANES, LUMP_BRUSHSIDES, LUMP_BRUSHES, LUMP_SURFACES, LUMP_DRAWVERTS, LUMP_DRAWINDEXES
+	};
+	int      options[ 2 + CACHE_NUM_ARRAYS ];
+	uint64_t key = CACHE_VERSION;
+	int      i;
+
+	options[ 0 ] = cm.perPolyCollision || cm_forceTriangles.Get();
+	options[ 1 ] = sizeof( cacheHeader_t );
+
+	for ( i = 0; i < CACHE_NUM_ARRAYS; i++ )
+	{
+		options[ 2 + i ] = cacheSizes[ i ];
+	}
+
+	key = CM_CacheHash( options, sizeof( options ), key );
+
+	for ( i = 0; i < ARRAY_LEN( lumps ); i++ )
+	{
+		const lump_t *l = &header->lumps[ lumps[ i ] ];
+
+		key = CM_CacheHash( &l->filelen, sizeof( l->filelen ), key );
+		key = CM_CacheHash( cmod_base + l->fileofs, l->filelen, key );
+	}
+
+	return key;
+}
+
+/*
+================
+CM_CacheLayout
+
+Sets where each array starts, returns the size of the file
+================
+*/
+static size_t CM_CacheLayout( const int *counts, size_t *offsets )
+{
+	size_t size = sizeof( cacheHeader_t );
+	int    i;
+
+	for ( i = 0; i < CACHE_NUM_ARRAYS; i++ )
+	{
+		size = ( size + CACHE_ALIGN - 1 ) & ~( size_t )( CACHE_ALIGN - 1 );
+		offsets[ i ] = size;
+		size += counts[ i ] * cacheSizes[ i ];
+	}
+
+	return size;
+}
+
+/*
+================
+CM_CachePath
+================
+*/
+static std::string CM_CachePath( const char *name )
+{
+	char base[ MAX_QPATH ];
+
+	COM_StripExtension3( name, base, sizeof( base ) );
+
+	return Str::Format( "cache/%s.clc", base );
+}
+
+/*
+================
+CM_SurfaceHasCollide
+
+Whether CMod_LoadSurfaces builds collision data for a surface
+================
+*/
+static qboolean CM_SurfaceHasCollide( const dsurface_t *surface )
+{
+	int type = LittleLong( surface->surfaceType );
+
+	return type == MST_PATCH || ( type == MST_TRIANGLE_SOUP && ( cm.perPolyCollision || cm_forceTriangles.Get() ) );
+}
+
+/*
+================
+CM_CachedFacetsValid
+
+Whether the plane indices of the facets of a cached surface are all within
+its planes, the traces use them without checking
+================
+*/
+static qboolean CM_CachedFacetsValid( const cFacet_t *facets, int numFacets, int numPlanes )
+{
+	int i, j;
+
+	for ( i = 0; i < numFacets; i++ )
+	{
+		if ( facets[ i ].surfacePlane < 0 || facets[ i ].surfacePlane >= numPlanes ||
+		     facets[ i ].numBorders < 0 || facets[ i ].numBorders > MAX_FACET_BEVELS )
+		{
+			return qfalse;
+		}
+
+		for ( j = 0; j < facets[ i ].numBorders; j++ )
+		{
+			if ( facets[ i ].borderPlanes[ j ] < 0 || facets[ i ].borderPlanes[ j ] >= numPlanes )
+			{
+				return qfalse;
+			}
+		}
+	}
+
+	return qtrue;
+}
+
+/*
+================
+CM_LoadCollisionCache
+
+Gives the brushes their edges from the cache of the map and keeps its surface
+collision data for CM_CachedSurfaceCollide. Must be called once the brushes
+and the entity string are loaded; returns qfalse if there is no up to date
+cache, in which case the data has to be built
+================
+*/
+qboolean CM_LoadCollisionCache( const char *name, const dheader_t *header )
+{
+	const lump_t         *surfaceLump = &header->lumps[ LUMP_SURFACES ];
+	const dsurface_t     *surfaces = ( const dsurface_t * )( cmod_base + surfaceLump->fileofs );
+	std::string          path = CM_CachePath( name );
+	std::error_code      err;
+	FS::File             f;
+	size_t               length, offsets[ CACHE_NUM_ARRAYS ];
+	std::vector<byte>    buffer;
+	byte                 *data;
+	const cacheHeader_t  *cache;
+	const cacheBrush_t   *brushes;
+	const cacheSurface_t *surface;
+	cSurfaceCollide_t    *collides;
+	int                  i;
+
+	cachedCollides = NULL;
+
+	if ( !cm_collisionCache.Get() )
+	{
+		return qfalse;
+	}
+
+	f = FS::HomePath::OpenRead( path, err );
+
+	if ( err )
+	{
+		cmLog.Debug( "no collision cache %s\n", path );
+		return qfalse;
+	}
+
+	length = f.Length( err );
+
+	if ( err || length < sizeof( cacheHeader_t ) || length > INT_MAX )
+	{
+		cmLog.Warn( "invalid collision cache %s\n", path );
+		return qfalse;
+	}
+
+	// read in one block, it is all used in place once it is known to be valid
+	buffer.resize( length );
+	data = buffer.data();
+	f.Read( data, length, err );
+	cache = ( const cacheHeader_t * ) data;
+
+	if ( err || cache->ident != CACHE_IDENT || cache->version != CACHE_VERSION || cache->size != ( int ) length )
+	{
+		cmLog.Warn( "invalid collision cache %s\n", path );
+		return qfalse;
+	}
+
+	if ( cache->key != CM_CacheKey( header ) )
+	{
+		cmLog.Debug( "collision cache %s is out of date\n", path );
+		return qfalse;
+	}
+
+	// the layout can't be computed from negative counts
+	for ( i = 0; i < CACHE_NUM_ARRAYS; i++ )
+	{
+		if ( cache->counts[ i ] < 0 )
+		{
+			cmLog.Warn( "invalid collision cache %s\n", path );
+			return qfalse;
+		}
+	}
+
+	if ( cache->counts[ CACHE_BRUSHES ] != cm.numBrushes ||
+	     cache->counts[ CACHE_SURFACES ] != ( int )( surfaceLump->filelen / sizeof( dsurface_t ) ) ||
+	     CM_CacheLayout( cache->counts, offsets ) != length ||
+	     cache->checksum != CM_CacheHash( data + sizeof( *cache ), length - sizeof( *cache ), 0 ) )
+	{
+		cmLog.Warn( "invalid collision cache %s\n", path );
+		return qfalse;
+	}
+
+	// check everything before using any of it, so that a bad cache leaves
+	// nothing behind
+	brushes = ( const cacheBrush_t * )( data + offsets[ CACHE_BRUSHES ] );
+
+	for ( i = 0; i < cm.numBrushes; i++ )
+	{
+		if ( brushes[ i ].firstEdge < 0 || brushes[ i ].numEdges < 0 ||
+		     brushes[ i ].firstEdge > cache->counts[ CACHE_EDGES ] - brushes[ i ].numEdges )
+		{
+			cmLog.Warn( "invalid collision cache %s\n", path );
+			return qfalse;
+		}
+	}
+
+	surface = ( const cacheSurface_t * )( data + offsets[ CACHE_SURFACES ] );
+
+	for ( i = 0; i < cache->counts[ CACHE_SURFACES ]; i++, surface++ )
+	{
+		if ( ( surface->numPlanes >= 0 ) != ( CM_SurfaceHasCollide( &surfaces[ i ] ) == qtrue ) ||
+		     ( surface->numPlanes >= 0 &&
+		       ( surface->firstPlane < 0 || surface->firstPlane > cache->counts[ CACHE_PLANES ] - surface->numPlanes ||
+		         surface->firstFacet < 0 || surface->numFacets < 0 ||
+		         surface->firstFacet > cache->counts[ CACHE_FACETS ] - surface->numFacets ||
+		         !CM_CachedFacetsValid( ( const cFacet_t * )( data + offsets[ CACHE_FACETS ] ) + surface->firstFacet,
+		                                surface->numFacets, surface->numPlanes ) ) ) )
+		{
+			cmLog.Warn( "invalid collision cache %s\n", path );
+			return qfalse;
+		}
+	}
+
+	data = ( byte * ) CM_Alloc( length );
+	memcpy( data, buffer.data(), length );
+	cache = ( const cacheHeader_t * ) data;
+	brushes = ( const cacheBrush_t * )( data + offsets[ CACHE_BRUSHES ] );
+
+	for ( i = 0; i < cm.numBrushes; i++ )
+	{
+		cm.brushes[ i ].edges = ( cbrushedge_t * )( data + offsets[ CACHE_EDGES ] ) + brushes[ i ].firstEdge;
+		cm.brushes[ i ].numEdges = brushes[ i ].numEdges;
+	}
+
+	cachedCollides = ( cSurfaceCollide_t ** ) CM_Alloc( cache->counts[ CACHE_SURFACES ] * sizeof( *cachedCollides ) );
+	collides = ( cSurfaceCollide_t * ) CM_Alloc( cache->counts[ CACHE_SURFACES ] * sizeof( *collides ) );
+	surface = ( const cacheSurface_t * )( data + offsets[ CACHE_SURFACES ] );
+
+	for ( i = 0; i < cache->counts[ CACHE_SURFACES ]; i++, surface++ )
+	{
+		if ( surface->numPlanes < 0 )
+		{
+			continue;
+		}
+
+		VectorCopy( surface->bounds[ 0 ], collides[ i ].bounds[ 0 ] );
+		VectorCopy( surface->bounds[ 1 ], collides[ i ].bounds[ 1 ] );
+		collides[ i ].numPlanes = surface->numPlanes;
+		collides[ i ].planes = ( cPlane_t * )( data + offsets[ CACHE_PLANES ] ) + surface->firstPlane;
+		collides[ i ].numFacets = surface->numFacets;
+		collides[ i ].facets = ( cFacet_t * )( data + offsets[ CACHE_FACETS ] ) + surface->firstFacet;
+		cachedCollides[ i ] = &collides[ i ];
+	}
+
+	cmLog.Debug( "loaded %d KB of collision data from %s\n", ( int )( length >> 10 ), path );
+
+	return qtrue;
+}
+
+/*
+================
+CM_CachedSurfaceCollide
+
+Collision data of a surface of the map being loaded, once
+CM_LoadCollisionCache succeeded
+================
+*/
+cSurfaceCollide_t *CM_CachedSurfaceCollide( int surfaceNum )
+{
+	return cachedCollides[ surfaceNum ];
+}
+
+/*
+================
+CM_WriteCollisionCache
+
+Saves the brush edges and surface collision data of the map that was just
+loaded without a cache
+================
+*/
+void CM_WriteCollisionCache( const char *name, const dheader_t *header )
+{
+	std::string       path = CM_CachePath( name );
+	std::string       tempPath = path + ".tmp";
+	std::vector<byte> data;
+	std::error_code   err;
+	FS::File          f;
+	cacheHeader_t     cache;
+	cacheBrush_t      *brushes;
+	cacheSurface_t    *surfaces;
+	size_t            offsets[ CACHE_NUM_ARRAYS ];
+	int               i, numEdges, numPlanes, numFacets;
+
+	if ( !cm_collisionCache.Get() )
+	{
+		return;
+	}
+
+	memset( &cache, 0, sizeof( cache ) );
+	cache.ident = CACHE_IDENT;
+	cache.version = CACHE_VERSION;
+	cache.key = CM_CacheKey( header );
+	cache.counts[ CACHE_BRUSHES ] = cm.numBrushes;
+	cache.counts[ CACHE_SURFACES ] = cm.numSurfaces;
+
+	for ( i = 0; i < cm.numBrushes; i++ )
+	{
+		cache.counts[ CACHE_EDGES ] += cm.brushes[ i ].numEdges;
+	}
+
+	for ( i = 0; i < cm.numSurfaces; i++ )
+	{
+		if ( cm.surfaces[ i ] && cm.surfaces[ i ]->sc )
+		{
+			cache.counts[ CACHE_PLANES ] += cm.surfaces[ i ]->sc->numPlanes;
+			cache.counts[ CACHE_FACETS ] += cm.surfaces[ i ]->sc->numFacets;
+		}
+	}
+
+	cache.size = CM_CacheLayout( cache.counts, offsets );
+	data.resize( cache.size );
+	brushes = ( cacheBrush_t * )( data.data() + offsets[ CACHE_BRUSHES ] );
+	surfaces = ( cacheSurface_t * )( data.data() + offsets[ CACHE_SURFACES ] );
+
+	for ( i = numEdges = 0; i < cm.numBrushes; i++ )
+	{
+		const cbrush_t *brush = &cm.brushes[ i ];
+
+		brushes[ i ].firstEdge = numEdges;
+		brushes[ i ].numEdges = brush->numEdges;
+		memcpy( data.data() + offsets[ CACHE_EDGES ] + numEdges * sizeof( cbrushedge_t ), brush->edges,
+		        brush->numEdges * sizeof( cbrushedge_t ) );
+		numEdges += brush->numEdges;
+	}
+
+	for ( i = numPlanes = numFacets = 0; i < cm.numSurfaces; i++ )
+	{
+		const cSurfaceCollide_t *sc = cm.surfaces[ i ] ? cm.surfaces[ i ]->sc : NULL;
+
+		if ( !sc )
+		{
+			surfaces[ i ].numPlanes = -1;
+			continue;
+		}
+
+		VectorCopy( sc->bounds[ 0 ], surfaces[ i ].bounds[ 0 ] );
+		VectorCopy( sc->bounds[ 1 ], surfaces[ i ].bounds[ 1 ] );
+		surfaces[ i ].firstPlane = numPlanes;
+		surfaces[ i ].numPlanes = sc->numPlanes;
+		surfaces[ i ].firstFacet = numFacets;
+		surfaces[ i ].numFacets = sc->numFacets;
+		memcpy( data.data() + offsets[ CACHE_PLANES ] + numPlanes * sizeof( cPlane_t ), sc->planes, sc->numPlanes * sizeof( cPlane_t ) );
+		memcpy( data.data() + offsets[ CACHE_FACETS ] + numFacets * sizeof( cFacet_t ), sc->facets, sc->numFacets * sizeof( cFacet_t ) );
+		numPlanes += sc->numPlanes;
+		numFacets += sc->numFacets;
+	}
+
+	cache.checksum = CM_CacheHash( data.data() + sizeof( cache ), data.size() - sizeof( cache ), 0 );
+	memcpy( data.data(), &cache, sizeof( cache ) );
+
+	// written aside then moved in place, so that a map loading at the same
+	// time in another module never reads half a file
+	f = FS::HomePath::OpenWrite( tempPath, err );
+
+	if ( !err )
+	{
+		f.Write( data.data(), data.size(), err );
+		f.Close( err );
+	}
+
+	if ( !err )
+	{
+		FS::HomePath::MoveFile( path, tempPath, err );
+	}
+
+	if ( err )
+	{
+		cmLog.Warn( "couldn't write collision cache %s: %s\n", path, err.message() );
+		return;
+	}
+
+	cmLog.Debug( "wrote %d KB of collision data to %s\n", cache.size >> 10, path );
+}
@@ -47,8 +47,8 @@ Maryland 20850 USA.
 #define LL( x ) x = LittleLong( x )
 
 clipMap_t cm;
-int       c_pointcontents;
-int       c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
+std::atomic<int> c_pointcontents;
+std::atomic<int> c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
 
 byte      *cmod_base;
 
@@ -766,11 +766,13 @@ void CMod_LoadVisibility( lump_t *l )
 /*
 =================
 CMod_LoadSurfaces
+
+Takes the surface collision data from the cache if there is one
 =================
 */
 #define MAX_PATCH_SIZE  64
 #define MAX_PATCH_VERTS ( MAX_PATCH_SIZE * MAX_PATCH_SIZE )
-void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump )
+void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump, qboolean cached )
 {
 	drawVert_t    *dv, *dv_p;
 	dsurface_t    *in;
@@ -821,6 +823,16 @@ void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump )
 			cm.surfaces[ i ] = surface = ( cSurface_t * ) CM_Alloc( sizeof( *surface ) );
 			surface->type = MST_PATCH;
 
+			shaderNum = LittleLong( in->shaderNum );
+			surface->contents = cm.shaders[ shaderNum ].contentFlags;
+			surface->surfaceFlags = cm.shaders[ shaderNum ].surfaceFlags;
+
+			if ( cached )
+			{
+				surface->sc = CM_CachedSurfaceCollide( i );
+				continue;
+			}
+
 			// load the full drawverts onto the stack
 			width = LittleLong( in->patchWidth );
 			height = LittleLong( in->patchHeight );
@@ -840,10 +852,6 @@ void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump )
 				vertexes[ j ][ 2 ] = LittleFloat( dv_p->xyz[ 2 ] );
 			}
 
-			shaderNum = LittleLong( in->shaderNum );
-			surface->contents = cm.shaders[ shaderNum ].contentFlags;
-			surface->surfaceFlags = cm.shaders[ shaderNum ].surfaceFlags;
-
 			// create the internal facet structure
 			surface->sc = CM_GeneratePatchCollide( width, height, vertexes );
 		}
@@ -854,6 +862,16 @@ void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump )
 			cm.surfaces[ i ] = surface = ( cSurface_t * ) CM_Alloc( sizeof( *surface ) );
 			surface->type = MST_TRIANGLE_SOUP;
 
+			shaderNum = LittleLong( in->shaderNum );
+			surface->contents = cm.shaders[ shaderNum ].contentFlags;
+			surface->surfaceFlags = cm.shaders[ shaderNum ].surfaceFlags;
+
+			if ( cached )
+			{
+				surface->sc = CM_CachedSurfaceCollide( i );
+				continue;
+			}
+
 			// load the full drawverts onto the stack
 			numVertexes = LittleLong( in->numVerts );
 
@@ -890,10 +908,6 @@ void CMod_LoadSurfaces( lump_t *surfs, lump_t *verts, lump_t *indexesLump )
 				}
 			}
 
-			shaderNum = LittleLong( in->shaderNum );
-			surface->contents = cm.shaders[ shaderNum ].contentFlags;
-			surface->surfaceFlags = cm.shaders[ shaderNum ].surfaceFlags;
-
 			// create the internal facet structure
 			surface->sc = CM_GenerateTriangleSoupCollide( numVertexes, vertexes, numIndexes, indexes );
 		}
@@ -913,6 +927,8 @@ void CM_LoadMap( const char *name, const void* buffer, qboolean clientload )
 {
 	int             i;
 	dheader_t       header;
+	qboolean        cached;
+	uint64_t        startTime;
 
 	if ( !name || !name[ 0 ] )
 	{
@@ -967,9 +983,28 @@ void CM_LoadMap( const char *name, const void* buffer, qboolean clientload )
 	CMod_LoadNodes( &header.lumps[ LUMP_NODES ] );
 	CMod_LoadEntityString( &header.lumps[ LUMP_ENTITIES ] );
 	CMod_LoadVisibility( &header.lumps[ LUMP_VISIBILITY ] );
-	CMod_LoadSurfaces( &header.lumps[ LUMP_SURFACES ], &header.lumps[ LUMP_DRAWVERTS ], &header.lumps[ LUMP_DRAWINDEXES ] );
 
-	CMod_CreateBrushSideWindings();
+	// the brush edges and the surface facets are the slow part, skip building
+	// them when they are in the cache
+	startTime = CM_ProfileClock();
+	cached = CM_LoadCollisionCache( name, &header );
+
+	CMod_LoadSurfaces( &header.lumps[ LUMP_SURFACES ], &header.lumps[ LUMP_DRAWVERTS ], &header.lumps[ LUMP_DRAWINDEXES ], cached );
+
+	if ( !cached )
+	{
+		CMod_CreateBrushSideWindings();
+	}
+
+	cmLog.Debug( "%s collision data of %s in %.1f ms\n", cached ? "Loaded the cached" : "Built the",
+	             name, ( CM_ProfileClock() - startTime ) * 1e-6 );
+
+	if ( !cached )
+	{
+		startTime = CM_ProfileClock();
+		CM_WriteCollisionCache( name, &header );
+		cmLog.Debug( "Cached the collision data of %s in %.1f ms\n", name, ( CM_ProfileClock() - startTime ) * 1e-6 );
+	}
 
 	CM_InitBoxHull();
 
@@ -1040,6 +1075,11 @@ int CM_NumInlineModels( void )
 	return cm.numSubModels;
 }
 
+int CM_NumClusters( void )
+{
+	return cm.numClusters;
+}
+
 char           *CM_EntityString( void )
 {
 	return cm.entityString;
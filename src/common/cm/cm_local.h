@@ -88,17 +88,14 @@ typedef struct
 	vec3_t       bounds[ 2 ];
 	int          numsides;
 	cbrushside_t *sides;
-	int          checkcount; // to avoid repeated testings
-	qboolean     collided; // marker for optimisation
 	cbrushedge_t *edges;
 	int          numEdges;
 } cbrush_t;
 
-typedef struct cPlane_s
+typedef struct
 {
-	float           plane[ 4 ];
-	int             signbits; // signx + (signy<<1) + (signz<<2), used as lookup during collision
-	struct cPlane_s *hashChain;
+	float plane[ 4 ];
+	int   signbits; // signx + (signy<<1) + (signz<<2), used as lookup during collision
 } cPlane_t;
 
 // 3 or four + 6 axial bevels + 4 or 3 * 4 edge bevels
@@ -126,7 +123,6 @@ typedef struct cSurfaceCollide_s
 
 typedef struct
 {
-	int               checkcount; // to avoid repeated testings
 	int               surfaceFlags;
 	int               contents;
 	cSurfaceCollide_t *sc;
@@ -186,7 +182,6 @@ typedef struct
 	cSurface_t   **surfaces; // non-patches will be NULL
 
 	int          floodvalid;
-	int          checkcount; // incremented on each trace
 	qboolean     perPolyCollision;
 } clipMap_t;
 
@@ -195,10 +190,11 @@ typedef struct
 #define SURFACE_CLIP_EPSILON ( 0.125 )
 
 extern clipMap_t cm;
-extern int       c_pointcontents;
-extern int       c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
+extern std::atomic<int> c_pointcontents;
+extern std::atomic<int> c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
 extern Cvar::Cvar<bool> cm_forceTriangles;
 extern Log::Logger cmLog;
+extern byte *cmod_base;
 
 // cm_test.c
 
@@ -216,6 +212,30 @@ typedef struct
 	vec3_t offset;
 } sphere_t;
 
+// the brushes and surfaces a trace already tested, kept per trace rather than
+// stamped into the shared clip map so that traces can run on several threads
+#define TRACE_VISITED_SLOTS    64 // initial size, must be a power of two
+#define TRACE_VISITED_COLLIDED 0x40000000 // brush crossed one of its planes
+
+typedef struct
+{
+	int              numVisited;
+	int              visitedMask;
+	int              *visited; // open addressing, see CM_VisitOnce
+	int              visitedSlots[ TRACE_VISITED_SLOTS ];
+	std::vector<int> visitedOverflow; // once the slots are 3/4 full
+
+	// statistics, added to the c_ counters when the trace is done
+	int              brushTraces;
+	int              patchTraces;
+	int              trisoupTraces;
+
+	// collision profiler, see CM_ProfileTrace
+	qboolean         profile;
+	uint64_t         profileStart;
+	std::vector<int> profileLeafs; // world leafs the trace went through
+} traceContext_t;
+
 typedef struct
 {
 	traceType_t type;
@@ -234,6 +254,8 @@ typedef struct
 	sphere_t    sphere; // sphere for oriendted capsule collision
 	biSphere_t  biSphere;
 	qboolean    testLateralCollision; // whether or not to test for lateral collision
+	qboolean    brushCollided; // set by CM_TraceThroughBrush
+	traceContext_t *context;
 } traceWork_t;
 
 typedef struct leafList_s
@@ -254,6 +276,19 @@ typedef struct leafList_s
 cSurfaceCollide_t *CM_GeneratePatchCollide( int width, int height, vec3_t *points );
 void              CM_ClearLevelPatches( void );
 
+// cm_cache.cpp
+
+qboolean          CM_LoadCollisionCache( const char *name, const dheader_t *header );
+cSurfaceCollide_t *CM_CachedSurfaceCollide( int surfaceNum );
+void              CM_WriteCollisionCache( const char *name, const dheader_t *header );
+
+// cm_profile.cpp
+
+extern std::atomic<bool> cm_profiling;
+
+uint64_t CM_ProfileClock( void );
+void     CM_ProfileTrace( const traceContext_t *context, const vec3_t position, uint64_t nsec );
+
 // cm_trisoup.c
 
 typedef struct
@@ -290,8 +325,8 @@ qboolean CM_GenerateFacetFor4Points( cFacet_t *facet, const vec3_t p1, const vec
 
 
 // cm_test.c
-extern const cSurfaceCollide_t *debugSurfaceCollide;
-extern const cFacet_t          *debugFacet;
+extern std::atomic<const cSurfaceCollide_t *> debugSurfaceCollide; // last hit by any thread
+extern std::atomic<const cFacet_t *>          debugFacet;
 extern qboolean                debugBlock;
 extern vec3_t                  debugBlockPoints[ 4 ];
 
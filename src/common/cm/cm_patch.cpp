@@ -37,8 +37,8 @@ Maryland 20850 USA.
 
 int                     c_totalPatchBlocks;
 
-const cSurfaceCollide_t *debugSurfaceCollide;
-const cFacet_t          *debugFacet;
+std::atomic<const cSurfaceCollide_t *> debugSurfaceCollide;
+std::atomic<const cFacet_t *>          debugFacet;
 qboolean                debugBlock;
 vec3_t                  debugBlockPoints[ 4 ];
 
@@ -40,6 +40,9 @@ static cPlane_t *planeHashTable[ PLANE_HASHES ];
 int      numPlanes;
 cPlane_t planes[ SHADER_MAX_TRIANGLES ];
 
+// kept apart so that the planes copied out hold no pointers (see cm_cache.cpp)
+static cPlane_t *planeHashChains[ SHADER_MAX_TRIANGLES ];
+
 int      numFacets;
 cFacet_t facets[ SHADER_MAX_TRIANGLES ];
 
@@ -191,7 +194,7 @@ static void CM_AddPlaneToHash( cPlane_t *p )
 
 	hash = CM_GenerateHashValue( p->plane );
 
-	p->hashChain = planeHashTable[ hash ];
+	planeHashChains[ p - planes ] = planeHashTable[ hash ];
 	planeHashTable[ hash ] = p;
 }
 
@@ -240,7 +243,7 @@ int CM_FindPlane2( float plane[ 4 ], qboolean *flipped )
 	{
 		h = ( hash + i ) & ( PLANE_HASHES - 1 );
 
-		for ( p = planeHashTable[ h ]; p; p = p->hashChain )
+		for ( p = planeHashTable[ h ]; p; p = planeHashChains[ p - planes ] )
 		{
 			if ( CM_PlaneEqual( p, plane, flipped ) )
 			{
@@ -278,7 +281,7 @@ int CM_FindPlane( const float *p1, const float *p2, const float *p3 )
 	{
 		h = ( hash + i ) & ( PLANE_HASHES - 1 );
 
-		for ( p = planeHashTable[ h ]; p; p = p->hashChain )
+		for ( p = planeHashTable[ h ]; p; p = planeHashChains[ p - planes ] )
 		{
 			//check points on the plane
 			if ( DotProduct( plane, p->plane ) < 0 )
@@ -0,0 +1,442 @@
+/*
+===========================================================================
+
+Daemon GPL Source Code
+Copyright (C) 1999-2010 id Software LLC, a ZeniMax Media company.
+
+This file is part of the Daemon GPL Source Code (Daemon Source Code).
+
+Daemon Source Code is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Daemon Source Code is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Daemon Source Code.  If not, see <http://www.gnu.org/licenses/>.
+
+In addition, the Daemon Source Code is also subject to certain additional terms.
+You should have received a copy of these additional terms immediately following the
+terms and conditions of the GNU General Public License which accompanied the Daemon
+Source Code.  If not, please request a copy in writing from id Software at the address
+below.
+
+If you have questions concerning this license or the applicable additional terms, you
+may contact in writing id Software LLC, c/o ZeniMax Media Inc., Suite 120, Rockville,
+Maryland 20850 USA.
+
+===========================================================================
+*/
+
+// collision profiler, attributes the time of the traces to their source,
+// to the leafs and brushes they went through and to where they happened
+
+#include "cm_local.h"
+
+std::atomic<bool> cm_profiling( false );
+
+static THREAD_LOCAL traceSource_t traceSource = TRACE_SOURCE_OTHER;
+
+static const char *const traceSourceNames[ TRACE_NUM_SOURCES ] =
+{
+	"other",
+	"pmove",
+	"weapons",
+	"buildables",
+	"bots",
+	"cgame"
+};
+
+struct profileCounter_t
+{
+	uint64_t traces;
+	uint64_t time; // nanoseconds
+	uint64_t maxTime;
+	uint64_t brushTests;
+};
+
+struct profileLeaf_t
+{
+	uint64_t traces;
+	uint64_t time;
+	double   position[ 3 ]; // sum of where the traces were, see CM_ProfileTrace
+};
+
+struct profileBrush_t
+{
+	uint64_t traces;
+	uint64_t time;
+};
+
+struct profile_t
+{
+	std::mutex                  lock;
+	char                        map[ MAX_QPATH ];
+	uint64_t                    startTime, stopTime; // stopTime is 0 while running
+	float                       cellSize;
+	profileCounter_t            sources[ TRACE_NUM_SOURCES ];
+	std::vector<profileLeaf_t>  leafs;
+	std::vector<profileBrush_t> brushes;
+	std::unordered_map<uint64_t, profileCounter_t> cells; // see CM_ProfileCell
+};
+
+static profile_t profile;
+
+/*
+================
+CM_SetTraceSource
+================
+*/
+traceSource_t CM_SetTraceSource( traceSource_t source )
+{
+	traceSource_t previous = traceSource;
+
+	traceSource = source;
+	return previous;
+}
+
+/*
+================
+CM_ProfileClock
+
+Nanoseconds from an arbitrary point in time
+================
+*/
+uint64_t CM_ProfileClock( void )
+{
+#ifdef LIBSTDCXX_BROKEN_CXX11
+	auto now = std::chrono::monotonic_clock::now().time_since_epoch();
+#else
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+#endif
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( now ).count();
+}
+
+/*
+================
+CM_ResetProfile
+
+The profile lock must be held
+================
+*/
+static void CM_ResetProfile( void )
+{
+	Q_strncpyz( profile.map, cm.name, sizeof( profile.map ) );
+	profile.startTime = CM_ProfileClock();
+	profile.stopTime = cm_profiling ? 0 : profile.startTime;
+	Com_Memset( profile.sources, 0, sizeof( profile.sources ) );
+	profile.leafs.assign( cm.numLeafs, profileLeaf_t() );
+	profile.brushes.assign( cm.numBrushes, profileBrush_t() );
+	profile.cells.clear();
+}
+
+/*
+================
+CM_ProfileCell
+
+Key of the heatmap cell holding a position, cells are columns over the
+map seen from above
+================
+*/
+static uint64_t CM_ProfileCell( const vec3_t position )
+{
+	int x = floor( position[ 0 ] / profile.cellSize );
+	int y = floor( position[ 1 ] / profile.cellSize );
+
+	return ( uint64_t )( uint32_t ) x << 32 | ( uint32_t ) y;
+}
+
+/*
+================
+CM_ProfileTrace
+
+Adds a finished trace that took nsec to the profile. The leafs and
+brushes are charged the whole time of the traces that reached them
+================
+*/
+void CM_ProfileTrace( const traceContext_t *context, const vec3_t position, uint64_t nsec )
+{
+	profileCounter_t *counter;
+	int              i, key;
+
+	std::lock_guard<std::mutex> lock( profile.lock );
+
+	if ( profile.stopTime )
+	{
+		return; // stopped while the trace was running
+	}
+
+	if ( Q_stricmp( profile.map, cm.name ) )
+	{
+		CM_ResetProfile(); // another map was loaded
+	}
+
+	for ( i = 0; i < 2; i++ )
+	{
+		counter = i ? &profile.cells[ CM_ProfileCell( position ) ] : &profile.sources[ traceSource ];
+		counter->traces++;
+		counter->time += nsec;
+		counter->maxTime = std::max( counter->maxTime, nsec );
+		counter->brushTests += context->brushTraces;
+	}
+
+	for ( int leafnum : context->profileLeafs )
+	{
+		if ( leafnum < 0 || ( size_t ) leafnum >= profile.leafs.size() )
+		{
+			continue;
+		}
+
+		profileLeaf_t &leaf = profile.leafs[ leafnum ];
+
+		leaf.traces++;
+		leaf.time += nsec;
+		leaf.position[ 0 ] += position[ 0 ];
+		leaf.position[ 1 ] += position[ 1 ];
+		leaf.position[ 2 ] += position[ 2 ];
+	}
+
+	// the visited set holds every brush the trace tested
+	for ( i = 0; i <= context->visitedMask; i++ )
+	{
+		key = context->visited[ i ] & ~TRACE_VISITED_COLLIDED;
+
+		if ( ( key & 1 ) && ( key >> 1 ) < profile.brushes.size() )
+		{
+			profile.brushes[ key >> 1 ].traces++;
+			profile.brushes[ key >> 1 ].time += nsec;
+		}
+	}
+}
+
+/*
+================
+CM_SortProfile
+
+Indexes of the count entries taking the most time
+================
+*/
+template<typename T> static std::vector<int> CM_SortProfile( const std::vector<T>& entries, int count )
+{
+	std::vector<int> order;
+
+	for ( int i = 0; i < entries.size(); i++ )
+	{
+		if ( entries[ i ].traces )
+		{
+			order.push_back( i );
+		}
+	}
+
+	count = std::min<int>( count, order.size() );
+	std::partial_sort( order.begin(), order.begin() + count, order.end(), [ &entries ]( int a, int b ) {
+		return entries[ a ].time > entries[ b ].time;
+	} );
+	order.resize( count );
+
+	return order;
+}
+
+/*
+================
+CM_PrintProfile
+================
+*/
+static void CM_PrintProfile( int count )
+{
+	uint64_t         now = CM_ProfileClock();
+	profileCounter_t total;
+	int              i;
+
+	std::lock_guard<std::mutex> lock( profile.lock );
+
+	Com_Memset( &total, 0, sizeof( total ) );
+	Com_Printf( "Collision profile of %s over %.1f s%s\n", profile.map,
+	            ( ( profile.stopTime ? profile.stopTime : now ) - profile.startTime ) * 1e-9,
+	            profile.stopTime ? " (stopped)" : "" );
+	Com_Printf( "%-10s %9s %9s %9s %9s %12s\n", "source", "traces", "ms", "us/trace", "max us", "brush tests" );
+
+	for ( i = 0; i < TRACE_NUM_SOURCES; i++ )
+	{
+		const profileCounter_t &source = profile.sources[ i ];
+
+		if ( !source.traces )
+		{
+			continue;
+		}
+
+		Com_Printf( "%-10s %9llu %9.1f %9.2f %9.1f %12llu\n", traceSourceNames[ i ], ( unsigned long long ) source.traces,
+		            source.time * 1e-6, source.time * 1e-3 / source.traces, source.maxTime * 1e-3,
+		            ( unsigned long long ) source.brushTests );
+		total.traces += source.traces;
+		total.time += source.time;
+		total.maxTime = std::max( total.maxTime, source.maxTime );
+		total.brushTests += source.brushTests;
+	}
+
+	if ( !total.traces )
+	{
+		return;
+	}
+
+	Com_Printf( "%-10s %9llu %9.1f %9.2f %9.1f %12llu\n", "total", ( unsigned long long ) total.traces,
+	            total.time * 1e-6, total.time * 1e-3 / total.traces, total.maxTime * 1e-3,
+	            ( unsigned long long ) total.brushTests );
+
+	Com_Printf( "\nLeafs by time of the traces through them:\n" );
+	Com_Printf( "%6s %7s %5s %9s %9s  %s\n", "leaf", "cluster", "area", "traces", "ms", "traces around" );
+
+	for ( int leafnum : CM_SortProfile( profile.leafs, count ) )
+	{
+		if ( leafnum >= cm.numLeafs )
+		{
+			continue; // the map was unloaded since
+		}
+
+		const profileLeaf_t &leaf = profile.leafs[ leafnum ];
+
+		Com_Printf( "%6i %7i %5i %9llu %9.1f  (%.0f %.0f %.0f)\n", leafnum, cm.leafs[ leafnum ].cluster,
+		            cm.leafs[ leafnum ].area, ( unsigned long long ) leaf.traces, leaf.time * 1e-6,
+		            leaf.position[ 0 ] / leaf.traces, leaf.position[ 1 ] / leaf.traces, leaf.position[ 2 ] / leaf.traces );
+	}
+
+	Com_Printf( "\nBrushes by time of the traces testing them:\n" );
+	Com_Printf( "%6s %5s %9s %9s  %s\n", "brush", "sides", "traces", "ms", "center" );
+
+	for ( int brushnum : CM_SortProfile( profile.brushes, count ) )
+	{
+		if ( brushnum >= cm.numBrushes )
+		{
+			continue; // the map was unloaded since
+		}
+
+		const profileBrush_t &brush = profile.brushes[ brushnum ];
+		const cbrush_t       *b = &cm.brushes[ brushnum ];
+
+		Com_Printf( "%6i %5i %9llu %9.1f  (%.0f %.0f %.0f)\n", brushnum, b->numsides, ( unsigned long long ) brush.traces,
+		            brush.time * 1e-6, ( b->bounds[ 0 ][ 0 ] + b->bounds[ 1 ][ 0 ] ) * 0.5f,
+		            ( b->bounds[ 0 ][ 1 ] + b->bounds[ 1 ][ 1 ] ) * 0.5f, ( b->bounds[ 0 ][ 2 ] + b->bounds[ 1 ][ 2 ] ) * 0.5f );
+	}
+
+	std::vector<std::pair<uint64_t, profileCounter_t>> cells( profile.cells.begin(), profile.cells.end() );
+
+	count = std::min<int>( count, cells.size() );
+	std::partial_sort( cells.begin(), cells.begin() + count, cells.end(),
+	                   []( const std::pair<uint64_t, profileCounter_t>& a, const std::pair<uint64_t, profileCounter_t>& b ) {
+		return a.second.time > b.second.time;
+	} );
+
+	Com_Printf( "\nHeatmap cells of %g units by time:\n", profile.cellSize );
+	Com_Printf( "%7s %7s %9s %9s %9s\n", "x", "y", "traces", "ms", "max us" );
+
+	for ( i = 0; i < count; i++ )
+	{
+		Com_Printf( "%7.0f %7.0f %9llu %9.1f %9.1f\n", ( ( int32_t )( cells[ i ].first >> 32 ) + 0.5f ) * profile.cellSize,
+		            ( ( int32_t ) cells[ i ].first + 0.5f ) * profile.cellSize, ( unsigned long long ) cells[ i ].second.traces,
+		            cells[ i ].second.time * 1e-6, cells[ i ].second.maxTime * 1e-3 );
+	}
+}
+
+/*
+================
+CM_WriteHeatmap
+
+One line per cell with its center, the traces and the microseconds they
+took, that gnuplot and spreadsheets can read
+================
+*/
+static void CM_WriteHeatmap( const std::string& path )
+{
+	std::string     text;
+	std::error_code err;
+
+	std::lock_guard<std::mutex> lock( profile.lock );
+
+	text = va( "# collision heatmap of %s, cells of %g units\n# x y traces us maxus brushtests\n",
+	           profile.map, profile.cellSize );
+
+	for ( const auto &cell : profile.cells )
+	{
+		text += va( "%.0f %.0f %llu %llu %llu %llu\n", ( ( int32_t )( cell.first >> 32 ) + 0.5f ) * profile.cellSize,
+		            ( ( int32_t ) cell.first + 0.5f ) * profile.cellSize, ( unsigned long long ) cell.second.traces,
+		            ( unsigned long long ) cell.second.time / 1000, ( unsigned long long ) cell.second.maxTime / 1000,
+		            ( unsigned long long ) cell.second.brushTests );
+	}
+
+	FS::File f = FS::HomePath::OpenWrite( path, err );
+
+	if ( !err )
+	{
+		f.Write( text.data(), text.size(), err );
+	}
+
+	if ( err )
+	{
+		Com_Printf( "^1Couldn't write %s: %s\n", path.c_str(), err.message().c_str() );
+	}
+	else
+	{
+		Com_Printf( "Wrote %i heatmap cells to %s\n", ( int ) profile.cells.size(), path.c_str() );
+	}
+}
+
+class ProfileCmd: public Cmd::StaticCmd {
+public:
+	ProfileCmd()
+		: Cmd::StaticCmd(VM_STRING_PREFIX "cm_profile", Cmd::SYSTEM, "profiles the collision traces by source, leaf, brush and map position") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		const std::string& command = args.Argc() > 1 ? args.Argv(1) : "";
+
+		if (command == "start") {
+			if (!cm.numNodes) {
+				Print("No map loaded");
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(profile.lock);
+
+			profile.cellSize = args.Argc() > 2 ? std::max(atof(args.Argv(2).c_str()), 1.0) : 256.0f;
+			cm_profiling = true;
+			CM_ResetProfile();
+		} else if (command == "stop") {
+			std::lock_guard<std::mutex> lock(profile.lock);
+
+			if (cm_profiling) {
+				cm_profiling = false;
+				profile.stopTime = CM_ProfileClock();
+			}
+		} else if (command == "reset") {
+			std::lock_guard<std::mutex> lock(profile.lock);
+
+			CM_ResetProfile();
+		} else if (command == "report") {
+			CM_PrintProfile(args.Argc() > 2 ? std::max(atoi(args.Argv(2).c_str()), 1) : 10);
+		} else if (command == "heatmap" && args.Argc() > 2) {
+			CM_WriteHeatmap(args.Argv(2));
+		} else {
+			PrintUsage(args, "start [cellsize] | stop | reset | report [count] | heatmap <file>", "");
+		}
+	}
+
+	Cmd::CompletionResult Complete(int argNum, const Cmd::Args& args, Str::StringRef prefix) const OVERRIDE
+	{
+		if (argNum == 1) {
+			return Cmd::FilterCompletion(prefix, {
+				{"start", "starts recording traces"},
+				{"stop", "stops recording"},
+				{"reset", "clears the profile"},
+				{"report", "prints the profile"},
+				{"heatmap", "writes the heatmap to a file"}
+			});
+		}
+
+		return {};
+	}
+};
+static ProfileCmd ProfileCmdRegistration;
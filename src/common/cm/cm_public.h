@@ -32,6 +32,9 @@ Maryland 20850 USA.
 ===========================================================================
 */
 
+#ifndef CM_PUBLIC_H_
+#define CM_PUBLIC_H_
+
 #include "../../engine/qcommon/q_shared.h"
 #include "../../engine/qcommon/qfiles.h"
 #include "../../engine/renderer/tr_types.h"
@@ -47,6 +50,9 @@ void         CM_ModelBounds( clipHandle_t model, vec3_t mins, vec3_t maxs );
 int          CM_NumInlineModels( void );
 char         *CM_EntityString( void );
 
+// traces and contents queries can run on several threads at once, but
+// CM_TempBoxModel and loading a map must not overlap with them
+
 // returns an ORed contents mask
 int          CM_PointContents( const vec3_t p, clipHandle_t model );
 int          CM_TransformedPointContents( const vec3_t p, clipHandle_t model, const vec3_t origin, const vec3_t angles );
@@ -54,6 +60,9 @@ int          CM_TransformedPointContents( const vec3_t p, clipHandle_t model, co
 void         CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end, vec3_t mins,
                           vec3_t maxs, clipHandle_t model, int brushmask, int skipmask,
                           traceType_t type );
+void         CM_BoxTraceBatch( trace_t *results, int numTraces, const vec3_t *starts,
+                               const vec3_t *ends, const vec3_t *mins, const vec3_t *maxs,
+                               int brushmask, int skipmask, traceType_t type );
 void         CM_TransformedBoxTrace( trace_t *results, const vec3_t start, const vec3_t end,
                                      const vec3_t mins, const vec3_t maxs, clipHandle_t model,
                                      int brushmask, int skipmask, const vec3_t origin,
@@ -65,9 +74,26 @@ void         CM_TransformedBiSphereTrace( trace_t *results, const vec3_t start,
                                           float startRad, float endRad, clipHandle_t model,
                                           int mask, int skipmask, const vec3_t origin );
 
+// the collision profiler (cm_profile) attributes each trace to the source
+// last set on the calling thread, returns the previous source to be set
+// back when the caller is done
+traceSource_t CM_SetTraceSource( traceSource_t source );
+
+// sets the trace source until the end of the scope
+class CM_TraceSourceScope
+{
+public:
+	CM_TraceSourceScope( traceSource_t source ) : previous( CM_SetTraceSource( source ) ) {}
+	~CM_TraceSourceScope() { CM_SetTraceSource( previous ); }
+
+private:
+	traceSource_t previous;
+};
+
 float CM_DistanceToModel( const vec3_t loc, clipHandle_t model );
 
 byte *CM_ClusterPVS( int cluster );
+int  CM_NumClusters( void );
 
 int  CM_PointLeafnum( const vec3_t p );
 
@@ -89,3 +115,5 @@ int      CM_MarkFragments( int numPoints, const vec3_t *points, const vec3_t pro
 
 // cm_patch.c
 void CM_DrawDebugSurface( void ( *drawPoly )( int color, int numPoints, float *points ) );
+
+#endif /* CM_PUBLIC_H_ */
@@ -72,7 +72,7 @@ int CM_PointLeafnum_r( const vec3_t p, int num )
 		}
 	}
 
-	c_pointcontents++; // optimize counter
+	c_pointcontents.fetch_add( 1, std::memory_order_relaxed ); // optimize counter
 
 	return -1 - num;
 }
@@ -168,8 +168,6 @@ int CM_BoxLeafnums( const vec3_t mins, const vec3_t maxs, int *list, int listsiz
 {
 	leafList_t ll;
 
-	cm.checkcount++;
-
 	VectorCopy( mins, ll.bounds[ 0 ] );
 	VectorCopy( maxs, ll.bounds[ 1 ] );
 	ll.count = 0;
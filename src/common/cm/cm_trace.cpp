@@ -155,6 +155,172 @@ float CM_DistanceFromLineSquared( vec3_t p, vec3_t lp1, vec3_t lp2, vec3_t dir )
 /*
 ===============================================================================
 
+TRACE CONTEXT
+
+===============================================================================
+*/
+
+/*
+================
+CM_InitTraceContext
+================
+*/
+static void CM_InitTraceContext( traceContext_t *context )
+{
+	context->numVisited = 0;
+	context->visitedMask = TRACE_VISITED_SLOTS - 1;
+	context->visited = context->visitedSlots;
+	Com_Memset( context->visitedSlots, 0, sizeof( context->visitedSlots ) );
+
+	context->brushTraces = 0;
+	context->patchTraces = 0;
+	context->trisoupTraces = 0;
+
+	context->profile = cm_profiling.load( std::memory_order_relaxed ) ? qtrue : qfalse;
+
+	if ( context->profile )
+	{
+		context->profileLeafs.clear();
+		context->profileStart = CM_ProfileClock();
+	}
+}
+
+/*
+================
+CM_FinishTraceContext
+
+position is where the trace is reported on the profiler heatmap
+================
+*/
+static void CM_FinishTraceContext( traceContext_t *context, const vec3_t position )
+{
+	c_traces.fetch_add( 1, std::memory_order_relaxed ); // for statistics, may be zeroed
+
+	if ( context->profile )
+	{
+		CM_ProfileTrace( context, position, CM_ProfileClock() - context->profileStart );
+	}
+
+	if ( context->brushTraces )
+	{
+		c_brush_traces.fetch_add( context->brushTraces, std::memory_order_relaxed );
+	}
+
+	if ( context->patchTraces )
+	{
+		c_patch_traces.fetch_add( context->patchTraces, std::memory_order_relaxed );
+	}
+
+	if ( context->trisoupTraces )
+	{
+		c_trisoup_traces.fetch_add( context->trisoupTraces, std::memory_order_relaxed );
+	}
+}
+
+/*
+================
+CM_ProfileLeaf
+================
+*/
+static inline void CM_ProfileLeaf( traceContext_t *context, int leafnum )
+{
+	if ( context->profile )
+	{
+		context->profileLeafs.push_back( leafnum );
+	}
+}
+
+static inline int CM_VisitedHash( int key )
+{
+	return ( int )( ( unsigned ) key * 2654435761u >> 8 );
+}
+
+/*
+================
+CM_GrowVisited
+
+Moves the visited set to twice as many slots once it gets crowded
+================
+*/
+static void CM_GrowVisited( traceContext_t *context )
+{
+	std::vector<int> slots( ( context->visitedMask + 1 ) * 2, 0 );
+	int              mask = slots.size() - 1;
+	int              i, j;
+
+	for ( i = 0; i <= context->visitedMask; i++ )
+	{
+		if ( !context->visited[ i ] )
+		{
+			continue;
+		}
+
+		for ( j = CM_VisitedHash( context->visited[ i ] & ~TRACE_VISITED_COLLIDED ) & mask; slots[ j ]; j = ( j + 1 ) & mask )
+		{
+		}
+
+		slots[ j ] = context->visited[ i ];
+	}
+
+	context->visitedOverflow.swap( slots );
+	context->visited = context->visitedOverflow.data();
+	context->visitedMask = mask;
+}
+
+/*
+================
+CM_VisitOnce
+
+Keys are brushnum * 2 + 1 and surfacenum * 2 + 2. Returns the slot of
+the key if this is the first time the trace reaches it, NULL if it was
+already tested through another leaf
+================
+*/
+static int *CM_VisitOnce( traceContext_t *context, int key )
+{
+	int i;
+
+	if ( ( context->numVisited + 1 ) * 4 > ( context->visitedMask + 1 ) * 3 )
+	{
+		CM_GrowVisited( context );
+	}
+
+	for ( i = CM_VisitedHash( key ) & context->visitedMask; context->visited[ i ]; i = ( i + 1 ) & context->visitedMask )
+	{
+		if ( ( context->visited[ i ] & ~TRACE_VISITED_COLLIDED ) == key )
+		{
+			return NULL;
+		}
+	}
+
+	context->visited[ i ] = key;
+	context->numVisited++;
+	return &context->visited[ i ];
+}
+
+/*
+================
+CM_VisitedCollided
+================
+*/
+static qboolean CM_VisitedCollided( const traceContext_t *context, int key )
+{
+	int i;
+
+	for ( i = CM_VisitedHash( key ) & context->visitedMask; context->visited[ i ]; i = ( i + 1 ) & context->visitedMask )
+	{
+		if ( ( context->visited[ i ] & ~TRACE_VISITED_COLLIDED ) == key )
+		{
+			return ( context->visited[ i ] & TRACE_VISITED_COLLIDED ) ? qtrue : qfalse;
+		}
+	}
+
+	return qfalse;
+}
+
+/*
+===============================================================================
+
 POSITION TESTING
 
 ===============================================================================
@@ -374,7 +540,7 @@ CM_TestInLeaf
 void CM_TestInLeaf( traceWork_t *tw, cLeaf_t *leaf )
 {
 	int        k;
-	int        brushnum;
+	int        brushnum, surfacenum;
 	cbrush_t   *b;
 	cSurface_t *surface;
 
@@ -384,13 +550,11 @@ void CM_TestInLeaf( traceWork_t *tw, cLeaf_t *leaf )
 		brushnum = cm.leafbrushes[ leaf->firstLeafBrush + k ];
 		b = &cm.brushes[ brushnum ];
 
-		if ( b->checkcount == cm.checkcount )
+		if ( !CM_VisitOnce( tw->context, brushnum * 2 + 1 ) )
 		{
 			continue; // already checked this brush in another leaf
 		}
 
-		b->checkcount = cm.checkcount;
-
 		if ( !( b->contents & tw->contents ) )
 		{
 			continue;
@@ -412,20 +576,19 @@ void CM_TestInLeaf( traceWork_t *tw, cLeaf_t *leaf )
 	// test against all surfaces
 	for ( k = 0; k < leaf->numLeafSurfaces; k++ )
 	{
-		surface = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+		surfacenum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+		surface = cm.surfaces[ surfacenum ];
 
 		if ( !surface )
 		{
 			continue;
 		}
 
-		if ( surface->checkcount == cm.checkcount )
+		if ( !CM_VisitOnce( tw->context, surfacenum * 2 + 2 ) )
 		{
 			continue; // already checked this surface in another leaf
 		}
 
-		surface->checkcount = cm.checkcount;
-
 		if ( !( surface->contents & tw->contents ) )
 		{
 			continue;
@@ -616,15 +779,12 @@ void CM_PositionTest( traceWork_t *tw )
 	ll.lastLeaf = 0;
 	ll.overflowed = qfalse;
 
-	cm.checkcount++;
-
 	CM_BoxLeafnums_r( &ll, 0 );
 
-	cm.checkcount++;
-
 	// test the contents of the leafs
 	for ( i = 0; i < ll.count; i++ )
 	{
+		CM_ProfileLeaf( tw->context, leafs[ i ] );
 		CM_TestInLeaf( tw, &cm.leafs[ leafs[ i ] ] );
 
 		if ( tw->trace.allsolid )
@@ -740,8 +900,8 @@ void CM_TracePointThroughSurfaceCollide( traceWork_t *tw, const cSurfaceCollide_
 
 		if ( j == facet->numBorders )
 		{
-			debugSurfaceCollide = sc;
-			debugFacet = facet;
+			debugSurfaceCollide.store( sc, std::memory_order_relaxed );
+			debugFacet.store( facet, std::memory_order_relaxed );
 
 			planes = &sc->planes[ facet->surfacePlane ];
 
@@ -973,8 +1133,8 @@ void CM_TraceThroughSurfaceCollide( traceWork_t *tw, const cSurfaceCollide_t *sc
 					enterFrac = 0;
 				}
 
-				debugSurfaceCollide = sc;
-				debugFacet = facet;
+				debugSurfaceCollide.store( sc, std::memory_order_relaxed );
+				debugFacet.store( facet, std::memory_order_relaxed );
 
 				tw->trace.fraction = enterFrac;
 				VectorCopy( bestplane, tw->trace.plane.normal );
@@ -998,13 +1158,13 @@ void CM_TraceThroughSurface( traceWork_t *tw, cSurface_t *surface )
 	if ( !cm_noCurves.Get() && surface->type == MST_PATCH && surface->sc )
 	{
 		CM_TraceThroughSurfaceCollide( tw, surface->sc );
-		c_patch_traces++;
+		tw->context->patchTraces++;
 	}
 
 	if ( ( cm.perPolyCollision || cm_forceTriangles.Get() ) && surface->type == MST_TRIANGLE_SOUP && surface->sc )
 	{
 		CM_TraceThroughSurfaceCollide( tw, surface->sc );
-		c_trisoup_traces++;
+		tw->context->trisoupTraces++;
 	}
 
 	if ( tw->trace.fraction < oldFrac )
@@ -1042,7 +1202,7 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush )
 		return;
 	}
 
-	c_brush_traces++;
+	tw->context->brushTraces++;
 
 	getout = qfalse;
 	startout = qfalse;
@@ -1087,7 +1247,7 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush )
 				continue;
 			}
 
-			brush->collided = qtrue;
+			tw->brushCollided = qtrue;
 
 			// crosses face
 			if ( d1 > d2 )
@@ -1178,7 +1338,7 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush )
 				continue;
 			}
 
-			brush->collided = qtrue;
+			tw->brushCollided = qtrue;
 
 			// crosses face
 			if ( d1 > d2 )
@@ -1255,7 +1415,7 @@ void CM_TraceThroughBrush( traceWork_t *tw, cbrush_t *brush )
 				continue;
 			}
 
-			brush->collided = qtrue;
+			tw->brushCollided = qtrue;
 
 			// crosses face
 			if ( d1 > d2 )
@@ -1353,6 +1513,7 @@ static void CM_ProximityToBrush( traceWork_t *tw, cbrush_t *brush )
 	VectorClear( tw2.sphere.offset );
 	VectorCopy( tw->start, tw2.start );
 	VectorCopy( tw->end, tw2.end );
+	tw2.context = tw->context;
 
 	CM_TraceThroughBrush( &tw2, brush );
 
@@ -1415,6 +1576,7 @@ static void CM_ProximityToSurface( traceWork_t *tw, cSurface_t *surface )
 	VectorClear( tw2.sphere.offset );
 	VectorCopy( tw->start, tw2.start );
 	VectorCopy( tw->end, tw2.end );
+	tw2.context = tw->context;
 
 	CM_TraceThroughSurface( &tw2, surface );
 
@@ -1436,7 +1598,8 @@ CM_TraceThroughLeaf
 void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 {
 	int        k;
-	int        brushnum;
+	int        brushnum, surfacenum;
+	int        *visited;
 	cbrush_t   *b;
 	cSurface_t *surface;
 
@@ -1447,13 +1610,6 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 
 		b = &cm.brushes[ brushnum ];
 
-		if ( b->checkcount == cm.checkcount )
-		{
-			continue; // already checked this brush in another leaf
-		}
-
-		b->checkcount = cm.checkcount;
-
 		if ( !( b->contents & tw->contents ) )
 		{
 			continue;
@@ -1464,15 +1620,27 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 			continue;
 		}
 
-		b->collided = qfalse;
-
+		// the bounds don't change, so brushes out of them needn't be marked visited
 		if ( !CM_BoundsIntersect( tw->bounds[ 0 ], tw->bounds[ 1 ], b->bounds[ 0 ], b->bounds[ 1 ] ) )
 		{
 			continue;
 		}
 
+		visited = CM_VisitOnce( tw->context, brushnum * 2 + 1 );
+
+		if ( !visited )
+		{
+			continue; // already checked this brush in another leaf
+		}
+
+		tw->brushCollided = qfalse;
 		CM_TraceThroughBrush( tw, b );
 
+		if ( tw->brushCollided )
+		{
+			*visited |= TRACE_VISITED_COLLIDED;
+		}
+
 		if ( !tw->trace.fraction )
 		{
 			tw->trace.lateralFraction = 0.0f;
@@ -1483,20 +1651,14 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 	// trace line against all surfaces in the leaf
 	for ( k = 0; k < leaf->numLeafSurfaces; k++ )
 	{
-		surface = cm.surfaces[ cm.leafsurfaces[ leaf->firstLeafSurface + k ] ];
+		surfacenum = cm.leafsurfaces[ leaf->firstLeafSurface + k ];
+		surface = cm.surfaces[ surfacenum ];
 
 		if ( !surface )
 		{
 			continue;
 		}
 
-		if ( surface->checkcount == cm.checkcount )
-		{
-			continue; // already checked this surface in another leaf
-		}
-
-		surface->checkcount = cm.checkcount;
-
 		if ( !( surface->contents & tw->contents ) )
 		{
 			continue;
@@ -1512,6 +1674,11 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 			continue;
 		}
 
+		if ( !CM_VisitOnce( tw->context, surfacenum * 2 + 2 ) )
+		{
+			continue; // already checked this surface in another leaf
+		}
+
 		CM_TraceThroughSurface( tw, surface );
 
 		if ( !tw->trace.fraction )
@@ -1530,7 +1697,7 @@ void CM_TraceThroughLeaf( traceWork_t *tw, cLeaf_t *leaf )
 			b = &cm.brushes[ brushnum ];
 
 			// This brush never collided, so don't bother
-			if ( !b->collided )
+			if ( !CM_VisitedCollided( tw->context, brushnum * 2 + 1 ) )
 			{
 				continue;
 			}
@@ -1946,6 +2113,7 @@ static void CM_TraceThroughTree( traceWork_t *tw, int num, float p1f, float p2f,
 	// if < 0, we are in a leaf node
 	if ( num < 0 )
 	{
+		CM_ProfileLeaf( tw->context, -1 - num );
 		CM_TraceThroughLeaf( tw, &cm.leafs[ -1 - num ] );
 		return;
 	}
@@ -2065,25 +2233,27 @@ static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, ve
                       vec3_t maxs, clipHandle_t model, const vec3_t origin, int brushmask,
                       int skipmask, traceType_t type, sphere_t *sphere )
 {
-	int         i;
-	traceWork_t tw;
-	vec3_t      offset;
-	cmodel_t    *cmod;
+	int            i;
+	traceWork_t    tw;
+	traceContext_t context;
+	vec3_t         offset;
+	cmodel_t       *cmod;
 
 	cmod = CM_ClipHandleToModel( model );
 
-	cm.checkcount++; // for multi-check avoidance
-
-	c_traces++; // for statistics, may be zeroed
-
 	// fill in a default trace
 	Com_Memset( &tw, 0, sizeof( tw ) );
 	tw.trace.fraction = 1; // assume it goes the entire distance until shown otherwise
 	VectorCopy( origin, tw.modelOrigin );
 	tw.type = type;
 
+	// for multi-check avoidance and statistics
+	CM_InitTraceContext( &context );
+	tw.context = &context;
+
 	if ( !cm.numNodes )
 	{
+		CM_FinishTraceContext( &context, start );
 		*results = tw.trace;
 
 		return; // map not loaded, shouldn't happen
@@ -2321,9 +2491,104 @@ static void CM_Trace( trace_t *results, const vec3_t start, const vec3_t end, ve
 //	assert(tw.trace.fraction != 1.0);
 //	assert(VectorLength(tw.trace.plane.normal) > 0.9999);
 
+	// traces against entities are reported where the entity is
+	CM_FinishTraceContext( &context, model ? origin : start );
 	*results = tw.trace;
 }
 
+#ifdef BUILD_ENGINE
+// world traces recorded by cm_captureTraces, to be replayed by cm_replayTraces
+#define CAPTURE_MAGIC   0x52544d43 // "CMTR"
+#define CAPTURE_VERSION 1
+
+struct capturedTrace_t
+{
+	vec3_t start, end, mins, maxs;
+	int    brushmask, skipmask, type;
+};
+
+static std::mutex                   captureLock;
+static std::vector<capturedTrace_t> captureTraces;
+static std::string                  captureFile;
+static std::atomic<int>             captureLeft( 0 );
+
+/*
+==================
+CM_WriteCapture
+==================
+*/
+static void CM_WriteCapture( void )
+{
+	std::error_code err;
+	int             header[ 3 ] = { CAPTURE_MAGIC, CAPTURE_VERSION, ( int ) captureTraces.size() };
+	FS::File        f = FS::HomePath::OpenWrite( captureFile, err );
+
+	if ( !err )
+	{
+		f.Write( header, sizeof( header ), err );
+	}
+
+	if ( !err )
+	{
+		f.Write( cm.name, sizeof( cm.name ), err );
+	}
+
+	if ( !err )
+	{
+		f.Write( captureTraces.data(), captureTraces.size() * sizeof( capturedTrace_t ), err );
+	}
+
+	if ( err )
+	{
+		Com_Printf( "^1Couldn't write %s: %s\n", captureFile.c_str(), err.message().c_str() );
+	}
+	else
+	{
+		Com_Printf( "Wrote %i traces to %s\n", ( int ) captureTraces.size(), captureFile.c_str() );
+	}
+
+	captureTraces.clear();
+}
+
+/*
+==================
+CM_CaptureTrace
+==================
+*/
+static void CM_CaptureTrace( const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs,
+                             int brushmask, int skipmask, traceType_t type )
+{
+	capturedTrace_t trace;
+
+	if ( captureLeft.load( std::memory_order_relaxed ) <= 0 )
+	{
+		return;
+	}
+
+	VectorCopy( start, trace.start );
+	VectorCopy( end, trace.end );
+	VectorCopy( mins ? mins : vec3_origin, trace.mins );
+	VectorCopy( maxs ? maxs : vec3_origin, trace.maxs );
+	trace.brushmask = brushmask;
+	trace.skipmask = skipmask;
+	trace.type = type;
+
+	std::lock_guard<std::mutex> lock( captureLock );
+
+	if ( captureLeft <= 0 )
+	{
+		return;
+	}
+
+	captureTraces.push_back( trace );
+
+	if ( --captureLeft == 0 )
+	{
+		CM_WriteCapture();
+	}
+}
+#endif
+
 /*
 ==================
 CM_BoxTrace
@@ -2332,9 +2597,37 @@ CM_BoxTrace
 void CM_BoxTrace( trace_t *results, const vec3_t start, const vec3_t end, vec3_t mins, vec3_t maxs,
                   clipHandle_t model, int brushmask, int skipmask, traceType_t type )
 {
+#ifdef BUILD_ENGINE
+	if ( !model )
+	{
+		CM_CaptureTrace( start, end, mins, maxs, brushmask, skipmask, type );
+	}
+#endif
+
 	CM_Trace( results, start, end, mins, maxs, model, vec3_origin, brushmask, skipmask, type, NULL );
 }
 
+/*
+==================
+CM_BoxTraceBatch
+
+Traces numTraces boxes through the world, with the same results as one
+CM_BoxTrace per ray. mins and maxs may be NULL for point traces
+==================
+*/
+void CM_BoxTraceBatch( trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *ends,
+                       const vec3_t *mins, const vec3_t *maxs, int brushmask, int skipmask,
+                       traceType_t type )
+{
+	int i;
+
+	for ( i = 0; i < numTraces; i++ )
+	{
+		CM_BoxTrace( &results[ i ], starts[ i ], ends[ i ], mins ? ( float * ) mins[ i ] : NULL,
+		             maxs ? ( float * ) maxs[ i ] : NULL, 0, brushmask, skipmask, type );
+	}
+}
+
 /*
 ==================
 CM_TransformedBoxTrace
@@ -2453,17 +2746,14 @@ CM_BiSphereTrace
 void CM_BiSphereTrace( trace_t *results, const vec3_t start, const vec3_t end, float startRad,
                        float endRad, clipHandle_t model, int mask, int skipmask )
 {
-	int         i;
-	traceWork_t tw;
-	float       largestRadius = startRad > endRad ? startRad : endRad;
-	cmodel_t    *cmod;
+	int            i;
+	traceWork_t    tw;
+	traceContext_t context;
+	float          largestRadius = startRad > endRad ? startRad : endRad;
+	cmodel_t       *cmod;
 
 	cmod = CM_ClipHandleToModel( model );
 
-	cm.checkcount++; // for multi-check avoidance
-
-	c_traces++; // for statistics, may be zeroed
-
 	// fill in a default trace
 	Com_Memset( &tw, 0, sizeof( tw ) );
 	tw.trace.fraction = 1.0f; // assume it goes the entire distance until shown otherwise
@@ -2472,8 +2762,13 @@ void CM_BiSphereTrace( trace_t *results, const vec3_t start, const vec3_t end, f
 	tw.testLateralCollision = qtrue;
 	tw.trace.lateralFraction = 1.0f;
 
+	// for multi-check avoidance and statistics
+	CM_InitTraceContext( &context );
+	tw.context = &context;
+
 	if ( !cm.numNodes )
 	{
+		CM_FinishTraceContext( &context, start );
 		*results = tw.trace;
 
 		return; // map not loaded, shouldn't happen
@@ -2545,6 +2840,7 @@ void CM_BiSphereTrace( trace_t *results, const vec3_t start, const vec3_t end, f
 	//  assert(tw.trace.fraction != 1.0);
 	//  assert(VectorLength(tw.trace.plane.normal) > 0.9999);
 
+	CM_FinishTraceContext( &context, start );
 	*results = tw.trace;
 }
 
@@ -2790,3 +3086,284 @@ void CM_DrawDebugSurface( void ( *drawPoly )( int color, int numPoints, float *p
 	}
 #endif
 }
+
+#ifdef BUILD_ENGINE
+/*
+===============================================================================
+
+TRACE STRESS TEST
+
+===============================================================================
+*/
+
+struct stressTrace_t
+{
+	vec3_t       start, end, mins, maxs;
+	clipHandle_t model;
+	int          mask;
+	int          kind; // 0 box, 1 capsule, 2 bisphere, 3 point contents
+	trace_t      trace;
+	int          contents;
+};
+
+/*
+================
+CM_StressRun
+================
+*/
+static void CM_StressRun( stressTrace_t *st, trace_t *trace, int *contents )
+{
+	switch ( st->kind )
+	{
+		case 0:
+			CM_BoxTrace( trace, st->start, st->end, st->mins, st->maxs, st->model, st->mask, 0, TT_AABB );
+			break;
+
+		case 1:
+			CM_BoxTrace( trace, st->start, st->end, st->mins, st->maxs, st->model, st->mask, 0, TT_CAPSULE );
+			break;
+
+		case 2:
+			CM_BiSphereTrace( trace, st->start, st->end, st->mins[ 0 ], st->maxs[ 0 ], st->model, st->mask, 0 );
+			break;
+
+		default:
+			*contents = CM_PointContents( st->start, st->model );
+			break;
+	}
+}
+
+static bool CM_SameTrace( const trace_t *a, const trace_t *b )
+{
+	return a->allsolid == b->allsolid && a->startsolid == b->startsolid && a->fraction == b->fraction &&
+	       VectorCompare( a->endpos, b->endpos ) && VectorCompare( a->plane.normal, b->plane.normal ) &&
+	       a->plane.dist == b->plane.dist && a->surfaceFlags == b->surfaceFlags && a->contents == b->contents &&
+	       a->lateralFraction == b->lateralFraction;
+}
+
+/*
+================
+CM_TraceStress
+
+Runs randomized traces through the loaded map serially, then runs them all
+again on several threads at once and compares against the serial results
+================
+*/
+static void CM_TraceStress( int numTraces, int numThreads )
+{
+	std::vector<stressTrace_t> traces( numTraces );
+	std::vector<std::thread>   threads;
+	std::atomic<int>           mismatches( 0 );
+	std::mt19937               rng( numTraces );
+	cmodel_t                   *world = &cm.cmodels[ 0 ];
+	int                        serialTime, threadedTime;
+	int                        i, j;
+
+	auto frand = [ &rng ]( float lo, float hi )
+	{
+		return std::uniform_real_distribution<float>( lo, hi )( rng );
+	};
+
+	for ( i = 0; i < numTraces; i++ )
+	{
+		stressTrace_t *st = &traces[ i ];
+
+		for ( j = 0; j < 3; j++ )
+		{
+			st->start[ j ] = frand( world->mins[ j ], world->maxs[ j ] );
+			st->end[ j ] = st->start[ j ] + frand( -1024, 1024 );
+			st->mins[ j ] = -frand( 0, 32 );
+			st->maxs[ j ] = frand( 0, 32 );
+		}
+
+		// points, positions tests and inline models now and then
+		if ( i % 7 == 0 )
+		{
+			VectorClear( st->mins );
+			VectorClear( st->maxs );
+		}
+
+		if ( i % 11 == 0 )
+		{
+			VectorCopy( st->start, st->end );
+		}
+
+		st->model = ( i % 13 == 0 && cm.numSubModels > 1 ) ? CM_InlineModel( 1 + i % ( cm.numSubModels - 1 ) ) : 0;
+		st->mask = ( i & 1 ) ? CONTENTS_SOLID : CONTENTS_SOLID | CONTENTS_PLAYERCLIP | CONTENTS_BODY;
+		st->kind = i % 4;
+		st->contents = 0;
+		CM_StressRun( st, &st->trace, &st->contents );
+	}
+
+	serialTime = Sys_Milliseconds();
+
+	for ( i = 0; i < numTraces; i++ )
+	{
+		trace_t trace;
+		int     contents = 0;
+
+		CM_StressRun( &traces[ i ], &trace, &contents );
+	}
+
+	serialTime = Sys_Milliseconds() - serialTime;
+	threadedTime = Sys_Milliseconds();
+
+	// every thread runs all the traces from a different starting point
+	for ( i = 0; i < numThreads; i++ )
+	{
+		threads.emplace_back( [ &traces, &mismatches, numTraces, numThreads, i ]()
+		{
+			int k;
+
+			for ( k = 0; k < numTraces; k++ )
+			{
+				stressTrace_t *st = &traces[ ( k + i * numTraces / numThreads ) % numTraces ];
+				trace_t       trace;
+				int           contents = 0;
+
+				Com_Memset( &trace, 0, sizeof( trace ) );
+				CM_StressRun( st, &trace, &contents );
+
+				if ( st->kind == 3 ? contents != st->contents : !CM_SameTrace( &trace, &st->trace ) )
+				{
+					mismatches++;
+				}
+			}
+		} );
+	}
+
+	for ( std::thread& thread : threads )
+	{
+		thread.join();
+	}
+
+	threadedTime = Sys_Milliseconds() - threadedTime;
+
+	Com_Printf( "%i traces: serial %i ms, %i threads %i ms, %s%i mismatches\n", numTraces, serialTime,
+	            numThreads, threadedTime, mismatches ? "^1" : "", mismatches.load() );
+}
+
+class TraceStressCmd: public Cmd::StaticCmd {
+public:
+	TraceStressCmd()
+		: Cmd::StaticCmd("cm_traceStress", Cmd::SYSTEM, "runs random traces on several threads and compares them to serial ones") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		if (!cm.numNodes) {
+			Print("No map loaded");
+			return;
+		}
+
+		int traces = args.Argc() > 1 ? std::max(atoi(args.Argv(1).c_str()), 1) : 100000;
+		int threads = args.Argc() > 2 ? std::max(atoi(args.Argv(2).c_str()), 1) : std::max((int) std::thread::hardware_concurrency(), 2);
+
+		CM_TraceStress(traces, threads);
+	}
+};
+static TraceStressCmd TraceStressCmdRegistration;
+
+/*
+================
+CM_ReplayTraces
+
+Runs captured world traces and reports the time they take
+================
+*/
+static void CM_ReplayTraces( const std::vector<capturedTrace_t>& traces, int repeats )
+{
+	int     numTraces = traces.size();
+	trace_t trace;
+	int     time;
+	int     i, j;
+
+	time = Sys_Milliseconds();
+
+	for ( j = 0; j < repeats; j++ )
+	{
+		for ( i = 0; i < numTraces; i++ )
+		{
+			CM_BoxTrace( &trace, traces[ i ].start, traces[ i ].end, ( float * ) traces[ i ].mins, ( float * ) traces[ i ].maxs, 0,
+			             traces[ i ].brushmask, traces[ i ].skipmask, ( traceType_t ) traces[ i ].type );
+		}
+	}
+
+	time = Sys_Milliseconds() - time;
+
+	Com_Printf( "%i traces x %i: %i ms, %.2f us per trace\n", numTraces, repeats, time,
+	            time * 1000.0 / ( ( double ) numTraces * repeats ) );
+}
+
+class CaptureTracesCmd: public Cmd::StaticCmd {
+public:
+	CaptureTracesCmd()
+		: Cmd::StaticCmd("cm_captureTraces", Cmd::SYSTEM, "records the next world traces to a file for cm_replayTraces") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		if (args.Argc() < 2) {
+			PrintUsage(args, "<file> [traces]", "");
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(captureLock);
+
+		captureTraces.clear();
+		captureFile = args.Argv(1);
+		captureLeft = args.Argc() > 2 ? std::max(atoi(args.Argv(2).c_str()), 1) : 10000;
+	}
+};
+static CaptureTracesCmd CaptureTracesCmdRegistration;
+
+class ReplayTracesCmd: public Cmd::StaticCmd {
+public:
+	ReplayTracesCmd()
+		: Cmd::StaticCmd("cm_replayTraces", Cmd::SYSTEM, "times the traces recorded by cm_captureTraces") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		if (args.Argc() < 2) {
+			PrintUsage(args, "<file> [repeats]", "");
+			return;
+		}
+
+		if (!cm.numNodes) {
+			Print("No map loaded");
+			return;
+		}
+
+		std::error_code err;
+		FS::File file = FS::HomePath::OpenRead(args.Argv(1), err);
+		std::string data;
+		if (!err)
+			data = file.ReadAll(err);
+		int header[3];
+		char map[MAX_QPATH];
+
+		if (err || data.size() < sizeof(header) + sizeof(map)) {
+			Print("Couldn't read %s", args.Argv(1));
+			return;
+		}
+
+		memcpy(header, data.data(), sizeof(header));
+		memcpy(map, data.data() + sizeof(header), sizeof(map));
+		map[MAX_QPATH - 1] = '\0';
+
+		if (header[0] != CAPTURE_MAGIC || header[1] != CAPTURE_VERSION || header[2] <= 0 ||
+		    data.size() != sizeof(header) + sizeof(map) + header[2] * sizeof(capturedTrace_t)) {
+			Print("%s is not a trace capture", args.Argv(1));
+			return;
+		}
+
+		if (Q_stricmp(map, cm.name)) {
+			Print("^3%s was captured on %s, not %s", args.Argv(1), map, cm.name);
+		}
+
+		std::vector<capturedTrace_t> traces(header[2]);
+		memcpy(traces.data(), data.data() + sizeof(header) + sizeof(map), header[2] * sizeof(capturedTrace_t));
+
+		CM_ReplayTraces(traces, args.Argc() > 2 ? std::max(atoi(args.Argv(2).c_str()), 1) : 10);
+	}
+};
+static ReplayTracesCmd ReplayTracesCmdRegistration;
+#endif
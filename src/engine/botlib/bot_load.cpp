@@ -309,6 +309,7 @@ bool BotLoadNavMesh( const char *filename, NavData_t &nav )
 	return true;
 }
 
+#ifndef BUILD_GAME
 inline void *dtAllocCustom( int size, dtAllocHint hint )
 {
 	return Z_TagMalloc( size, TAG_BOTLIB );
@@ -318,6 +319,7 @@ inline void dtFreeCustom( void *ptr )
 {
 	Z_Free( ptr );
 }
+#endif
 
 void BotShutdownNav( void )
 {
@@ -347,7 +349,7 @@ void BotShutdownNav( void )
 		memset( nav->name, 0, sizeof( nav->name ) );
 	}
 
-#ifndef BUILD_SERVER
+#if !defined( BUILD_SERVER ) && !defined( BUILD_GAME )
 	NavEditShutdown();
 #endif
 	numNavData = 0;
@@ -355,13 +357,24 @@ void BotShutdownNav( void )
 
 qboolean BotSetupNav( const botClass_t *botClass, qhandle_t *navHandle )
 {
-	cvar_t *maxNavNodes = Cvar_Get( "bot_maxNavNodes", "4096",  CVAR_LATCH );
+#ifdef BUILD_GAME
+	int maxNavNodes = trap_Cvar_VariableIntegerValue( "bot_maxNavNodes" );
+
+	if ( maxNavNodes <= 0 )
+	{
+		maxNavNodes = 4096;
+	}
+#else
+	int maxNavNodes = Cvar_Get( "bot_maxNavNodes", "4096",  CVAR_LATCH )->integer;
+#endif
 
 	if ( !numNavData )
 	{
 		vec3_t clearVec = { 0, 0, 0 };
 
+#ifndef BUILD_GAME
 		dtAllocSetCustom( dtAllocCustom, dtFreeCustom );
+#endif
 
 		for ( int i = 0; i < MAX_CLIENTS; i++ )
 		{
@@ -381,7 +394,7 @@ qboolean BotSetupNav( const botClass_t *botClass, qhandle_t *navHandle )
 			agents[ i ].offMesh = false;
 			memset( agents[ i ].routeResults, 0, sizeof( agents[ i ].routeResults ) );
 		}
-#ifndef BUILD_SERVER
+#if !defined( BUILD_SERVER ) && !defined( BUILD_GAME )
 		NavEditInit();
 #endif
 	}
@@ -411,7 +424,7 @@ qboolean BotSetupNav( const botClass_t *botClass, qhandle_t *navHandle )
 		return qfalse;
 	}
 
-	if ( dtStatusFailed( nav->query->init( nav->mesh, maxNavNodes->integer ) ) )
+	if ( dtStatusFailed( nav->query->init( nav->mesh, maxNavNodes ) ) )
 	{
 		Com_Printf( "Could not init Detour Navigation Mesh Query for navmesh %s\n", filename );
 		BotShutdownNav();
@@ -33,7 +33,9 @@ Maryland 20850 USA.
 */
 
 #include "bot_local.h"
+#ifndef BUILD_GAME
 #include "../server/server.h"
+#endif
 
 /*
 ====================
@@ -47,6 +49,13 @@ make sure the vectors use the same coordinate system
 ====================
 */
 
+#ifndef BUILD_GAME
+int BotNavTime( void )
+{
+	return svs.time;
+}
+#endif
+
 void BotCalcSteerDir( Bot_t *bot, rVec &dir )
 {
 	const int ip0 = 0;
@@ -117,7 +126,7 @@ bool PointInPolyExtents( Bot_t *bot, dtPolyRef ref, rVec point, rVec extents )
 
 bool PointInPoly( Bot_t *bot, dtPolyRef ref, rVec point )
 {
-	sharedEntity_t *ent = SV_GentityNum( bot->clientNum );
+	sharedEntity_t *ent = BotGentity( bot->clientNum );
 	return PointInPolyExtents( bot, ref, point, ent->r.maxs );
 }
 
@@ -154,7 +163,7 @@ static void InvalidateRouteResults( Bot_t *bot )
 			continue;
 		}
 
-		if ( svs.time - res.time > ROUTE_CACHE_TIME )
+		if ( BotNavTime() - res.time > ROUTE_CACHE_TIME )
 		{
 			res.invalid = true;
 			continue;
@@ -230,7 +239,7 @@ static void AddRouteResult( Bot_t *bot, dtPolyRef start, dtPolyRef end, dtStatus
 	bestPos->endRef = end;
 	bestPos->startRef = start;
 	bestPos->invalid = false;
-	bestPos->time = svs.time;
+	bestPos->time = BotNavTime();
 	bestPos->status = status;
 }
 
@@ -36,7 +36,74 @@ Maryland 20850 USA.
 #define __BOT_LOCAL_H
 
 #include "../qcommon/q_shared.h"
-#include "../qcommon/qcommon.h"
+
+#ifdef BUILD_GAME
+#include "../server/g_api.h"
+
+// With g_bot_localNav the navigation runs inside the game module, which
+// provides the few engine services it needs through its traps
+int             trap_Cvar_VariableIntegerValue( const char *var_name );
+void            trap_Cvar_VariableStringBuffer( const char *var_name, char *buffer, int bufsize );
+int             trap_FS_FOpenFile( const char *qpath, fileHandle_t *f, fsMode_t mode );
+void            trap_FS_Read( void *buffer, int len, fileHandle_t f );
+int             trap_FS_Write( const void *buffer, int len, fileHandle_t f );
+void            trap_FS_FCloseFile( fileHandle_t f );
+sharedEntity_t *G_BotGentity( int num );
+int             G_BotNavTime( void );
+
+static inline sharedEntity_t *BotGentity( int num )
+{
+	return G_BotGentity( num );
+}
+
+static inline int BotNavTime( void )
+{
+	return G_BotNavTime();
+}
+
+static inline void Cvar_VariableStringBuffer( const char *var_name, char *buffer, int bufsize )
+{
+	trap_Cvar_VariableStringBuffer( var_name, buffer, bufsize );
+}
+
+static inline int FS_FOpenFileRead( const char *qpath, fileHandle_t *f, qboolean )
+{
+	return trap_FS_FOpenFile( qpath, f, FS_READ );
+}
+
+static inline fileHandle_t FS_FOpenFileWrite( const char *qpath )
+{
+	fileHandle_t f = 0;
+	trap_FS_FOpenFile( qpath, &f, FS_WRITE );
+	return f;
+}
+
+static inline int FS_Read( void *buffer, int len, fileHandle_t f )
+{
+	trap_FS_Read( buffer, len, f );
+	return len;
+}
+
+static inline int FS_Write( const void *buffer, int len, fileHandle_t f )
+{
+	return trap_FS_Write( buffer, len, f );
+}
+
+static inline void FS_FCloseFile( fileHandle_t f )
+{
+	trap_FS_FCloseFile( f );
+}
+#else
+#include "../server/server.h"
+
+static inline sharedEntity_t *BotGentity( int num )
+{
+	return SV_GentityNum( num );
+}
+
+// Time used to expire the cached routes
+int BotNavTime( void );
+#endif
 
 #include "../../libs/detour/DetourNavMeshBuilder.h"
 #include "../../libs/detour/DetourNavMeshQuery.h"
@@ -33,7 +33,9 @@ Maryland 20850 USA.
 */
 
 #include "bot_local.h"
+#ifndef BUILD_GAME
 #include "../server/server.h"
+#endif
 
 Bot_t agents[ MAX_CLIENTS ];
 
@@ -128,12 +130,12 @@ void BotSetNavMesh( int botClientNum, qhandle_t nav )
 
 void GetEntPosition( int num, rVec &pos )
 {
-	pos = qVec( SV_GentityNum( num )->s.origin );
+	pos = qVec( BotGentity( num )->s.origin );
 }
 
 void GetEntPosition( int num, qVec &pos )
 {
-	pos = SV_GentityNum( num )->s.origin;
+	pos = BotGentity( num )->s.origin;
 }
 
 qboolean BotFindRouteExt( int botClientNum, const botRouteTarget_t *target, qboolean allowPartial )
@@ -330,7 +332,7 @@ float frand()
 
 void BotFindRandomPoint( int botClientNum, vec3_t point )
 {
-	qVec origin = SV_GentityNum( botClientNum )->s.origin;
+	qVec origin = BotGentity( botClientNum )->s.origin;
 
 	if ( !BotFindRandomPointInRadius( botClientNum, origin, point, 2000 ) )
 	{
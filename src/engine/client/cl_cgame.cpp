@@ -1649,45 +1649,63 @@ intptr_t CL_CgameSystemCalls( intptr_t *args )
 			                                    (float*) VMA( 4 ) );
 
 		case CG_CM_BOXTRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_BoxTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ),
 			             (float*) VMA( 4 ), (float*) VMA( 5 ), args[ 6 ], args[ 7 ], args[ 8 ],
 			             TT_AABB );
 			return 0;
+		}
 
 		case CG_CM_TRANSFORMEDBOXTRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_TransformedBoxTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ),
 			                        (float*) VMA( 4 ), (float*) VMA( 5 ), args[ 6 ], args[ 7 ],
 			                        args[ 8 ], (float*) VMA( 9 ), (float*) VMA( 10 ), TT_AABB );
 			return 0;
+		}
 
 		case CG_CM_CAPSULETRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_BoxTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ),
 			             (float*) VMA( 4 ), (float*) VMA( 5 ), args[ 6 ], args[ 7 ], args[ 8 ],
 			             TT_CAPSULE );
 			return 0;
+		}
 
 		case CG_CM_TRANSFORMEDCAPSULETRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_TransformedBoxTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ),
 			                        (float*) VMA( 4 ), (float*) VMA( 5 ), args[ 6 ], args[ 7 ],
 			                        args[ 8 ], (float*) VMA( 9 ), (float*) VMA( 10 ), TT_CAPSULE );
 			return 0;
+		}
 
 		case CG_CM_BISPHERETRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_BiSphereTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ), VMF( 4 ),
 			                  VMF( 5 ), args[ 6 ], args[ 7 ], args[ 8 ] );
 			return 0;
+		}
 
 		case CG_CM_TRANSFORMEDBISPHERETRACE:
+		{
 			cls.nCgamePhysicsSyscalls ++;
+			CM_TraceSourceScope scope( TRACE_SOURCE_CGAME );
 			CM_TransformedBiSphereTrace( (trace_t*) VMA( 1 ), (float*) VMA( 2 ), (float*) VMA( 3 ),
 			                             VMF( 4 ), VMF( 5 ), args[ 6 ], args[ 7 ], args[ 8 ],
 			                             (float*) VMA( 8 ) );
 			return 0;
+		}
 
 		case CG_CM_MARKFRAGMENTS:
 			cls.nCgamePhysicsSyscalls ++;
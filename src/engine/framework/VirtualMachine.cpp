@@ -49,6 +49,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 // File handle for the root socket
 #define ROOT_SOCKET_FD 100
 
+// Size of each of the shared memory rings used for the native VMs
+#define SHARED_RING_SIZE (1024 * 1024)
+
 // MinGW doesn't define JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE
 #ifndef JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE
 #define JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE 0x2000
@@ -338,7 +341,7 @@ std::pair<IPC::OSHandleType, IPC::Socket> CreateNativeVM(std::pair<IPC::Socket,
 	return InternalLoadModule(std::move(pair), args.data(), true);
 }
 
-IPC::Socket CreateInProcessNativeVM(std::pair<IPC::Socket, IPC::Socket> pair, Str::StringRef name, VM::VMBase::InProcessInfo& inProcess) {
+static void* LoadNativeDLL(Str::StringRef name, Str::StringRef function, VM::VMBase::InProcessInfo& inProcess) {
 	std::string filename = FS::Path::Build(FS::GetLibPath(), name + "-nacl-native-dll" + DLL_EXT);
 
 	Com_Printf("Loading VM module %s...\n", filename.c_str());
@@ -349,10 +352,15 @@ IPC::Socket CreateInProcessNativeVM(std::pair<IPC::Socket, IPC::Socket> pair, St
 	}
 	inProcess.sharedLibHandle = handle;
 
-	int (*vmMain)(int, const char**) = (int (*)(int, const char**))(Sys_LoadFunction(handle, "main"));
-	if (!vmMain) {
-		Com_Error(ERR_DROP, "VM: Could not find main function in shared library VM %s", filename.c_str());
+	void* func = Sys_LoadFunction(handle, function.c_str());
+	if (!func) {
+		Com_Error(ERR_DROP, "VM: Could not find %s function in shared library VM %s", function.c_str(), filename.c_str());
 	}
+	return func;
+}
+
+IPC::Socket CreateInProcessNativeVM(std::pair<IPC::Socket, IPC::Socket> pair, Str::StringRef name, VM::VMBase::InProcessInfo& inProcess) {
+	int (*vmMain)(int, const char**) = (int (*)(int, const char**))(LoadNativeDLL(name, "main", inProcess));
 
 	std::string vmSocketArg = std::to_string((int)(intptr_t)pair.second.ReleaseHandle());
 
@@ -369,6 +377,92 @@ IPC::Socket CreateInProcessNativeVM(std::pair<IPC::Socket, IPC::Socket> pair, St
 	return std::move(pair.first);
 }
 
+// The VM runs its initialization and sends its ABI version before returning
+// its end of the channel, after that it only runs when we send it a message.
+void CreateDirectNativeVM(IPC::Channel& channel, Str::StringRef name, VM::VMBase::InProcessInfo& inProcess) {
+	IPC::DirectPeer (*vmDirectMain)(IPC::DirectPeer) = (IPC::DirectPeer (*)(IPC::DirectPeer))(LoadNativeDLL(name, "vmDirectMain", inProcess));
+
+	channel = IPC::Channel();
+	channel.ConnectDirect(vmDirectMain(channel.GetDirectPeer()));
+}
+
+MessageStats::MessageStats()
+	: entries(new Entry[NUM_ENTRIES + 1]()) {}
+
+void MessageStats::Record(uint32_t id, uint64_t nsec)
+{
+	size_t major = id >> 16;
+	size_t minor = id & 0xffff;
+	Entry& entry = entries[major < LAST_COMMON_SYSCALL && minor < MAX_MINOR ? major * MAX_MINOR + minor : NUM_ENTRIES];
+
+	entry.count.fetch_add(1, std::memory_order_relaxed);
+	entry.totalTime.fetch_add(nsec, std::memory_order_relaxed);
+	uint64_t max = entry.maxTime.load(std::memory_order_relaxed);
+	while (nsec > max && !entry.maxTime.compare_exchange_weak(max, nsec, std::memory_order_relaxed)) {}
+
+	int bucket = 0;
+	while (bucket < NUM_BUCKETS - 1 && nsec >> (bucket + 1))
+		bucket++;
+	entry.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void MessageStats::Reset()
+{
+	for (size_t i = 0; i <= NUM_ENTRIES; i++) {
+		entries[i].count.store(0, std::memory_order_relaxed);
+		entries[i].totalTime.store(0, std::memory_order_relaxed);
+		entries[i].maxTime.store(0, std::memory_order_relaxed);
+		for (int j = 0; j < NUM_BUCKETS; j++)
+			entries[i].buckets[j].store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t MessageStats::Percentile(const Entry& entry, double fraction)
+{
+	// The counters may change while we read them, use the sum of the buckets
+	uint64_t counts[NUM_BUCKETS];
+	uint64_t total = 0;
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		counts[i] = entry.buckets[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+
+	uint64_t max = entry.maxTime.load(std::memory_order_relaxed);
+	uint64_t seen = 0;
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen > 0 && seen >= fraction * total)
+			return std::min<uint64_t>(uint64_t(2) << i, max);
+	}
+	return max;
+}
+
+// The VMs that exist, for the vm.stats command
+static std::vector<VMBase*> allVMs;
+static std::vector<LegacyVMStats*> allLegacyVMs;
+
+void RegisterLegacyVMStats(LegacyVMStats* stats)
+{
+	allLegacyVMs.push_back(stats);
+}
+
+void UnregisterLegacyVMStats(LegacyVMStats* stats)
+{
+	allLegacyVMs.erase(std::remove(allLegacyVMs.begin(), allLegacyVMs.end(), stats), allLegacyVMs.end());
+}
+
+VMBase::VMBase(std::string name, VMParams& params)
+	: processHandle(IPC::INVALID_HANDLE), name(name), params(params)
+{
+	allVMs.push_back(this);
+}
+
+VMBase::~VMBase()
+{
+	Free();
+	allVMs.erase(std::remove(allVMs.begin(), allVMs.end(), this), allVMs.end());
+}
+
 int VMBase::Create()
 {
 	type = static_cast<vmType_t>(params.vmType.Get());
@@ -391,18 +485,22 @@ int VMBase::Create()
 		}
 	}
 
-	// Create the socket pair to get the handle for ROOT_SOCKET
-	std::pair<IPC::Socket, IPC::Socket> pair = IPC::Socket::CreatePair();
-
-	IPC::Socket rootSocket;
-	if (type == TYPE_NACL || type == TYPE_NACL_DEBUG || type == TYPE_NACL_LIBPATH || type == TYPE_NACL_LIBPATH_DEBUG) {
-		std::tie(processHandle, rootSocket) = CreateNaClVM(std::move(pair), name, type == TYPE_NACL_DEBUG || type == TYPE_NACL_LIBPATH_DEBUG, type == TYPE_NACL || type == TYPE_NACL_DEBUG, params.debugLoader.Get());
-	} else if (type == TYPE_NATIVE_EXE || type == TYPE_NATIVE_EXE_DEBUG) {
-		std::tie(processHandle, rootSocket) = CreateNativeVM(std::move(pair), name, type == TYPE_NATIVE_EXE_DEBUG);
+	if (type == TYPE_NATIVE_DLL_DIRECT) {
+		CreateDirectNativeVM(rootChannel, name, inProcess);
 	} else {
-		rootSocket = CreateInProcessNativeVM(std::move(pair), name, inProcess);
+		// Create the socket pair to get the handle for ROOT_SOCKET
+		std::pair<IPC::Socket, IPC::Socket> pair = IPC::Socket::CreatePair();
+
+		IPC::Socket rootSocket;
+		if (type == TYPE_NACL || type == TYPE_NACL_DEBUG || type == TYPE_NACL_LIBPATH || type == TYPE_NACL_LIBPATH_DEBUG) {
+			std::tie(processHandle, rootSocket) = CreateNaClVM(std::move(pair), name, type == TYPE_NACL_DEBUG || type == TYPE_NACL_LIBPATH_DEBUG, type == TYPE_NACL || type == TYPE_NACL_DEBUG, params.debugLoader.Get());
+		} else if (type == TYPE_NATIVE_EXE || type == TYPE_NATIVE_EXE_DEBUG) {
+			std::tie(processHandle, rootSocket) = CreateNativeVM(std::move(pair), name, type == TYPE_NATIVE_EXE_DEBUG);
+		} else {
+			rootSocket = CreateInProcessNativeVM(std::move(pair), name, inProcess);
+		}
+		rootChannel = IPC::Channel(std::move(rootSocket));
 	}
-	rootChannel = IPC::Channel(std::move(rootSocket));
 
 	if (type == TYPE_NACL_DEBUG || type == TYPE_NATIVE_EXE_DEBUG || type == TYPE_NACL_LIBPATH_DEBUG)
 		Com_Printf("Waiting for GDB connection on localhost:4014\n");
@@ -411,7 +509,43 @@ int VMBase::Create()
 	// If this fails, we assume the remote process failed to start
 	IPC::Reader reader = rootChannel.RecvMsg();
 	Com_Printf("Loaded VM module in %d msec\n", Sys_Milliseconds() - loadStartTime);
-	return reader.Read<uint32_t>();
+	uint32_t version = reader.Read<uint32_t>();
+
+	// From now on the syscalls of a direct VM are handled as they are made
+	if (type == TYPE_NATIVE_DLL_DIRECT) {
+		rootChannel.SetDirectHandler([this](uint32_t id, IPC::Reader reader) {
+			HandleDirectSyscall(id, std::move(reader));
+		});
+	}
+
+	// The VM is now waiting for its first message, native VMs can move to
+	// shared memory rings (NaCl can't wait on them)
+	bool native = type == TYPE_NATIVE_EXE || type == TYPE_NATIVE_EXE_DEBUG || type == TYPE_NATIVE_DLL;
+	if (native && params.sharedMemoryIPC.Get() && IPC::SharedRings::Supported())
+		rootChannel.UseSharedRings(SHARED_RING_SIZE);
+
+	return version;
+}
+
+// An engine error can't longjmp through the frames of the direct VM, they
+// aren't made for it. It is trapped here instead and the VM gets no reply,
+// so that it fails in its own way: its SendMsg gets an error, which exits
+// it through an ExitException caught by the vmDirectMain handler. SendMsg
+// then raises the error here, where the VM is out of the way.
+void VMBase::HandleDirectSyscall(uint32_t id, IPC::Reader reader)
+{
+	// Nothing more is handled once an error was trapped
+	if (Com_ErrorTrapped())
+		return;
+
+	jmp_buf trap;
+	jmp_buf* previous = Com_SetErrorTrap(&trap);
+	if (setjmp(trap)) {
+		Com_SetErrorTrap(previous);
+		return;
+	}
+	HandleSyscall(id, std::move(reader));
+	Com_SetErrorTrap(previous);
 }
 
 void VMBase::FreeInProcessVM() {
@@ -479,10 +613,221 @@ void VMBase::Free()
 		waitpid(processHandle, NULL, 0);
 #endif
 		processHandle = IPC::INVALID_HANDLE;
-	} else if (type == TYPE_NATIVE_DLL) {
+	} else if (type == TYPE_NATIVE_DLL || type == TYPE_NATIVE_DLL_DIRECT) {
 		FreeInProcessVM();
 	}
 
 }
 
+static void PrintBenchmark(const char* transport, int count, int size, std::chrono::steady_clock::duration time)
+{
+	double usec = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count() / 1000.0;
+	Com_Printf("%s: %d round trips of %d bytes in %.1f msec, %.2f usec per round trip, %.0f messages/sec\n",
+	           transport, count, size, usec / 1000.0, usec / count, 2 * count * 1000000.0 / usec);
+}
+
+// Measure the round trip time of small messages through a channel, echoed
+// back by another thread
+static void BenchmarkChannel(bool useRings, int count, int size)
+{
+	std::pair<IPC::Socket, IPC::Socket> pair = IPC::Socket::CreatePair();
+	IPC::Channel channel(std::move(pair.first));
+	IPC::Socket peerSocket = std::move(pair.second);
+
+	if (useRings)
+		channel.UseSharedRings(SHARED_RING_SIZE);
+
+	std::thread peer([&peerSocket]() {
+		IPC::Channel peerChannel(std::move(peerSocket));
+		while (true) {
+			IPC::Reader reader = peerChannel.RecvMsg();
+			if (reader.Read<uint32_t>() == 0)
+				break;
+			IPC::Writer writer;
+			writer.WriteData(reader.GetData().data(), reader.GetData().size());
+			peerChannel.SendMsg(writer);
+		}
+	});
+
+	IPC::Writer writer;
+	writer.Write<uint32_t>(1);
+	std::vector<char> payload(size, 'x');
+	writer.WriteData(payload.data(), payload.size());
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++) {
+		channel.SendMsg(writer);
+		channel.RecvMsg();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	IPC::Writer quit;
+	quit.Write<uint32_t>(0);
+	channel.SendMsg(quit);
+	peer.join();
+
+	PrintBenchmark(useRings ? "shared memory rings" : "socket", count, size, end - start);
+}
+
+// Same through a pair of direct channels, the echo runs on the calling thread
+static void BenchmarkDirectChannel(int count, int size)
+{
+	IPC::Channel channel, peerChannel;
+	channel.ConnectDirect(peerChannel.GetDirectPeer());
+	peerChannel.ConnectDirect(channel.GetDirectPeer());
+	peerChannel.SetDirectHandler([&peerChannel](uint32_t, IPC::Reader reader) {
+		IPC::Writer writer = peerChannel.GetWriter();
+		writer.WriteData(reader.GetData().data(), reader.GetData().size());
+		peerChannel.SendMsg(writer);
+		peerChannel.RecycleWriter(std::move(writer));
+	});
+
+	IPC::Writer writer;
+	writer.Write<uint32_t>(1);
+	std::vector<char> payload(size, 'x');
+	writer.WriteData(payload.data(), payload.size());
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < count; i++) {
+		channel.SendMsg(writer);
+		channel.RecvMsg();
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	PrintBenchmark("direct", count, size, end - start);
+}
+
+class IPCBenchCmd: public Cmd::StaticCmd {
+public:
+	IPCBenchCmd()
+		: Cmd::StaticCmd("ipcbench", Cmd::SYSTEM, "measures the VM message round trip time with sockets, shared memory rings and direct calls") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		int count = args.Argc() > 1 ? std::max(atoi(args.Argv(1).c_str()), 1) : 100000;
+		int size = args.Argc() > 2 ? std::min(std::max(atoi(args.Argv(2).c_str()), 0), 65536) : 64;
+
+		BenchmarkChannel(false, count, size);
+		if (IPC::SharedRings::Supported())
+			BenchmarkChannel(true, count, size);
+		else
+			Print("Shared memory rings are not supported on this platform");
+		BenchmarkDirectChannel(count, size);
+	}
+};
+static IPCBenchCmd IPCBenchCmdRegistration;
+
+// The legacy VMs are keyed by trap number instead of major and minor
+static void DumpMessageStats(FS::File& file, const char* key, const MessageStats& stats, bool legacy)
+{
+	file.Printf("\t\"%s\": [", key);
+	bool first = true;
+	stats.ForEach([&file, &first, legacy](uint32_t id, const MessageStats::Entry& entry) {
+		if (legacy)
+			file.Printf("%s\n\t\t{\"trap\": %d,", first ? "" : ",", id == 0xffffffff ? -1 : int((id >> 16) * 256 + (id & 0xffff)));
+		else
+			file.Printf("%s\n\t\t{\"major\": %d, \"minor\": %d,", first ? "" : ",", id == 0xffffffff ? -1 : int(id >> 16), id == 0xffffffff ? -1 : int(id & 0xffff));
+		file.Printf(" \"count\": %llu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"histogram\": [",
+		            (unsigned long long)entry.count.load(std::memory_order_relaxed), (unsigned long long)entry.totalTime.load(std::memory_order_relaxed),
+		            (unsigned long long)MessageStats::Percentile(entry, 0.5), (unsigned long long)MessageStats::Percentile(entry, 0.99),
+		            (unsigned long long)entry.maxTime.load(std::memory_order_relaxed));
+		for (int i = 0; i < MessageStats::NUM_BUCKETS; i++)
+			file.Printf("%s%u", i ? ", " : "", entry.buckets[i].load(std::memory_order_relaxed));
+		file.Printf("]}");
+		first = false;
+	});
+	file.Printf("\n\t]");
+}
+
+class VMStatsCmd: public Cmd::StaticCmd {
+public:
+	VMStatsCmd()
+		: Cmd::StaticCmd("vm.stats", Cmd::SYSTEM, "shows the time spent in each VM message, 'reset' clears the counters and 'dump' writes them to <vm>.syscallStats.json in the home path") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		std::string action = args.Argc() > 1 ? args.Argv(1) : "";
+		if (action != "" && action != "reset" && action != "dump") {
+			PrintUsage(args, "[reset|dump]", "");
+			return;
+		}
+
+		for (VMBase* vm : allVMs) {
+			if (action == "reset") {
+				vm->ResetStats();
+			} else if (action == "dump") {
+				Dump(vm->GetName(), vm->GetSyscallStats(), vm->GetCallStats(), false);
+			} else {
+				Print("^2%s^7 VM, times in microseconds:", vm->GetName());
+				PrintStats("syscalls from the VM (handling time)", vm->GetSyscallStats(), false);
+				PrintStats("calls into the VM (including their syscalls)", vm->GetCallStats(), false);
+			}
+		}
+
+		for (LegacyVMStats* vm : allLegacyVMs) {
+			if (action == "reset") {
+				vm->syscalls.Reset();
+				vm->calls.Reset();
+			} else if (action == "dump") {
+				Dump(vm->name, vm->syscalls, vm->calls, true);
+			} else {
+				Print("^2%s^7 QVM, times in microseconds:", vm->name);
+				PrintStats("traps from the QVM (handling time)", vm->syscalls, true);
+				PrintStats("calls into the QVM (including their traps)", vm->calls, true);
+			}
+		}
+	}
+
+private:
+	void Dump(const std::string& name, const MessageStats& syscalls, const MessageStats& calls, bool legacy) const
+	{
+		std::string filename = name + ".syscallStats.json";
+		try {
+			FS::File file = FS::HomePath::OpenWrite(filename);
+			file.Printf("{\n\t\"vm\": \"%s\",\n", name);
+			DumpMessageStats(file, "syscalls", syscalls, legacy);
+			file.Printf(",\n");
+			DumpMessageStats(file, "calls", calls, legacy);
+			file.Printf("\n}\n");
+			file.Close();
+			Print("Wrote %s", filename);
+		} catch (std::system_error& err) {
+			Print("Couldn't write %s: %s", filename, err.what());
+		}
+	}
+
+	void PrintStats(const char* title, const MessageStats& stats, bool legacy) const
+	{
+		std::vector<std::pair<uint32_t, const MessageStats::Entry*>> sorted;
+		stats.ForEach([&sorted](uint32_t id, const MessageStats::Entry& entry) {
+			sorted.emplace_back(id, &entry);
+		});
+		std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint32_t, const MessageStats::Entry*>& a, const std::pair<uint32_t, const MessageStats::Entry*>& b) {
+			return a.second->totalTime.load(std::memory_order_relaxed) > b.second->totalTime.load(std::memory_order_relaxed);
+		});
+
+		Print("%s:", title);
+		if (legacy)
+			Print("   trap      count   total ms    avg us    p50 us    p99 us    max us");
+		else
+			Print("  major minor      count   total ms    avg us    p50 us    p99 us    max us");
+		for (auto& it : sorted) {
+			const MessageStats::Entry& entry = *it.second;
+			uint64_t count = entry.count.load(std::memory_order_relaxed);
+			uint64_t total = entry.totalTime.load(std::memory_order_relaxed);
+			std::string id;
+			if (it.first == 0xffffffff)
+				id = legacy ? " other" : "other      ";
+			else if (legacy)
+				id = Str::Format("%6d", (it.first >> 16) * 256 + (it.first & 0xffff));
+			else
+				id = Str::Format("%5d %5d", it.first >> 16, it.first & 0xffff);
+			Print("  %s %10llu %10.2f %9.2f %9.2f %9.2f %9.2f", id, (unsigned long long)count, total / 1000000.0,
+			      total / 1000.0 / count, MessageStats::Percentile(entry, 0.5) / 1000.0, MessageStats::Percentile(entry, 0.99) / 1000.0,
+			      entry.maxTime.load(std::memory_order_relaxed) / 1000.0);
+		}
+	}
+};
+static VMStatsCmd VMStatsCmdRegistration;
+
 } // namespace VM
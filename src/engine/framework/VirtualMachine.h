@@ -61,10 +61,15 @@ namespace VM {
  * provide sandboxing like the nacl executable but the OS will still clean up any
  * leak for us.
  *
+ * Direct native DLL: the same DLL is loaded but the VM runs on the engine's
+ * thread, messages are handed over with function calls through direct IPC
+ * channels instead of a socket. There is no isolation at all.
+ *
  * TL;DR
  * - Native DLL: no sandboxing, no cleaning up but debuger support. Use for dev.
  * - NaCl exe: sandboxing, no leaks, slightly slower, hard to debug. Use for regular players.
  * - Native exe: no sandboxing, no leaks, hard to debug. Might be used by server owners for perf.
+ * - Direct native DLL: no sandboxing, no cleaning up, fastest. For trusted dedicated servers.
  */
 enum vmType_t {
 	// Loads the VM as an executable from the hompath, potentially from a pk3
@@ -86,6 +91,9 @@ enum vmType_t {
 	TYPE_NACL_LIBPATH,
 	// Same as above, with the debugger
 	TYPE_NACL_LIBPATH_DEBUG,
+
+	// Loads the VM as a native DLL from the libpath and runs it on the engine's thread
+	TYPE_NATIVE_DLL_DIRECT,
 	TYPE_END
 };
 
@@ -94,19 +102,77 @@ struct VMParams {
 	VMParams(std::string name)
 		: logSyscalls("vm." + name + ".logSyscalls", "dump all the syscalls in the " + name + ".syscallLog file", Cvar::NONE, false),
 		  vmType("vm." + name + ".type", "how the vm should be loaded for " + name, Cvar::NONE, TYPE_NACL, 0, TYPE_END - 1),
-		  debugLoader("vm." + name + ".debugLoader", "make sel_ldr dump information to " + name + "-sel_ldr.log", Cvar::NONE, 0, 0, 5) {
+		  debugLoader("vm." + name + ".debugLoader", "make sel_ldr dump information to " + name + "-sel_ldr.log", Cvar::NONE, 0, 0, 5),
+		  sharedMemoryIPC("vm." + name + ".sharedMemoryIPC", "exchange the messages with native " + name + " VMs through shared memory rings", Cvar::NONE, false) {
 	}
 
 	Cvar::Cvar<bool> logSyscalls;
 	Cvar::Range<Cvar::Cvar<int>> vmType;
 	Cvar::Range<Cvar::Cvar<int>> debugLoader;
+	Cvar::Cvar<bool> sharedMemoryIPC;
+};
+
+// Lock free counters of the number of calls, the time spent and a latency
+// histogram for each message id, so that they can be updated from any thread
+// and read by the vm.stats command while the VM is running.
+class MessageStats {
+public:
+	// Bucket i counts the calls that took between 2^i and 2^(i+1) nanoseconds
+	static const int NUM_BUCKETS = 32;
+
+	struct Entry {
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> totalTime;
+		std::atomic<uint64_t> maxTime;
+		std::atomic<uint32_t> buckets[NUM_BUCKETS];
+	};
+
+	MessageStats();
+
+	// Add a call of the message that took the given number of nanoseconds
+	void Record(uint32_t id, uint64_t nsec);
+
+	void Reset();
+
+	// Estimate the latency under which the given fraction of the calls
+	// completed, as the upper bound of the histogram bucket it falls in
+	static uint64_t Percentile(const Entry& entry, double fraction);
+
+	// Call func(id, entry) for each message that was called at least once,
+	// the messages that don't fit in the table are all reported as id 0xffffffff
+	template<typename Func> void ForEach(Func&& func) const
+	{
+		for (size_t i = 0; i <= NUM_ENTRIES; i++) {
+			if (entries[i].count.load(std::memory_order_relaxed) != 0)
+				func(i == NUM_ENTRIES ? 0xffffffff : (i / MAX_MINOR) << 16 | (i % MAX_MINOR), entries[i]);
+		}
+	}
+
+private:
+	static const size_t MAX_MINOR = 256;
+	static const size_t NUM_ENTRIES = LAST_COMMON_SYSCALL * MAX_MINOR;
+
+	std::unique_ptr<Entry[]> entries;
+};
+
+// Counters of the legacy QVMs (cgame and ui, see vm_t) so that vm.stats can
+// list them next to the IPC VMs. Their ids are trap and export numbers split
+// as (num / 256) << 16 | num % 256.
+struct LegacyVMStats {
+	LegacyVMStats(std::string name)
+		: name(std::move(name)) {}
+
+	std::string name;
+	MessageStats syscalls;
+	MessageStats calls;
 };
+void RegisterLegacyVMStats(LegacyVMStats* stats);
+void UnregisterLegacyVMStats(LegacyVMStats* stats);
 
 // Base class for a virtual machine instance
 class VMBase {
 public:
-	VMBase(std::string name, VMParams& params)
-		: processHandle(IPC::INVALID_HANDLE), name(name), params(params) {}
+	VMBase(std::string name, VMParams& params);
 
 	// Create the VM for the named module. Returns the ABI version reported
 	// by the module.
@@ -118,24 +184,53 @@ public:
 	// Check if the VM is active
 	bool IsActive() const
 	{
-		return processHandle != IPC::INVALID_HANDLE || inProcess.thread.joinable();
+		return processHandle != IPC::INVALID_HANDLE || inProcess.thread.joinable() || inProcess.sharedLibHandle;
 	}
 
 	// Make sure the VM is closed on exit
-	~VMBase()
-	{
-		Free();
-	}
+	~VMBase();
 
 	// Send a message to the VM
 	template<typename Msg, typename... Args> void SendMsg(Args&&... args)
 	{
 		// Marking lambda as mutable to work around a bug in gcc 4.6
         LogMessage(false, Msg::id);
+		auto start = std::chrono::steady_clock::now();
 		IPC::SendMsg<Msg>(rootChannel, [this](uint32_t id, IPC::Reader reader) mutable {
-			Syscall(id, std::move(reader), rootChannel);
-            LogMessage(true, id);
+			HandleSyscall(id, std::move(reader));
 		}, std::forward<Args>(args)...);
+		callStats.Record(Msg::id, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+		// The direct VM is out of the way, raise the error one of its syscalls hit
+		if (Com_ErrorTrapped())
+			Com_Error(ERR_DROP, "VM: Error in a direct syscall");
+	}
+
+	// Counters of the messages received from the VM
+	const IPC::ChannelStats& GetChannelStats() const
+	{
+		return rootChannel.GetStats();
+	}
+
+	// Time spent handling each syscall from the VM
+	const MessageStats& GetSyscallStats() const
+	{
+		return syscallStats;
+	}
+	// Time spent in each call into the VM, including the syscalls it made
+	const MessageStats& GetCallStats() const
+	{
+		return callStats;
+	}
+	void ResetStats()
+	{
+		syscallStats.Reset();
+		callStats.Reset();
+	}
+
+	const std::string& GetName() const
+	{
+		return name;
 	}
 
 	struct InProcessInfo {
@@ -156,6 +251,17 @@ protected:
 private:
 	void FreeInProcessVM();
 
+	// Syscalls of a direct VM, made from its frames
+	void HandleDirectSyscall(uint32_t id, IPC::Reader reader);
+
+	void HandleSyscall(uint32_t id, IPC::Reader reader)
+	{
+		auto start = std::chrono::steady_clock::now();
+		Syscall(id, std::move(reader), rootChannel);
+		syscallStats.Record(id, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+		LogMessage(true, id);
+	}
+
 	// Used for the NaCl VMs
 	IPC::OSHandleType processHandle;
 
@@ -174,6 +280,10 @@ private:
 	// Logging the syscalls
 	FS::File syscallLogFile;
 
+	// Latency of the messages
+	MessageStats syscallStats;
+	MessageStats callStats;
+
 	void LogMessage(bool vmToEngine, int id);
 };
 
@@ -66,6 +66,10 @@ Maryland 20850 USA.
 
 jmp_buf             abortframe; // an ERR_DROP has occurred, exit the entire frame
 
+static jmp_buf      *errorTrap; // see Com_SetErrorTrap
+static int          trappedErrorCode; // 0 when there is none
+static char         trappedErrorMessage[ MAXPRINTMSG ];
+
 static fileHandle_t logfile;
 static FILE         *pipefile;
 
@@ -259,6 +263,31 @@ void QDECL PRINTF_LIKE(1) Com_DPrintf( const char *fmt, ... )
 	Com_Printf( "%s", msg );
 }
 
+/*
+=============
+Com_SetErrorTrap
+Com_ErrorTrapped
+
+While a trap is set, a Com_Error that isn't fatal only keeps its message and
+longjmps to the trap, before anything is shut down. This is for the code that
+can't be unwound, like a direct VM that made the syscall which failed. The
+error is raised for real by the next Com_Error, in place of its own.
+Returns the previous trap.
+=============
+*/
+jmp_buf *Com_SetErrorTrap( jmp_buf *trap )
+{
+	jmp_buf *previous = errorTrap;
+
+	errorTrap = trap;
+	return previous;
+}
+
+qboolean Com_ErrorTrapped( void )
+{
+	return trappedErrorCode != 0;
+}
+
 /*
 =============
 Com_Error
@@ -275,6 +304,30 @@ void QDECL PRINTF_LIKE(2) NORETURN Com_Error( int code, const char *fmt, ... )
 	static int errorCount;
 	int        currentTime;
 
+	if ( errorTrap && code != ERR_FATAL )
+	{
+		jmp_buf *trap = errorTrap;
+
+		// keep the first one, the others are its consequences
+		if ( !trappedErrorCode )
+		{
+			va_start( argptr, fmt );
+			Q_vsnprintf( trappedErrorMessage, sizeof( trappedErrorMessage ), fmt, argptr );
+			va_end( argptr );
+			trappedErrorCode = code;
+		}
+
+		errorTrap = NULL;
+		longjmp( *trap, -1 );
+	}
+
+	if ( trappedErrorCode && code != ERR_FATAL )
+	{
+		code = trappedErrorCode;
+		trappedErrorCode = 0;
+		Com_Error( code, "%s", trappedErrorMessage );
+	}
+
 	// make sure we can get at our local stuff
 	if (code != ERR_FATAL) {
 		FS::PakPath::ClearPaks();
@@ -1390,6 +1443,7 @@ sysEvent_t Com_GetEvent( void )
 	char       *s;
 	msg_t      netmsg;
 	netadr_t   adr;
+	int        time;
 
 	// return if we have data
 	if ( eventHead > eventTail )
@@ -1416,7 +1470,7 @@ sysEvent_t Com_GetEvent( void )
 	MSG_Init( &netmsg, sys_packetReceived, sizeof( sys_packetReceived ) );
 	adr.type = NA_UNSPEC;
 
-	if ( Sys_GetPacket( &adr, &netmsg ) )
+	if ( Sys_GetPacket( &adr, &netmsg, &time ) )
 	{
 		netadr_t *buf;
 		int      len;
@@ -1426,7 +1480,7 @@ sysEvent_t Com_GetEvent( void )
 		buf = ( netadr_t * ) Z_Malloc( len );
 		*buf = adr;
 		memcpy( buf + 1, &netmsg.data[ netmsg.readcount ], netmsg.cursize - netmsg.readcount );
-		Com_QueueEvent( 0, SE_PACKET, 0, 0, len, buf );
+		Com_QueueEvent( time, SE_PACKET, 0, 0, len, buf );
 	}
 
 	// return if we have data
@@ -1448,7 +1502,7 @@ sysEvent_t Com_GetEvent( void )
 Com_RunAndTimeServerPacket
 =================
 */
-void Com_RunAndTimeServerPacket( netadr_t *evFrom, msg_t *buf )
+void Com_RunAndTimeServerPacket( netadr_t *evFrom, msg_t *buf, int time )
 {
 	int t1, t2, msec;
 
@@ -1459,7 +1513,7 @@ void Com_RunAndTimeServerPacket( netadr_t *evFrom, msg_t *buf )
 		t1 = Sys_Milliseconds();
 	}
 
-	SV_PacketEvent( *evFrom, buf );
+	SV_PacketEvent( *evFrom, buf, time );
 
 	if ( com_speeds->integer )
 	{
@@ -1519,10 +1573,13 @@ int Com_EventLoop( void )
 				// if the server just shut down, flush the events
 				if ( com_sv_running->integer )
 				{
-					Com_RunAndTimeServerPacket( &evFrom, &buf );
+					Com_RunAndTimeServerPacket( &evFrom, &buf, Sys_Milliseconds() );
 				}
 			}
 
+			// send the replies to the packets just handled
+			Sys_FlushPackets();
+
 			return ev.evTime;
 		}
 
@@ -1624,7 +1681,7 @@ int Com_EventLoop( void )
 
 				if ( com_sv_running->integer )
 				{
-					Com_RunAndTimeServerPacket( &evFrom, &buf );
+					Com_RunAndTimeServerPacket( &evFrom, &buf, ev.evTime );
 				}
 				else
 				{
@@ -2325,6 +2382,7 @@ void Com_Frame( void (*GetInput)( void ), void (*DoneInput)( void ) )
 	}
 
 	SV_Frame( msec );
+	Sys_FlushPackets();
 
 	// if "dedicated" has been modified, start up
 	// or shut down the client system.
@@ -2443,11 +2501,11 @@ void Com_Frame( void (*GetInput)( void ), void (*DoneInput)( void ) )
 	//
 	if ( showTraceStats.Get() )
 	{
-		extern int c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
-		extern int c_pointcontents;
+		extern std::atomic<int> c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces;
+		extern std::atomic<int> c_pointcontents;
 
-		Com_Printf( "%4i traces  (%ib %ip %it) %4i points\n", c_traces, c_brush_traces, c_patch_traces, c_trisoup_traces,
-		            c_pointcontents );
+		Com_Printf( "%4i traces  (%ib %ip %it) %4i points\n", c_traces.load(), c_brush_traces.load(), c_patch_traces.load(),
+		            c_trisoup_traces.load(), c_pointcontents.load() );
 		c_traces = 0;
 		c_brush_traces = 0;
 		c_patch_traces = 0;
@@ -2460,6 +2518,8 @@ void Com_Frame( void (*GetInput)( void ), void (*DoneInput)( void ) )
 
 	Com_ReadFromPipe();
 
+	NET_UpdateStats();
+
 	com_frameNumber++;
 }
 
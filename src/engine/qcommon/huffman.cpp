@@ -39,7 +39,8 @@ Maryland 20850 USA.
 #include "../qcommon/q_shared.h"
 #include "qcommon.h"
 
-static int bloc = 0;
+// per thread so that messages can be encoded concurrently
+static THREAD_LOCAL int bloc = 0;
 
 //bani - optimized version
 //clears data along the way so we don't have to memset() it ahead of time
@@ -483,6 +484,120 @@ void Huff_offsetTransmit( huff_t *huff, int ch, byte *fout, int *offset )
 	*offset = bloc;
 }
 
+/*
+Precomputed tables
+
+Once a tree stops being updated, like the one of the messages built from
+msg_hData, the code of each symbol never changes. Sending a symbol is then
+a single write of its code, and receiving one a lookup on the next
+HUFF_LOOKUP_BITS bits, instead of walking the tree one bit at a time.
+*/
+
+/* Build the code of every symbol and the lookup of the short codes */
+void Huff_BuildTable( const huff_t *huff, huffTable_t *table )
+{
+	int          ch, i, length, fill;
+	uint32_t     code;
+	const node_t *node;
+
+	Com_Memset( table, 0, sizeof( *table ) );
+
+	for ( ch = 0; ch < HMAX; ch++ )
+	{
+		if ( !huff->loc[ ch ] )
+		{
+			continue;
+		}
+
+		// walk up to the root, the bit of the root being the first one sent
+		code = 0;
+		length = 0;
+
+		for ( node = huff->loc[ ch ]; node->parent; node = node->parent )
+		{
+			if ( length == 32 )
+			{
+				break;
+			}
+
+			code = ( code << 1 ) | ( node->parent->right == node ? 1 : 0 );
+			length++;
+		}
+
+		if ( node->parent )
+		{
+			// too long, keep using the tree for this one
+			continue;
+		}
+
+		table->code[ ch ] = code;
+		table->length[ ch ] = length;
+
+		if ( length > HUFF_LOOKUP_BITS )
+		{
+			continue;
+		}
+
+		// every index starting with this code decodes to this symbol
+		for ( fill = 0; fill < ( 1 << ( HUFF_LOOKUP_BITS - length ) ); fill++ )
+		{
+			i = code | ( fill << length );
+			table->lookup[ i ] = ch | ( length << 8 );
+		}
+	}
+}
+
+/* Send a symbol with its precomputed code */
+void Huff_tableTransmit( const huffTable_t *table, huff_t *huff, int ch, byte *fout, int *offset )
+{
+	uint32_t code = table->code[ ch ];
+	int      length = table->length[ ch ];
+	int      x, y, n;
+
+	if ( !length )
+	{
+		Huff_offsetTransmit( huff, ch, fout, offset );
+		return;
+	}
+
+	// as many bits as fit in the current byte each time, clearing new bytes like add_bit
+	while ( length > 0 )
+	{
+		x = *offset >> 3;
+		y = *offset & 7;
+		n = 8 - y < length ? 8 - y : length;
+
+		if ( !y )
+		{
+			fout[ x ] = 0;
+		}
+
+		fout[ x ] |= ( code & ( ( 1u << n ) - 1 ) ) << y;
+
+		code >>= n;
+		length -= n;
+		*offset += n;
+	}
+}
+
+/* Get a symbol with the lookup table, walking the tree for the long codes */
+void Huff_tableReceive( const huffTable_t *table, node_t *tree, int *ch, const byte *fin, int *offset )
+{
+	int      x = *offset >> 3;
+	int      y = *offset & 7;
+	uint32_t bits = ( fin[ x ] | ( fin[ x + 1 ] << 8 ) | ( fin[ x + 2 ] << 16 ) ) >> y;
+	int      entry = table->lookup[ bits & ( ( 1 << HUFF_LOOKUP_BITS ) - 1 ) ];
+
+	if ( entry >> 8 )
+	{
+		*ch = entry & 0xff;
+		*offset += entry >> 8;
+		return;
+	}
+
+	Huff_offsetReceive( tree, ch, ( byte * ) fin, offset );
+}
+
 void Huff_Decompress( msg_t *mbuf, int offset )
 {
 	int    ch, cch, i, j, size;
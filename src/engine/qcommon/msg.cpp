@@ -34,9 +34,11 @@ Maryland 20850 USA.
 
 #include "../qcommon/q_shared.h"
 #include "qcommon.h"
+#include "msg_local.h"
 
-static huffman_t msgHuff;
-static qboolean  msgInit = qfalse;
+huffman_t   msgHuff;
+huffTable_t msgHuffTable; // the codes of msgHuff, which never changes once built
+qboolean    msgInit = qfalse;
 
 /*
 ==============================================================================
@@ -134,6 +136,60 @@ bit functions
 =============================================================================
 */
 
+/*
+============
+MSG_PutRawBits
+
+Writes up to 8 uncompressed bits at once, with the same result as
+calling Huff_putBit for each of them: the bits above them are cleared
+============
+*/
+static inline void MSG_PutRawBits( byte *data, int *offset, unsigned int value, int bits )
+{
+	int x = *offset >> 3;
+	int y = *offset & 7;
+
+	value &= ( 1u << bits ) - 1;
+
+	if ( !y )
+	{
+		data[ x ] = 0;
+	}
+
+	data[ x ] |= ( byte )( value << y );
+
+	if ( y + bits > 8 )
+	{
+		data[ x + 1 ] = ( byte )( value >> ( 8 - y ) );
+	}
+
+	*offset += bits;
+}
+
+/*
+============
+MSG_GetRawBits
+
+Reads up to 8 uncompressed bits at once, the bits past the size bytes
+of data are zero
+============
+*/
+static inline unsigned int MSG_GetRawBits( const byte *data, int size, int *offset, int bits )
+{
+	int          x = *offset >> 3;
+	int          y = *offset & 7;
+	unsigned int value = x < size ? data[ x ] >> y : 0;
+
+	if ( y + bits > 8 && x + 1 < size )
+	{
+		value |= data[ x + 1 ] << ( 8 - y );
+	}
+
+	*offset += bits;
+
+	return value & ( ( 1u << bits ) - 1 );
+}
+
 // negative bit values include signs
 void MSG_WriteBits( msg_t *msg, int value, int bits )
 {
@@ -197,11 +253,8 @@ void MSG_WriteBits( msg_t *msg, int value, int bits )
 
 			nbits = bits & 7;
 
-			for ( i = 0; i < nbits; i++ )
-			{
-				Huff_putBit( ( value & 1 ), msg->data, &msg->bit );
-				value = ( value >> 1 );
-			}
+			MSG_PutRawBits( msg->data, &msg->bit, value, nbits );
+			value = ( ( unsigned int ) value >> nbits );
 
 			bits = bits - nbits;
 		}
@@ -210,7 +263,7 @@ void MSG_WriteBits( msg_t *msg, int value, int bits )
 		{
 			for ( i = 0; i < bits; i += 8 )
 			{
-				Huff_offsetTransmit( &msgHuff.compressor, ( value & 0xff ), msg->data, &msg->bit );
+				Huff_tableTransmit( &msgHuffTable, &msgHuff.compressor, ( value & 0xff ), msg->data, &msg->bit );
 				value = ( value >> 8 );
 			}
 		}
@@ -219,6 +272,60 @@ void MSG_WriteBits( msg_t *msg, int value, int bits )
 	}
 }
 
+void MSG_WriteBitString( msg_t *msg, const byte *data, int bits, int uncompsize )
+{
+	int  i, numBytes, shift;
+	byte *out;
+
+	msg->uncompsize += uncompsize; // NERVE - SMF - net debugging
+
+	if ( msg->oob )
+	{
+		Com_Error( ERR_DROP, "MSG_WriteBitString: not a bitstream message" );
+	}
+
+	if ( !bits )
+	{
+		return;
+	}
+
+	numBytes = ( bits + 7 ) >> 3;
+
+	// same margin as MSG_WriteBits
+	if ( msg->maxsize - msg->cursize < numBytes + 32 )
+	{
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	out = msg->data + ( msg->bit >> 3 );
+	shift = msg->bit & 7;
+
+	if ( !shift )
+	{
+		Com_Memcpy( out, data, numBytes );
+	}
+	else
+	{
+		// the bits above the write position are always clear, like Huff_putBit leaves them
+		for ( i = 0; i < numBytes; i++ )
+		{
+			out[ i ] |= data[ i ] << shift;
+			out[ i + 1 ] = data[ i ] >> ( 8 - shift );
+		}
+	}
+
+	msg->bit += bits;
+
+	// clear the bits past the end, the writers expect them to be
+	if ( msg->bit & 7 )
+	{
+		msg->data[ msg->bit >> 3 ] &= ( 1 << ( msg->bit & 7 ) ) - 1;
+	}
+
+	msg->cursize = ( msg->bit >> 3 ) + 1;
+}
+
 int MSG_ReadBits( msg_t *msg, int bits )
 {
 	int      value;
@@ -275,10 +382,7 @@ int MSG_ReadBits( msg_t *msg, int bits )
 		{
 			nbits = bits & 7;
 
-			for ( i = 0; i < nbits; i++ )
-			{
-				value |= ( Huff_getBit( msg->data, &msg->bit ) << i );
-			}
+			value = MSG_GetRawBits( msg->data, msg->cursize, &msg->bit, nbits );
 
 			bits = bits - nbits;
 		}
@@ -287,7 +391,15 @@ int MSG_ReadBits( msg_t *msg, int bits )
 		{
 			for ( i = 0; i < bits; i += 8 )
 			{
-				Huff_offsetReceive( msgHuff.decompressor.tree, &get, msg->data, &msg->bit );
+				// the lookup reads ahead, near the end of the message walk the tree
+				if ( ( msg->bit >> 3 ) + 3 <= msg->cursize )
+				{
+					Huff_tableReceive( &msgHuffTable, msgHuff.decompressor.tree, &get, msg->data, &msg->bit );
+				}
+				else
+				{
+					Huff_offsetReceive( msgHuff.decompressor.tree, &get, msg->data, &msg->bit );
+				}
 				value |= ( get << ( i + nbits ) );
 			}
 		}
@@ -907,18 +1019,73 @@ entityState_t communication
 =============================================================================
 */
 
-typedef struct
+/*
+==================
+MSG_ChangedFields
+
+Returns a bitmask of the fields of the table which differ between the two
+structures, bit i being set if field i changed. Computed without branches
+so that the whole table is compared in one pass.
+==================
+*/
+static inline uint64_t MSG_ChangedFields( const netField_t *fields, int numFields, const void *from, const void *to )
+{
+	uint64_t changed = 0;
+
+	for ( int i = 0; i < numFields; i++ )
+	{
+		int fromF = * ( const int * )( ( const byte * ) from + fields[ i ].offset );
+		int toF = * ( const int * )( ( const byte * ) to + fields[ i ].offset );
+
+		changed |= ( uint64_t )( fromF != toF ) << i;
+	}
+
+	return changed;
+}
+
+/*
+==================
+MSG_LastChangedField
+
+Returns one more than the index of the highest changed field, 0 if none
+==================
+*/
+static inline int MSG_LastChangedField( uint64_t changed )
+{
+#ifdef __GNUC__
+	return changed ? 64 - __builtin_clzll( changed ) : 0;
+#else
+	int lc = 0;
+
+	while ( changed )
+	{
+		lc++;
+		changed >>= 1;
+	}
+
+	return lc;
+#endif
+}
+
+/*
+==================
+MSG_CountFieldUses
+
+Updates the field statistics reported by fieldinfo
+==================
+*/
+static inline void MSG_CountFieldUses( netField_t *fields, uint64_t changed )
 {
-	const char *name;
-	int  offset;
-	int  bits;
-	int  used;
-} netField_t;
+	for ( int i = 0; changed; i++, changed >>= 1 )
+	{
+		fields[ i ].used += changed & 1;
+	}
+}
 
 // using the stringizing operator to save typing...
 #define NETF( x ) # x,int((size_t)&( (entityState_t*)0 )->x)
 
-static netField_t entityStateFields[] =
+netField_t entityStateFields[] =
 {
 	{ NETF( eType ),             8               },
 	{ NETF( eFlags ),            24              },
@@ -983,6 +1150,11 @@ static netField_t entityStateFields[] =
 	{ NETF( weaponAnim ),        ANIM_BITS       },
 };
 
+// the changed fields are tracked as a 64 bit mask
+static_assert( ARRAY_LEN( entityStateFields ) <= 64, "too many entityState_t fields" );
+
+const int numEntityStateFields = ARRAY_LEN( entityStateFields );
+
 static int QDECL qsort_entitystatefields( const void *a, const void *b )
 {
 	int aa, bb;
@@ -1027,11 +1199,6 @@ void MSG_PrioritiseEntitystateFields( void )
 	Com_Printf( "};\n" );
 }
 
-// if (int)f == f and (int)f + ( 1<<(FLOAT_INT_BITS-1) ) < ( 1 << FLOAT_INT_BITS )
-// the float will be sent with FLOAT_INT_BITS, otherwise all 32 bits will be sent
-#define FLOAT_INT_BITS 13
-#define FLOAT_INT_BIAS ( 1 << ( FLOAT_INT_BITS - 1 ) )
-
 /*
 ==================
 MSG_WriteDeltaEntity
@@ -1050,7 +1217,8 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 	netField_t *field;
 	int        trunc;
 	float      fullFloat;
-	int        *fromF, *toF;
+	int        *toF;
+	uint64_t   changed;
 
 	numFields = ARRAY_LEN( entityStateFields );
 
@@ -1083,22 +1251,17 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 		Com_Error( ERR_FATAL, "MSG_WriteDeltaEntity: Bad entity number: %i", to->number );
 	}
 
-	lc = 0;
-
-	// build the change vector as bytes so it is endien independent
-	for ( i = 0, field = entityStateFields; i < numFields; i++, field++ )
+	// all the fields and the number are ints, so an unchanged entity
+	// can be found by comparing the whole structure at once
+	if ( !force && !memcmp( from, to, sizeof( *from ) ) )
 	{
-		fromF = ( int * )( ( byte * ) from + field->offset );
-		toF = ( int * )( ( byte * ) to + field->offset );
-
-		if ( *fromF != *toF )
-		{
-			lc = i + 1;
-
-			field->used++;
-		}
+		return; // nothing at all
 	}
 
+	changed = MSG_ChangedFields( entityStateFields, numFields, from, to );
+	lc = MSG_LastChangedField( changed );
+	MSG_CountFieldUses( entityStateFields, changed );
+
 	if ( lc == 0 )
 	{
 		// nothing at all changed
@@ -1124,10 +1287,9 @@ void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entity
 
 	for ( i = 0, field = entityStateFields; i < lc; i++, field++ )
 	{
-		fromF = ( int * )( ( byte * ) from + field->offset );
 		toF = ( int * )( ( byte * ) to + field->offset );
 
-		if ( *fromF == *toF )
+		if ( !( changed & ( ( uint64_t ) 1 << i ) ) )
 		{
 			MSG_WriteBits( msg, 0, 1 );  // no change
 			continue;
@@ -1496,6 +1658,9 @@ static netField_t playerStateFields[] =
 	{ PSF( weaponAnim ),           ANIM_BITS       }
 };
 
+// the changed fields are tracked as a 64 bit mask
+static_assert( ARRAY_LEN( playerStateFields ) <= 64, "too many playerState_t fields" );
+
 static int QDECL qsort_playerstatefields( const void *a, const void *b )
 {
 	int aa, bb;
@@ -1554,12 +1719,13 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 	int           persistantbits;
 	int           numFields;
 	netField_t *field;
-	int        *fromF, *toF;
+	int        *toF;
 	float      fullFloat;
 	int        trunc;
 	int        startBit, endBit;
 	int        print;
 	int        miscbits;
+	uint64_t   changed;
 
 	if ( !from )
 	{
@@ -1590,29 +1756,17 @@ void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct p
 
 	numFields = ARRAY_LEN( playerStateFields );
 
-	lc = 0;
-
-	for ( i = 0, field = playerStateFields; i < numFields; i++, field++ )
-	{
-		fromF = ( int * )( ( byte * ) from + field->offset );
-		toF = ( int * )( ( byte * ) to + field->offset );
-
-		if ( *fromF != *toF )
-		{
-			lc = i + 1;
-
-			field->used++;
-		}
-	}
+	changed = MSG_ChangedFields( playerStateFields, numFields, from, to );
+	lc = MSG_LastChangedField( changed );
+	MSG_CountFieldUses( playerStateFields, changed );
 
 	MSG_WriteByte( msg, lc );  // # of changes
 
 	for ( i = 0, field = playerStateFields; i < lc; i++, field++ )
 	{
-		fromF = ( int * )( ( byte * ) from + field->offset );
 		toF = ( int * )( ( byte * ) to + field->offset );
 
-		if ( *fromF == *toF )
+		if ( !( changed & ( ( uint64_t ) 1 << i ) ) )
 		{
 			MSG_WriteBits( msg, 0, 1 );  // no change
 			continue;
@@ -2224,6 +2378,10 @@ void MSG_initHuffman( void )
 			Huff_addRef( &msgHuff.decompressor, ( byte ) i );  /* Do update */
 		}
 	}
+
+	// both trees got the same updates, so they have the same codes
+	Huff_BuildTable( &msgHuff.compressor, &msgHuffTable );
 }
 
+
 //===========================================================================
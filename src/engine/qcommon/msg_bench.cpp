@@ -0,0 +1,405 @@
+/*
+===========================================================================
+
+Daemon GPL Source Code
+Copyright (C) 1999-2010 id Software LLC, a ZeniMax Media company.
+
+This file is part of the Daemon GPL Source Code (Daemon Source Code).
+
+Daemon Source Code is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Daemon Source Code is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Daemon Source Code.  If not, see <http://www.gnu.org/licenses/>.
+
+In addition, the Daemon Source Code is also subject to certain additional terms.
+You should have received a copy of these additional terms immediately following the
+terms and conditions of the GNU General Public License which accompanied the Daemon
+Source Code.  If not, please request a copy in writing from id Software at the address
+below.
+
+If you have questions concerning this license or the applicable additional terms, you
+may contact in writing id Software LLC, c/o ZeniMax Media Inc., Suite 120, Rockville,
+Maryland 20850 USA.
+
+===========================================================================
+*/
+
+// msg_bench.cpp -- benchmarks of the message encoding, checking the current
+// code against the reference implementations it replaced
+
+#include "../qcommon/q_shared.h"
+#include "qcommon.h"
+#include "msg_local.h"
+
+/*
+==================
+MSG_WriteReferenceBits
+
+The bit writer as it was before MSG_PutRawBits, one huffman bit at a time
+==================
+*/
+static void MSG_WriteReferenceBits( msg_t *msg, int value, int bits )
+{
+	int i;
+
+	msg->uncompsize += bits;
+
+	if ( msg->maxsize - msg->cursize < 32 )
+	{
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	value &= ( 0xffffffff >> ( 32 - bits ) );
+
+	for ( i = 0; i < ( bits & 7 ); i++ )
+	{
+		Huff_putBit( ( value & 1 ), msg->data, &msg->bit );
+		value = ( value >> 1 );
+	}
+
+	for ( i = 0; i < ( bits & ~7 ); i += 8 )
+	{
+		Huff_offsetTransmit( &msgHuff.compressor, ( value & 0xff ), msg->data, &msg->bit );
+		value = ( value >> 8 );
+	}
+
+	msg->cursize = ( msg->bit >> 3 ) + 1;
+}
+
+/*
+==================
+MSG_WriteReferenceDeltaEntity
+
+MSG_WriteDeltaEntity as it was before the changed field mask, comparing the
+fields one at a time, kept to check and measure the current encoder against
+==================
+*/
+static void MSG_WriteReferenceDeltaEntity( msg_t *msg, const entityState_t *from, const entityState_t *to, qboolean force )
+{
+	int              i, lc;
+	const netField_t *field;
+	const int        *fromF, *toF;
+	float            fullFloat;
+	int              trunc;
+	int              numFields = numEntityStateFields;
+
+	lc = 0;
+
+	for ( i = 0, field = entityStateFields; i < numFields; i++, field++ )
+	{
+		fromF = ( const int * )( ( const byte * ) from + field->offset );
+		toF = ( const int * )( ( const byte * ) to + field->offset );
+
+		if ( *fromF != *toF )
+		{
+			lc = i + 1;
+		}
+	}
+
+	if ( lc == 0 )
+	{
+		if ( !force )
+		{
+			return;
+		}
+
+		MSG_WriteReferenceBits( msg, to->number, GENTITYNUM_BITS );
+		MSG_WriteReferenceBits( msg, 0, 1 );
+		MSG_WriteReferenceBits( msg, 0, 1 );
+		return;
+	}
+
+	MSG_WriteReferenceBits( msg, to->number, GENTITYNUM_BITS );
+	MSG_WriteReferenceBits( msg, 0, 1 );
+	MSG_WriteReferenceBits( msg, 1, 1 );
+	MSG_WriteReferenceBits( msg, lc, 8 );
+
+	for ( i = 0, field = entityStateFields; i < lc; i++, field++ )
+	{
+		fromF = ( const int * )( ( const byte * ) from + field->offset );
+		toF = ( const int * )( ( const byte * ) to + field->offset );
+
+		if ( *fromF == *toF )
+		{
+			MSG_WriteReferenceBits( msg, 0, 1 );
+			continue;
+		}
+
+		MSG_WriteReferenceBits( msg, 1, 1 );
+
+		if ( field->bits == 0 )
+		{
+			fullFloat = * ( const float * ) toF;
+			trunc = ( int ) fullFloat;
+
+			if ( fullFloat == 0.0f )
+			{
+				MSG_WriteReferenceBits( msg, 0, 1 );
+			}
+			else
+			{
+				MSG_WriteReferenceBits( msg, 1, 1 );
+
+				if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) )
+				{
+					MSG_WriteReferenceBits( msg, 0, 1 );
+					MSG_WriteReferenceBits( msg, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
+				}
+				else
+				{
+					MSG_WriteReferenceBits( msg, 1, 1 );
+					MSG_WriteReferenceBits( msg, *toF, 32 );
+				}
+			}
+		}
+		else
+		{
+			if ( *toF == 0 )
+			{
+				MSG_WriteReferenceBits( msg, 0, 1 );
+			}
+			else
+			{
+				MSG_WriteReferenceBits( msg, 1, 1 );
+				MSG_WriteReferenceBits( msg, *toF, field->bits );
+			}
+		}
+	}
+}
+
+/*
+==================
+MSG_BenchmarkDeltaEntities
+
+Encodes a stream of entity transitions with both the reference encoder and
+MSG_WriteDeltaEntity, checks that they produce the same bits and prints the
+time each one took. Returns the number of transitions encoded differently.
+==================
+*/
+int MSG_BenchmarkDeltaEntities( const entityState_t *from, const entityState_t *to, const qboolean *force, int count, int iterations )
+{
+	static byte buffer[ 2 ][ MAX_MSGLEN ];
+	msg_t       msg[ 2 ];
+	int         i, n, mismatches;
+	int         start, referenceTime, currentTime;
+	int         bits;
+
+	// check that both produce the same output for every transition
+	mismatches = 0;
+
+	for ( i = 0; i < count; i++ )
+	{
+		MSG_Init( &msg[ 0 ], buffer[ 0 ], sizeof( buffer[ 0 ] ) );
+		MSG_Init( &msg[ 1 ], buffer[ 1 ], sizeof( buffer[ 1 ] ) );
+
+		// start at an odd position so the raw bits straddle bytes
+		MSG_WriteReferenceBits( &msg[ 0 ], 5, 3 );
+		MSG_WriteBits( &msg[ 1 ], 5, 3 );
+
+		MSG_WriteReferenceDeltaEntity( &msg[ 0 ], &from[ i ], &to[ i ], force[ i ] );
+		MSG_WriteDeltaEntity( &msg[ 1 ], ( entityState_t * ) &from[ i ], ( entityState_t * ) &to[ i ], force[ i ] );
+
+		if ( msg[ 0 ].bit != msg[ 1 ].bit || memcmp( buffer[ 0 ], buffer[ 1 ], ( msg[ 0 ].bit + 7 ) >> 3 ) )
+		{
+			mismatches++;
+		}
+	}
+
+	// then time them over the whole stream
+	bits = 0;
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		MSG_Init( &msg[ 0 ], buffer[ 0 ], sizeof( buffer[ 0 ] ) );
+
+		for ( i = 0; i < count; i++ )
+		{
+			if ( msg[ 0 ].cursize > MAX_MSGLEN / 2 )
+			{
+				bits += msg[ 0 ].bit;
+				MSG_Clear( &msg[ 0 ] );
+			}
+
+			MSG_WriteReferenceDeltaEntity( &msg[ 0 ], &from[ i ], &to[ i ], force[ i ] );
+		}
+
+		bits += msg[ 0 ].bit;
+	}
+
+	referenceTime = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		MSG_Init( &msg[ 1 ], buffer[ 1 ], sizeof( buffer[ 1 ] ) );
+
+		for ( i = 0; i < count; i++ )
+		{
+			if ( msg[ 1 ].cursize > MAX_MSGLEN / 2 )
+			{
+				MSG_Clear( &msg[ 1 ] );
+			}
+
+			MSG_WriteDeltaEntity( &msg[ 1 ], ( entityState_t * ) &from[ i ], ( entityState_t * ) &to[ i ], force[ i ] );
+		}
+	}
+
+	currentTime = Sys_Milliseconds() - start;
+
+	Com_Printf( "%i entity deltas x %i, %i bits per pass\n", count, iterations, iterations ? bits / iterations : 0 );
+	Com_Printf( "reference encoder: %i msec\n", referenceTime );
+	Com_Printf( "current encoder:   %i msec\n", currentTime );
+	Com_Printf( "%i mismatching deltas\n", mismatches );
+
+	return mismatches;
+}
+
+/*
+==================
+MSG_BenchmarkHuffman
+
+Reads the data as a stream of message symbols and writes them back, both
+walking the trees and with the precomputed tables, checking that the two
+agree and printing the throughput of each
+==================
+*/
+static void MSG_BenchmarkHuffman( const byte *data, int size, int iterations )
+{
+	std::vector<int>  symbols;
+	std::vector<byte> bytes, output[ 2 ];
+	int               i, n, ch, offset, end[ 2 ], start, time[ 4 ];
+	bool              same = true;
+
+	if ( !msgInit )
+	{
+		MSG_initHuffman();
+	}
+
+	// stop early enough for the table lookups to stay in the buffer
+	end[ 0 ] = ( size - 3 ) * 8;
+
+	for ( offset = 0; offset < end[ 0 ]; )
+	{
+		Huff_offsetReceive( msgHuff.decompressor.tree, &ch, ( byte * ) data, &offset );
+		symbols.push_back( ch );
+
+		// data that is not a message can hit the escape code, which has no byte to send back
+		if ( ch < HMAX )
+		{
+			bytes.push_back( ch );
+		}
+	}
+
+	if ( symbols.empty() )
+	{
+		Com_Printf( "Not enough data\n" );
+		return;
+	}
+
+	for ( i = 0, offset = 0; i < ( int ) symbols.size(); i++ )
+	{
+		Huff_tableReceive( &msgHuffTable, msgHuff.decompressor.tree, &ch, data, &offset );
+		same = same && ch == symbols[ i ];
+	}
+
+	// the longest code is far below 32 bits
+	output[ 0 ].resize( bytes.size() * 4 + 1 );
+	output[ 1 ].resize( bytes.size() * 4 + 1 );
+
+	for ( i = 0, end[ 0 ] = 0, end[ 1 ] = 0; i < ( int ) bytes.size(); i++ )
+	{
+		Huff_offsetTransmit( &msgHuff.compressor, bytes[ i ], output[ 0 ].data(), &end[ 0 ] );
+		Huff_tableTransmit( &msgHuffTable, &msgHuff.compressor, bytes[ i ], output[ 1 ].data(), &end[ 1 ] );
+	}
+
+	same = same && end[ 0 ] == end[ 1 ] && !memcmp( output[ 0 ].data(), output[ 1 ].data(), ( end[ 0 ] + 7 ) >> 3 );
+
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		for ( i = 0, offset = 0; i < ( int ) symbols.size(); i++ )
+		{
+			Huff_offsetReceive( msgHuff.decompressor.tree, &ch, ( byte * ) data, &offset );
+		}
+	}
+
+	time[ 0 ] = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		for ( i = 0, offset = 0; i < ( int ) symbols.size(); i++ )
+		{
+			Huff_tableReceive( &msgHuffTable, msgHuff.decompressor.tree, &ch, data, &offset );
+		}
+	}
+
+	time[ 1 ] = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		for ( i = 0, offset = 0; i < ( int ) bytes.size(); i++ )
+		{
+			Huff_offsetTransmit( &msgHuff.compressor, bytes[ i ], output[ 0 ].data(), &offset );
+		}
+	}
+
+	time[ 2 ] = Sys_Milliseconds() - start;
+	start = Sys_Milliseconds();
+
+	for ( n = 0; n < iterations; n++ )
+	{
+		for ( i = 0, offset = 0; i < ( int ) bytes.size(); i++ )
+		{
+			Huff_tableTransmit( &msgHuffTable, &msgHuff.compressor, bytes[ i ], output[ 1 ].data(), &offset );
+		}
+	}
+
+	time[ 3 ] = Sys_Milliseconds() - start;
+
+	// throughput in uncompressed bytes
+	double received = ( double ) symbols.size() * iterations / ( 1024 * 1024 );
+	double sent = ( double ) bytes.size() * iterations / ( 1024 * 1024 );
+
+	Com_Printf( "%i symbols x %i, %s\n", ( int ) symbols.size(), iterations, same ? "tables match the trees" : "^1tables DIFFER from the trees" );
+	Com_Printf( "receive: tree %.1f MB/s, table %.1f MB/s\n", received * 1000 / std::max( time[ 0 ], 1 ), received * 1000 / std::max( time[ 1 ], 1 ) );
+	Com_Printf( "send:    tree %.1f MB/s, table %.1f MB/s\n", sent * 1000 / std::max( time[ 2 ], 1 ), sent * 1000 / std::max( time[ 3 ], 1 ) );
+}
+
+class BenchHuffmanCmd: public Cmd::StaticCmd {
+public:
+	BenchHuffmanCmd()
+		: Cmd::StaticCmd("benchhuffman", Cmd::SYSTEM, "measures the message huffman codec on captured packets such as a demo") {}
+
+	void Run(const Cmd::Args& args) const OVERRIDE
+	{
+		if (args.Argc() < 2) {
+			PrintUsage(args, "<file> [iterations]", "");
+			return;
+		}
+
+		void* buffer;
+		int size = FS_ReadFile(args.Argv(1).c_str(), &buffer);
+
+		if (size < 0) {
+			Print("File not found: \"%s\"", args.Argv(1));
+			return;
+		}
+
+		MSG_BenchmarkHuffman(static_cast<const byte*>(buffer), size, args.Argc() > 2 ? std::max(atoi(args.Argv(2).c_str()), 1) : 20);
+		FS_FreeFile(buffer);
+	}
+};
+static BenchHuffmanCmd BenchHuffmanCmdRegistration;
@@ -35,6 +35,11 @@ Maryland 20850 USA.
 #include "../qcommon/q_shared.h"
 #include "../qcommon/qcommon.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #ifdef BUILD_SERVER
 #include "../server/server.h"
 #endif
@@ -169,6 +174,85 @@ typedef struct
 static nip_localaddr_t localIP[ MAX_IPS ];
 static int             numIP;
 
+// datagrams sent and received, and the socket calls it took, since the last NET_UpdateStats
+static struct
+{
+	int              sendCalls, sendPackets;
+	std::atomic<int> recvCalls, recvPackets; // also counted by the receive thread
+} netStats;
+
+static cvar_t *net_sendCalls;
+static cvar_t *net_sendPackets;
+static cvar_t *net_recvCalls;
+static cvar_t *net_recvPackets;
+
+#ifdef __linux__
+#define NET_BATCH
+#endif
+
+#ifdef NET_BATCH
+
+// queue outgoing datagrams for sendmmsg and drain incoming ones with recvmmsg
+static cvar_t *net_batch;
+
+#define NET_BATCH_SEND  64
+#define NET_BATCH_BYTES ( 8 * MAX_MSGLEN )
+#define NET_BATCH_RECV  32
+
+typedef struct
+{
+	SOCKET                  socket;
+	int                     offset, length;
+	netadrtype_t            type;
+	struct sockaddr_storage addr;
+	socklen_t               addrlen;
+} sendSlot_t;
+
+static sendSlot_t sendQueue[ NET_BATCH_SEND ];
+static int        sendCount;
+static byte       sendPool[ NET_BATCH_BYTES ];
+static int        sendPoolUsed;
+
+typedef struct
+{
+	SOCKET                  socket;
+	struct sockaddr_storage from;
+	socklen_t               fromlen;
+	msg_t                   msg;
+	byte                    data[ MAX_MSGLEN ];
+} recvSlot_t;
+
+static recvSlot_t recvRing[ NET_BATCH_RECV ];
+static int        recvNext, recvCount;
+
+#endif
+
+// read the sockets on a thread of their own, timestamping the datagrams as they arrive
+static cvar_t *net_recvThread;
+
+#define NET_RECV_QUEUE 256 // power of two
+
+typedef struct
+{
+	SOCKET                  socket;
+	int                     time; // Sys_Milliseconds when it was read
+	int                     length;
+	struct sockaddr_storage from;
+	socklen_t               fromlen;
+	byte                    data[ MAX_MSGLEN ];
+} queuedPacket_t;
+
+// single producer, the receive thread, and single consumer, Sys_GetPacket
+static queuedPacket_t        *recvQueue;
+static std::atomic<unsigned> recvQueueHead, recvQueueTail;
+
+static std::thread             recvThread;
+static std::atomic<bool>       recvThreadStop;
+static bool                    recvThreadBatch;
+static std::atomic<int>        recvThreadErrors, recvThreadLastError;
+static std::mutex              recvThreadMutex;
+static std::condition_variable recvThreadWake;
+
 //=============================================================================
 
 /*
@@ -701,12 +785,55 @@ qboolean        NET_IsLocalAddress( netadr_t adr )
 
 /*
 ==================
-Sys_GetPacket
+NET_ReceivedPacket
 
-Never called by the game logic, just the system event queuing
+Fills in the source of a datagram read from a socket, unwrapping the socks relay header
+==================
+*/
+static qboolean NET_ReceivedPacket( SOCKET socket, int ret, struct sockaddr_storage *from, socklen_t fromlen, netadr_t *net_from, msg_t *net_message )
+{
+	if ( socket == ip_socket )
+	{
+		memset( ( ( struct sockaddr_in * ) from )->sin_zero, 0, 8 );
+	}
+
+	if ( socket == ip_socket && usingSocks && memcmp( from, &socksRelayAddr, fromlen ) == 0 )
+	{
+		if ( ret < 10 || net_message->data[ 0 ] != 0 || net_message->data[ 1 ] != 0 || net_message->data[ 2 ] != 0 || net_message->data[ 3 ] != 1 )
+		{
+			return qfalse;
+		}
+
+		net_from->type = NA_IP;
+		net_from->ip[ 0 ] = net_message->data[ 4 ];
+		net_from->ip[ 1 ] = net_message->data[ 5 ];
+		net_from->ip[ 2 ] = net_message->data[ 6 ];
+		net_from->ip[ 3 ] = net_message->data[ 7 ];
+		net_from->port = * ( short * ) &net_message->data[ 8 ];
+		net_message->readcount = 10;
+	}
+	else
+	{
+		SockadrToNetadr( ( struct sockaddr * ) from, net_from );
+		net_message->readcount = 0;
+	}
+
+	if ( ret == net_message->maxsize )
+	{
+		Com_Printf( "Oversize packet from %s\n", NET_AdrToString( *net_from ) );
+		return qfalse;
+	}
+
+	net_message->cursize = ret;
+	return qtrue;
+}
+
+/*
+==================
+NET_ReadSocket
 ==================
 */
-qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message )
+static qboolean NET_ReadSocket( SOCKET socket, netadr_t *net_from, msg_t *net_message )
 {
 	int                     ret;
 	struct sockaddr_storage from;
@@ -714,112 +841,412 @@ qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message )
 	socklen_t               fromlen;
 	int                     err;
 
-	if ( ip_socket != INVALID_SOCKET )
+	fromlen = sizeof( from );
+	ret = recvfrom( socket, ( char * ) net_message->data, net_message->maxsize, 0, ( struct sockaddr * ) &from, &fromlen );
+	netStats.recvCalls++;
+
+	if ( ret == SOCKET_ERROR )
 	{
-		fromlen = sizeof( from );
-		ret = recvfrom( ip_socket, ( char * ) net_message->data, net_message->maxsize, 0, ( struct sockaddr * ) &from, &fromlen );
+		err = socketError;
 
-		if ( ret == SOCKET_ERROR )
+		if ( err != EAGAIN && err != ECONNRESET )
 		{
-			err = socketError;
+			Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+		}
 
-			if ( err != EAGAIN && err != ECONNRESET )
-			{
-				Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
-			}
+		return qfalse;
+	}
+
+	netStats.recvPackets++;
+
+	return NET_ReceivedPacket( socket, ret, &from, fromlen, net_from, net_message );
+}
+
+#ifdef NET_BATCH
+
+/*
+==================
+NET_FillReceiveRing
+
+Reads as many datagrams as are waiting on the socket, up to the ring size, in one call
+==================
+*/
+static int NET_FillReceiveRing( SOCKET socket )
+{
+	struct mmsghdr headers[ NET_BATCH_RECV ];
+	struct iovec   vectors[ NET_BATCH_RECV ];
+	int            i, ret, err;
+
+	for ( i = 0; i < NET_BATCH_RECV; i++ )
+	{
+		vectors[ i ].iov_base = recvRing[ i ].msg.data;
+		vectors[ i ].iov_len = recvRing[ i ].msg.maxsize;
+
+		memset( &headers[ i ], 0, sizeof( headers[ i ] ) );
+		headers[ i ].msg_hdr.msg_name = &recvRing[ i ].from;
+		headers[ i ].msg_hdr.msg_namelen = sizeof( recvRing[ i ].from );
+		headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+		headers[ i ].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg( socket, headers, NET_BATCH_RECV, MSG_DONTWAIT, NULL );
+	netStats.recvCalls++;
+
+	if ( ret == SOCKET_ERROR )
+	{
+		err = socketError;
+
+		if ( err != EAGAIN && err != ECONNRESET )
+		{
+			Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
 		}
-		else
+
+		return 0;
+	}
+
+	for ( i = 0; i < ret; i++ )
+	{
+		recvRing[ i ].socket = socket;
+		recvRing[ i ].fromlen = headers[ i ].msg_hdr.msg_namelen;
+		recvRing[ i ].msg.cursize = headers[ i ].msg_len;
+	}
+
+	netStats.recvPackets += ret;
+
+	return ret;
+}
+
+/*
+==================
+NET_GetBatchedPacket
+
+Hands out the datagrams left in the ring, refilling it from the first socket with data waiting
+==================
+*/
+static qboolean NET_GetBatchedPacket( netadr_t *net_from, msg_t *net_message )
+{
+	recvSlot_t *slot;
+
+	while ( 1 )
+	{
+		if ( recvNext == recvCount )
 		{
-			memset( ( ( struct sockaddr_in * ) &from )->sin_zero, 0, 8 );
+			recvNext = 0;
+			recvCount = 0;
 
-			if ( usingSocks && memcmp( &from, &socksRelayAddr, fromlen ) == 0 )
+			if ( ip_socket != INVALID_SOCKET )
 			{
-				if ( ret < 10 || net_message->data[ 0 ] != 0 || net_message->data[ 1 ] != 0 || net_message->data[ 2 ] != 0 || net_message->data[ 3 ] != 1 )
-				{
-					return qfalse;
-				}
+				recvCount = NET_FillReceiveRing( ip_socket );
+			}
 
-				net_from->type = NA_IP;
-				net_from->ip[ 0 ] = net_message->data[ 4 ];
-				net_from->ip[ 1 ] = net_message->data[ 5 ];
-				net_from->ip[ 2 ] = net_message->data[ 6 ];
-				net_from->ip[ 3 ] = net_message->data[ 7 ];
-				net_from->port = * ( short * ) &net_message->data[ 8 ];
-				net_message->readcount = 10;
+			if ( !recvCount && ip6_socket != INVALID_SOCKET )
+			{
+				recvCount = NET_FillReceiveRing( ip6_socket );
 			}
-			else
+
+			if ( !recvCount && multicast6_socket != INVALID_SOCKET && multicast6_socket != ip6_socket )
 			{
-				SockadrToNetadr( ( struct sockaddr * ) &from, net_from );
-				net_message->readcount = 0;
+				recvCount = NET_FillReceiveRing( multicast6_socket );
 			}
 
-			if ( ret == net_message->maxsize )
+			if ( !recvCount )
 			{
-				Com_Printf( "Oversize packet from %s\n", NET_AdrToString( *net_from ) );
 				return qfalse;
 			}
+		}
+
+		slot = &recvRing[ recvNext++ ];
 
-			net_message->cursize = ret;
+		// the ring buffers are as large as the event ones, so the oversize check still applies
+		net_message->cursize = std::min( slot->msg.cursize, net_message->maxsize );
+		Com_Memcpy( net_message->data, slot->msg.data, net_message->cursize );
+
+		if ( NET_ReceivedPacket( slot->socket, slot->msg.cursize, &slot->from, slot->fromlen, net_from, net_message ) )
+		{
 			return qtrue;
 		}
 	}
+}
 
-	if ( ip6_socket != INVALID_SOCKET )
+#endif
+
+/*
+==================
+NET_ReadQueueSlots
+
+Reads datagrams from the socket into consecutive queue slots, returns how many were read
+==================
+*/
+static int NET_ReadQueueSlots( SOCKET socket, queuedPacket_t *slots, int count )
+{
+	int ret, i, now;
+
+#ifdef NET_BATCH
+
+	if ( recvThreadBatch )
 	{
-		fromlen = sizeof( from );
-		ret = recvfrom( ip6_socket, ( char * ) net_message->data, net_message->maxsize, 0, ( struct sockaddr * ) &from, &fromlen );
+		struct mmsghdr headers[ NET_BATCH_RECV ];
+		struct iovec   vectors[ NET_BATCH_RECV ];
 
-		if ( ret == SOCKET_ERROR )
+		count = std::min( count, NET_BATCH_RECV );
+
+		for ( i = 0; i < count; i++ )
 		{
-			err = socketError;
+			vectors[ i ].iov_base = slots[ i ].data;
+			vectors[ i ].iov_len = sizeof( slots[ i ].data );
 
-			if ( err != EAGAIN && err != ECONNRESET )
-			{
-				Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
-			}
+			memset( &headers[ i ], 0, sizeof( headers[ i ] ) );
+			headers[ i ].msg_hdr.msg_name = &slots[ i ].from;
+			headers[ i ].msg_hdr.msg_namelen = sizeof( slots[ i ].from );
+			headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+			headers[ i ].msg_hdr.msg_iovlen = 1;
 		}
-		else
+
+		ret = recvmmsg( socket, headers, count, MSG_DONTWAIT, NULL );
+
+		for ( i = 0; i < ret; i++ )
 		{
-			SockadrToNetadr( ( struct sockaddr * ) &from, net_from );
-			net_message->readcount = 0;
+			slots[ i ].fromlen = headers[ i ].msg_hdr.msg_namelen;
+			slots[ i ].length = headers[ i ].msg_len;
+		}
+	}
+	else
+#endif
+	{
+		slots[ 0 ].fromlen = sizeof( slots[ 0 ].from );
+		ret = recvfrom( socket, ( char * ) slots[ 0 ].data, sizeof( slots[ 0 ].data ), 0, ( struct sockaddr * ) &slots[ 0 ].from, &slots[ 0 ].fromlen );
 
-			if ( ret == net_message->maxsize )
-			{
-				Com_Printf( "Oversize packet from %s\n", NET_AdrToString( *net_from ) );
-				return qfalse;
-			}
+		if ( ret != SOCKET_ERROR )
+		{
+			slots[ 0 ].length = ret;
+			ret = 1;
+		}
+	}
 
-			net_message->cursize = ret;
-			return qtrue;
+	netStats.recvCalls++;
+
+	if ( ret == SOCKET_ERROR )
+	{
+		int err = socketError;
+
+		// printing is left to the main thread
+		if ( err != EAGAIN && err != ECONNRESET )
+		{
+			recvThreadLastError = err;
+			recvThreadErrors++;
 		}
+
+		return 0;
+	}
+
+	now = Sys_Milliseconds();
+
+	for ( i = 0; i < ret; i++ )
+	{
+		slots[ i ].socket = socket;
+		slots[ i ].time = now;
+	}
+
+	netStats.recvPackets += ret;
+
+	return ret;
+}
+
+/*
+==================
+NET_QueueFromSocket
+
+Reads everything waiting on the socket, as long as the queue has room for it
+==================
+*/
+static int NET_QueueFromSocket( SOCKET socket )
+{
+	unsigned head = recvQueueHead.load( std::memory_order_relaxed );
+	unsigned tail = recvQueueTail.load( std::memory_order_acquire );
+	int      total = 0, room, ret;
+
+	while ( head - tail < NET_RECV_QUEUE )
+	{
+		// free slots up to the wrap around
+		room = std::min( NET_RECV_QUEUE - ( head - tail ), NET_RECV_QUEUE - ( head & ( NET_RECV_QUEUE - 1 ) ) );
+		ret = NET_ReadQueueSlots( socket, &recvQueue[ head & ( NET_RECV_QUEUE - 1 ) ], room );
+
+		if ( !ret )
+		{
+			break;
+		}
+
+		head += ret;
+		total += ret;
+		recvQueueHead.store( head, std::memory_order_release );
+		tail = recvQueueTail.load( std::memory_order_acquire );
+	}
+
+	return total;
+}
+
+/*
+==================
+NET_RecvThreadMain
+==================
+*/
+static void NET_RecvThreadMain( void )
+{
+	struct timeval timeout;
+	fd_set         fdset;
+	SOCKET         sockets[ 3 ];
+	SOCKET         highestfd = INVALID_SOCKET;
+	int            numSockets = 0, i, ret;
+
+	// the sockets stay open until the thread is stopped
+	if ( ip_socket != INVALID_SOCKET )
+	{
+		sockets[ numSockets++ ] = ip_socket;
+	}
+
+	if ( ip6_socket != INVALID_SOCKET )
+	{
+		sockets[ numSockets++ ] = ip6_socket;
 	}
 
 	if ( multicast6_socket != INVALID_SOCKET && multicast6_socket != ip6_socket )
 	{
-		fromlen = sizeof( from );
-		ret = recvfrom( multicast6_socket, ( char * ) net_message->data, net_message->maxsize, 0, ( struct sockaddr * ) &from, &fromlen );
+		sockets[ numSockets++ ] = multicast6_socket;
+	}
 
-		if ( ret == SOCKET_ERROR )
+	for ( i = 0; i < numSockets; i++ )
+	{
+		if ( highestfd == INVALID_SOCKET || sockets[ i ] > highestfd )
+		{
+			highestfd = sockets[ i ];
+		}
+	}
+
+	while ( !recvThreadStop )
+	{
+		// wake up now and then to check for the stop request
+		FD_ZERO( &fdset );
+
+		for ( i = 0; i < numSockets; i++ )
 		{
-			err = socketError;
+			FD_SET( sockets[ i ], &fdset );
+		}
 
-			if ( err != EAGAIN && err != ECONNRESET )
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000;
+
+		if ( select( highestfd + 1, &fdset, NULL, NULL, &timeout ) <= 0 )
+		{
+			continue;
+		}
+
+		for ( i = 0, ret = 0; i < numSockets; i++ )
+		{
+			if ( FD_ISSET( sockets[ i ], &fdset ) )
 			{
-				Com_Printf( "NET_GetPacket: %s\n", NET_ErrorString() );
+				ret += NET_QueueFromSocket( sockets[ i ] );
 			}
 		}
-		else
-		{
-			SockadrToNetadr( ( struct sockaddr * ) &from, net_from );
-			net_message->readcount = 0;
 
-			if ( ret == net_message->maxsize )
+		if ( ret )
+		{
+			// taking the lock makes sure a NET_Sleep about to wait sees the new packets
 			{
-				Com_Printf( "Oversize packet from %s\n", NET_AdrToString( *net_from ) );
-				return qfalse;
+				std::lock_guard<std::mutex> lock( recvThreadMutex );
 			}
 
-			net_message->cursize = ret;
+			recvThreadWake.notify_one();
+		}
+		else
+		{
+			// the queue is full, give the main thread some time to empty it
+			std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+		}
+	}
+}
+
+/*
+==================
+NET_StartRecvThread
+==================
+*/
+static void NET_StartRecvThread( void )
+{
+	if ( ip_socket == INVALID_SOCKET && ip6_socket == INVALID_SOCKET )
+	{
+		return;
+	}
+
+	if ( !recvQueue )
+	{
+		recvQueue = new queuedPacket_t[ NET_RECV_QUEUE ];
+	}
+
+#ifdef NET_BATCH
+	recvThreadBatch = net_batch && net_batch->integer;
+#endif
+
+	recvQueueHead = 0;
+	recvQueueTail = 0;
+	recvThreadStop = false;
+	recvThread = std::thread( NET_RecvThreadMain );
+
+	Com_Printf( "Receiving packets on a separate thread\n" );
+}
+
+/*
+==================
+NET_StopRecvThread
+
+Drops whatever is left in the queue, it may come from sockets about to be closed
+==================
+*/
+static void NET_StopRecvThread( void )
+{
+	if ( !recvThread.joinable() )
+	{
+		return;
+	}
+
+	recvThreadStop = true;
+	recvThread.join();
+
+	recvQueueHead = 0;
+	recvQueueTail = 0;
+}
+
+/*
+==================
+NET_GetQueuedPacket
+==================
+*/
+static qboolean NET_GetQueuedPacket( netadr_t *net_from, msg_t *net_message, int *time )
+{
+	queuedPacket_t *slot;
+	unsigned       tail = recvQueueTail.load( std::memory_order_relaxed );
+	qboolean       ok;
+	int            errors = recvThreadErrors.exchange( 0 );
+
+	if ( errors )
+	{
+		Com_Printf( "NET_GetPacket: %i receive errors, the last one being %i\n", errors, recvThreadLastError.load() );
+	}
+
+	while ( tail != recvQueueHead.load( std::memory_order_acquire ) )
+	{
+		slot = &recvQueue[ tail & ( NET_RECV_QUEUE - 1 ) ];
+
+		// the queue slots are as large as the event buffer, so the oversize check still applies
+		net_message->cursize = std::min( slot->length, net_message->maxsize );
+		Com_Memcpy( net_message->data, slot->data, net_message->cursize );
+		*time = slot->time;
+
+		ok = NET_ReceivedPacket( slot->socket, slot->length, &slot->from, slot->fromlen, net_from, net_message );
+
+		recvQueueTail.store( ++tail, std::memory_order_release );
+
+		if ( ok )
+		{
 			return qtrue;
 		}
 	}
@@ -827,10 +1254,179 @@ qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message )
 	return qfalse;
 }
 
+/*
+==================
+Sys_GetPacket
+
+Never called by the game logic, just the system event queuing
+==================
+*/
+qboolean Sys_GetPacket( netadr_t *net_from, msg_t *net_message, int *time )
+{
+	if ( recvThread.joinable() )
+	{
+		return NET_GetQueuedPacket( net_from, net_message, time );
+	}
+
+	*time = Sys_Milliseconds();
+
+#ifdef NET_BATCH
+
+	// drain what is left in the ring even if batching was just turned off
+	if ( ( net_batch && net_batch->integer ) || recvNext < recvCount )
+	{
+		return NET_GetBatchedPacket( net_from, net_message );
+	}
+
+#endif
+
+	if ( ip_socket != INVALID_SOCKET && NET_ReadSocket( ip_socket, net_from, net_message ) )
+	{
+		return qtrue;
+	}
+
+	if ( ip6_socket != INVALID_SOCKET && NET_ReadSocket( ip6_socket, net_from, net_message ) )
+	{
+		return qtrue;
+	}
+
+	if ( multicast6_socket != INVALID_SOCKET && multicast6_socket != ip6_socket && NET_ReadSocket( multicast6_socket, net_from, net_message ) )
+	{
+		return qtrue;
+	}
+
+	return qfalse;
+}
+
 //=============================================================================
 
 static char socksBuf[ 4096 ];
 
+/*
+==================
+NET_SendFailed
+==================
+*/
+static void NET_SendFailed( int err, netadrtype_t type, sa_family_t family )
+{
+	// wouldblock is silent
+	if ( err == EAGAIN )
+	{
+		return;
+	}
+
+	// some PPP links do not allow broadcasts and return an error
+	if ( ( err == EADDRNOTAVAIL ) && ( ( type == NA_BROADCAST ) ) )
+	{
+		return;
+	}
+
+	if ( family == AF_INET )
+	{
+		Com_Printf( "Sys_SendPacket (ipv4): %s\n", NET_ErrorString() );
+	}
+	else if ( family == AF_INET6 )
+	{
+		Com_Printf( "Sys_SendPacket (ipv6): %s\n", NET_ErrorString() );
+	}
+	else
+	{
+		Com_Printf( "Sys_SendPacket (%i): %s\n", family , NET_ErrorString() );
+	}
+}
+
+/*
+==================
+Sys_FlushPackets
+
+Sends the datagrams queued since the last flush, one call for each run going to the same socket
+==================
+*/
+void Sys_FlushPackets( void )
+{
+#ifdef NET_BATCH
+	struct mmsghdr headers[ NET_BATCH_SEND ];
+	struct iovec   vectors[ NET_BATCH_SEND ];
+	int            i, run, ret;
+
+	for ( i = 0; i < sendCount; i++ )
+	{
+		vectors[ i ].iov_base = sendPool + sendQueue[ i ].offset;
+		vectors[ i ].iov_len = sendQueue[ i ].length;
+
+		memset( &headers[ i ], 0, sizeof( headers[ i ] ) );
+		headers[ i ].msg_hdr.msg_name = &sendQueue[ i ].addr;
+		headers[ i ].msg_hdr.msg_namelen = sendQueue[ i ].addrlen;
+		headers[ i ].msg_hdr.msg_iov = &vectors[ i ];
+		headers[ i ].msg_hdr.msg_iovlen = 1;
+	}
+
+	for ( i = 0; i < sendCount; )
+	{
+		for ( run = 1; i + run < sendCount && sendQueue[ i + run ].socket == sendQueue[ i ].socket; run++ )
+		{
+		}
+
+		ret = sendmmsg( sendQueue[ i ].socket, headers + i, run, 0 );
+		netStats.sendCalls++;
+
+		if ( ret == SOCKET_ERROR )
+		{
+			// the first one failed, drop it and go on with the rest
+			NET_SendFailed( socketError, sendQueue[ i ].type, sendQueue[ i ].addr.ss_family );
+			i++;
+			continue;
+		}
+
+		// a short count means the next one failed, the next call reports it
+		netStats.sendPackets += ret;
+		i += ret;
+	}
+
+	sendCount = 0;
+	sendPoolUsed = 0;
+#endif
+}
+
+/*
+==================
+NET_SendTo
+
+Sends a datagram right away, or queues it for Sys_FlushPackets when batching
+==================
+*/
+static int NET_SendTo( SOCKET socket, const void *data, int length, const struct sockaddr *to, socklen_t tolen, netadrtype_t type )
+{
+#ifdef NET_BATCH
+	sendSlot_t *slot;
+
+	if ( net_batch && net_batch->integer )
+	{
+		if ( sendCount == NET_BATCH_SEND || sendPoolUsed + length > NET_BATCH_BYTES )
+		{
+			Sys_FlushPackets();
+		}
+
+		slot = &sendQueue[ sendCount++ ];
+		slot->socket = socket;
+		slot->offset = sendPoolUsed;
+		slot->length = length;
+		slot->type = type;
+		slot->addrlen = tolen;
+		memcpy( &slot->addr, to, tolen );
+		memcpy( sendPool + sendPoolUsed, data, length );
+		sendPoolUsed += length;
+
+		return length;
+	}
+
+#endif
+	netStats.sendCalls++;
+	netStats.sendPackets++;
+
+	return sendto( socket, ( const char* )data, length, 0, to, tolen );
+}
+
 /*
 ==================
 Sys_SendPacket
@@ -871,48 +1467,23 @@ void Sys_SendPacket( int length, const void *data, netadr_t to )
 		* ( int * ) &socksBuf[ 4 ] = ( ( struct sockaddr_in * ) &addr )->sin_addr.s_addr;
 		* ( short * ) &socksBuf[ 8 ] = ( ( struct sockaddr_in * ) &addr )->sin_port;
 		memcpy( &socksBuf[ 10 ], data, length );
-		ret = sendto( ip_socket, ( const char* )socksBuf, length + 10, 0, &socksRelayAddr, sizeof( socksRelayAddr ) );
+		ret = NET_SendTo( ip_socket, socksBuf, length + 10, &socksRelayAddr, sizeof( socksRelayAddr ), to.type );
 	}
 	else
 	{
 		if ( addr.ss_family == AF_INET )
 		{
-			ret = sendto( ip_socket, ( const char* )data, length, 0, ( struct sockaddr * ) &addr, sizeof( struct sockaddr_in ) );
+			ret = NET_SendTo( ip_socket, data, length, ( struct sockaddr * ) &addr, sizeof( struct sockaddr_in ), to.type );
 		}
 		else if ( addr.ss_family == AF_INET6 )
 		{
-			ret = sendto( ip6_socket, ( const char* )data, length, 0, ( struct sockaddr * ) &addr, sizeof( struct sockaddr_in6 ) );
+			ret = NET_SendTo( ip6_socket, data, length, ( struct sockaddr * ) &addr, sizeof( struct sockaddr_in6 ), to.type );
 		}
 	}
 
 	if ( ret == SOCKET_ERROR )
 	{
-		int err = socketError;
-
-		// wouldblock is silent
-		if ( err == EAGAIN )
-		{
-			return;
-		}
-
-		// some PPP links do not allow broadcasts and return an error
-		if ( ( err == EADDRNOTAVAIL ) && ( ( to.type == NA_BROADCAST ) ) )
-		{
-			return;
-		}
-
-		if ( addr.ss_family == AF_INET )
-		{
-			Com_Printf( "Sys_SendPacket (ipv4): %s\n", NET_ErrorString() );
-		}
-		else if ( addr.ss_family == AF_INET6 )
-		{
-			Com_Printf( "Sys_SendPacket (ipv6): %s\n", NET_ErrorString() );
-		}
-		else
-		{
-			Com_Printf( "Sys_SendPacket (%i): %s\n", addr.ss_family , NET_ErrorString() );
-		}
+		NET_SendFailed( socketError, to.type, addr.ss_family );
 	}
 }
 
@@ -1868,6 +2439,10 @@ static qboolean NET_GetCvars( void )
 	modified += net_socksPassword->modified;
 	net_socksPassword->modified = qfalse;
 
+	net_recvThread = Cvar_Get( "net_recvThread", "0", CVAR_LATCH );
+	modified += net_recvThread->modified;
+	net_recvThread->modified = qfalse;
+
 	return modified ? qtrue : qfalse;
 }
 
@@ -1937,6 +2512,13 @@ void NET_Config( qboolean enableNetworking )
 
 	if ( stop )
 	{
+		// nothing queued or left unread may outlive its socket
+		NET_StopRecvThread();
+		Sys_FlushPackets();
+#ifdef NET_BATCH
+		recvNext = recvCount = 0;
+#endif
+
 		if ( ip_socket != INVALID_SOCKET )
 		{
 			closesocket( ip_socket );
@@ -1975,6 +2557,11 @@ void NET_Config( qboolean enableNetworking )
 #ifdef BUILD_SERVER
 			SV_NET_Config();
 #endif
+
+			if ( net_recvThread->integer )
+			{
+				NET_StartRecvThread();
+			}
 		}
 	}
 }
@@ -2041,6 +2628,20 @@ void NET_Init( void )
 	Com_Printf( "Loaded GeoIP data: ^%dIPv4 ^%dIPv6\n", geoip_data_4 ? 2 : 1, geoip_data_6 ? 2 : 1 );
 #endif
 
+	net_sendCalls = Cvar_Get( "net_sendCalls", "0", CVAR_ROM );
+	net_sendPackets = Cvar_Get( "net_sendPackets", "0", CVAR_ROM );
+	net_recvCalls = Cvar_Get( "net_recvCalls", "0", CVAR_ROM );
+	net_recvPackets = Cvar_Get( "net_recvPackets", "0", CVAR_ROM );
+
+#ifdef NET_BATCH
+	net_batch = Cvar_Get( "net_batch", "1", 0 );
+
+	for ( int i = 0; i < NET_BATCH_RECV; i++ )
+	{
+		MSG_Init( &recvRing[ i ].msg, recvRing[ i ].data, sizeof( recvRing[ i ].data ) );
+	}
+#endif
+
 	NET_Config( qtrue );
 
 	Cmd_AddCommand( "net_restart", NET_Restart_f );
@@ -2066,6 +2667,50 @@ void NET_Shutdown( void )
 #endif
 }
 
+/*
+====================
+NET_UpdateStats
+
+Sends what is still queued and publishes the socket calls and datagrams of the frame
+====================
+*/
+void NET_UpdateStats( void )
+{
+	Sys_FlushPackets();
+
+	if ( !net_sendCalls )
+	{
+		return;
+	}
+
+	if ( net_sendCalls->integer != netStats.sendCalls )
+	{
+		Cvar_Set( "net_sendCalls", va( "%i", netStats.sendCalls ) );
+	}
+
+	if ( net_sendPackets->integer != netStats.sendPackets )
+	{
+		Cvar_Set( "net_sendPackets", va( "%i", netStats.sendPackets ) );
+	}
+
+	// the receive thread may be counting at the same time
+	int recvCalls = netStats.recvCalls.exchange( 0 );
+	int recvPackets = netStats.recvPackets.exchange( 0 );
+
+	if ( net_recvCalls->integer != recvCalls )
+	{
+		Cvar_Set( "net_recvCalls", va( "%i", recvCalls ) );
+	}
+
+	if ( net_recvPackets->integer != recvPackets )
+	{
+		Cvar_Set( "net_recvPackets", va( "%i", recvPackets ) );
+	}
+
+	netStats.sendCalls = 0;
+	netStats.sendPackets = 0;
+}
+
 /*
 ====================
 NET_Sleep
@@ -2090,11 +2735,25 @@ void NET_Sleep( int msec )
 		return;
 	}
 
+	// don't hold anything back while waiting
+	Sys_FlushPackets();
+
 	if ( msec < 0 )
 	{
 		return;
 	}
 
+	// the receive thread owns the sockets, wait for it to queue something
+	if ( recvThread.joinable() )
+	{
+		std::unique_lock<std::mutex> lock( recvThreadMutex );
+
+		recvThreadWake.wait_for( lock, std::chrono::milliseconds( msec ), [] {
+			return recvQueueHead.load() != recvQueueTail.load();
+		} );
+		return;
+	}
+
 	FD_ZERO( &fdset );
 
 	if ( ip_socket != INVALID_SOCKET )
@@ -127,6 +127,7 @@ typedef int intptr_t;
 #include <vector>
 #include <array>
 #include <list>
+#include <deque>
 #include <forward_list>
 #include <set>
 #include <map>
@@ -140,6 +141,7 @@ typedef int intptr_t;
 #include <numeric>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
 #include <valarray>
 #include <sstream>
@@ -2061,6 +2063,19 @@ void         ByteToDir( int b, vec3_t dir );
 	  TT_NUM_TRACE_TYPES
 	} traceType_t;
 
+// what a trace is run for, see CM_SetTraceSource
+	typedef enum
+	{
+	  TRACE_SOURCE_OTHER,
+	  TRACE_SOURCE_PMOVE,
+	  TRACE_SOURCE_WEAPONS,
+	  TRACE_SOURCE_BUILDABLES,
+	  TRACE_SOURCE_BOTS,
+	  TRACE_SOURCE_CGAME,
+
+	  TRACE_NUM_SOURCES
+	} traceSource_t;
+
 // a trace is returned when a box is swept through the world
 	typedef struct
 	{
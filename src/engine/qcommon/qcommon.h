@@ -79,6 +79,10 @@ struct playerState_s;
 
 void  MSG_WriteBits( msg_t *msg, int value, int bits );
 
+// appends the bits written to another bitstream message, the huffman
+// codes do not depend on their position so they can be reused as is
+void  MSG_WriteBitString( msg_t *msg, const byte *data, int bits, int uncompsize );
+
 void  MSG_WriteChar( msg_t *sb, int c );
 void  MSG_WriteByte( msg_t *sb, int c );
 void  MSG_WriteShort( msg_t *sb, int c );
@@ -110,6 +114,7 @@ void  MSG_WriteDeltaUsercmdKey( msg_t *msg, int key, usercmd_t *from, usercmd_t
 void  MSG_ReadDeltaUsercmdKey( msg_t *msg, int key, usercmd_t *from, usercmd_t *to );
 
 void  MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entityState_s *to, qboolean force );
+int   MSG_BenchmarkDeltaEntities( const entityState_t *from, const entityState_t *to, const qboolean *force, int count, int iterations );
 void  MSG_ReadDeltaEntity( msg_t *msg, entityState_t *from, entityState_t *to, int number );
 
 void  MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct playerState_s *to );
@@ -209,6 +214,7 @@ void       NET_JoinMulticast6( void );
 void       NET_LeaveMulticast6( void );
 
 void       NET_Sleep( int msec );
+void       NET_UpdateStats( void );
 
 #ifdef HAVE_GEOIP
 const char *NET_GeoIP_Country( const netadr_t *a );
@@ -674,6 +680,8 @@ void QDECL Com_Log( log_level_t level, const char* message );
 
 // *INDENT-ON*
 void NORETURN Com_Quit_f( void );
+jmp_buf    *Com_SetErrorTrap( jmp_buf *trap );
+qboolean   Com_ErrorTrapped( void );
 int        Com_Milliseconds( void );
 unsigned   Com_BlockChecksum( const void *buffer, int length );
 char       *Com_MD5File( const char *filename, int length );
@@ -892,7 +900,7 @@ void S_ClearSoundBuffer( void );
 void     SV_Init( void );
 void     SV_Shutdown( const char *finalmsg );
 void     SV_Frame( int msec );
-void     SV_PacketEvent( netadr_t from, msg_t *msg );
+void     SV_PacketEvent( netadr_t from, msg_t *msg, int time );
 int      SV_FrameMsec( void );
 
 /*
@@ -971,7 +979,8 @@ int           Sys_GetProcessorFeatures( void );
 void          Sys_SetErrorText( const char *text );
 
 void          Sys_SendPacket( int length, const void *data, netadr_t to );
-qboolean      Sys_GetPacket( netadr_t *net_from, msg_t *net_message );
+void          Sys_FlushPackets( void );
+qboolean      Sys_GetPacket( netadr_t *net_from, msg_t *net_message, int *time );
 
 qboolean      Sys_StringToAdr( const char *s, netadr_t *a, netadrtype_t family );
 
@@ -1065,6 +1074,16 @@ typedef struct
     huff_t decompressor;
 } huffman_t;
 
+#define HUFF_LOOKUP_BITS 11
+
+// precomputed codes of a tree which is no longer updated, for the static message tree
+typedef struct
+{
+    uint32_t code[ HMAX ]; // first bit sent in the lowest bit
+    byte     length[ HMAX ]; // 0 if the code doesn't fit in code, sent through the tree instead
+    uint16_t lookup[ 1 << HUFF_LOOKUP_BITS ]; // symbol | length << 8 of the code starting with these bits, 0 if longer
+} huffTable_t;
+
 void             Huff_Compress( msg_t *buf, int offset );
 void             Huff_Decompress( msg_t *buf, int offset );
 void             Huff_Init( huffman_t *huff );
@@ -1075,6 +1094,10 @@ void             Huff_offsetReceive( node_t *node, int *ch, byte *fin, int *offs
 void             Huff_offsetTransmit( huff_t *huff, int ch, byte *fout, int *offset );
 void             Huff_putBit( int bit, byte *fout, int *offset );
 int              Huff_getBit( byte *fout, int *offset );
+void             Huff_BuildTable( const huff_t *huff, huffTable_t *table );
+void             Huff_tableTransmit( const huffTable_t *table, huff_t *huff, int ch, byte *fout, int *offset );
+// reads up to 3 bytes from fin + ( *offset >> 3 ), the caller has to make sure they are readable
+void             Huff_tableReceive( const huffTable_t *table, node_t *tree, int *ch, const byte *fin, int *offset );
 
 // don't use if you don't know what you're doing.
 int              Huff_getBloc( void );
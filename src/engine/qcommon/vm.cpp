@@ -50,6 +50,7 @@ and one exported function: Perform
 #include "vm_traps.h"
 
 #include "../framework/CommandSystem.h"
+#include "../framework/VirtualMachine.h"
 
 vm_t       *currentVM = NULL;
 vm_t       *lastVM = NULL;
@@ -61,6 +62,55 @@ static int forced_unload;
 #define MAX_VM 3
 vm_t       vmTable[ MAX_VM ];
 
+// vm.stats counters of each vmTable slot, see VM_DispatchSyscall and VM_Call
+static std::unique_ptr<VM::LegacyVMStats> vmStats[ MAX_VM ];
+
+// see VM::LegacyVMStats, negative numbers end up in the "other" entry
+static uint32_t VM_StatsId( intptr_t num )
+{
+	return num < 0 ? 0xffffffff : ( uint32_t )( num / 256 ) << 16 | ( uint32_t )( num % 256 );
+}
+
+/*
+vm_compareInterpreter: the compiled VMs also get an interpreter and each call
+into them is run by both. The compiled run goes first and records the traps it
+makes, with their return value and the bytes they wrote to the VM memory. The
+interpreted run then starts from the same memory, and the recorded traps are
+replayed to it instead of calling the handlers again. The traps common to all
+VMs only use the VM memory and are run by both, as the compiled code may inline
+them. Both runs must make the same traps and end with the same return value and
+memory. The trap arguments are not compared, as the stack words past them hold
+return addresses in the interpreter only.
+*/
+typedef struct
+{
+	intptr_t callnum;
+	intptr_t ret;
+	size_t   firstWrite, numWrites;
+} vmCompareTrap_t;
+
+typedef struct
+{
+	int    ofs, length;
+	size_t data; // in vmCompare_t::written
+} vmCompareWrite_t;
+
+typedef struct
+{
+	vm_t                          *vm, *interpreter;
+	int                           callLevel;
+	size_t                        nextTrap; // when replaying
+
+	std::vector<vmCompareTrap_t>  traps;
+	std::vector<vmCompareWrite_t> writes;
+	std::vector<byte>             written;
+	std::vector<byte>             before, after;
+} vmCompare_t;
+
+static std::unique_ptr<vm_t> vmInterpreters[ MAX_VM ];
+static vmCompare_t           vmCompare;
+static qboolean              vmComparing; // a call is being compared
+
 void       VM_VmInfo_f( void );
 void       VM_VmProfile_f( void );
 
@@ -92,6 +142,13 @@ void VM_Init( void )
 	Cvar_Get( "vm_cgame", "0", 0 );
 	Cvar_Get( "vm_ui", "0", 0 );
 
+	// compiled VMs only, both take effect when the VM is loaded
+	Cvar_Get( "vm_inlineTraps", "1", 0 );
+	Cvar_Get( "vm_trapStats", "0", 0 );
+
+	// debugging, takes effect when the VM is loaded, see VM_CallCompared
+	Cvar_Get( "vm_compareInterpreter", "0", 0 );
+
 	Cmd_AddCommand( "vmprofile", VM_VmProfile_f );
 	Cmd_AddCommand( "vminfo", VM_VmInfo_f );
 
@@ -428,6 +485,152 @@ void VM_CheckSanity( vm_t *vm, intptr_t call )
 	}
 }
 
+/*
+============
+VM_RecordTrap
+
+Stores a trap of the compiled run of a compared call, with what it wrote
+to the VM memory since vmCompare.before was taken
+============
+*/
+static void VM_RecordTrap( intptr_t callnum, intptr_t ret )
+{
+	const byte      *before = vmCompare.before.data();
+	const byte      *after = vmCompare.vm->dataBase;
+	int             size = vmCompare.vm->dataMask + 1;
+	int             i, start;
+	vmCompareTrap_t trap;
+
+	trap.callnum = callnum;
+	trap.ret = ret;
+	trap.firstWrite = vmCompare.writes.size();
+
+	i = 0;
+
+	while ( i < size )
+	{
+		vmCompareWrite_t write;
+
+		// skip the unchanged blocks quickly
+		if ( !( i & 63 ) && i + 64 <= size && !memcmp( before + i, after + i, 64 ) )
+		{
+			i += 64;
+			continue;
+		}
+
+		// exact ranges, the bytes around them may legitimately differ in
+		// the interpreted run, like the return addresses on its stack
+		if ( before[ i ] == after[ i ] )
+		{
+			i++;
+			continue;
+		}
+
+		start = i;
+
+		while ( i < size && before[ i ] != after[ i ] )
+		{
+			i++;
+		}
+
+		write.ofs = start;
+		write.length = i - start;
+		write.data = vmCompare.written.size();
+		vmCompare.written.insert( vmCompare.written.end(), after + start, after + i );
+		vmCompare.writes.push_back( write );
+	}
+
+	trap.numWrites = vmCompare.writes.size() - trap.firstWrite;
+	vmCompare.traps.push_back( trap );
+}
+
+/*
+============
+VM_ReplayTrap
+
+Hands the next recorded trap to the interpreted run of a compared call
+============
+*/
+static intptr_t VM_ReplayTrap( intptr_t callnum )
+{
+	const vmCompareTrap_t *trap;
+	size_t                i;
+
+	if ( vmCompare.nextTrap == vmCompare.traps.size() || vmCompare.traps[ vmCompare.nextTrap ].callnum != callnum )
+	{
+		vmComparing = qfalse;
+		Com_Error( ERR_DROP, "vm_compareInterpreter: %s trap %d is %d interpreted but %d compiled", vmCompare.vm->name,
+		           ( int ) vmCompare.nextTrap, ( int ) callnum,
+		           vmCompare.nextTrap == vmCompare.traps.size() ? -1 : ( int ) vmCompare.traps[ vmCompare.nextTrap ].callnum );
+	}
+
+	trap = &vmCompare.traps[ vmCompare.nextTrap++ ];
+
+	for ( i = trap->firstWrite; i < trap->firstWrite + trap->numWrites; i++ )
+	{
+		const vmCompareWrite_t *write = &vmCompare.writes[ i ];
+
+		Com_Memcpy( vmCompare.vm->dataBase + write->ofs, &vmCompare.written[ write->data ], write->length );
+	}
+
+	return trap->ret;
+}
+
+/*
+============
+VM_DispatchSyscall
+
+Hands a trap to the common or the VM specific handler, args[ 0 ] is the
+trap number. The time spent is added to the vm.stats counters of the VM.
+============
+*/
+intptr_t VM_DispatchSyscall( vm_t *vm, intptr_t *args )
+{
+	VM::LegacyVMStats *stats;
+	std::chrono::steady_clock::time_point start;
+	intptr_t callnum = args[ 0 ];
+	intptr_t ret;
+	qboolean record;
+
+	if ( vmComparing && vm == vmCompare.interpreter )
+	{
+		return callnum < FIRST_VM_SYSCALL ? VM_SystemCall( args ) : VM_ReplayTrap( callnum );
+	}
+
+	// the traps of nested calls are part of the outer trap
+	record = vmComparing && vm == vmCompare.vm && vm->callLevel == vmCompare.callLevel && callnum >= FIRST_VM_SYSCALL;
+
+	if ( record )
+	{
+		Com_Memcpy( vmCompare.before.data(), vm->dataBase, vm->dataMask + 1 );
+	}
+
+	stats = vmStats[ vm - vmTable ].get();
+	start = std::chrono::steady_clock::now();
+
+	if ( callnum < FIRST_VM_SYSCALL )
+	{
+		ret = VM_SystemCall( args ); // all VMs
+	}
+	else
+	{
+		ret = vm->systemCall( args ); // VM-specific
+	}
+
+	// the VM may have been freed by the trap
+	if ( stats && stats == vmStats[ vm - vmTable ].get() )
+	{
+		stats->syscalls.Record( VM_StatsId( callnum ), std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count() );
+	}
+
+	if ( record && vmComparing )
+	{
+		VM_RecordTrap( callnum, ret );
+	}
+
+	return ret;
+}
+
 /*
 ============
 VM_DllSyscall
@@ -488,25 +691,11 @@ intptr_t QDECL VM_DllSyscall( intptr_t arg, ... )
 
 	VM_SetSanity( currentVM, arg );
 
-	if ( arg < FIRST_VM_SYSCALL )
-	{
-		ret = VM_SystemCall( args ); // all VMs
-	}
-	else
-	{
-		ret = currentVM->systemCall( args );
-	}
+	ret = VM_DispatchSyscall( currentVM, args );
 #else // original id code (almost)
 	VM_SetSanity( currentVM, arg );
 
-	if ( arg < FIRST_VM_SYSCALL )
-	{
-		ret = VM_SystemCall( &arg ); // all VMs
-	}
-	else
-	{
-		ret = currentVM->systemCall( &arg );
-	}
+	ret = VM_DispatchSyscall( currentVM, &arg );
 #endif
 	VM_CheckSanity( currentVM, arg );
 	return ret;
@@ -782,6 +971,9 @@ vm_t *VM_Create( const char *module, intptr_t ( *systemCalls )( intptr_t * ),
 	Q_strncpyz( vm->name, module, sizeof( vm->name ) );
 	vm->systemCall = systemCalls;
 
+	vmStats[ i ].reset( new VM::LegacyVMStats( vm->name ) );
+	VM::RegisterLegacyVMStats( vmStats[ i ].get() );
+
 	if ( interpret == VMI_NATIVE && !onlyQVM )
 	{
 		// try to load as a system dll
@@ -826,6 +1018,8 @@ vm_t *VM_Create( const char *module, intptr_t ( *systemCalls )( intptr_t * ),
 	if ( interpret >= VMI_COMPILED )
 	{
 		vm->compiled = qtrue;
+		vm->inlineTraps = Cvar_VariableIntegerValue( "vm_inlineTraps" ) != 0;
+		vm->trapStats = Cvar_VariableIntegerValue( "vm_trapStats" ) != 0;
 		VM_Compile( vm, header );
 	}
 
@@ -836,6 +1030,19 @@ vm_t *VM_Create( const char *module, intptr_t ( *systemCalls )( intptr_t * ),
 	{
 		VM_PrepareInterpreter( vm, header );
 	}
+	else if ( Cvar_VariableIntegerValue( "vm_compareInterpreter" ) )
+	{
+		vm_t *interpreter = new vm_t( *vm );
+
+		interpreter->compiled = qfalse;
+		interpreter->destroy = NULL;
+		interpreter->codeLength = header->codeLength;
+		interpreter->instructionPointers = (intptr_t*) Hunk_Alloc( interpreter->instructionCount * sizeof( *interpreter->instructionPointers ), h_high );
+		VM_PrepareInterpreter( interpreter, header );
+		vmInterpreters[ vm - vmTable ].reset( interpreter );
+
+		Com_Printf( "%s: the calls are compared with the interpreter\n", module );
+	}
 
 	// free the original file
 	FS_FreeFile( header );
@@ -861,6 +1068,21 @@ VM_Free
 */
 void VM_Free( vm_t *vm )
 {
+	std::unique_ptr<VM::LegacyVMStats>& stats = vmStats[ vm - vmTable ];
+
+	if ( stats )
+	{
+		VM::UnregisterLegacyVMStats( stats.get() );
+		stats.reset();
+	}
+
+	vmInterpreters[ vm - vmTable ].reset();
+
+	if ( vmComparing && vmCompare.vm == vm )
+	{
+		vmComparing = qfalse;
+	}
+
 	if ( vm->dllHandle )
 	{
 		Sys_UnloadDll( vm->dllHandle );
@@ -940,6 +1162,104 @@ void *VM_ExplicitArgPtr( vm_t *vm, intptr_t intValue )
 	}
 }
 
+/*
+==============
+VM_CallCompared
+
+Runs a call into a compiled VM, then again with its interpreter,
+see vm_compareInterpreter. The VM is left as the compiled run left it.
+==============
+*/
+#ifndef NO_VM_COMPILED
+static int VM_CallCompared( vm_t *vm, int *args )
+{
+	vm_t *interpreter = vmInterpreters[ vm - vmTable ].get();
+	int  size = vm->dataMask + 1;
+	int  stack = vm->programStack;
+	int  callArgs[ 11 ];
+	int  compiled, interpreted;
+	int  i, first, count;
+
+	// the interpreted run starts from the same memory and arguments
+	Com_Memcpy( callArgs, args, sizeof( callArgs ) );
+	vmCompare.before.resize( size );
+	vmCompare.after.assign( vm->dataBase, vm->dataBase + size );
+
+	vmCompare.vm = vm;
+	vmCompare.interpreter = interpreter;
+	vmCompare.callLevel = vm->callLevel;
+	vmCompare.nextTrap = 0;
+	vmCompare.traps.clear();
+	vmCompare.writes.clear();
+	vmCompare.written.clear();
+	vmComparing = qtrue;
+
+	compiled = VM_CallCompiled( vm, args );
+
+	// swap the initial memory in
+	std::swap_ranges( vm->dataBase, vm->dataBase + size, vmCompare.after.begin() );
+
+	// the sanity bytes after the memory are shared too
+	interpreter->programStack = stack;
+	interpreter->stackBottom = vm->stackBottom;
+	interpreter->versionChecked = vm->versionChecked;
+	interpreter->clean = vm->clean;
+	Com_Memcpy( interpreter->sanity, vm->sanity, sizeof( vm->sanity ) );
+
+	interpreted = VM_CallInterpreted( interpreter, callArgs );
+
+	vmComparing = qfalse;
+	Com_Memcpy( vm->sanity, interpreter->sanity, sizeof( vm->sanity ) );
+
+	if ( vmCompare.nextTrap != vmCompare.traps.size() )
+	{
+		Com_Printf( S_COLOR_YELLOW "WARNING: vm_compareInterpreter: %s call %d made %d traps interpreted but %d compiled\n",
+		            vm->name, callArgs[ 0 ], ( int ) vmCompare.nextTrap, ( int ) vmCompare.traps.size() );
+	}
+
+	if ( compiled != interpreted )
+	{
+		Com_Printf( S_COLOR_YELLOW "WARNING: vm_compareInterpreter: %s call %d returned %d interpreted but %d compiled\n",
+		            vm->name, callArgs[ 0 ], interpreted, compiled );
+	}
+
+	// the stack below the entry point is scratch, the interpreter keeps
+	// its return addresses there and the compiled code doesn't
+	first = -1;
+	count = 0;
+
+	for ( i = 0; i < size; i++ )
+	{
+		if ( i == vm->stackBottom )
+		{
+			i = stack - 1;
+			continue;
+		}
+
+		if ( vm->dataBase[ i ] != vmCompare.after[ i ] )
+		{
+			if ( first < 0 )
+			{
+				first = i;
+			}
+
+			count++;
+		}
+	}
+
+	if ( count )
+	{
+		Com_Printf( S_COLOR_YELLOW "WARNING: vm_compareInterpreter: %s call %d left %d bytes different, the first at 0x%x\n",
+		            vm->name, callArgs[ 0 ], count, first );
+	}
+
+	// keep the compiled run
+	Com_Memcpy( vm->dataBase, vmCompare.after.data(), size );
+
+	return compiled;
+}
+#endif
+
 /*
 ==============
 VM_Call
@@ -969,6 +1289,8 @@ intptr_t        QDECL VM_Call( vm_t *vm, int callnum, ... )
 	vm_t     *oldVM;
 	intptr_t r;
 	int      i;
+	VM::LegacyVMStats *stats;
+	std::chrono::steady_clock::time_point start;
 
 	if ( !vm || !vm->name[ 0 ] )
 	{
@@ -986,6 +1308,9 @@ intptr_t        QDECL VM_Call( vm_t *vm, int callnum, ... )
 
 	++vm->callLevel;
 
+	stats = vmStats[ vm - vmTable ].get();
+	start = std::chrono::steady_clock::now();
+
 	// if we have a native library loaded, call it directly
 	if ( vm->entryPoint )
 	{
@@ -1038,7 +1363,11 @@ intptr_t        QDECL VM_Call( vm_t *vm, int callnum, ... )
 		va_end( ap );
 #ifndef NO_VM_COMPILED
 
-		if ( vm->compiled )
+		if ( vm->compiled && vmInterpreters[ vm - vmTable ] && !vmComparing )
+		{
+			r = VM_CallCompared( vm, &a.callnum );
+		}
+		else if ( vm->compiled )
 		{
 			r = VM_CallCompiled( vm, &a.callnum );
 		}
@@ -1051,6 +1380,12 @@ intptr_t        QDECL VM_Call( vm_t *vm, int callnum, ... )
 
 	--vm->callLevel;
 
+	// the VM may have been freed during the call
+	if ( stats && stats == vmStats[ vm - vmTable ].get() )
+	{
+		stats->calls.Record( VM_StatsId( callnum ), std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count() );
+	}
+
 	if ( oldVM != NULL )
 	{
 		currentVM = oldVM;
@@ -1166,6 +1501,12 @@ void VM_VmInfo_f( void )
 		Com_Printf( "    code length : %7i\n", vm->codeLength );
 		Com_Printf( "    table length: %7i\n", vm->instructionCount * 4 );
 		Com_Printf( "    data length : %7i\n", vm->dataMask + 1 );
+
+		if ( vm->trapStats )
+		{
+			Com_Printf( "    memory traps: %7i syscalls, %i inline, %.3f Mticks\n",
+			            vm->memoryTrapCalls, vm->memoryTrapsInlined, vm->memoryTrapTicks / 1.0e6 );
+		}
 	}
 }
 
@@ -580,26 +580,12 @@ nextInstruction2:
 								argarr[ i ] = * ( ++imagePtr );
 							}
 
-							if ( programCounter < -FIRST_VM_SYSCALL )
-							{
-								r = vm->systemCall( argarr );
-							}
-							else
-							{
-								r = VM_SystemCall( argarr ); // all VMs
-							}
+							r = VM_DispatchSyscall( vm, argarr );
 						}
 						else
 						{
 							intptr_t *argptr = ( intptr_t * ) &image[ programStack + 4 ];
-							if ( programCounter < -FIRST_VM_SYSCALL )
-							{
-								r = vm->systemCall( argptr );
-							}
-							else
-							{
-								r = VM_SystemCall( argptr ); // all VMs
-							}
+							r = VM_DispatchSyscall( vm, argptr );
 						}
 
 						VM_CheckSanity( vm, ~programCounter );
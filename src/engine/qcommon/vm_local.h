@@ -192,6 +192,13 @@ struct vm_s
 	byte              sanity[ 16 ];
 	qboolean          versionChecked;
 	qboolean          clean;
+
+	// memory traps in compiled code, see vm_inlineTraps and vm_trapStats
+	qboolean          inlineTraps;
+	qboolean          trapStats;
+	int               memoryTrapCalls; // through DoSyscall
+	int               memoryTrapsInlined;
+	uint64_t          memoryTrapTicks; // TSC ticks spent in both
 };
 
 extern  vm_t *currentVM;
@@ -207,6 +214,7 @@ vmSymbol_t   *VM_ValueToFunctionSymbol( vm_t *vm, int value );
 int          VM_SymbolToValue( vm_t *vm, const char *symbol );
 const char   *VM_ValueToSymbol( vm_t *vm, int value );
 void         VM_LogSyscalls( int *args );
+intptr_t     VM_DispatchSyscall( vm_t *vm, intptr_t *args );
 
 void         VM_BlockCopy( unsigned int dest, unsigned int src, size_t n );
 
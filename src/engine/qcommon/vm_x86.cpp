@@ -47,7 +47,9 @@ Maryland 20850 USA.
 
 #ifdef _WIN32
 #include <windows.h>
+#include <intrin.h> // for __rdtsc
 #else
+#include <x86intrin.h> // for __rdtsc
 
 #ifdef __FreeBSD__
 #include <sys/types.h>
@@ -77,6 +79,7 @@ static void VM_Destroy_Compiled( vm_t *self );
 x86_64:
   r8    vm->instructionPointers
   r9    vm->dataBase
+  r10 - r15  cached opStack values
 
 */
 
@@ -447,9 +450,19 @@ static struct {
 static void DoSyscall( void )
 {
 	vm_t     *savedVM;
+	uint64_t trapStart = 0;
 
 	// save currentVM so as to allow for recursive VM entry
 	savedVM = currentVM;
+
+#if idx64 && !idx64_32
+	if ( savedVM->trapStats && ( vmInfo.syscallNum == VM_BLOCK_COPY
+	     || ( vmInfo.syscallNum < 0 && ~vmInfo.syscallNum <= TRAP_STRNCPY ) ) )
+	{
+		trapStart = __rdtsc();
+	}
+
+#endif
 	// modify VM stack pointer for recursive VM entry
 	currentVM->programStack = vmInfo.programStack - 4;
 
@@ -471,25 +484,11 @@ static void DoSyscall( void )
 			args[ index ] = data[ index ];
 		}
 
-		if ( args[ 0 ] < FIRST_VM_SYSCALL )
-		{
-			vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = VM_SystemCall( args ); // Common
-		}
-		else
-		{
-			vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = savedVM->systemCall( args ); // VM-specific
-		}
+		vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = VM_DispatchSyscall( savedVM, args );
 #else
 		data[ 0 ] = ~vmInfo.syscallNum;
 
-		if ( data[ 0 ] < FIRST_VM_SYSCALL )
-		{
-			vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = VM_SystemCall( (intptr_t *) data ); // Common
-		}
-		else
-		{
-			vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = savedVM->systemCall( (intptr_t *) data ); // VM-specific
-		}
+		vmInfo.opStackBase[ vmInfo.opStackOfs + 1 ] = VM_DispatchSyscall( savedVM, (intptr_t *) data );
 #endif
 		VM_CheckSanity( savedVM, ~vmInfo.syscallNum );
 	}
@@ -514,6 +513,12 @@ static void DoSyscall( void )
 		}
 	}
 
+	if ( trapStart )
+	{
+		savedVM->memoryTrapTicks += __rdtsc() - trapStart;
+		savedVM->memoryTrapCalls++;
+	}
+
 	currentVM = savedVM;
 }
 
@@ -754,6 +759,241 @@ void EmitCallIns( vm_t *vm, int cdest )
 	}
 }
 
+#if idx64 && !idx64_32
+/*
+=================
+Inline memory traps
+
+memset and memcpy trap calls with a constant trap number and OP_BLOCK_COPY
+are done in place: the range checks of VM_CheckBlock and VM_CheckBlockPair
+are made on the sign extended arguments and anything failing them takes the
+regular syscall path to raise the same error
+=================
+*/
+
+static int EmitJumpRel32( const char *jmpop )
+{
+	EmitString( jmpop );  // j??? 0x12345678
+	Emit4( 0 );
+	return compiledOfs - 4;
+}
+
+static void SetJumpRel32( int ofs )
+{
+	int v = compiledOfs - ( ofs + 4 );
+
+	buf[ ofs ] = v & 0xFF;
+	buf[ ofs + 1 ] = ( v >> 8 ) & 0xFF;
+	buf[ ofs + 2 ] = ( v >> 16 ) & 0xFF;
+	buf[ ofs + 3 ] = ( v >> 24 ) & 0xFF;
+}
+
+/*
+=================
+EmitTrapTimer
+Accounts the TSC ticks and executions of an inline memory trap when vm_trapStats is set
+=================
+*/
+
+static void EmitTrapTimer( vm_t *vm, qboolean stop )
+{
+	if ( !vm->trapStats )
+	{
+		return;
+	}
+
+	EmitString( "0F 31" );  // rdtsc
+	EmitString( "48 C1 E2 20" );  // shl rdx, 32
+	EmitString( "48 09 D0" );  // or rax, rdx
+	EmitString( "49 BB" );  // mov r11, &vm->memoryTrapTicks
+	EmitPtr( &vm->memoryTrapTicks );
+
+	if ( stop )
+	{
+		EmitString( "49 01 03" );  // add qword ptr [r11], rax
+		EmitString( "49 BB" );  // mov r11, &vm->memoryTrapsInlined
+		EmitPtr( &vm->memoryTrapsInlined );
+		EmitString( "41 FF 03" );  // inc dword ptr [r11]
+	}
+	else
+	{
+		EmitString( "49 29 03" );  // sub qword ptr [r11], rax
+	}
+}
+
+/*
+=================
+EmitMemoryTrap
+Inline memset or memcpy trap call, args at programStack + 8
+=================
+*/
+
+static void EmitMemoryTrap( vm_t *vm, int cdest, int callProcOfsSyscall )
+{
+	int failJumps[ 5 ], numFailJumps = 0;
+	int jmpDone, i;
+
+	EmitTrapTimer( vm, qfalse );
+
+	EmitString( "49 63 54 31 08" );  // movsxd rdx, dword ptr [r9 + rsi + 8]
+	EmitString( "49 63 4C 31 10" );  // movsxd rcx, dword ptr [r9 + rsi + 16]
+	EmitString( "48 85 C9" );  // test rcx, rcx
+	failJumps[ numFailJumps++ ] = EmitJumpRel32( "0F 88" );  // js fail
+	EmitString( "48 81 FA" );  // cmp rdx, vm->dataMask
+	Emit4( vm->dataMask );
+	failJumps[ numFailJumps++ ] = EmitJumpRel32( "0F 87" );  // ja fail
+	EmitString( "4C 8D 1C 0A" );  // lea r11, [rdx + rcx]
+	EmitString( "49 81 FB" );  // cmp r11, vm->dataMask
+	Emit4( vm->dataMask );
+	failJumps[ numFailJumps++ ] = EmitJumpRel32( "0F 87" );  // ja fail
+
+	if ( cdest == ~TRAP_MEMSET )
+	{
+		EmitString( "41 8B 44 31 0C" );  // mov eax, dword ptr [r9 + rsi + 12]
+		EmitString( "49 89 FA" );  // mov r10, rdi
+		EmitString( "49 8D 3C 11" );  // lea rdi, [r9 + rdx]
+		EmitString( "F3 AA" );  // rep stosb
+		EmitString( "4C 89 D7" );  // mov rdi, r10
+	}
+	else
+	{
+		EmitString( "49 63 44 31 0C" );  // movsxd rax, dword ptr [r9 + rsi + 12]
+		EmitString( "48 3D" );  // cmp rax, vm->dataMask
+		Emit4( vm->dataMask );
+		failJumps[ numFailJumps++ ] = EmitJumpRel32( "0F 87" );  // ja fail
+		EmitString( "4C 8D 1C 08" );  // lea r11, [rax + rcx]
+		EmitString( "49 81 FB" );  // cmp r11, vm->dataMask
+		Emit4( vm->dataMask );
+		failJumps[ numFailJumps++ ] = EmitJumpRel32( "0F 87" );  // ja fail
+
+		EmitString( "49 89 FA" );  // mov r10, rdi
+		EmitString( "49 89 F3" );  // mov r11, rsi
+		EmitString( "49 8D 3C 11" );  // lea rdi, [r9 + rdx]
+		EmitString( "49 8D 34 01" );  // lea rsi, [r9 + rax]
+		EmitString( "F3 A4" );  // rep movsb
+		EmitString( "4C 89 D7" );  // mov rdi, r10
+		EmitString( "4C 89 DE" );  // mov rsi, r11
+	}
+
+	// both traps return 0
+	STACK_PUSH( 1 );  // add bl, 1
+	EmitString( "C7 04 9F" );  // mov dword ptr [edi + ebx * 4], 0
+	Emit4( 0 );
+	jmpDone = EmitJumpRel32( "E9" );  // jmp done
+
+	// fail:
+	for ( i = 0; i < numFailJumps; i++ )
+	{
+		SetJumpRel32( failJumps[ i ] );
+	}
+
+	EmitString( "B8" );  // mov eax, cdest
+	Emit4( cdest );
+	EmitCallRel( vm, callProcOfsSyscall );
+
+	// done:
+	SetJumpRel32( jmpDone );
+	EmitTrapTimer( vm, qtrue );
+}
+
+/*
+=================
+EmitBlockCopy
+Inline OP_BLOCK_COPY, small blocks are moved with unrolled SSE loads and stores
+=================
+*/
+
+static void EmitBlockCopy( vm_t *vm, int n, int callDoSyscallOfs )
+{
+	int jmpFail[ 2 ], jmpDone, ofs;
+
+	if ( n < 0 || n > vm->dataMask )
+	{
+		EmitString( "B8" );  // mov eax, 0x12345678
+		Emit4( VM_BLOCK_COPY );
+		EmitString( "B9" );  // mov ecx, 0x12345678
+		Emit4( n );
+		EmitCallRel( vm, callDoSyscallOfs );
+		return;
+	}
+
+	EmitTrapTimer( vm, qfalse );
+
+	EmitString( "8B 54 9F FC" );  // mov edx, dword ptr -4[edi + ebx * 4]
+	EmitString( "8B 04 9F" );  // mov eax, dword ptr [edi + ebx * 4]
+	EmitString( "48 81 FA" );  // cmp rdx, vm->dataMask - n
+	Emit4( vm->dataMask - n );
+	jmpFail[ 0 ] = EmitJumpRel32( "0F 87" );  // ja fail
+	EmitString( "48 3D" );  // cmp rax, vm->dataMask - n
+	Emit4( vm->dataMask - n );
+	jmpFail[ 1 ] = EmitJumpRel32( "0F 87" );  // ja fail
+
+	if ( n <= 64 )
+	{
+		for ( ofs = 0; ofs + 16 <= n; ofs += 16 )
+		{
+			EmitString( "F3 41 0F 6F 84 01" );  // movdqu xmm0, [r9 + rax + ofs]
+			Emit4( ofs );
+			EmitString( "F3 41 0F 7F 84 11" );  // movdqu [r9 + rdx + ofs], xmm0
+			Emit4( ofs );
+		}
+
+		if ( n - ofs >= 8 )
+		{
+			EmitString( "4D 8B 94 01" );  // mov r10, qword ptr [r9 + rax + ofs]
+			Emit4( ofs );
+			EmitString( "4D 89 94 11" );  // mov qword ptr [r9 + rdx + ofs], r10
+			Emit4( ofs );
+			ofs += 8;
+		}
+
+		if ( n - ofs >= 4 )
+		{
+			EmitString( "45 8B 94 01" );  // mov r10d, dword ptr [r9 + rax + ofs]
+			Emit4( ofs );
+			EmitString( "45 89 94 11" );  // mov dword ptr [r9 + rdx + ofs], r10d
+			Emit4( ofs );
+			ofs += 4;
+		}
+
+		for ( ; ofs < n; ofs++ )
+		{
+			EmitString( "45 8A 94 01" );  // mov r10b, byte ptr [r9 + rax + ofs]
+			Emit4( ofs );
+			EmitString( "45 88 94 11" );  // mov byte ptr [r9 + rdx + ofs], r10b
+			Emit4( ofs );
+		}
+	}
+	else
+	{
+		EmitString( "49 89 FA" );  // mov r10, rdi
+		EmitString( "49 89 F3" );  // mov r11, rsi
+		EmitString( "49 8D 3C 11" );  // lea rdi, [r9 + rdx]
+		EmitString( "49 8D 34 01" );  // lea rsi, [r9 + rax]
+		EmitString( "B9" );  // mov ecx, n
+		Emit4( n );
+		EmitString( "F3 A4" );  // rep movsb
+		EmitString( "4C 89 D7" );  // mov rdi, r10
+		EmitString( "4C 89 DE" );  // mov rsi, r11
+	}
+
+	jmpDone = EmitJumpRel32( "E9" );  // jmp done
+
+	// fail:
+	SetJumpRel32( jmpFail[ 0 ] );
+	SetJumpRel32( jmpFail[ 1 ] );
+	EmitString( "B8" );  // mov eax, 0x12345678
+	Emit4( VM_BLOCK_COPY );
+	EmitString( "B9" );  // mov ecx, 0x12345678
+	Emit4( n );
+	EmitCallRel( vm, callDoSyscallOfs );
+
+	// done:
+	SetJumpRel32( jmpDone );
+	EmitTrapTimer( vm, qtrue );
+}
+#endif
+
 /*
 =================
 EmitCallConst
@@ -763,6 +1003,14 @@ Call to constant instruction number or syscall
 
 void EmitCallConst( vm_t *vm, int cdest, int callProcOfsSyscall )
 {
+#if idx64 && !idx64_32
+	if ( vm->inlineTraps && ( cdest == ~TRAP_MEMSET || cdest == ~TRAP_MEMCPY ) )
+	{
+		EmitMemoryTrap( vm, cdest, callProcOfsSyscall );
+		return;
+	}
+#endif
+
 	if ( cdest < 0 )
 	{
 		EmitString( "B8" );  // mov eax, cdest
@@ -1203,142 +1451,1073 @@ qboolean ConstOptimize( vm_t *vm, int callProcOfsSyscall )
 	return qfalse;
 }
 
-#if idx64 || idx64_32
-#  define EAX "%%rax"
-#  define EBX "%%rbx"
-#  define ESP "%%rsp"
-#  define EDI "%%rdi"
-#else
-#  define EAX "%%eax"
-#  define EBX "%%ebx"
-#  define ESP "%%esp"
-#  define EDI "%%edi"
-#endif
-
+#if idx64 && !idx64_32
 /*
 =================
-VM_Compile
+opStack register cache
+
+Inside a basic block, the operands pushed by OP_CONST and OP_LOCAL and the
+results of the integer operations consuming them are kept at compile time
+instead of being written to the opStack, with loaded and computed values
+living in r10d - r15d.  Anything the cache does not translate, every jump
+label, call and branch first flushes it, so the opStack layout seen at
+any entry point is the same as with the plain translation.
 =================
 */
-void VM_Compile( vm_t *vm, vmHeader_t *header )
+
+typedef enum
 {
-	int op;
-	int maxLength;
-	int v;
-	int i;
-	int callProcOfsSyscall, callProcOfs, callDoSyscallOfs;
+  OPSTACK_CONST,
+  OPSTACK_LOCAL,
+  OPSTACK_REG
+} opStackKind_t;
 
-	jusedSize = header->instructionCount + 2;
+typedef struct
+{
+	opStackKind_t kind;
+	int           value; // constant, programStack offset or register number
+} opStackItem_t;
 
-	// allocate a very large temp buffer, we will shrink it later
-	maxLength = header->codeLength * 8 + 64;
-	buf = (byte*) Z_Malloc( maxLength );
-	jused = (byte*) Z_Malloc( jusedSize );
-	code = (byte*) Z_Malloc( header->codeLength + 32 );
+#define OPSTACK_CACHE_SIZE 8
 
-	Com_Memset( jused, 0, jusedSize );
-	Com_Memset( buf, 0, maxLength );
+static  opStackItem_t opStackCache[ OPSTACK_CACHE_SIZE ];
+static  int opStackDepth;
+static  int opStackRegs;
 
-	// copy code in larger buffer and put some zeros at the end
-	// so we can safely look ahead for a few instructions in it
-	// without a chance to get false-positive because of some garbage bytes
-	Com_Memset( code, 0, header->codeLength + 32 );
-	Com_Memcpy( code, ( byte * ) header + header->codeOffset, header->codeLength );
+static int OpStackAllocReg( void )
+{
+	int reg;
 
-	// ensure that the optimisation pass knows about all the jump
-	// table targets
-	for ( i = 0; i < vm->numJumpTableTargets; i++ )
+	for ( reg = 10; reg < 16; reg++ )
 	{
-		jused[ * ( int * )( vm->jumpTableTargets + ( i * sizeof( int ) ) ) ] = 1;
+		if ( !( opStackRegs & ( 1 << reg ) ) )
+		{
+			opStackRegs |= 1 << reg;
+			return reg;
+		}
 	}
 
-	// Start buffer with x86-VM specific procedures
-	compiledOfs = 0;
+	return -1;
+}
 
-	callDoSyscallOfs = compiledOfs;
-	callProcOfs = EmitCallDoSyscall( vm );
-	callProcOfsSyscall = EmitCallProcedure( vm, callDoSyscallOfs );
-	vm->entryOfs = compiledOfs;
+static int OpStackFreeRegs( void )
+{
+	int reg, count = 0;
 
-	for ( pass = 0; pass < 3; pass++ )
+	for ( reg = 10; reg < 16; reg++ )
 	{
-		oc0 = -23423;
-		oc1 = -234354;
-		pop0 = -43435;
-		pop1 = -545455;
-
-		// translate all instructions
-		pc = 0;
-		instruction = 0;
-		//code = (byte *)header + header->codeOffset;
-		compiledOfs = vm->entryOfs;
-
-		LastCommand = LAST_COMMAND_NONE;
-
-		while ( instruction < header->instructionCount )
+		if ( !( opStackRegs & ( 1 << reg ) ) )
 		{
-			if ( compiledOfs > maxLength - 16 )
-			{
-				VMFREE_BUFFERS();
-				Com_Error( ERR_DROP, "VM_CompileX86: maxLength exceeded" );
-			}
-
-			vm->instructionPointers[ instruction ] = compiledOfs;
+			count++;
+		}
+	}
 
-			if ( !vm->jumpTableTargets )
-			{
-				jlabel = 1;
-			}
-			else
-			{
-				jlabel = jused[ instruction ];
-			}
+	return count;
+}
 
-			instruction++;
+static void OpStackRelease( const opStackItem_t *item )
+{
+	if ( item->kind == OPSTACK_REG )
+	{
+		opStackRegs &= ~( 1 << item->value );
+	}
+}
 
-			if ( pc > header->codeLength )
-			{
-				VMFREE_BUFFERS();
-				Com_Error( ERR_DROP, "VM_CompileX86: pc > header->codeLength" );
-			}
+/*
+=================
+EmitRex
+REX prefix for 32-bit operations on r8d - r15d, omitted when not needed
+=================
+*/
 
-			op = code[ pc ];
-			pc++;
+static void EmitRex( int reg, int index, int base )
+{
+	int rex = 0;
 
-			switch ( op )
-			{
-				case 0:
-						break;
+	if ( reg & 8 )
+	{
+		rex |= 4;
+	}
 
-				case OP_BREAK:
-						EmitString( "CC" );  // int 3
-					break;
+	if ( index & 8 )
+	{
+		rex |= 2;
+	}
 
-				case OP_ENTER:
-						EmitString( "81 EE" );  // sub esi, 0x12345678
-					Emit4( Constant4() );
-					break;
+	if ( base & 8 )
+	{
+		rex |= 1;
+	}
 
-				case OP_CONST:
-						if ( ConstOptimize( vm, callProcOfsSyscall ) )
-						{
-							break;
-						}
+	if ( rex )
+	{
+		Emit1( 0x40 | rex );
+	}
+}
 
-					EmitPushStack( vm );
-					EmitString( "C7 04 9F" );  // mov dword ptr [edi + ebx * 4], 0x12345678
-					lastConst = Constant4();
+static void EmitOpcode( int opcode )
+{
+	if ( opcode > 0xFF )
+	{
+		Emit1( opcode >> 8 );  // 0F escape
+	}
 
-					Emit4( lastConst );
+	Emit1( opcode & 0xFF );
+}
 
-					if ( code[ pc ] == OP_JUMP )
-					{
-						JUSED( lastConst );
-					}
+/*
+=================
+EmitRegOp
+Emits "op rm, reg" in register direct form, reg holding the /digit of group opcodes
+=================
+*/
 
-					break;
+static void EmitRegOp( int opcode, int reg, int rm )
+{
+	EmitRex( reg, 0, rm );
+	EmitOpcode( opcode );
+	Emit1( 0xC0 | ( ( reg & 7 ) << 3 ) | ( rm & 7 ) );
+}
 
-				case OP_LOCAL:
+static void EmitRegImm( int digit, int rm, int v )
+{
+	if ( iss8( v ) )
+	{
+		EmitRegOp( 0x83, digit, rm );  // op rm, 0x7F
+		Emit1( v );
+	}
+	else
+	{
+		EmitRegOp( 0x81, digit, rm );  // op rm, 0x12345678
+		Emit4( v );
+	}
+}
+
+/*
+=================
+EmitDataOp
+Emits "op reg, [r9 + index]" for a masked address in eax or edx,
+or "op reg, [r9 + addr]" for a constant one when index is negative
+=================
+*/
+
+static void EmitDataOp( int opcode, int reg, int index, int addr )
+{
+	EmitRex( reg, 0, 9 );
+	EmitOpcode( opcode );
+
+	if ( index < 0 )
+	{
+		Emit1( 0x81 | ( ( reg & 7 ) << 3 ) );  // [r9 + 0x12345678]
+		Emit4( addr );
+	}
+	else
+	{
+		Emit1( 0x04 | ( ( reg & 7 ) << 3 ) );  // [r9 + index]
+		Emit1( ( index << 3 ) | 1 );
+	}
+}
+
+/*
+=================
+OpStackLoadReg
+Materializes a cached operand in the given register
+=================
+*/
+
+static void OpStackLoadReg( const opStackItem_t *item, int reg )
+{
+	switch ( item->kind )
+	{
+		case OPSTACK_CONST:
+			EmitRex( 0, 0, reg );
+			Emit1( 0xB8 + ( reg & 7 ) );  // mov reg, 0x12345678
+			Emit4( item->value );
+			break;
+
+		case OPSTACK_LOCAL:
+			EmitRex( reg, 0, 0 );
+			Emit1( 0x8D );  // lea reg, [esi + 0x12345678]
+			Emit1( 0x86 | ( ( reg & 7 ) << 3 ) );
+			Emit4( item->value );
+			break;
+
+		case OPSTACK_REG:
+			if ( item->value != reg )
+			{
+				EmitRegOp( 0x89, item->value, reg );  // mov reg, item
+			}
+
+			break;
+	}
+}
+
+/*
+=================
+OpStackAddress
+Returns the register holding the masked address of a cached operand,
+or -1 with the masked constant address in addr
+=================
+*/
+
+static int OpStackAddress( const opStackItem_t *item, int mask, int *addr )
+{
+	if ( item->kind == OPSTACK_CONST )
+	{
+		*addr = item->value & mask;
+		return -1;
+	}
+
+	OpStackLoadReg( item, 0 );  // eax
+	MASK_REG( "E0", mask );  // and eax, 0x12345678
+	return 0;
+}
+
+/*
+=================
+OpStackFlush
+Writes the count bottom-most cached operands to the opStack
+=================
+*/
+
+static void OpStackFlush( int count )
+{
+	opStackItem_t *item;
+	int           i;
+
+	for ( i = 0; i < count; i++ )
+	{
+		item = &opStackCache[ i ];
+
+		STACK_PUSH( 1 );  // add bl, 1
+
+		switch ( item->kind )
+		{
+			case OPSTACK_CONST:
+				EmitString( "C7 04 9F" );  // mov dword ptr [edi + ebx * 4], 0x12345678
+				Emit4( item->value );
+				break;
+
+			case OPSTACK_LOCAL:
+				EmitString( "8D 86" );  // lea eax, [0x12345678 + esi]
+				Emit4( item->value );
+				EmitCommand( LAST_COMMAND_MOV_STACK_EAX );  // mov dword ptr [edi + ebx * 4], eax
+				break;
+
+			case OPSTACK_REG:
+				EmitRex( item->value, 0, 0 );
+				Emit1( 0x89 );  // mov dword ptr [edi + ebx * 4], reg
+				Emit1( 0x04 | ( ( item->value & 7 ) << 3 ) );
+				Emit1( 0x9F );
+				OpStackRelease( item );
+				break;
+		}
+	}
+
+	opStackDepth -= count;
+	memmove( opStackCache, opStackCache + count, opStackDepth * sizeof( opStackCache[ 0 ] ) );
+}
+
+/*
+=================
+OpStackPull
+Makes sure the top count operands are cached, popping the missing ones
+off the opStack into registers
+=================
+*/
+
+static qboolean OpStackPull( int count )
+{
+	int missing = count - opStackDepth;
+	int i, reg;
+
+	if ( missing <= 0 )
+	{
+		return qtrue;
+	}
+
+	// nothing to gain over the plain translation
+	if ( !opStackDepth || opStackDepth + missing > OPSTACK_CACHE_SIZE || OpStackFreeRegs() < missing )
+	{
+		return qfalse;
+	}
+
+	memmove( opStackCache + missing, opStackCache, opStackDepth * sizeof( opStackCache[ 0 ] ) );
+	opStackDepth += missing;
+
+	for ( i = missing - 1; i >= 0; i-- )
+	{
+		reg = OpStackAllocReg();
+		EmitRex( reg, 0, 0 );
+		Emit1( 0x8B );  // mov reg, dword ptr [edi + ebx * 4]
+		Emit1( 0x04 | ( ( reg & 7 ) << 3 ) );
+		Emit1( 0x9F );
+		STACK_POP( 1 );  // sub bl, 1
+
+		opStackCache[ i ].kind = OPSTACK_REG;
+		opStackCache[ i ].value = reg;
+	}
+
+	return qtrue;
+}
+
+/*
+=================
+OpStackToReg
+Turns a cached operand into a register one
+=================
+*/
+
+static qboolean OpStackToReg( opStackItem_t *item )
+{
+	int reg;
+
+	if ( item->kind == OPSTACK_REG )
+	{
+		return qtrue;
+	}
+
+	if ( ( reg = OpStackAllocReg() ) < 0 )
+	{
+		return qfalse;
+	}
+
+	OpStackLoadReg( item, reg );
+	item->kind = OPSTACK_REG;
+	item->value = reg;
+	return qtrue;
+}
+
+static qboolean OpStackConsumes( int op )
+{
+	switch ( op )
+	{
+		case OP_CONST:
+		case OP_LOCAL:
+		case OP_POP:
+		case OP_LOAD1:
+		case OP_LOAD2:
+		case OP_LOAD4:
+		case OP_STORE1:
+		case OP_STORE2:
+		case OP_STORE4:
+		case OP_ARG:
+		case OP_SEX8:
+		case OP_SEX16:
+		case OP_NEGI:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_DIVI:
+		case OP_DIVU:
+		case OP_MODI:
+		case OP_MODU:
+		case OP_MULI:
+		case OP_MULU:
+		case OP_BAND:
+		case OP_BOR:
+		case OP_BXOR:
+		case OP_BCOM:
+		case OP_LSH:
+		case OP_RSHI:
+		case OP_RSHU:
+			return qtrue;
+
+		default:
+			return op >= OP_EQ && op <= OP_GEU;
+	}
+}
+
+/*
+=================
+OpStackFold
+Constant folding of binary operations, returns qfalse if not possible
+=================
+*/
+
+static qboolean OpStackFold( int op, opStackItem_t *left, const opStackItem_t *right )
+{
+	int l = left->value, r = right->value;
+
+	if ( left->kind == OPSTACK_LOCAL && right->kind == OPSTACK_CONST && ( op == OP_ADD || op == OP_SUB ) )
+	{
+		left->value = op == OP_ADD ? l + r : l - r;
+		return qtrue;
+	}
+
+	if ( left->kind == OPSTACK_CONST && right->kind == OPSTACK_LOCAL && op == OP_ADD )
+	{
+		left->kind = OPSTACK_LOCAL;
+		left->value = l + r;
+		return qtrue;
+	}
+
+	if ( left->kind != OPSTACK_CONST || right->kind != OPSTACK_CONST )
+	{
+		return qfalse;
+	}
+
+	switch ( op )
+	{
+		case OP_ADD:  l = ( unsigned ) l + r; break;
+		case OP_SUB:  l = ( unsigned ) l - r; break;
+		case OP_MULI:
+		case OP_MULU: l = ( unsigned ) l * r; break;
+		case OP_BAND: l &= r; break;
+		case OP_BOR:  l |= r; break;
+		case OP_BXOR: l ^= r; break;
+		case OP_LSH:  l = ( unsigned ) l << ( r & 31 ); break;
+		case OP_RSHI: l >>= ( r & 31 ); break;
+		case OP_RSHU: l = ( unsigned ) l >> ( r & 31 ); break;
+		default:      return qfalse;
+	}
+
+	left->value = l;
+	return qtrue;
+}
+
+/*
+=================
+OpStackTranslate
+Translates op using the opStack cache, returns qfalse if the plain translation
+has to be used after flushing the cache
+=================
+*/
+
+static qboolean OpStackTranslate( vm_t *vm, int op )
+{
+	opStackItem_t *left, *right;
+	int           nextOp, reg, src, index, addr = 0, v;
+
+	switch ( op )
+	{
+		case OP_CONST:
+		case OP_LOCAL:
+			// never carry the cache into a jump label
+			if ( jused[ instruction ] || opStackDepth == OPSTACK_CACHE_SIZE )
+			{
+				return qfalse;
+			}
+
+			nextOp = code[ pc + 4 ];
+
+			if ( !OpStackConsumes( nextOp ) )
+			{
+				return qfalse;
+			}
+
+			// ConstOptimize does as well on a single constant operand
+			if ( op == OP_CONST && !opStackDepth && nextOp != OP_CONST && nextOp != OP_LOCAL &&
+			     nextOp != OP_LOAD1 && nextOp != OP_LOAD2 && nextOp != OP_LOAD4 )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth++ ];
+			left->kind = op == OP_CONST ? OPSTACK_CONST : OPSTACK_LOCAL;
+			left->value = Constant4();
+			return qtrue;
+
+		case OP_POP:
+			if ( !opStackDepth )
+			{
+				return qfalse;
+			}
+
+			OpStackRelease( &opStackCache[ --opStackDepth ] );
+			return qtrue;
+
+		case OP_LOAD1:
+		case OP_LOAD2:
+		case OP_LOAD4:
+			if ( !opStackDepth )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth - 1 ];
+
+			if ( left->kind == OPSTACK_REG )
+			{
+				reg = left->value;
+			}
+			else if ( ( reg = OpStackAllocReg() ) < 0 )
+			{
+				return qfalse;
+			}
+
+			index = OpStackAddress( left, vm->dataMask, &addr );
+
+			if ( op == OP_LOAD4 )
+			{
+				EmitDataOp( 0x8B, reg, index, addr );  // mov reg, dword ptr [r9 + eax]
+			}
+			else if ( op == OP_LOAD2 )
+			{
+				EmitDataOp( 0x0FB7, reg, index, addr );  // movzx reg, word ptr [r9 + eax]
+			}
+			else
+			{
+				EmitDataOp( 0x0FB6, reg, index, addr );  // movzx reg, byte ptr [r9 + eax]
+			}
+
+			left->kind = OPSTACK_REG;
+			left->value = reg;
+			return qtrue;
+
+		case OP_STORE1:
+		case OP_STORE2:
+		case OP_STORE4:
+			if ( !OpStackPull( 2 ) )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth - 2 ];
+			right = &opStackCache[ opStackDepth - 1 ];
+			src = right->value;
+
+			if ( right->kind == OPSTACK_LOCAL )
+			{
+				OpStackLoadReg( right, 2 );  // edx
+				src = 2;
+			}
+
+			if ( op == OP_STORE4 )
+			{
+				index = OpStackAddress( left, vm->dataMask & ~3, &addr );
+			}
+			else if ( op == OP_STORE2 )
+			{
+				index = OpStackAddress( left, vm->dataMask & ~1, &addr );
+				Emit1( 0x66 );
+			}
+			else
+			{
+				index = OpStackAddress( left, vm->dataMask, &addr );
+			}
+
+			if ( right->kind == OPSTACK_CONST )
+			{
+				EmitDataOp( op == OP_STORE1 ? 0xC6 : 0xC7, 0, index, addr );  // mov [r9 + eax], 0x12345678
+
+				if ( op == OP_STORE4 )
+				{
+					Emit4( right->value );
+				}
+				else if ( op == OP_STORE2 )
+				{
+					Emit2( right->value );
+				}
+				else
+				{
+					Emit1( right->value );
+				}
+			}
+			else
+			{
+				EmitDataOp( op == OP_STORE1 ? 0x88 : 0x89, src, index, addr );  // mov [r9 + eax], src
+			}
+
+			OpStackRelease( left );
+			OpStackRelease( right );
+			opStackDepth -= 2;
+			return qtrue;
+
+		case OP_ARG:
+			if ( !opStackDepth )
+			{
+				return qfalse;
+			}
+
+			right = &opStackCache[ opStackDepth - 1 ];
+			src = right->value;
+
+			if ( right->kind == OPSTACK_LOCAL )
+			{
+				OpStackLoadReg( right, 0 );  // eax
+				src = 0;
+			}
+
+			EmitString( "8D 96" );  // lea edx, [0x12345678 + esi]
+			Emit4( Constant1() & 0xFF );
+			MASK_REG( "E2", vm->dataMask );  // and edx, 0x12345678
+
+			if ( right->kind == OPSTACK_CONST )
+			{
+				EmitDataOp( 0xC7, 0, 2, 0 );  // mov dword ptr [r9 + edx], 0x12345678
+				Emit4( right->value );
+			}
+			else
+			{
+				EmitDataOp( 0x89, src, 2, 0 );  // mov dword ptr [r9 + edx], src
+			}
+
+			OpStackRelease( right );
+			opStackDepth--;
+			return qtrue;
+
+		case OP_SEX8:
+		case OP_SEX16:
+		case OP_NEGI:
+		case OP_BCOM:
+			if ( !opStackDepth )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth - 1 ];
+
+			if ( left->kind == OPSTACK_CONST )
+			{
+				v = left->value;
+				left->value = op == OP_SEX8 ? ( signed char ) v : op == OP_SEX16 ? ( short ) v : op == OP_NEGI ? -( unsigned ) v : ~v;
+				return qtrue;
+			}
+
+			if ( !OpStackToReg( left ) )
+			{
+				return qfalse;
+			}
+
+			reg = left->value;
+
+			switch ( op )
+			{
+				case OP_SEX8:
+					EmitRegOp( 0x0FBE, reg, reg );  // movsx reg, reg8
+					break;
+
+				case OP_SEX16:
+					EmitRegOp( 0x0FBF, reg, reg );  // movsx reg, reg16
+					break;
+
+				case OP_NEGI:
+					EmitRegOp( 0xF7, 3, reg );  // neg reg
+					break;
+
+				default:
+					EmitRegOp( 0xF7, 2, reg );  // not reg
+					break;
+			}
+
+			return qtrue;
+
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MULI:
+		case OP_MULU:
+		case OP_BAND:
+		case OP_BOR:
+		case OP_BXOR:
+		case OP_LSH:
+		case OP_RSHI:
+		case OP_RSHU:
+			if ( !OpStackPull( 2 ) )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth - 2 ];
+			right = &opStackCache[ opStackDepth - 1 ];
+
+			if ( OpStackFold( op, left, right ) )
+			{
+				opStackDepth--;
+				return qtrue;
+			}
+
+			if ( !OpStackToReg( left ) )
+			{
+				return qfalse;
+			}
+
+			reg = left->value;
+
+			if ( right->kind == OPSTACK_CONST )
+			{
+				v = right->value;
+
+				switch ( op )
+				{
+					case OP_ADD:  EmitRegImm( 0, reg, v ); break;  // add reg, v
+					case OP_SUB:  EmitRegImm( 5, reg, v ); break;  // sub reg, v
+					case OP_BAND: EmitRegImm( 4, reg, v ); break;  // and reg, v
+					case OP_BOR:  EmitRegImm( 1, reg, v ); break;  // or reg, v
+					case OP_BXOR: EmitRegImm( 6, reg, v ); break;  // xor reg, v
+
+					case OP_MULI:
+					case OP_MULU:
+						EmitRegOp( 0x69, reg, reg );  // imul reg, reg, 0x12345678
+						Emit4( v );
+						break;
+
+					default:
+						EmitRegOp( 0xC1, op == OP_LSH ? 4 : op == OP_RSHI ? 7 : 5, reg );  // shl/sar/shr reg, v
+						Emit1( v & 31 );
+						break;
+				}
+			}
+			else if ( op == OP_LSH || op == OP_RSHI || op == OP_RSHU )
+			{
+				OpStackLoadReg( right, 1 );  // mov ecx, right
+				EmitRegOp( 0xD3, op == OP_LSH ? 4 : op == OP_RSHI ? 7 : 5, reg );  // shl/sar/shr reg, cl
+			}
+			else
+			{
+				src = right->value;
+
+				if ( right->kind == OPSTACK_LOCAL )
+				{
+					OpStackLoadReg( right, 2 );  // edx
+					src = 2;
+				}
+
+				switch ( op )
+				{
+					case OP_ADD:  EmitRegOp( 0x01, src, reg ); break;  // add reg, src
+					case OP_SUB:  EmitRegOp( 0x29, src, reg ); break;  // sub reg, src
+					case OP_BAND: EmitRegOp( 0x21, src, reg ); break;  // and reg, src
+					case OP_BOR:  EmitRegOp( 0x09, src, reg ); break;  // or reg, src
+					case OP_BXOR: EmitRegOp( 0x31, src, reg ); break;  // xor reg, src
+					default:      EmitRegOp( 0x0FAF, reg, src ); break;  // imul reg, src
+				}
+			}
+
+			OpStackRelease( right );
+			opStackDepth--;
+			return qtrue;
+
+		case OP_DIVI:
+		case OP_DIVU:
+		case OP_MODI:
+		case OP_MODU:
+			if ( !OpStackPull( 2 ) )
+			{
+				return qfalse;
+			}
+
+			left = &opStackCache[ opStackDepth - 2 ];
+			right = &opStackCache[ opStackDepth - 1 ];
+
+			// the quotient or remainder goes to the first register operand
+			if ( left->kind == OPSTACK_REG )
+			{
+				reg = left->value;
+			}
+			else if ( right->kind == OPSTACK_REG )
+			{
+				reg = right->value;
+			}
+			else if ( ( reg = OpStackAllocReg() ) < 0 )
+			{
+				return qfalse;
+			}
+
+			src = right->value;
+
+			if ( right->kind != OPSTACK_REG )
+			{
+				OpStackLoadReg( right, 1 );  // ecx
+				src = 1;
+			}
+
+			OpStackLoadReg( left, 0 );  // eax
+
+			if ( op == OP_DIVI || op == OP_MODI )
+			{
+				EmitString( "99" );  // cdq
+				EmitRegOp( 0xF7, 7, src );  // idiv src
+			}
+			else
+			{
+				EmitString( "33 D2" );  // xor edx, edx
+				EmitRegOp( 0xF7, 6, src );  // div src
+			}
+
+			EmitRegOp( 0x89, ( op == OP_DIVI || op == OP_DIVU ) ? 0 : 2, reg );  // mov reg, eax/edx
+
+			if ( left->kind == OPSTACK_REG && left->value != reg )
+			{
+				OpStackRelease( left );
+			}
+
+			if ( right->kind == OPSTACK_REG && right->value != reg )
+			{
+				OpStackRelease( right );
+			}
+
+			opStackDepth--;
+			left->kind = OPSTACK_REG;
+			left->value = reg;
+			return qtrue;
+
+		default:
+			if ( op < OP_EQ || op > OP_GEU || !OpStackPull( 2 ) )
+			{
+				return qfalse;
+			}
+
+			// whatever lies below the compared values is expected on the opStack at the target
+			OpStackFlush( opStackDepth - 2 );
+
+			left = &opStackCache[ 0 ];
+			right = &opStackCache[ 1 ];
+			reg = left->value;
+
+			if ( left->kind != OPSTACK_REG )
+			{
+				OpStackLoadReg( left, 0 );  // eax
+				reg = 0;
+			}
+
+			if ( right->kind == OPSTACK_CONST )
+			{
+				EmitRegImm( 7, reg, right->value );  // cmp reg, v
+			}
+			else if ( right->kind == OPSTACK_LOCAL )
+			{
+				OpStackLoadReg( right, 2 );  // edx
+				EmitRegOp( 0x39, 2, reg );  // cmp reg, edx
+			}
+			else
+			{
+				EmitRegOp( 0x39, right->value, reg );  // cmp reg, right
+			}
+
+			OpStackRelease( left );
+			OpStackRelease( right );
+			opStackDepth = 0;
+
+			EmitBranchConditions( vm, op );
+			return qtrue;
+	}
+}
+
+/*
+=================
+FindJumpTargets
+Basic block analysis: marks the destinations of all constant jumps
+and branches up front, so that every compiler pass agrees on where
+the opStack cache has to be flushed
+=================
+*/
+
+static void FindJumpTargets( vm_t *vm, vmHeader_t *header )
+{
+	int i, op, target;
+
+	pc = 0;
+
+	for ( i = 0; i < header->instructionCount && pc < header->codeLength; i++ )
+	{
+		op = code[ pc++ ];
+
+		switch ( op )
+		{
+			case OP_CONST:
+				target = Constant4();
+
+				if ( code[ pc ] == OP_JUMP && target >= 0 && target < vm->instructionCount )
+				{
+					jused[ target ] = 1;
+				}
+
+				break;
+
+			case OP_ENTER:
+			case OP_LEAVE:
+			case OP_LOCAL:
+			case OP_BLOCK_COPY:
+				pc += 4;
+				break;
+
+			case OP_ARG:
+				pc += 1;
+				break;
+
+			default:
+				if ( op >= OP_EQ && op <= OP_GEF )
+				{
+					target = Constant4();
+
+					if ( target >= 0 && target < vm->instructionCount )
+					{
+						jused[ target ] = 1;
+					}
+				}
+
+				break;
+		}
+	}
+}
+#endif
+
+#if idx64 || idx64_32
+#  define EAX "%%rax"
+#  define EBX "%%rbx"
+#  define ESP "%%rsp"
+#  define EDI "%%rdi"
+#else
+#  define EAX "%%eax"
+#  define EBX "%%ebx"
+#  define ESP "%%esp"
+#  define EDI "%%edi"
+#endif
+
+/*
+=================
+VM_Compile
+=================
+*/
+void VM_Compile( vm_t *vm, vmHeader_t *header )
+{
+	int op;
+	int maxLength;
+	int v;
+	int i;
+	int callProcOfsSyscall, callProcOfs, callDoSyscallOfs;
+
+	jusedSize = header->instructionCount + 2;
+
+	// allocate a very large temp buffer, we will shrink it later
+	maxLength = header->codeLength * 8 + 64;
+	buf = (byte*) Z_Malloc( maxLength );
+	jused = (byte*) Z_Malloc( jusedSize );
+	code = (byte*) Z_Malloc( header->codeLength + 32 );
+
+	Com_Memset( jused, 0, jusedSize );
+	Com_Memset( buf, 0, maxLength );
+
+	// copy code in larger buffer and put some zeros at the end
+	// so we can safely look ahead for a few instructions in it
+	// without a chance to get false-positive because of some garbage bytes
+	Com_Memset( code, 0, header->codeLength + 32 );
+	Com_Memcpy( code, ( byte * ) header + header->codeOffset, header->codeLength );
+
+	// ensure that the optimisation pass knows about all the jump
+	// table targets
+	for ( i = 0; i < vm->numJumpTableTargets; i++ )
+	{
+		jused[ * ( int * )( vm->jumpTableTargets + ( i * sizeof( int ) ) ) ] = 1;
+	}
+
+#if idx64 && !idx64_32
+	if ( vm->jumpTableTargets )
+	{
+		FindJumpTargets( vm, header );
+	}
+#endif
+
+	// Start buffer with x86-VM specific procedures
+	compiledOfs = 0;
+
+	callDoSyscallOfs = compiledOfs;
+	callProcOfs = EmitCallDoSyscall( vm );
+	callProcOfsSyscall = EmitCallProcedure( vm, callDoSyscallOfs );
+	vm->entryOfs = compiledOfs;
+
+	for ( pass = 0; pass < 3; pass++ )
+	{
+		oc0 = -23423;
+		oc1 = -234354;
+		pop0 = -43435;
+		pop1 = -545455;
+
+		// translate all instructions
+		pc = 0;
+		instruction = 0;
+		//code = (byte *)header + header->codeOffset;
+		compiledOfs = vm->entryOfs;
+
+		LastCommand = LAST_COMMAND_NONE;
+#if idx64 && !idx64_32
+		opStackDepth = 0;
+		opStackRegs = 0;
+#endif
+
+		while ( instruction < header->instructionCount )
+		{
+			if ( compiledOfs > maxLength - 16 )
+			{
+				VMFREE_BUFFERS();
+				Com_Error( ERR_DROP, "VM_CompileX86: maxLength exceeded" );
+			}
+
+#if idx64 && !idx64_32
+			// jumps to this instruction expect the operands on the opStack
+			if ( opStackDepth && jused[ instruction ] )
+			{
+				OpStackFlush( opStackDepth );
+			}
+#endif
+
+			vm->instructionPointers[ instruction ] = compiledOfs;
+
+			if ( !vm->jumpTableTargets )
+			{
+				jlabel = 1;
+			}
+			else
+			{
+				jlabel = jused[ instruction ];
+			}
+
+			instruction++;
+
+			if ( pc > header->codeLength )
+			{
+				VMFREE_BUFFERS();
+				Com_Error( ERR_DROP, "VM_CompileX86: pc > header->codeLength" );
+			}
+
+			op = code[ pc ];
+			pc++;
+
+#if idx64 && !idx64_32
+			if ( vm->jumpTableTargets && OpStackTranslate( vm, op ) )
+			{
+				pop0 = pop1;
+				pop1 = OP_UNDEF;
+				continue;
+			}
+
+			OpStackFlush( opStackDepth );
+#endif
+
+			switch ( op )
+			{
+				case 0:
+						break;
+
+				case OP_BREAK:
+						EmitString( "CC" );  // int 3
+					break;
+
+				case OP_ENTER:
+						EmitString( "81 EE" );  // sub esi, 0x12345678
+					Emit4( Constant4() );
+					break;
+
+				case OP_CONST:
+						if ( ConstOptimize( vm, callProcOfsSyscall ) )
+						{
+							break;
+						}
+
+					EmitPushStack( vm );
+					EmitString( "C7 04 9F" );  // mov dword ptr [edi + ebx * 4], 0x12345678
+					lastConst = Constant4();
+
+					Emit4( lastConst );
+
+					if ( code[ pc ] == OP_JUMP )
+					{
+						JUSED( lastConst );
+					}
+
+					break;
+
+				case OP_LOCAL:
 						EmitPushStack( vm );
 					EmitString( "8D 86" );  // lea eax, [0x12345678 + esi]
 					oc0 = oc1;
@@ -1508,7 +2687,7 @@ void VM_Compile( vm_t *vm, vmHeader_t *header )
 						break;
 					}
 
-					if ( buf[ compiledOfs - 3 ] == 0x89 && buf[ compiledOfs - 2 ] == 0x04 && buf[ compiledOfs - 1 ] == 0x9F )
+					if ( LastCommand == LAST_COMMAND_MOV_STACK_EAX )
 					{
 						compiledOfs -= 3;
 						vm->instructionPointers[ instruction - 1 ] = compiledOfs;
@@ -1818,6 +2997,15 @@ void VM_Compile( vm_t *vm, vmHeader_t *header )
 					break;
 
 				case OP_BLOCK_COPY:
+#if idx64 && !idx64_32
+						if ( vm->inlineTraps )
+						{
+							EmitBlockCopy( vm, Constant4(), callDoSyscallOfs );
+							EmitCommand( LAST_COMMAND_SUB_BL_2 );  // sub bl, 2
+							break;
+						}
+
+#endif
 						EmitString( "B8" );  // mov eax, 0x12345678
 					Emit4( VM_BLOCK_COPY );
 					EmitString( "B9" );  // mov ecx, 0x12345678
@@ -33,6 +33,10 @@ qvmcall64 PROC
   push rsi							; push non-volatile registers to stack
   push rdi
   push rbx
+  push r12							; used by the opStack register cache
+  push r13
+  push r14
+  push r15
   ; need to save the pointer in rcx, so we can write back the programStack value to the caller
   push rcx
 
@@ -50,6 +54,10 @@ qvmcall64 PROC
   xor rax, rax
   mov al, bl						; return the opStack offset
 
+  pop r15
+  pop r14
+  pop r13
+  pop r12
   pop rbx
   pop rdi
   pop rsi
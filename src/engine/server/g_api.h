@@ -104,6 +104,26 @@ typedef struct
 	entityShared_t r; // shared by both the server and game module
 } sharedEntity_t;
 
+// a string published by the server in the shared memory region, the game
+// module reads it without a syscall as long as the generation doesn't change
+// during the copy (it is odd while the server is writing the slot)
+typedef struct
+{
+	std::atomic<uint32_t> generation;
+	uint32_t              length; // the string doesn't fit when >= sizeof( data )
+	char                  data[ MAX_STRING_CHARS ];
+} sharedString_t;
+
+// mirror of the configstrings, userinfos and serverinfo. it follows the
+// clients in the shared memory region and is only written by the server,
+// the serverinfo is refreshed once per server frame like CS_SERVERINFO
+typedef struct
+{
+	sharedString_t configstrings[ MAX_CONFIGSTRINGS ];
+	sharedString_t userinfos[ MAX_CLIENTS ];
+	sharedString_t serverinfo;
+} sharedStrings_t;
+
 // game-module-to-engine calls
 typedef enum gameImport_s
 {
@@ -147,10 +167,7 @@ typedef enum gameImport_s
   G_GET_TIME_STRING,
 
   G_PARSE_ADD_GLOBAL_DEFINE,
-  G_PARSE_LOAD_SOURCE,
-  G_PARSE_FREE_SOURCE,
-  G_PARSE_READ_TOKEN,
-  G_PARSE_SOURCE_FILE_AND_LINE,
+  G_PARSE_LOAD_TOKENS,
 
   BOT_ALLOCATE_CLIENT,
   BOT_FREE_CLIENT,
@@ -171,7 +188,7 @@ typedef enum gameImport_s
 } gameImport_t;
 
 // PrintMsg
-typedef IPC::Message<IPC::Id<VM::QVM, G_PRINT>, std::string> PrintMsg;
+typedef IPC::Message<IPC::Id<VM::QVM, G_PRINT>, Str::StringRef> PrintMsg;
 // ErrorMsg
 typedef IPC::Message<IPC::Id<VM::QVM, G_ERROR>, std::string> ErrorMsg;
 // LogMsg TODO
@@ -220,27 +237,27 @@ typedef IPC::SyncMessage<
 	IPC::Message<IPC::Id<VM::QVM, G_DROP_CLIENT>, int, std::string>
 > DropClientMsg;
 // SendServerCommandMsg
-typedef IPC::Message<IPC::Id<VM::QVM, G_SEND_SERVER_COMMAND>, int, std::string> SendServerCommandMsg;
+typedef IPC::Message<IPC::Id<VM::QVM, G_SEND_SERVER_COMMAND>, int, Str::StringRef> SendServerCommandMsg;
 // SetConfigStringMsg
-typedef IPC::Message<IPC::Id<VM::QVM, G_SET_CONFIGSTRING>, int, std::string> SetConfigStringMsg;
+typedef IPC::Message<IPC::Id<VM::QVM, G_SET_CONFIGSTRING>, int, Str::StringRef> SetConfigStringMsg;
 // GetConfigStringMsg
 typedef IPC::SyncMessage<
     IPC::Message<IPC::Id<VM::QVM, G_GET_CONFIGSTRING>, int, int>,
-    IPC::Reply<std::string>
+    IPC::Reply<Str::StringRef>
 > GetConfigStringMsg;
 // SetConfigStringRestrictionsMsg
 typedef IPC::Message<IPC::Id<VM::QVM, G_SET_CONFIGSTRING_RESTRICTIONS>> SetConfigStringRestrictionsMsg;
 // SetUserinfoMsg
-typedef IPC::Message<IPC::Id<VM::QVM, G_SET_USERINFO>, int, std::string> SetUserinfoMsg;
+typedef IPC::Message<IPC::Id<VM::QVM, G_SET_USERINFO>, int, Str::StringRef> SetUserinfoMsg;
 // GetUserinfoMsg
 typedef IPC::SyncMessage<
     IPC::Message<IPC::Id<VM::QVM, G_GET_USERINFO>, int, int>,
-    IPC::Reply<std::string>
+    IPC::Reply<Str::StringRef>
 > GetUserinfoMsg;
 // GetServerinfoMsg
 typedef IPC::SyncMessage<
     IPC::Message<IPC::Id<VM::QVM, G_GET_SERVERINFO>, int>,
-    IPC::Reply<std::string>
+    IPC::Reply<Str::StringRef>
 > GetServerinfoMsg;
 // GetUsercmdMsg
 typedef IPC::SyncMessage<
@@ -302,26 +319,15 @@ typedef IPC::SyncMessage<
     IPC::Message<IPC::Id<VM::QVM, G_PARSE_ADD_GLOBAL_DEFINE>, std::string>,
     IPC::Reply<int>
 > ParseAddGlobalDefineMsg;
-//ParseLoadSourceMsg
-typedef IPC::SyncMessage<
-    IPC::Message<IPC::Id<VM::QVM, G_PARSE_LOAD_SOURCE>, std::string>,
-    IPC::Reply<int>
-> ParseLoadSourceMsg;
-//ParseFreeSourceMsg
-typedef IPC::SyncMessage<
-    IPC::Message<IPC::Id<VM::QVM, G_PARSE_FREE_SOURCE>, int>,
-    IPC::Reply<int>
-> ParseFreeSourceMsg;
-//ParseReadTokenMsg
-typedef IPC::SyncMessage<
-    IPC::Message<IPC::Id<VM::QVM, G_PARSE_READ_TOKEN>, int>,
-    IPC::Reply<int, pc_token_t>
-> ParseReadTokenMsg;
-//ParseSourceFileAndLineMsg
-typedef IPC::SyncMessage<
-    IPC::Message<IPC::Id<VM::QVM, G_PARSE_SOURCE_FILE_AND_LINE>, int>,
-    IPC::Reply<int, std::string, int>
-> ParseSourceFileAndLineMsg;
+//ParseLoadTokensMsg
+// Preprocesses a whole source at once, the reply is whether it could be
+// loaded, its file name, the number of tokens and the tokens packed as:
+// int startLine, then for each token: int type, int subtype, int intvalue,
+// float floatvalue, int line (after the token was read), string
+typedef IPC::SyncMessage<
+    IPC::Message<IPC::Id<VM::QVM, G_PARSE_LOAD_TOKENS>, std::string>,
+    IPC::Reply<bool, std::string, int, std::vector<char>>
+> ParseLoadTokensMsg;
 
 // BotAllocateClientMsg
 typedef IPC::SyncMessage<
@@ -67,6 +67,7 @@ typedef struct svEntity_s
 {
 	entityState_t        baseline; // for delta compression of initial sighting
 	int                  snapshotCounter; // used to prevent double adding from portal views
+	int                  visCheckCounter; // used to prevent testing twice from the same viewpoint
 } svEntity_t;
 
 typedef enum
@@ -84,6 +85,7 @@ typedef struct
 	int           restartedServerId; // serverId before a map_restart
 	int           checksumFeed; // the feed key that we use to compute the pure checksum strings
 	int             snapshotCounter; // incremented for each snapshot built
+	int             visCheckCounter; // incremented for each viewpoint tested
 	int             timeResidual; // <= 1000 / sv_frame->value
 	int             nextFrameTime; // when time > nextFrameTime, process world
 	struct cmodel_s *models[ MAX_MODELS ];
@@ -102,6 +104,8 @@ typedef struct
 	playerState_t  *gameClients;
 	int            gameClientSize; // will be > sizeof(playerState_t) due to game private data
 
+	sharedStrings_t *gameStrings; // mirror of the configstrings and userinfos for the game
+
 	int            restartTime;
 	int            time;
 
@@ -157,6 +161,8 @@ typedef struct netchan_buffer_s
 	struct netchan_buffer_s *next;
 } netchan_buffer_t;
 
+struct downloadPak_t;
+
 typedef struct client_s
 {
 	clientState_t  state;
@@ -184,13 +190,13 @@ typedef struct client_s
 
 	// downloading
 	char          downloadName[ MAX_QPATH ]; // if not empty string, we are downloading
-	std::shared_ptr<FS::File> download; // file being downloaded (Using shared_ptr to work around MSVC failing at infering move constructors)
+	std::shared_ptr<const downloadPak_t> download; // pak being downloaded, shared with the other clients downloading it
 	int           downloadSize; // total bytes (can't use EOF because of paks)
 	int           downloadCount; // bytes sent
 	int           downloadClientBlock; // last block we sent to the client, awaiting ack
 	int           downloadCurrentBlock; // current block number
 	int           downloadXmitBlock; // last block we xmited
-	unsigned char *downloadBlocks[ MAX_DOWNLOAD_WINDOW ]; // the buffers for the download blocks
+	int           downloadBlockOffset[ MAX_DOWNLOAD_WINDOW ]; // where the blocks start in the pak
 	int           downloadBlockSize[ MAX_DOWNLOAD_WINDOW ];
 	qboolean      downloadEOF; // We have sent the EOF block
 	int           downloadSendTime; // time we last got an ack from the client
@@ -268,6 +274,8 @@ typedef struct
 	qboolean connected;
 } challenge_t;
 
+// rate limiting bucket, time is when it has drained: it may take another response
+// as long as that is less than a burst ahead of now
 typedef struct
 {
 	netadr_t adr;
@@ -275,8 +283,15 @@ typedef struct
 } receipt_t;
 
 // MAX_INFO_RECEIPTS is the maximum number of getstatus+getinfo responses that we send
-// in a two second time period.
-#define MAX_INFO_RECEIPTS 48
+// in a two second time period, MAX_INFO_RECEIPTS_PER_ADDRESS the maximum for a single
+// /24 IPv4 or /56 IPv6 network.
+#define MAX_INFO_RECEIPTS             48
+#define MAX_INFO_RECEIPTS_PER_ADDRESS 3
+#define INFO_RECEIPT_PERIOD           2000
+
+// the per address buckets are kept in a set associative table
+#define INFO_RECEIPT_SETS 256 // power of two
+#define INFO_RECEIPT_WAYS 4
 
 #define SERVER_PERFORMANCECOUNTER_FRAMES  600
 #define SERVER_PERFORMANCECOUNTER_SAMPLES 6
@@ -287,6 +302,7 @@ typedef struct
 	qboolean      initialized; // sv_init has completed
 
 	int           time; // will be strictly increasing across level changes
+	int           packetTime; // Sys_Milliseconds when the packet being handled arrived
 
 	int           snapFlagServerBit; // ^= SNAPFLAG_SERVERCOUNT every SV_SpawnServer()
 
@@ -296,7 +312,9 @@ typedef struct
 	entityState_t *snapshotEntities; // [numSnapshotEntities]
 	int           nextHeartbeatTime;
 	challenge_t   challenges[ MAX_CHALLENGES ]; // to prevent invalid IP addresses from connecting
-	receipt_t     infoReceipts[ MAX_INFO_RECEIPTS ];
+	receipt_t     infoReceipts[ INFO_RECEIPT_SETS * INFO_RECEIPT_WAYS ];
+	int           infoBudgetTime; // bucket for all the addresses together
+	int           downloadRateShare; // sv_dlRate share of each downloading client, 0 if unlimited
 
 	int       sampleTimes[ SERVER_PERFORMANCECOUNTER_SAMPLES ];
 	int       currentSampleIndex;
@@ -380,6 +398,7 @@ extern cvar_t *sv_showAverageBPS; // NERVE - SMF - net debugging
 
 // TTimo - autodl
 extern cvar_t *sv_dl_maxRate;
+extern cvar_t *sv_dlRate; // total download bandwidth shared between the clients
 
 // TTimo
 extern cvar_t *sv_wwwDownload; // general flag to enable/disable www download redirects
@@ -421,6 +440,8 @@ void       SV_MasterGameStat( const char *data );
 //bani - bugtraq 12534
 qboolean   SV_VerifyChallenge( const char *challenge );
 
+void       SV_InvalidateInfoCache( void );
+
 //
 // sv_init.c
 //
@@ -458,6 +479,7 @@ void SV_ExecuteClientCommand( client_t *cl, const char *s, qboolean clientOK, qb
 void SV_ClientThink( client_t *cl, usercmd_t *cmd );
 
 void SV_WriteDownloadToClient( client_t *cl, msg_t *msg );
+void SV_ScheduleDownloads( void );
 
 #ifdef USE_VOIP
 void SV_WriteVoipToClient( client_t *cl, msg_t *msg );
@@ -498,6 +520,9 @@ GameVM         *SV_CreateGameVM( void );
 void           SV_InitGameProgs(Str::StringRef mapname);
 void           SV_ShutdownGameProgs( void );
 void           SV_RestartGameProgs(Str::StringRef mapname);
+void           SV_MirrorConfigstring( int index );
+void           SV_MirrorUserinfo( int index );
+void           SV_MirrorServerinfo( void );
 qboolean       SV_inPVS( const vec3_t p1, const vec3_t p2 );
 qboolean       SV_GetTag( int clientNum, int tagFileNumber, const char *tagname, orientation_t *ort );
 int            SV_LoadTag( const char *mod_name );
@@ -104,6 +104,87 @@ static void SV_FieldInfo_f( void )
 	MSG_PrioritisePlayerStateFields();
 }
 
+/*
+================
+SV_BenchmarkDeltas_f
+
+Replays the entity deltas between the recent snapshots of the connected
+clients through the reference and current delta encoders
+================
+*/
+static void SV_BenchmarkDeltas_f( void )
+{
+	std::vector<entityState_t> from, to;
+	std::vector<qboolean>      force;
+	int                        i, j, iterations;
+
+	iterations = Cmd_Argc() > 1 ? atoi( Cmd_Argv( 1 ) ) : 100;
+
+	for ( i = 0; i < sv_maxclients->integer; i++ )
+	{
+		const client_t *cl = &svs.clients[ i ];
+
+		if ( cl->state != CS_ACTIVE )
+		{
+			continue;
+		}
+
+		// pair each frame still in the entity buffer with the one before it,
+		// the same way SV_EmitPacketEntities walks them
+		for ( j = 1; j < PACKET_BACKUP; j++ )
+		{
+			const clientSnapshot_t *oldframe = &cl->frames[ ( cl->netchan.outgoingSequence - j - 1 ) & PACKET_MASK ];
+			const clientSnapshot_t *frame = &cl->frames[ ( cl->netchan.outgoingSequence - j ) & PACKET_MASK ];
+			int                    oldindex = 0, newindex = 0;
+
+			if ( oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities )
+			{
+				break;
+			}
+
+			while ( newindex < frame->num_entities )
+			{
+				const entityState_t *newent = &svs.snapshotEntities[ ( frame->first_entity + newindex ) % svs.numSnapshotEntities ];
+				const entityState_t *oldent = nullptr;
+
+				while ( oldindex < oldframe->num_entities )
+				{
+					oldent = &svs.snapshotEntities[ ( oldframe->first_entity + oldindex ) % svs.numSnapshotEntities ];
+
+					if ( oldent->number >= newent->number )
+					{
+						break;
+					}
+
+					oldindex++;
+				}
+
+				if ( oldindex < oldframe->num_entities && oldent->number == newent->number )
+				{
+					from.push_back( *oldent );
+					force.push_back( qfalse );
+				}
+				else
+				{
+					from.push_back( sv.svEntities[ newent->number ].baseline );
+					force.push_back( qtrue );
+				}
+
+				to.push_back( *newent );
+				newindex++;
+			}
+		}
+	}
+
+	if ( from.empty() )
+	{
+		Com_Printf( "No snapshots to replay, clients need to be connected\n" );
+		return;
+	}
+
+	MSG_BenchmarkDeltaEntities( from.data(), to.data(), force.data(), from.size(), iterations );
+}
+
 /*
 ================
 SV_MapRestart_f
@@ -381,6 +462,28 @@ static void SV_Systeminfo_f( void )
 	Info_Print( Cvar_InfoString( CVAR_SYSTEMINFO, qfalse ) );
 }
 
+/*
+===========
+SV_IPCStats_f
+
+Show how the messages from the game VM were received
+===========
+*/
+static void SV_IPCStats_f( void )
+{
+	if ( !gvm || !gvm->IsActive() )
+	{
+		Com_Printf( "Game VM is not running.\n" );
+		return;
+	}
+
+	const IPC::ChannelStats& stats = gvm->GetChannelStats();
+
+	Com_Printf( "messages: %llu, receives: %llu\n", ( unsigned long long ) stats.messages, ( unsigned long long ) stats.receives );
+	Com_Printf( "batches: %llu, batched messages: %llu (%.1f per batch)\n", ( unsigned long long ) stats.batches,
+	            ( unsigned long long ) stats.batchedMessages, stats.batches ? ( double ) stats.batchedMessages / stats.batches : 0.0 );
+}
+
 /*
 =================
 SV_KillServer
@@ -401,8 +504,10 @@ void SV_AddOperatorCommands( void )
 	if ( com_sv_running->integer )
 	{
 		// These commands should only be available while the server is running.
+		Cmd_AddCommand( "benchdeltas", SV_BenchmarkDeltas_f );
 		Cmd_AddCommand( "fieldinfo",   SV_FieldInfo_f );
 		Cmd_AddCommand( "heartbeat",   SV_Heartbeat_f );
+		Cmd_AddCommand( "ipcstats",    SV_IPCStats_f );
 		Cmd_AddCommand( "killserver",  SV_KillServer_f );
 		Cmd_AddCommand( "map_restart", SV_MapRestart_f );
 		Cmd_AddCommand( "serverinfo",  SV_Serverinfo_f );
@@ -418,9 +523,11 @@ SV_RemoveOperatorCommands
 */
 void SV_RemoveOperatorCommands( void )
 {
+	Cmd_RemoveCommand( "benchdeltas" );
 	Cmd_RemoveCommand( "dumpuser" );
 	Cmd_RemoveCommand( "fieldinfo" );
 	Cmd_RemoveCommand( "heartbeat" );
+	Cmd_RemoveCommand( "ipcstats" );
 	Cmd_RemoveCommand( "killserver" );
 	Cmd_RemoveCommand( "map_restart" );
 	Cmd_RemoveCommand( "say" );
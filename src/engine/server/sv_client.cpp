@@ -405,6 +405,7 @@ gotnewcl:
 	Info_RemoveKey( userinfo, "pubkey", qfalse );
 	// save the userinfo
 	Q_strncpyz( newcl->userinfo, userinfo, sizeof( newcl->userinfo ) );
+	SV_MirrorUserinfo( clientNum );
 
 	// get the game a chance to reject this connection or modify the userinfo
 	denied = gvm->GameClientConnect( reason, sizeof( reason ), clientNum, qtrue, qfalse );  // firstTime = qtrue
@@ -675,34 +676,76 @@ CLIENT COMMAND EXECUTION
 ============================================================
 */
 
+/*
+ * A pak being served to clients. It is opened once and shared by every client
+ * downloading it, the clients only keep offsets into it and each block is read
+ * at its offset as it is sent. It isn't mapped: a pak replaced or truncated
+ * while it is served would fault the server, a read only comes up short.
+ */
+struct downloadPak_t
+{
+	FS::File file;
+	int      size;
+};
+
+static std::unordered_map<std::string, std::weak_ptr<const downloadPak_t>> downloadPaks;
+
 /*
 ==================
-SV_CloseDownload
+SV_OpenDownloadPak
 
-clear/free any download vars
+Returns the shared view of a pak, opening it if no client is downloading it yet
 ==================
 */
-static void SV_CloseDownload( client_t *cl )
+static std::shared_ptr<const downloadPak_t> SV_OpenDownloadPak( const std::string& path )
 {
-	int i;
+	auto it = downloadPaks.find( path );
 
-	// EOF
-	if ( cl->download )
+	if ( it != downloadPaks.end() )
 	{
-		cl->download = nullptr;
+		std::shared_ptr<const downloadPak_t> pak = it->second.lock();
+
+		if ( pak )
+		{
+			return pak;
+		}
 	}
 
-	*cl->downloadName = 0;
+	auto pak = std::make_shared<downloadPak_t>();
+
+	pak->file = FS::RawPath::OpenRead( path );
+	pak->size = pak->file.Length();
 
-	// Free the temporary buffer space
-	for ( i = 0; i < MAX_DOWNLOAD_WINDOW; i++ )
+	// forget the paks nobody is downloading anymore
+	for ( it = downloadPaks.begin(); it != downloadPaks.end(); )
 	{
-		if ( cl->downloadBlocks[ i ] )
+		if ( it->second.expired() )
 		{
-			Z_Free( cl->downloadBlocks[ i ] );
-			cl->downloadBlocks[ i ] = NULL;
+			it = downloadPaks.erase( it );
+		}
+		else
+		{
+			++it;
 		}
 	}
+
+	downloadPaks[ path ] = pak;
+	return pak;
+}
+
+/*
+==================
+SV_CloseDownload
+
+clear/free any download vars
+==================
+*/
+static void SV_CloseDownload( client_t *cl )
+{
+	// EOF, the pak is freed with its last download
+	cl->download = nullptr;
+
+	*cl->downloadName = 0;
 }
 
 /*
@@ -917,6 +960,100 @@ static qboolean SV_CheckFallbackURL( client_t *cl, const char* pakName, msg_t *m
 	return qtrue;
 }
 
+/*
+==================
+SV_DownloadRate
+
+The rate a client downloads at, capped by sv_dl_maxRate and by its share of sv_dlRate
+==================
+*/
+static int SV_DownloadRate( const client_t *cl )
+{
+	int rate = cl->rate;
+
+	// show_bug.cgi?id=509
+	// for autodownload, we use a separate max rate value
+	// 0 is no limitation, as in SV_RateMsec
+	if ( sv_dl_maxRate->integer && sv_dl_maxRate->integer < rate )
+	{
+		rate = sv_dl_maxRate->integer;
+	}
+
+	if ( svs.downloadRateShare && svs.downloadRateShare < rate )
+	{
+		rate = svs.downloadRateShare;
+	}
+
+	return rate;
+}
+
+/*
+==================
+SV_ScheduleDownloads
+
+Splits sv_dlRate fairly between the downloading clients: the clients
+which can't use their whole share keep their own rate and the remaining
+bandwidth is split evenly between the others. The shares never add up
+to more than sv_dlRate, taken as 1000 when it is set lower.
+==================
+*/
+void SV_ScheduleDownloads( void )
+{
+	int      demand[ MAX_CLIENTS ];
+	int      count = 0;
+	int      budget;
+	int      i;
+	client_t *cl;
+
+	svs.downloadRateShare = 0;
+
+	if ( sv_dlRate->integer <= 0 )
+	{
+		return;
+	}
+
+	for ( i = 0, cl = svs.clients; i < sv_maxclients->integer; i++, cl++ )
+	{
+		if ( cl->state < CS_CONNECTED || !cl->download || cl->bWWWing )
+		{
+			continue;
+		}
+
+		demand[ count ] = cl->rate;
+
+		if ( sv_dl_maxRate->integer && sv_dl_maxRate->integer < demand[ count ] )
+		{
+			demand[ count ] = sv_dl_maxRate->integer;
+		}
+
+		count++;
+	}
+
+	if ( !count )
+	{
+		return;
+	}
+
+	std::sort( demand, demand + count );
+
+	// low watermark for sv_dlRate, so that every share is at least a byte
+	// per second (a share of 0 would be no limitation)
+	budget = std::max( sv_dlRate->integer, 1000 );
+
+	for ( i = 0; i < count; i++ )
+	{
+		if ( demand[ i ] * ( count - i ) > budget )
+		{
+			// not 0: what is left is at least a byte per second for each
+			// client, the ones before kept their demand for every other
+			svs.downloadRateShare = budget / ( count - i );
+			return;
+		}
+
+		budget -= demand[ i ];
+	}
+}
+
 /*
 ==================
 SV_WriteDownloadToClient
@@ -931,6 +1068,7 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 	int      rate;
 	int      blockspersnap;
 	char     errorMessage[ 1024 ];
+	byte     block[ MAX_DOWNLOAD_BLKSIZE ];
 	int      download_flag;
 
 	qboolean bTellRate = qfalse; // verbosity
@@ -1066,8 +1204,8 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 			const FS::PakInfo* pak = checksum ? FS::FindPak(name, version) : FS::FindPak(name, version, *checksum);
 			if (pak) {
 				try {
-					cl->download = std::make_shared<FS::File>(FS::RawPath::OpenRead(pak->path));
-					cl->downloadSize = cl->download->Length();
+					cl->download = SV_OpenDownloadPak(pak->path);
+					cl->downloadSize = cl->download->size;
 				} catch (std::system_error&) {
 					success = false;
 				}
@@ -1093,23 +1231,14 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 		bTellRate = qtrue;
 	}
 
-	// Perform any reads that we need to
+	// Queue the blocks of the window
 	while ( cl->downloadCurrentBlock - cl->downloadClientBlock < MAX_DOWNLOAD_WINDOW && cl->downloadSize != cl->downloadCount )
 	{
 		curindex = ( cl->downloadCurrentBlock % MAX_DOWNLOAD_WINDOW );
 
-		if ( !cl->downloadBlocks[ curindex ] )
-		{
-			cl->downloadBlocks[ curindex ] = ( byte* ) Z_Malloc( MAX_DOWNLOAD_BLKSIZE );
-		}
-
-		try {
-			cl->downloadBlockSize[ curindex ] = cl->download->Read(cl->downloadBlocks[ curindex ], MAX_DOWNLOAD_BLKSIZE);
-		} catch (std::system_error&) {
-			// EOF right now
-			cl->downloadCount = cl->downloadSize;
-			break;
-		}
+		// the blocks are only offsets in the shared pak
+		cl->downloadBlockOffset[ curindex ] = cl->downloadCount;
+		cl->downloadBlockSize[ curindex ] = std::min( cl->downloadSize - cl->downloadCount, MAX_DOWNLOAD_BLKSIZE );
 
 		cl->downloadCount += cl->downloadBlockSize[ curindex ];
 
@@ -1131,23 +1260,19 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 	// client snapMsec and rate
 
 	// based on the rate, how many bytes can we fit in the snapMsec time of the client
-	rate = cl->rate;
-
-	// show_bug.cgi?id=509
-	// for autodownload, we use a separate max rate value
 	// we do this everytime because the client might change its rate during the download
-	if ( sv_dl_maxRate->integer < rate )
-	{
-		rate = sv_dl_maxRate->integer;
+	rate = SV_DownloadRate( cl );
 
-		if ( bTellRate )
+	if ( bTellRate )
+	{
+		if ( rate < cl->rate )
 		{
-			Com_Printf( "'%s' downloading at sv_dl_maxrate (%d)\n", cl->name, sv_dl_maxRate->integer );
+			Com_Printf( "'%s' downloading at sv_dl_maxrate or its sv_dlRate share (%d)\n", cl->name, rate );
+		}
+		else
+		{
+			Com_Printf( "'%s' downloading at rate %d\n", cl->name, rate );
 		}
-	}
-	else if ( bTellRate )
-	{
-		Com_Printf( "'%s' downloading at rate %d\n", cl->name, rate );
 	}
 
 	if ( !rate )
@@ -1193,6 +1318,29 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 		// Send current block
 		curindex = ( cl->downloadXmitBlock % MAX_DOWNLOAD_WINDOW );
 
+		// read it where it is in the pak, before anything is written
+		if ( cl->downloadBlockSize[ curindex ] )
+		{
+			std::error_code err;
+			size_t          read = 0;
+
+			cl->download->file.SeekSet( cl->downloadBlockOffset[ curindex ], err );
+
+			if ( !err )
+			{
+				read = cl->download->file.Read( block, cl->downloadBlockSize[ curindex ], err );
+			}
+
+			if ( err || read != ( size_t ) cl->downloadBlockSize[ curindex ] )
+			{
+				Com_Printf( "clientDownload: %d : \"%s\" could not be read anymore\n", ( int )( cl - svs.clients ), cl->downloadName );
+				SV_CloseDownload( cl );
+				SV_BadDownload( cl, msg );
+				MSG_WriteString( msg, "The file being downloaded was changed on the server.\n" );
+				return;
+			}
+		}
+
 		MSG_WriteByte( msg, svc_download );
 		MSG_WriteShort( msg, cl->downloadXmitBlock );
 
@@ -1207,7 +1355,7 @@ void SV_WriteDownloadToClient( client_t *cl, msg_t *msg )
 		// Write the block
 		if ( cl->downloadBlockSize[ curindex ] )
 		{
-			MSG_WriteData( msg, cl->downloadBlocks[ curindex ], cl->downloadBlockSize[ curindex ] );
+			MSG_WriteData( msg, block, cl->downloadBlockSize[ curindex ] );
 		}
 
 		Com_DPrintf( "clientDownload: %d: writing block %d\n", ( int )( cl - svs.clients ), cl->downloadXmitBlock );
@@ -1247,6 +1395,7 @@ void SV_UserinfoChanged( client_t *cl )
 
 	// name for C code
 	Q_strncpyz( cl->name, Info_ValueForKey( cl->userinfo, "name" ), sizeof( cl->name ) );
+	SV_InvalidateInfoCache();
 
 	// rate command
 
@@ -1332,6 +1481,8 @@ void SV_UserinfoChanged( client_t *cl )
 		Info_SetValueForKey( cl->userinfo, "geoip", NULL, qfalse );
 #endif
 	}
+
+	SV_MirrorUserinfo( cl - svs.clients );
 }
 
 /*
@@ -1617,8 +1768,8 @@ static void SV_UserMove( client_t *cl, msg_t *msg, qboolean delta )
 		oldcmd = cmd;
 	}
 
-	// save time for ping calculation
-	cl->frames[ cl->messageAcknowledge & PACKET_MASK ].messageAcked = svs.time;
+	// save time for ping calculation, as the packet arrived rather than when the frame got to it
+	cl->frames[ cl->messageAcknowledge & PACKET_MASK ].messageAcked = svs.packetTime;
 
 	// if this is the first usercmd we have received
 	// this gamestate, put the client into the world
@@ -174,6 +174,53 @@ void SV_GetServerinfo( char *buffer, int bufferSize )
 	Q_strncpyz( buffer, Cvar_InfoString( CVAR_SERVERINFO, qfalse ), bufferSize );
 }
 
+/*
+===============
+SV_ParseLoadTokens
+
+Preprocesses a whole source and packs all its tokens so that the game
+doesn't need a round trip for each of them, see ParseLoadTokensMsg
+===============
+*/
+static void SV_ParseLoadTokens( const char *filename, bool &res, std::string &file, int &numTokens, std::vector<char> &tokens )
+{
+	char        sourceFile[ MAX_QPATH ];
+	int         line;
+	pc_token_t  token;
+	IPC::Writer writer;
+
+	res = false;
+	numTokens = 0;
+
+	int handle = Parse_LoadSourceHandle( filename );
+
+	if ( !handle )
+	{
+		return;
+	}
+
+	Parse_SourceFileAndLine( handle, sourceFile, &line );
+	writer.Write<int>( line );
+
+	while ( Parse_ReadTokenHandle( handle, &token ) )
+	{
+		Parse_SourceFileAndLine( handle, sourceFile, &line );
+		writer.Write<int>( token.type );
+		writer.Write<int>( token.subtype );
+		writer.Write<int>( token.intvalue );
+		writer.Write<float>( token.floatvalue );
+		writer.Write<int>( line );
+		writer.Write<Str::StringRef>( token.string );
+		numTokens++;
+	}
+
+	Parse_FreeSourceHandle( handle );
+
+	res = true;
+	file = sourceFile;
+	tokens = writer.GetData();
+}
+
 /*
 ===============
 SV_LocateGameData
@@ -196,6 +243,79 @@ void SV_LocateGameData( const IPC::SharedMemory& shmRegion, int numGEntities, in
 
 	sv.gameClients = reinterpret_cast<playerState_t*>(base + MAX_GENTITIES * sizeofGEntity_t);
 	sv.gameClientSize = sizeofGameClient;
+
+	// the string mirror follows the clients, publish everything we have so far
+	size_t stringsOffset = MAX_GENTITIES * sizeofGEntity_t + MAX_CLIENTS * sizeofGameClient;
+	if ( shmRegion.GetSize() < stringsOffset + sizeof( sharedStrings_t ) )
+		Com_Error( ERR_DROP, "SV_LocateGameData: Shared memory region too small" );
+	sv.gameStrings = reinterpret_cast<sharedStrings_t*>(base + stringsOffset);
+
+	for ( int i = 0; i < MAX_CONFIGSTRINGS; i++ )
+		SV_MirrorConfigstring( i );
+	for ( int i = 0; i < sv_maxclients->integer; i++ )
+		SV_MirrorUserinfo( i );
+	SV_MirrorServerinfo();
+}
+
+/*
+===============
+SV_WriteSharedString
+
+Seqlock style update, the generation is odd while the data is inconsistent
+===============
+*/
+static void SV_WriteSharedString( sharedString_t& slot, const char *val )
+{
+	// don't trust the current value, the game module can write to the region
+	uint32_t generation = slot.generation.load( std::memory_order_relaxed ) | 1;
+	slot.generation.store( generation, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	size_t len = strlen( val );
+	slot.length = len;
+	if ( len < sizeof( slot.data ) )
+		memcpy( slot.data, val, len + 1 );
+
+	slot.generation.store( generation + 1, std::memory_order_release );
+}
+
+/*
+===============
+SV_MirrorConfigstring
+===============
+*/
+void SV_MirrorConfigstring( int index )
+{
+	if ( !sv.gameStrings )
+		return;
+
+	SV_WriteSharedString( sv.gameStrings->configstrings[ index ], sv.configstrings[ index ] ? sv.configstrings[ index ] : "" );
+}
+
+/*
+===============
+SV_MirrorUserinfo
+===============
+*/
+void SV_MirrorUserinfo( int index )
+{
+	if ( !sv.gameStrings )
+		return;
+
+	SV_WriteSharedString( sv.gameStrings->userinfos[ index ], svs.clients[ index ].userinfo );
+}
+
+/*
+===============
+SV_MirrorServerinfo
+===============
+*/
+void SV_MirrorServerinfo( void )
+{
+	if ( !sv.gameStrings )
+		return;
+
+	SV_WriteSharedString( sv.gameStrings->serverinfo, Cvar_InfoString( CVAR_SERVERINFO, qfalse ) );
 }
 
 /*
@@ -495,6 +615,8 @@ bool GameVM::Start()
 
 GameVM::~GameVM()
 {
+	// the region is unmapped with us, even when the game didn't shut down cleanly
+	sv.gameStrings = nullptr;
     this->Free();
 }
 
@@ -513,7 +635,9 @@ void GameVM::GameShutdown(qboolean restart)
 	//TODO ignore errors
 	this->SendMsg<GameShutdownMsg>(restart);
 
-	// Release the shared memory region
+	// Release the shared memory region, the mirror must not be written until
+	// the next game locates its own
+	sv.gameStrings = nullptr;
 	this->shmRegion.Close();
 }
 
@@ -618,7 +742,7 @@ void GameVM::QVMSyscall(int index, IPC::Reader& reader, IPC::Channel& channel)
 {
 	switch (index) {
 	case G_PRINT:
-		IPC::HandleMsg<PrintMsg>(channel, std::move(reader), [this](std::string text) {
+		IPC::HandleMsg<PrintMsg>(channel, std::move(reader), [this](Str::StringRef text) {
 			Com_Printf("%s", text.c_str());
 		});
 		break;
@@ -714,23 +838,26 @@ void GameVM::QVMSyscall(int index, IPC::Reader& reader, IPC::Channel& channel)
 		break;
 
 	case G_SEND_SERVER_COMMAND:
-		IPC::HandleMsg<SendServerCommandMsg>(channel, std::move(reader), [this](int clientNum, std::string text) {
+		IPC::HandleMsg<SendServerCommandMsg>(channel, std::move(reader), [this](int clientNum, Str::StringRef text) {
 			SV_GameSendServerCommand(clientNum, text.c_str());
 		});
 		break;
 
 	case G_SET_CONFIGSTRING:
-		IPC::HandleMsg<SetConfigStringMsg>(channel, std::move(reader), [this](int index, std::string val) {
+		IPC::HandleMsg<SetConfigStringMsg>(channel, std::move(reader), [this](int index, Str::StringRef val) {
 			SV_SetConfigstring(index, val.c_str());
 		});
 		break;
 
 	case G_GET_CONFIGSTRING:
-		IPC::HandleMsg<GetConfigStringMsg>(channel, std::move(reader), [this](int index, int len, std::string& res) {
-			std::unique_ptr<char[]> buffer(new char[len]);
-			buffer[0] = '\0';
-			SV_GetConfigstring(index, buffer.get(), len);
-			res.assign(buffer.get(), len);
+		IPC::HandleMsg<GetConfigStringMsg>(channel, std::move(reader), [this](int index, int len, Str::StringRef& res) {
+			// Reply with a view of the config string, the VM truncates it to its buffer
+			if (len < 1)
+				Com_Error(ERR_DROP, "SV_GetConfigstring: bufferSize == %i", len);
+			if (index < 0 || index >= MAX_CONFIGSTRINGS)
+				Com_Error(ERR_DROP, "SV_GetConfigstring: bad index %i", index);
+			if (sv.configstrings[index])
+				res = sv.configstrings[index];
 		});
 		break;
 
@@ -741,26 +868,26 @@ void GameVM::QVMSyscall(int index, IPC::Reader& reader, IPC::Channel& channel)
 		break;
 
 	case G_SET_USERINFO:
-		IPC::HandleMsg<SetUserinfoMsg>(channel, std::move(reader), [this](int index, std::string val) {
+		IPC::HandleMsg<SetUserinfoMsg>(channel, std::move(reader), [this](int index, Str::StringRef val) {
 			SV_SetUserinfo(index, val.c_str());
 		});
 		break;
 
 	case G_GET_USERINFO:
-		IPC::HandleMsg<GetUserinfoMsg>(channel, std::move(reader), [this](int index, int len, std::string& res) {
-			std::unique_ptr<char[]> buffer(new char[len]);
-			buffer[0] = '\0';
-			SV_GetUserinfo(index, buffer.get(), len);
-			res.assign(buffer.get(), len);
+		IPC::HandleMsg<GetUserinfoMsg>(channel, std::move(reader), [this](int index, int len, Str::StringRef& res) {
+			if (len < 1)
+				Com_Error(ERR_DROP, "SV_GetUserinfo: bufferSize == %i", len);
+			if (index < 0 || index >= sv_maxclients->integer)
+				Com_Error(ERR_DROP, "SV_GetUserinfo: bad index %i", index);
+			res = svs.clients[index].userinfo;
 		});
 		break;
 
 	case G_GET_SERVERINFO:
-		IPC::HandleMsg<GetServerinfoMsg>(channel, std::move(reader), [this](int len, std::string& res) {
-			std::unique_ptr<char[]> buffer(new char[len]);
-			buffer[0] = '\0';
-			SV_GetServerinfo(buffer.get(), len);
-			res.assign(buffer.get(), len);
+		IPC::HandleMsg<GetServerinfoMsg>(channel, std::move(reader), [this](int len, Str::StringRef& res) {
+			if (len < 1)
+				Com_Error(ERR_DROP, "SV_GetServerinfo: bufferSize == %i", len);
+			res = Cvar_InfoString(CVAR_SERVERINFO, qfalse);
 		});
 		break;
 
@@ -856,29 +983,9 @@ void GameVM::QVMSyscall(int index, IPC::Reader& reader, IPC::Channel& channel)
 		});
 		break;
 
-	case G_PARSE_LOAD_SOURCE:
-		IPC::HandleMsg<ParseLoadSourceMsg>(channel, std::move(reader), [this](std::string name, int& res) {
-			res = Parse_LoadSourceHandle(name.c_str());
-		});
-		break;
-
-	case G_PARSE_FREE_SOURCE:
-		IPC::HandleMsg<ParseFreeSourceMsg>(channel, std::move(reader), [this](int source, int& res) {
-			res = Parse_FreeSourceHandle(source);
-		});
-		break;
-
-	case G_PARSE_READ_TOKEN:
-		IPC::HandleMsg<ParseReadTokenMsg>(channel, std::move(reader), [this](int source, int& res, pc_token_t& token) {
-			res = Parse_ReadTokenHandle(source, &token);
-		});
-		break;
-
-	case G_PARSE_SOURCE_FILE_AND_LINE:
-		IPC::HandleMsg<ParseSourceFileAndLineMsg>(channel, std::move(reader), [this](int source, int& res, std::string& file, int& line) {
-			char buffer[128] = {0};
-			res = Parse_SourceFileAndLine(source, buffer, &line);
-			file = buffer;
+	case G_PARSE_LOAD_TOKENS:
+		IPC::HandleMsg<ParseLoadTokensMsg>(channel, std::move(reader), [this](std::string name, bool& res, std::string& file, int& numTokens, std::vector<char>& tokens) {
+			SV_ParseLoadTokens(name.c_str(), res, file, numTokens, tokens);
 		});
 		break;
 
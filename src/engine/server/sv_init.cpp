@@ -68,6 +68,9 @@ void SV_SetConfigstring( int index, const char *val )
 	Z_Free( sv.configstrings[ index ] );
 	sv.configstrings[ index ] = CopyString( val );
 	sv.configstringsmodified[ index ] = qtrue;
+	SV_MirrorConfigstring( index );
+
+	SV_InvalidateInfoCache();
 }
 
 void SV_UpdateConfigStrings( void )
@@ -192,6 +195,10 @@ void SV_SetUserinfo( int index, const char *val )
 
 	Q_strncpyz( svs.clients[ index ].userinfo, val, sizeof( svs.clients[ index ].userinfo ) );
 	Q_strncpyz( svs.clients[ index ].name, Info_ValueForKey( val, "name" ), sizeof( svs.clients[ index ].name ) );
+	SV_MirrorUserinfo( index );
+
+	// the name shows in getstatus
+	SV_InvalidateInfoCache();
 }
 
 /*
@@ -694,6 +701,7 @@ void SV_SpawnServer( const char *server )
 	SV_SetConfigstring( CS_SYSTEMINFO, Cvar_InfoString( CVAR_SYSTEMINFO, qtrue ) );
 
 	SV_SetConfigstring( CS_SERVERINFO, Cvar_InfoString( CVAR_SERVERINFO, qfalse ) );
+	SV_MirrorServerinfo();
 	cvar_modifiedFlags &= ~CVAR_SERVERINFO;
 
 	// any media configstring setting now should issue a warning
@@ -781,6 +789,7 @@ void SV_Init( void )
 
 	// the download netcode tops at 18/20 kb/s, no need to make you think you can go above
 	sv_dl_maxRate = Cvar_Get( "sv_dl_maxRate", "42000", 0 );
+	sv_dlRate = Cvar_Get( "sv_dlRate", "0", 0 );
 
 	sv_wwwDownload = Cvar_Get( "sv_wwwDownload", "0", 0 );
 	sv_wwwBaseURL = Cvar_Get( "sv_wwwBaseURL", "dl.unvanquished.net/pkg", 0 );
@@ -71,6 +71,7 @@ cvar_t         *sv_floodProtect;
 cvar_t         *sv_lanForceRate; // TTimo - dedicated 1 (LAN) server forces local client rates to 99999 (bug #491)
 
 cvar_t         *sv_dl_maxRate;
+cvar_t         *sv_dlRate;
 
 cvar_t *sv_showAverageBPS; // NERVE - SMF - net debugging
 
@@ -476,65 +477,212 @@ qboolean SV_VerifyChallenge( const char *challenge )
 	return qtrue;
 }
 
+/*
+==============================================================================
+
+The responses to getstatus and getinfo are kept until something they show
+changes: configstrings, which include the serverinfo, and userinfos
+invalidate them, while the player counts, scores, pings and the server load
+are compared on each query. The challenge is added to them when sending.
+
+==============================================================================
+*/
+
+static struct
+{
+	qboolean valid;
+	int      maxclients;
+	byte     connected[ MAX_CLIENTS ];
+	int      score[ MAX_CLIENTS ];
+	int      ping[ MAX_CLIENTS ];
+	char     infostring[ MAX_INFO_STRING ];
+	char     players[ MAX_MSGLEN ];
+} statusCache;
+
+static struct
+{
+	qboolean valid;
+	int      clients, bots;
+	int      serverLoad;
+	char     infostring[ MAX_INFO_STRING ];
+} infoCache;
+
 /*
 ================
-SVC_Status
+SV_InvalidateInfoCache
+================
+*/
+void SV_InvalidateInfoCache( void )
+{
+	statusCache.valid = qfalse;
+	infoCache.valid = qfalse;
+}
 
-Responds with all the info that qplug or qspy can see about the server
-and all connected players.  Used for getting detailed information after
-the simple info query.
+/*
+================
+SV_InfoCvarsModified
+
+Serverinfo cvars only reach the configstring on the next frame
 ================
 */
-void SVC_Status( netadr_t from, const Cmd::Args& args )
+static qboolean SV_InfoCvarsModified( void )
+{
+	return ( cvar_modifiedFlags & ( CVAR_SERVERINFO | CVAR_SYSTEMINFO ) ) ? qtrue : qfalse;
+}
+
+/*
+================
+SV_UpdateStatusCache
+================
+*/
+static void SV_UpdateStatusCache( void )
 {
 	char          player[ 1024 ];
-	char          status[ MAX_MSGLEN ];
 	int           i;
 	client_t      *cl;
 	playerState_t *ps;
 	int           statusLength;
 	int           playerLength;
-	char          infostring[ MAX_INFO_STRING ];
+	qboolean      valid = statusCache.valid && statusCache.maxclients == sv_maxclients->integer && !SV_InfoCvarsModified();
 
-	//bani - bugtraq 12534
-	if ( args.Argc() > 1 && !SV_VerifyChallenge( args.Argv(1).c_str() ) )
+	for ( i = 0; i < sv_maxclients->integer && valid; i++ )
 	{
-		return;
-	}
+		cl = &svs.clients[ i ];
 
-	Q_strncpyz( infostring, Cvar_InfoString( CVAR_SERVERINFO, qfalse ), MAX_INFO_STRING );
+		if ( statusCache.connected[ i ] != ( cl->state >= CS_CONNECTED ) )
+		{
+			valid = qfalse;
+		}
+		else if ( statusCache.connected[ i ] )
+		{
+			ps = SV_GameClientNum( i );
+			valid = statusCache.score[ i ] == ps->persistant[ PERS_SCORE ] && statusCache.ping[ i ] == cl->ping;
+		}
+	}
 
-	if ( args.Argc() > 1 )
+	if ( valid )
 	{
-		// echo back the parameter to status. so master servers can use it as a challenge
-		// to prevent timed spoofed reply packets that add ghost servers
-		Info_SetValueForKey( infostring, "challenge", args.Argv(1).c_str(), qfalse );
+		return;
 	}
 
-	status[ 0 ] = 0;
+	Q_strncpyz( statusCache.infostring, Cvar_InfoString( CVAR_SERVERINFO, qfalse ), MAX_INFO_STRING );
+
+	statusCache.players[ 0 ] = 0;
 	statusLength = 0;
 
 	for ( i = 0; i < sv_maxclients->integer; i++ )
 	{
 		cl = &svs.clients[ i ];
+		statusCache.connected[ i ] = cl->state >= CS_CONNECTED;
 
 		if ( cl->state >= CS_CONNECTED )
 		{
 			ps = SV_GameClientNum( i );
+			statusCache.score[ i ] = ps->persistant[ PERS_SCORE ];
+			statusCache.ping[ i ] = cl->ping;
+
+			// keep checking the ones that don't fit, they may fit later
+			if ( statusLength < 0 )
+			{
+				continue;
+			}
+
 			Com_sprintf( player, sizeof( player ), "%i %i \"%s\"\n", ps->persistant[ PERS_SCORE ], cl->ping, cl->name );
 			playerLength = strlen( player );
 
-			if ( statusLength + playerLength >= sizeof( status ) )
+			if ( statusLength + playerLength >= sizeof( statusCache.players ) )
 			{
-				break; // can't hold any more
+				statusLength = -1; // can't hold any more
+				continue;
 			}
 
-			strcpy( status + statusLength, player );
+			strcpy( statusCache.players + statusLength, player );
 			statusLength += playerLength;
 		}
 	}
 
-	NET_OutOfBandPrint( NS_SERVER, from, "statusResponse\n%s\n%s", infostring, status );
+	statusCache.maxclients = sv_maxclients->integer;
+	statusCache.valid = qtrue;
+}
+
+/*
+================
+SVC_Status
+
+Responds with all the info that qplug or qspy can see about the server
+and all connected players.  Used for getting detailed information after
+the simple info query.
+================
+*/
+void SVC_Status( netadr_t from, const Cmd::Args& args )
+{
+	char infostring[ MAX_INFO_STRING ];
+
+	//bani - bugtraq 12534
+	if ( args.Argc() > 1 && !SV_VerifyChallenge( args.Argv(1).c_str() ) )
+	{
+		return;
+	}
+
+	SV_UpdateStatusCache();
+
+	if ( args.Argc() > 1 )
+	{
+		// echo back the parameter to status. so master servers can use it as a challenge
+		// to prevent timed spoofed reply packets that add ghost servers
+		Q_strncpyz( infostring, statusCache.infostring, MAX_INFO_STRING );
+		Info_SetValueForKey( infostring, "challenge", args.Argv(1).c_str(), qfalse );
+		NET_OutOfBandPrint( NS_SERVER, from, "statusResponse\n%s\n%s", infostring, statusCache.players );
+	}
+	else
+	{
+		NET_OutOfBandPrint( NS_SERVER, from, "statusResponse\n%s\n%s", statusCache.infostring, statusCache.players );
+	}
+}
+
+/*
+================
+SV_SetInfoKeys
+
+The keys of the info response that come after the challenges
+================
+*/
+static void SV_SetInfoKeys( char *infostring, int count, int botCount )
+{
+	Info_SetValueForKey( infostring, "protocol", va( "%i", PROTOCOL_VERSION ), qfalse );
+	Info_SetValueForKey( infostring, "hostname", sv_hostname->string, qfalse );
+	Info_SetValueForKey( infostring, "serverload", va( "%i", svs.serverLoad ), qfalse );
+	Info_SetValueForKey( infostring, "mapname", sv_mapname->string, qfalse );
+	Info_SetValueForKey( infostring, "clients", va( "%i", count ), qfalse );
+	Info_SetValueForKey( infostring, "bots", va( "%i", botCount ), qfalse );
+	Info_SetValueForKey( infostring, "sv_maxclients", va( "%i", sv_maxclients->integer - sv_privateClients->integer ), qfalse );
+	Info_SetValueForKey( infostring, "pure", va( "%i", sv_pure->integer ), qfalse );
+
+	if ( sv_statsURL->string[0] )
+	{
+		Info_SetValueForKey( infostring, "stats", sv_statsURL->string, qfalse );
+	}
+
+#ifdef USE_VOIP
+
+	if ( sv_voip->integer )
+	{
+		Info_SetValueForKey( infostring, "voip", va( "%i", sv_voip->integer ), qfalse );
+	}
+
+#endif
+
+	if ( sv_minPing->integer )
+	{
+		Info_SetValueForKey( infostring, "minPing", va( "%i", sv_minPing->integer ), qfalse );
+	}
+
+	if ( sv_maxPing->integer )
+	{
+		Info_SetValueForKey( infostring, "maxPing", va( "%i", sv_maxPing->integer ), qfalse );
+	}
+
+	Info_SetValueForKey( infostring, "gamename", GAMENAME_STRING, qfalse );  // Arnout: to be able to filter out Quake servers
 }
 
 /*
@@ -626,42 +774,93 @@ void SVC_Info( netadr_t from, const Cmd::Args& args )
 		strcpy( challenges[ i ].text, challenge );
 	}
 
-	Info_SetValueForKey( infostring, "protocol", va( "%i", PROTOCOL_VERSION ), qfalse );
-	Info_SetValueForKey( infostring, "hostname", sv_hostname->string, qfalse );
-	Info_SetValueForKey( infostring, "serverload", va( "%i", svs.serverLoad ), qfalse );
-	Info_SetValueForKey( infostring, "mapname", sv_mapname->string, qfalse );
-	Info_SetValueForKey( infostring, "clients", va( "%i", count ), qfalse );
-	Info_SetValueForKey( infostring, "bots", va( "%i", botCount ), qfalse );
-	Info_SetValueForKey( infostring, "sv_maxclients", va( "%i", sv_maxclients->integer - sv_privateClients->integer ), qfalse );
-	Info_SetValueForKey( infostring, "pure", va( "%i", sv_pure->integer ), qfalse );
-
-	if ( sv_statsURL->string[0] )
+	if ( !infoCache.valid || infoCache.clients != count || infoCache.bots != botCount || infoCache.serverLoad != svs.serverLoad || SV_InfoCvarsModified() )
 	{
-		Info_SetValueForKey( infostring, "stats", sv_statsURL->string, qfalse );
-	}
+		infoCache.infostring[ 0 ] = 0;
+		SV_SetInfoKeys( infoCache.infostring, count, botCount );
 
-#ifdef USE_VOIP
+		infoCache.clients = count;
+		infoCache.bots = botCount;
+		infoCache.serverLoad = svs.serverLoad;
+		infoCache.valid = qtrue;
+	}
 
-	if ( sv_voip->integer )
+	// the keys are all new, so they would have been appended the same way
+	if ( strlen( infostring ) + strlen( infoCache.infostring ) < MAX_INFO_STRING )
 	{
-		Info_SetValueForKey( infostring, "voip", va( "%i", sv_voip->integer ), qfalse );
+		strcat( infostring, infoCache.infostring );
+	}
+	else
+	{
+		SV_SetInfoKeys( infostring, count, botCount );
 	}
 
-#endif
+	NET_OutOfBandPrint( NS_SERVER, from, "infoResponse\n%s", infostring );
+}
 
-	if ( sv_minPing->integer )
+/*
+=================
+SV_ReceiptBucket
+
+Finds the bucket of a masked address, taking over the least loaded one of
+its set when it has none
+=================
+*/
+static receipt_t *SV_ReceiptBucket( const netadr_t *adr )
+{
+	const byte *bytes = adr->type == NA_IP ? adr->ip : adr->ip6;
+	int        length = adr->type == NA_IP ? 4 : 16;
+	uint32_t   hash = 2166136261u;
+	receipt_t  *bucket, *lightest;
+	int        i;
+
+	for ( i = 0; i < length; i++ )
 	{
-		Info_SetValueForKey( infostring, "minPing", va( "%i", sv_minPing->integer ), qfalse );
+		hash = ( hash ^ bytes[ i ] ) * 16777619u;
 	}
 
-	if ( sv_maxPing->integer )
+	bucket = &svs.infoReceipts[ ( hash & ( INFO_RECEIPT_SETS - 1 ) ) * INFO_RECEIPT_WAYS ];
+	lightest = bucket;
+
+	for ( i = 0; i < INFO_RECEIPT_WAYS; i++, bucket++ )
 	{
-		Info_SetValueForKey( infostring, "maxPing", va( "%i", sv_maxPing->integer ), qfalse );
+		if ( NET_CompareBaseAdr( *adr, bucket->adr ) )
+		{
+			return bucket;
+		}
+
+		if ( bucket->time < lightest->time )
+		{
+			lightest = bucket;
+		}
 	}
 
-	Info_SetValueForKey( infostring, "gamename", GAMENAME_STRING, qfalse );  // Arnout: to be able to filter out Quake servers
+	// it has drained the longest, if it is not empty already
+	lightest->adr = *adr;
+	lightest->time = 0;
+	return lightest;
+}
 
-	NET_OutOfBandPrint( NS_SERVER, from, "infoResponse\n%s", infostring );
+/*
+=================
+SV_ReceiptAllowed
+
+Whether a bucket taking count responses every INFO_RECEIPT_PERIOD has room for one more
+=================
+*/
+static qboolean SV_ReceiptAllowed( int time, int count )
+{
+	return time - svs.time <= INFO_RECEIPT_PERIOD - INFO_RECEIPT_PERIOD / count ? qtrue : qfalse;
+}
+
+/*
+=================
+SV_AddReceipt
+=================
+*/
+static void SV_AddReceipt( int *time, int count )
+{
+	*time = std::max( *time, svs.time ) + INFO_RECEIPT_PERIOD / count;
 }
 
 /*
@@ -677,13 +876,8 @@ If the address isn't NA_IP, it's automatically denied.
 */
 qboolean SV_CheckDRDoS( netadr_t from )
 {
-	int        i;
-	int        globalCount;
-	int        specificCount;
 	receipt_t  *receipt;
 	netadr_t   exactFrom;
-	int        oldest;
-	int        oldestTime;
 	static int lastGlobalLogTime = 0;
 	static int lastSpecificLogTime = 0;
 
@@ -711,42 +905,9 @@ qboolean SV_CheckDRDoS( netadr_t from )
 		return qtrue;
 	}
 
-	// Count receipts in last 2 seconds.
-	globalCount = 0;
-	specificCount = 0;
-	receipt = &svs.infoReceipts[ 0 ];
-	oldest = 0;
-	oldestTime = 0x7fffffff;
-
-	for ( i = 0; i < MAX_INFO_RECEIPTS; i++, receipt++ )
-	{
-		if ( receipt->time + 2000 > svs.time )
-		{
-			if ( receipt->time )
-			{
-				// When the server starts, all receipt times are at zero.  Furthermore,
-				// svs.time is close to zero.  We check that the receipt time is already
-				// set so that during the first two seconds after server starts, queries
-				// from the master servers don't get ignored.  As a consequence a potentially
-				// unlimited number of getinfo+getstatus responses may be sent during the
-				// first frame of a server's life.
-				globalCount++;
-			}
-
-			if ( NET_CompareBaseAdr( from, receipt->adr ) )
-			{
-				specificCount++;
-			}
-		}
-
-		if ( receipt->time < oldestTime )
-		{
-			oldestTime = receipt->time;
-			oldest = i;
-		}
-	}
-
-	if ( globalCount == MAX_INFO_RECEIPTS ) // All receipts happened in last 2 seconds.
+	// The buckets start out empty, so queries from the master servers don't get
+	// ignored when the server starts.
+	if ( !SV_ReceiptAllowed( svs.infoBudgetTime, MAX_INFO_RECEIPTS ) )
 	{
 		if ( lastGlobalLogTime + 1000 <= svs.time ) // Limit one log every second.
 		{
@@ -757,21 +918,22 @@ qboolean SV_CheckDRDoS( netadr_t from )
 		return qtrue;
 	}
 
-	if ( specificCount >= 3 ) // Already sent 3 to this IP address in last 2 seconds.
+	receipt = SV_ReceiptBucket( &from );
+
+	if ( !SV_ReceiptAllowed( receipt->time, MAX_INFO_RECEIPTS_PER_ADDRESS ) )
 	{
 		if ( lastSpecificLogTime + 1000 <= svs.time ) // Limit one log every second.
 		{
-			Com_Printf( "Possible DRDoS attack to address %i.%i.%i.%i, ignoring getinfo/getstatus connectionless packet\n",
-			            exactFrom.ip[ 0 ], exactFrom.ip[ 1 ], exactFrom.ip[ 2 ], exactFrom.ip[ 3 ] );
+			Com_Printf( "Possible DRDoS attack to address %s, ignoring getinfo/getstatus connectionless packet\n",
+			            NET_AdrToString( exactFrom ) );
 			lastSpecificLogTime = svs.time;
 		}
 
 		return qtrue;
 	}
 
-	receipt = &svs.infoReceipts[ oldest ];
-	receipt->adr = from;
-	receipt->time = svs.time;
+	SV_AddReceipt( &svs.infoBudgetTime, MAX_INFO_RECEIPTS );
+	SV_AddReceipt( &receipt->time, MAX_INFO_RECEIPTS_PER_ADDRESS );
 	return qfalse;
 }
 
@@ -868,6 +1030,25 @@ void SVC_RemoteCommand( netadr_t from, const Cmd::Args& args )
 	env.Flush();
 }
 
+/*
+=================
+SV_IsCommand
+
+Whether the connectionless packet is the command, without tokenizing it
+=================
+*/
+static qboolean SV_IsCommand( const msg_t *msg, const char *command )
+{
+	int length = strlen( command );
+
+	if ( msg->cursize < 4 + length || memcmp( msg->data + 4, command, length ) )
+	{
+		return qfalse;
+	}
+
+	return msg->cursize == 4 + length || msg->data[ 4 + length ] <= ' ' ? qtrue : qfalse;
+}
+
 /*
 =================
 SV_ConnectionlessPacket
@@ -880,9 +1061,19 @@ connectionless packets.
 */
 void SV_ConnectionlessPacket( netadr_t from, msg_t *msg )
 {
+	qboolean checked = qfalse;
+
 	MSG_BeginReadingOOB( msg );
 	MSG_ReadLong( msg );  // skip the -1 marker
 
+	// floods are made of queries, turn them away before parsing anything
+	if ( SV_IsCommand( msg, "getstatus" ) || SV_IsCommand( msg, "getinfo" ) )
+	{
+		if ( SV_CheckDRDoS( from ) ) { return; }
+
+		checked = qtrue;
+	}
+
 	if ( !Q_strncmp( "connect", ( char * ) &msg->data[ 4 ], 7 ) )
 	{
 		Huff_Decompress( msg, 12 );
@@ -899,13 +1090,14 @@ void SV_ConnectionlessPacket( netadr_t from, msg_t *msg )
 
 	if ( args.Argv(0) == "getstatus" )
 	{
-		if ( SV_CheckDRDoS( from ) ) { return; }
+		// spellings the quick check missed still count
+		if ( !checked && SV_CheckDRDoS( from ) ) { return; }
 
 		SVC_Status( from, args );
 	}
 	else if ( args.Argv(0) == "getinfo" )
 	{
-		if ( SV_CheckDRDoS( from ) ) { return; }
+		if ( !checked && SV_CheckDRDoS( from ) ) { return; }
 
 		SVC_Info( from, args );
 	}
@@ -940,12 +1132,14 @@ void SV_ConnectionlessPacket( netadr_t from, msg_t *msg )
 SV_ReadPackets
 =================
 */
-void SV_PacketEvent( netadr_t from, msg_t *msg )
+void SV_PacketEvent( netadr_t from, msg_t *msg, int time )
 {
 	int      i;
 	client_t *cl;
 	int      qport;
 
+	svs.packetTime = time;
+
 	// check for connectionless packet (0xffffffff) first
 	if ( msg->cursize >= 4 && * ( int * ) msg->data == -1 )
 	{
@@ -1313,6 +1507,7 @@ void SV_Frame( int msec )
 	if ( cvar_modifiedFlags & CVAR_SERVERINFO )
 	{
 		SV_SetConfigstring( CS_SERVERINFO, Cvar_InfoString( CVAR_SERVERINFO, qfalse ) );
+		SV_MirrorServerinfo();
 		cvar_modifiedFlags &= ~CVAR_SERVERINFO;
 	}
 
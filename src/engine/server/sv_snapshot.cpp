@@ -34,6 +34,9 @@ Maryland 20850 USA.
 
 #include "server.h"
 
+#include <atomic>
+#include <condition_variable>
+
 /*
 =============================================================================
 
@@ -56,6 +59,167 @@ A server packet will look something like:
 =============================================================================
 */
 
+/*
+=============================================================================
+
+Entity delta cache
+
+Most clients receive the same entities with the same baseline or previous
+state, so the delta encoding of an entity is kept for the rest of the frame
+and its bits copied into the messages of the other clients needing it. The
+huffman codes do not depend on their position in the message, so the copied
+bits are identical to what encoding the delta again would produce.
+
+Each thread encoding snapshots has its own cache so they never need to lock.
+
+=============================================================================
+*/
+
+class EntityDeltaCache
+{
+public:
+	EntityDeltaCache(): hits( 0 ), misses( 0 ), frame( -1 ) {}
+
+	void WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entityState_t *to, bool force, int frame );
+
+	int hits;
+	int misses;
+
+private:
+	typedef struct
+	{
+		uint32_t      fromHash;
+		bool          force;
+		int           next; // next entry of the same entity number
+		int           firstByte; // into data
+		int           numBits;
+		int           uncompBits;
+		entityState_t from;
+		entityState_t to;
+	} entry_t;
+
+	static uint32_t HashState( const entityState_t *state );
+	void Clear( int frame );
+
+	int                  frame;
+	int                  first[ MAX_GENTITIES ];
+	std::vector<entry_t> entries;
+	std::vector<byte>    data;
+};
+
+/*
+=============
+EntityDeltaCache::HashState
+=============
+*/
+uint32_t EntityDeltaCache::HashState( const entityState_t *state )
+{
+	const uint32_t *words = ( const uint32_t * ) state;
+	uint32_t       hash = 2166136261u;
+
+	// FNV-1a over the words, the states are compared in full on a match
+	for ( std::size_t i = 0; i < sizeof( *state ) / 4; i++ )
+	{
+		hash = ( hash ^ words[ i ] ) * 16777619u;
+	}
+
+	return hash;
+}
+
+/*
+=============
+EntityDeltaCache::Clear
+=============
+*/
+void EntityDeltaCache::Clear( int newFrame )
+{
+	frame = newFrame;
+	entries.clear();
+	data.clear();
+
+	for ( int i = 0; i < MAX_GENTITIES; i++ )
+	{
+		first[ i ] = -1;
+	}
+}
+
+/*
+=============
+EntityDeltaCache::WriteDeltaEntity
+
+Same output as MSG_WriteDeltaEntity for an entity that is not removed
+=============
+*/
+void EntityDeltaCache::WriteDeltaEntity( msg_t *msg, const entityState_t *from, const entityState_t *to, bool force, int newFrame )
+{
+	byte     buffer[ 1024 ];
+	msg_t    encoded;
+	uint32_t fromHash;
+	int      i;
+
+	// nothing is written for an unchanged entity, don't bother caching it
+	if ( !force && !memcmp( from, to, sizeof( *from ) ) )
+	{
+		return;
+	}
+
+	if ( frame != newFrame )
+	{
+		Clear( newFrame );
+	}
+
+	fromHash = HashState( from );
+
+	for ( i = first[ to->number ]; i >= 0; i = entries[ i ].next )
+	{
+		const entry_t& entry = entries[ i ];
+
+		if ( entry.fromHash == fromHash && entry.force == force &&
+		     !memcmp( &entry.from, from, sizeof( *from ) ) && !memcmp( &entry.to, to, sizeof( *to ) ) )
+		{
+			hits++;
+			MSG_WriteBitString( msg, data.data() + entry.firstByte, entry.numBits, entry.uncompBits );
+			return;
+		}
+	}
+
+	misses++;
+
+	// encode it on its own so that the bits can be reused
+	MSG_Init( &encoded, buffer, sizeof( buffer ) );
+	MSG_WriteDeltaEntity( &encoded, ( entityState_t * ) from, ( entityState_t * ) to, force ? qtrue : qfalse );
+
+	if ( encoded.overflowed )
+	{
+		MSG_WriteDeltaEntity( msg, ( entityState_t * ) from, ( entityState_t * ) to, force ? qtrue : qfalse );
+		return;
+	}
+
+	entry_t entry;
+	entry.fromHash = fromHash;
+	entry.force = force;
+	entry.next = first[ to->number ];
+	entry.firstByte = data.size();
+	entry.numBits = encoded.bit;
+	entry.uncompBits = encoded.uncompsize;
+	entry.from = *from;
+	entry.to = *to;
+
+	first[ to->number ] = entries.size();
+	entries.push_back( entry );
+	data.insert( data.end(), buffer, buffer + ( ( encoded.bit + 7 ) >> 3 ) );
+
+	MSG_WriteBitString( msg, buffer, encoded.bit, encoded.uncompsize );
+}
+
+// used by snapshots built outside of the worker pool
+static EntityDeltaCache mainDeltaCache;
+
+// bumped by each SV_SendClientMessages, the caches are valid for one frame
+static int              deltaCacheFrame;
+
+static Cvar::Cvar<bool> sv_snapshotDeltaCache("sv_snapshotDeltaCache", "reuse the delta encoding of entities sent to several clients", Cvar::NONE, true);
+
 /*
 =============
 SV_EmitPacketEntities
@@ -63,7 +227,7 @@ SV_EmitPacketEntities
 Writes a delta update of an entityState_t list to the message.
 =============
 */
-static void SV_EmitPacketEntities( const clientSnapshot_t *from, clientSnapshot_t *to, msg_t *msg )
+static void SV_EmitPacketEntities( const clientSnapshot_t *from, clientSnapshot_t *to, msg_t *msg, EntityDeltaCache *cache )
 {
 	entityState_t *oldent, *newent;
 	int           oldindex, newindex;
@@ -115,7 +279,15 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, clientSnapshot_
 			// delta update from old position
 			// because the force parm is qfalse, this will not result
 			// in any bytes being emited if the entity has not changed at all
-			MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			if ( cache )
+			{
+				cache->WriteDeltaEntity( msg, oldent, newent, false, deltaCacheFrame );
+			}
+			else
+			{
+				MSG_WriteDeltaEntity( msg, oldent, newent, qfalse );
+			}
+
 			oldindex++;
 			newindex++;
 			continue;
@@ -124,7 +296,15 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, clientSnapshot_
 		if ( newnum < oldnum )
 		{
 			// this is a new entity, send it from the baseline
-			MSG_WriteDeltaEntity( msg, &sv.svEntities[ newnum ].baseline, newent, qtrue );
+			if ( cache )
+			{
+				cache->WriteDeltaEntity( msg, &sv.svEntities[ newnum ].baseline, newent, true, deltaCacheFrame );
+			}
+			else
+			{
+				MSG_WriteDeltaEntity( msg, &sv.svEntities[ newnum ].baseline, newent, qtrue );
+			}
+
 			newindex++;
 			continue;
 		}
@@ -143,47 +323,60 @@ static void SV_EmitPacketEntities( const clientSnapshot_t *from, clientSnapshot_
 
 /*
 ==================
-SV_WriteSnapshotToClient
+SV_SelectDeltaFrame
+
+Finds the frame the client has acknowledged which the snapshot
+being created can be delta compressed from, if any
 ==================
 */
-static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg )
+static void SV_SelectDeltaFrame( client_t *client, clientSnapshot_t **oldframe, int *lastframe )
 {
-	clientSnapshot_t *frame, *oldframe;
-	int              lastframe;
-	int              i;
-	int              snapFlags;
-
-	// this is the snapshot we are creating
-	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
-
 	// try to use a previous frame as the source for delta compressing the snapshot
 	if ( client->deltaMessage <= 0 || client->state != CS_ACTIVE )
 	{
 		// client is asking for a retransmit
-		oldframe = NULL;
-		lastframe = 0;
+		*oldframe = NULL;
+		*lastframe = 0;
 	}
 	else if ( client->netchan.outgoingSequence - client->deltaMessage >= ( PACKET_BACKUP - 3 ) )
 	{
 		// client hasn't gotten a good message through in a long time
 		Com_DPrintf( "%s^7: Delta request from out of date packet.\n", client->name );
-		oldframe = NULL;
-		lastframe = 0;
+		*oldframe = NULL;
+		*lastframe = 0;
 	}
 	else
 	{
 		// we have a valid snapshot to delta from
-		oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
-		lastframe = client->netchan.outgoingSequence - client->deltaMessage;
+		*oldframe = &client->frames[ client->deltaMessage & PACKET_MASK ];
+		*lastframe = client->netchan.outgoingSequence - client->deltaMessage;
 
 		// the snapshot's entities may still have rolled off the buffer, though
-		if ( oldframe->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities )
+		if ( ( *oldframe )->first_entity <= svs.nextSnapshotEntities - svs.numSnapshotEntities )
 		{
 			Com_DPrintf( "%s^7: Delta request from out of date entities.\n", client->name );
-			oldframe = NULL;
-			lastframe = 0;
+			*oldframe = NULL;
+			*lastframe = 0;
 		}
 	}
+}
+
+/*
+==================
+SV_WriteSnapshotToClient
+
+Only reads the state of the client and the snapshots,
+so it may be called from the snapshot worker threads
+==================
+*/
+static void SV_WriteSnapshotToClient( client_t *client, clientSnapshot_t *oldframe, int lastframe, msg_t *msg, EntityDeltaCache *cache )
+{
+	clientSnapshot_t *frame;
+	int              i;
+	int              snapFlags;
+
+	// this is the snapshot we are creating
+	frame = &client->frames[ client->netchan.outgoingSequence & PACKET_MASK ];
 
 	MSG_WriteByte( msg, svc_snapshot );
 
@@ -229,7 +422,7 @@ static void SV_WriteSnapshotToClient( client_t *client, msg_t *msg )
 	}
 
 	// delta encode the entities
-	SV_EmitPacketEntities( oldframe, frame, msg );
+	SV_EmitPacketEntities( oldframe, frame, msg, cache );
 
 	// padding for rate debugging
 	if ( sv_padPackets->integer )
@@ -339,58 +532,88 @@ static void SV_AddEntToSnapshot( sharedEntity_t *clientEnt, svEntity_t *svEnt, s
 	eNums->numSnapshotEntities++;
 }
 
+/*
+=============================================================================
+
+Entity visibility index
+
+Rather than testing every entity for every client, the linked entities
+are sorted once per frame into buckets, one per PVS cluster they touch.
+A client then only looks at the buckets of the clusters it can see, plus
+the entities which are not selected through the PVS.
+
+=============================================================================
+*/
+
+static Cvar::Cvar<bool> sv_snapshotStats("sv_snapshotStats", "print the number of entities examined and sent for snapshots each frame", Cvar::NONE, false);
+
+typedef struct
+{
+	bool             valid;
+	int              numClusters;
+	std::vector<int> clusterFirst; // [numClusters + 1], into clusterEntities
+	std::vector<int> clusterEntities;
+	std::vector<int> otherEntities; // broadcast, single client, in range and overflowed
+} entityIndex_t;
+
+static entityIndex_t entityIndex;
+
+static struct
+{
+	int snapshots;
+	int examined;
+	int emitted;
+	int deltaCacheHits;
+	int deltaCacheMisses;
+} snapshotStats;
+
 /*
 ===============
-SV_AddEntitiesVisibleFromPoint
+SV_EntityIsUnindexed
+
+Entities which may be sent without being in a cluster visible by the client
 ===============
 */
-static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *frame,
-//                                  snapshotEntityNumbers_t *eNums, qboolean portal, clientSnapshot_t *oldframe, qboolean localClient ) {
-//                                  snapshotEntityNumbers_t *eNums, qboolean portal ) {
-    snapshotEntityNumbers_t *eNums /*, qboolean portal, qboolean localClient */ )
+static bool SV_EntityIsUnindexed( const sharedEntity_t *ent )
 {
-	int            e, i;
-	sharedEntity_t *ent, *playerEnt;
-	svEntity_t     *svEnt;
-	int            l;
-	int            clientarea, clientcluster;
-	int            leafnum;
-//	int             c_fullsend;
-	byte           *clientpvs;
-	byte           *bitvector;
-
-	// during an error shutdown message we may need to transmit
-	// the shutdown message after the server has shutdown, so
-	// specfically check for it
-	if ( !sv.state )
+	if ( ent->r.svFlags & ( SVF_BROADCAST | SVF_CLIENTS_IN_RANGE | SVF_SINGLECLIENT ) )
 	{
-		return;
+		return true;
 	}
 
-	leafnum = CM_PointLeafnum( origin );
-	clientarea = CM_LeafArea( leafnum );
-	clientcluster = CM_LeafCluster( leafnum );
-
-	// calculate the visible areas
-	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
+	// the clusters past the stored ones aren't known, so test it every time
+	if ( !( ent->r.svFlags & SVF_IGNOREBMODELEXTENTS ) && ent->r.lastCluster )
+	{
+		return true;
+	}
 
-	clientpvs = CM_ClusterPVS( clientcluster );
+	return false;
+}
 
-//	c_fullsend = 0;
+/*
+===============
+SV_BuildEntityIndex
+===============
+*/
+static void SV_BuildEntityIndex( void )
+{
+	int            e, i;
+	int            numClusters;
+	sharedEntity_t *ent;
 
-	playerEnt = SV_GentityNum( frame->ps.clientNum );
+	numClusters = CM_NumClusters();
 
-	if ( playerEnt->r.svFlags & SVF_SELF_PORTAL )
-	{
-		SV_AddEntitiesVisibleFromPoint( playerEnt->s.origin2, frame, eNums );
-	}
+	entityIndex.numClusters = numClusters;
+	entityIndex.clusterFirst.assign( numClusters + 1, 0 );
+	entityIndex.clusterEntities.clear();
+	entityIndex.otherEntities.clear();
 
+	// first pass counts the entities of each cluster
 	for ( e = 0; e < sv.num_entities; e++ )
 	{
 		ent = SV_GentityNum( e );
 
-		// never send entities that aren't linked in
-		if ( !ent->r.linked )
+		if ( !ent->r.linked || ( ent->r.svFlags & SVF_NOCLIENT ) )
 		{
 			continue;
 		}
@@ -401,243 +624,412 @@ static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *fra
 			ent->s.number = e;
 		}
 
-		// entities can be flagged to explicitly not be sent to the client
-		if ( ent->r.svFlags & SVF_NOCLIENT )
+		if ( SV_EntityIsUnindexed( ent ) )
 		{
+			entityIndex.otherEntities.push_back( e );
 			continue;
 		}
 
-		// entities can be flagged to be sent to only one client
-		if ( ent->r.svFlags & SVF_SINGLECLIENT )
+		if ( ent->r.svFlags & SVF_IGNOREBMODELEXTENTS )
 		{
-			if ( ent->r.singleClient != frame->ps.clientNum )
+			if ( ent->r.originCluster >= 0 && ent->r.originCluster < numClusters )
 			{
-				continue;
+				entityIndex.clusterFirst[ ent->r.originCluster + 1 ]++;
+			}
+			else
+			{
+				entityIndex.otherEntities.push_back( e );
 			}
+
+			continue;
 		}
 
-		// entities can be flagged to be sent to everyone but one client
-		if ( ent->r.svFlags & SVF_NOTSINGLECLIENT )
+		for ( i = 0; i < ent->r.numClusters; i++ )
 		{
-			if ( ent->r.singleClient == frame->ps.clientNum )
+			int cluster = ent->r.clusternums[ i ];
+
+			if ( cluster >= 0 && cluster < numClusters )
 			{
-				continue;
+				entityIndex.clusterFirst[ cluster + 1 ]++;
 			}
 		}
+	}
+
+	for ( i = 0; i < numClusters; i++ )
+	{
+		entityIndex.clusterFirst[ i + 1 ] += entityIndex.clusterFirst[ i ];
+	}
+
+	entityIndex.clusterEntities.resize( entityIndex.clusterFirst[ numClusters ] );
+
+	// second pass fills the buckets, using the running count of each as the insertion point
+	std::vector<int> fill( entityIndex.clusterFirst.begin(), entityIndex.clusterFirst.end() - 1 );
 
-		// entities can be flagged to be sent to only a given mask of clients
-		if ( ent->r.svFlags & SVF_CLIENTMASK )
+	for ( e = 0; e < sv.num_entities; e++ )
+	{
+		ent = SV_GentityNum( e );
+
+		if ( !ent->r.linked || ( ent->r.svFlags & SVF_NOCLIENT ) || SV_EntityIsUnindexed( ent ) )
+		{
+			continue;
+		}
+
+		if ( ent->r.svFlags & SVF_IGNOREBMODELEXTENTS )
 		{
-			if ( frame->ps.clientNum >= 32 )
+			if ( ent->r.originCluster >= 0 && ent->r.originCluster < numClusters )
 			{
-				if ( ~ent->r.hiMask & ( 1 << ( frame->ps.clientNum - 32 ) ) )
-				{
-					continue;
-				}
+				entityIndex.clusterEntities[ fill[ ent->r.originCluster ]++ ] = e;
 			}
-			else
+
+			continue;
+		}
+
+		for ( i = 0; i < ent->r.numClusters; i++ )
+		{
+			int cluster = ent->r.clusternums[ i ];
+
+			if ( cluster >= 0 && cluster < numClusters )
 			{
-				if ( ~ent->r.loMask & ( 1 << frame->ps.clientNum ) )
-				{
-					continue;
-				}
+				entityIndex.clusterEntities[ fill[ cluster ]++ ] = e;
 			}
 		}
+	}
 
-		svEnt = SV_SvEntityForGentity( ent );
+	entityIndex.valid = true;
+}
 
-		// don't double add an entity through portals
-		if ( svEnt->snapshotCounter == sv.snapshotCounter )
+static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums );
+
+/*
+===============
+SV_AddEntityIfVisible
+===============
+*/
+static void SV_AddEntityIfVisible( vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums,
+                                   sharedEntity_t *playerEnt, int clientarea, byte *clientpvs, int visCheck, int e )
+{
+	int            i, l;
+	sharedEntity_t *ent;
+	svEntity_t     *svEnt;
+	byte           *bitvector;
+
+	ent = SV_GentityNum( e );
+	svEnt = SV_SvEntityForGentity( ent );
+
+	// an entity touching several visible clusters only needs to be tested once
+	if ( svEnt->visCheckCounter == visCheck )
+	{
+		return;
+	}
+
+	svEnt->visCheckCounter = visCheck;
+	snapshotStats.examined++;
+
+	// entities can be flagged to be sent to only one client
+	if ( ent->r.svFlags & SVF_SINGLECLIENT )
+	{
+		if ( ent->r.singleClient != frame->ps.clientNum )
 		{
-			continue;
+			return;
 		}
+	}
 
-		// broadcast entities are always sent
-		if ( ent->r.svFlags & SVF_BROADCAST )
+	// entities can be flagged to be sent to everyone but one client
+	if ( ent->r.svFlags & SVF_NOTSINGLECLIENT )
+	{
+		if ( ent->r.singleClient == frame->ps.clientNum )
 		{
-			SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
-			continue;
+			return;
 		}
+	}
 
-		// send entity if the client is in range
-		if ( (ent->r.svFlags & SVF_CLIENTS_IN_RANGE) &&
-		     Distance( ent->s.origin, playerEnt->s.origin ) <= ent->r.clientRadius )
+	// entities can be flagged to be sent to only a given mask of clients
+	if ( ent->r.svFlags & SVF_CLIENTMASK )
+	{
+		if ( frame->ps.clientNum >= 32 )
+		{
+			if ( ~ent->r.hiMask & ( 1 << ( frame->ps.clientNum - 32 ) ) )
+			{
+				return;
+			}
+		}
+		else
+		{
+			if ( ~ent->r.loMask & ( 1 << frame->ps.clientNum ) )
+			{
+				return;
+			}
+		}
+	}
+
+	// don't double add an entity through portals
+	if ( svEnt->snapshotCounter == sv.snapshotCounter )
+	{
+		return;
+	}
+
+	// broadcast entities are always sent
+	if ( ent->r.svFlags & SVF_BROADCAST )
+	{
+		SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
+		return;
+	}
+
+	// send entity if the client is in range
+	if ( (ent->r.svFlags & SVF_CLIENTS_IN_RANGE) &&
+	     Distance( ent->s.origin, playerEnt->s.origin ) <= ent->r.clientRadius )
+	{
+		SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
+		return;
+	}
+
+	bitvector = clientpvs;
+
+	// Gordon: just check origin for being in pvs, ignore bmodel extents
+	if ( ent->r.svFlags & SVF_IGNOREBMODELEXTENTS )
+	{
+		if ( bitvector[ ent->r.originCluster >> 3 ] & ( 1 << ( ent->r.originCluster & 7 ) ) )
 		{
 			SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
-			continue;
 		}
 
-		bitvector = clientpvs;
+		return;
+	}
 
-		// Gordon: just check origin for being in pvs, ignore bmodel extents
-		if ( ent->r.svFlags & SVF_IGNOREBMODELEXTENTS )
+	// ignore if not touching a PV leaf
+	// check area
+	if ( !CM_AreasConnected( clientarea, ent->r.areanum ) )
+	{
+		// doors can legally straddle two areas, so
+		// we may need to check another one
+		if ( !CM_AreasConnected( clientarea, ent->r.areanum2 ) )
+		{
+			return;
+		}
+	}
+
+	// check individual leafs
+	if ( !ent->r.numClusters )
+	{
+		return;
+	}
+
+	l = 0;
+
+	for ( i = 0; i < ent->r.numClusters; i++ )
+	{
+		l = ent->r.clusternums[ i ];
+
+		if ( bitvector[ l >> 3 ] & ( 1 << ( l & 7 ) ) )
+		{
+			break;
+		}
+	}
+
+	// if we haven't found it to be visible,
+	// check the overflow clusters that couldn't be stored
+	if ( i == ent->r.numClusters )
+	{
+		if ( ent->r.lastCluster )
+		{
+			for ( ; l <= ent->r.lastCluster; l++ )
+			{
+				if ( bitvector[ l >> 3 ] & ( 1 << ( l & 7 ) ) )
+				{
+					break;
+				}
+			}
+
+			if ( l == ent->r.lastCluster )
+			{
+				return;
+			}
+		}
+		else
+		{
+			return;
+		}
+	}
+
+	//----(SA) added "visibility dummies"
+	if ( ent->r.svFlags & SVF_VISDUMMY )
+	{
+		sharedEntity_t *ment = 0;
+
+		//find master;
+		ment = SV_GentityNum( ent->s.otherEntityNum );
+
+		if ( ment )
+		{
+			svEntity_t *master = 0;
+
+			master = SV_SvEntityForGentity( ment );
+
+			if ( master->snapshotCounter == sv.snapshotCounter || !ment->r.linked )
+			{
+				return;
+			}
+
+			SV_AddEntToSnapshot( playerEnt, master, ment, eNums );
+		}
+
+		return; // master needs to be added, but not this dummy ent
+	}
+	//----(SA) end
+	else if ( ent->r.svFlags & SVF_VISDUMMY_MULTIPLE )
+	{
+		int            h;
+		sharedEntity_t *ment = 0;
+		svEntity_t     *master = 0;
+
+		for ( h = 0; h < sv.num_entities; h++ )
 		{
-			if ( bitvector[ ent->r.originCluster >> 3 ] & ( 1 << ( ent->r.originCluster & 7 ) ) )
+			ment = SV_GentityNum( h );
+
+			if ( ment == ent )
+			{
+				continue;
+			}
+
+			if ( ment )
+			{
+				master = SV_SvEntityForGentity( ment );
+			}
+			else
+			{
+				continue;
+			}
+
+			if ( !( ment->r.linked ) )
+			{
+				continue;
+			}
+
+			if ( ment->s.number != h )
 			{
-				SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
+				Com_DPrintf( "FIXING vis dummy multiple ment->S.NUMBER!!!\n" );
+				ment->s.number = h;
+			}
+
+			if ( ment->r.svFlags & SVF_NOCLIENT )
+			{
+				continue;
 			}
 
-			continue;
-		}
-
-		// ignore if not touching a PV leaf
-		// check area
-		if ( !CM_AreasConnected( clientarea, ent->r.areanum ) )
-		{
-			// doors can legally straddle two areas, so
-			// we may need to check another one
-			if ( !CM_AreasConnected( clientarea, ent->r.areanum2 ) )
+			if ( master->snapshotCounter == sv.snapshotCounter )
 			{
 				continue;
 			}
-		}
 
-		// check individual leafs
-		if ( !ent->r.numClusters )
-		{
-			continue;
+			if ( ment->s.otherEntityNum == ent->s.number )
+			{
+				SV_AddEntToSnapshot( playerEnt, master, ment, eNums );
+			}
 		}
 
-		l = 0;
+		return;
+	}
+
+	// add it
+	SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
 
-		for ( i = 0; i < ent->r.numClusters; i++ )
+	// if it's a portal entity, add everything visible from its camera position
+	if ( ent->r.svFlags & SVF_PORTAL )
+	{
+		if ( ent->s.generic1 )
 		{
-			l = ent->r.clusternums[ i ];
+			vec3_t dir;
+			VectorSubtract( ent->s.origin, origin, dir );
 
-			if ( bitvector[ l >> 3 ] & ( 1 << ( l & 7 ) ) )
+			if ( VectorLengthSquared( dir ) > ( float ) ent->s.generic1 * ent->s.generic1 )
 			{
-				break;
+				return;
 			}
 		}
 
-		// if we haven't found it to be visible,
-		// check the overflow clusters that couldn't be stored
-		if ( i == ent->r.numClusters )
-		{
-			if ( ent->r.lastCluster )
-			{
-				for ( ; l <= ent->r.lastCluster; l++ )
-				{
-					if ( bitvector[ l >> 3 ] & ( 1 << ( l & 7 ) ) )
-					{
-						break;
-					}
-				}
+		SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums );
+	}
+}
 
-				if ( l == ent->r.lastCluster )
-				{
-					continue;
-				}
-			}
-			else
-			{
-				continue;
-			}
-		}
+/*
+===============
+SV_AddEntitiesVisibleFromPoint
+===============
+*/
+static void SV_AddEntitiesVisibleFromPoint( vec3_t origin, clientSnapshot_t *frame, snapshotEntityNumbers_t *eNums )
+{
+	int            i, bit;
+	sharedEntity_t *playerEnt;
+	int            clientarea, clientcluster;
+	int            leafnum;
+	int            clusterBytes;
+	int            visCheck;
+	byte           *clientpvs;
+	std::size_t    n;
 
-		//----(SA) added "visibility dummies"
-		if ( ent->r.svFlags & SVF_VISDUMMY )
-		{
-			sharedEntity_t *ment = 0;
+	// during an error shutdown message we may need to transmit
+	// the shutdown message after the server has shutdown, so
+	// specfically check for it
+	if ( !sv.state )
+	{
+		return;
+	}
 
-			//find master;
-			ment = SV_GentityNum( ent->s.otherEntityNum );
+	if ( !entityIndex.valid )
+	{
+		SV_BuildEntityIndex();
+	}
 
-			if ( ment )
-			{
-				svEntity_t *master = 0;
+	leafnum = CM_PointLeafnum( origin );
+	clientarea = CM_LeafArea( leafnum );
+	clientcluster = CM_LeafCluster( leafnum );
 
-				master = SV_SvEntityForGentity( ment );
+	// calculate the visible areas
+	frame->areabytes = CM_WriteAreaBits( frame->areabits, clientarea );
 
-				if ( master->snapshotCounter == sv.snapshotCounter || !ment->r.linked )
-				{
-					continue;
-				}
+	clientpvs = CM_ClusterPVS( clientcluster );
 
-				SV_AddEntToSnapshot( playerEnt, master, ment, eNums );
-			}
+	playerEnt = SV_GentityNum( frame->ps.clientNum );
 
-			continue; // master needs to be added, but not this dummy ent
-		}
-		//----(SA) end
-		else if ( ent->r.svFlags & SVF_VISDUMMY_MULTIPLE )
-		{
-			{
-				int            h;
-				sharedEntity_t *ment = 0;
-				svEntity_t     *master = 0;
+	if ( playerEnt->r.svFlags & SVF_SELF_PORTAL )
+	{
+		SV_AddEntitiesVisibleFromPoint( playerEnt->s.origin2, frame, eNums );
+	}
 
-				for ( h = 0; h < sv.num_entities; h++ )
-				{
-					ment = SV_GentityNum( h );
-
-					if ( ment == ent )
-					{
-						continue;
-					}
-
-					if ( ment )
-					{
-						master = SV_SvEntityForGentity( ment );
-					}
-					else
-					{
-						continue;
-					}
-
-					if ( !( ment->r.linked ) )
-					{
-						continue;
-					}
-
-					if ( ment->s.number != h )
-					{
-						Com_DPrintf( "FIXING vis dummy multiple ment->S.NUMBER!!!\n" );
-						ment->s.number = h;
-					}
-
-					if ( ment->r.svFlags & SVF_NOCLIENT )
-					{
-						continue;
-					}
-
-					if ( master->snapshotCounter == sv.snapshotCounter )
-					{
-						continue;
-					}
-
-					if ( ment->s.otherEntityNum == ent->s.number )
-					{
-						SV_AddEntToSnapshot( playerEnt, master, ment, eNums );
-					}
-				}
+	// each viewpoint has its own pvs, so entities rejected by another one must be tested again;
+	// the stamp is kept local because portals seen from here recurse and take a new one
+	visCheck = ++sv.visCheckCounter;
 
-				continue;
-			}
-		}
+	for ( n = 0; n < entityIndex.otherEntities.size(); n++ )
+	{
+		SV_AddEntityIfVisible( origin, frame, eNums, playerEnt, clientarea, clientpvs, visCheck, entityIndex.otherEntities[ n ] );
+	}
 
-		// add it
-		SV_AddEntToSnapshot( playerEnt, svEnt, ent, eNums );
+	// only walk the buckets of the clusters in the pvs
+	clusterBytes = ( entityIndex.numClusters + 7 ) >> 3;
 
-		// if it's a portal entity, add everything visible from its camera position
-		if ( ent->r.svFlags & SVF_PORTAL )
+	for ( i = 0; i < clusterBytes; i++ )
+	{
+		if ( !clientpvs[ i ] )
 		{
-			if ( ent->s.generic1 )
-			{
-				vec3_t dir;
-				VectorSubtract( ent->s.origin, origin, dir );
+			continue;
+		}
 
-				if ( VectorLengthSquared( dir ) > ( float ) ent->s.generic1 * ent->s.generic1 )
-				{
-					continue;
-				}
+		for ( bit = 0; bit < 8; bit++ )
+		{
+			int cluster = ( i << 3 ) + bit;
+			int j;
+
+			if ( !( clientpvs[ i ] & ( 1 << bit ) ) || cluster >= entityIndex.numClusters )
+			{
+				continue;
 			}
 
-//          SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums, qtrue, oldframe, localClient );
-			SV_AddEntitiesVisibleFromPoint( ent->s.origin2, frame, eNums /*, qtrue, localClient */ );
+			for ( j = entityIndex.clusterFirst[ cluster ]; j < entityIndex.clusterFirst[ cluster + 1 ]; j++ )
+			{
+				SV_AddEntityIfVisible( origin, frame, eNums, playerEnt, clientarea, clientpvs, visCheck, entityIndex.clusterEntities[ j ] );
+			}
 		}
-
-		continue;
 	}
 }
 
@@ -720,7 +1112,7 @@ static void SV_BuildClientSnapshot( client_t *client )
 
 	// add all the entities directly visible to the eye, which
 	// may include portal entities that merge other viewpoints
-	SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers /*, qfalse, client->netchan.remoteAddress.type == NA_LOOPBACK */ );
+	SV_AddEntitiesVisibleFromPoint( org, frame, &entityNumbers );
 
 	// if there were portals visible, there may be out of order entities
 	// in the list which will need to be resorted for the delta compression
@@ -755,6 +1147,9 @@ static void SV_BuildClientSnapshot( client_t *client )
 
 		frame->num_entities++;
 	}
+
+	snapshotStats.snapshots++;
+	snapshotStats.emitted += frame->num_entities;
 }
 
 #ifdef USE_VOIP
@@ -847,6 +1242,12 @@ static int SV_RateMsec( client_t *client, int messageSize )
 	else
 	{
 		maxRate = sv_dl_maxRate->integer;
+
+		// and the fair share of sv_dlRate
+		if ( svs.downloadRateShare && svs.downloadRateShare < rate )
+		{
+			rate = svs.downloadRateShare;
+		}
 	}
 
 	if ( maxRate )
@@ -875,7 +1276,7 @@ void SV_SendMessageToClient( msg_t *msg, client_t *client )
 
 	// record information about the message
 	client->frames[ client->netchan.outgoingSequence & PACKET_MASK ].messageSize = msg->cursize;
-	client->frames[ client->netchan.outgoingSequence & PACKET_MASK ].messageSent = svs.time;
+	client->frames[ client->netchan.outgoingSequence & PACKET_MASK ].messageSent = Sys_Milliseconds();
 	client->frames[ client->netchan.outgoingSequence & PACKET_MASK ].messageAcked = -1;
 
 	// send the datagram
@@ -973,6 +1374,59 @@ void SV_SendClientIdle( client_t *client )
 	sv.ubpsTotalBytes += msg.uncompsize / 8; // NERVE - SMF - net debugging
 }
 
+/*
+=======================
+SV_WriteSnapshotMessage
+
+Writes the reliable commands and the snapshot of a client,
+may be called from the snapshot worker threads
+=======================
+*/
+static void SV_WriteSnapshotMessage( client_t *client, clientSnapshot_t *oldframe, int lastframe, msg_t *msg, EntityDeltaCache *cache )
+{
+	// NOTE, MRE: all server->client messages now acknowledge
+	// let the client know which reliable clientCommands we have received
+	MSG_WriteLong( msg, client->lastClientCommand );
+
+	// (re)send any reliable server commands
+	SV_UpdateServerCommandsToClient( client, msg );
+
+	// send over all the relevant entityState_t
+	// and the playerState_t
+	SV_WriteSnapshotToClient( client, oldframe, lastframe, msg, cache );
+}
+
+/*
+=======================
+SV_FinishSnapshotMessage
+
+Appends the download and voip data and sends the message
+=======================
+*/
+static void SV_FinishSnapshotMessage( client_t *client, msg_t *msg )
+{
+	// Add any download data if the client is downloading
+	SV_WriteDownloadToClient( client, msg );
+#ifdef USE_VOIP
+	SV_WriteVoipToClient( client, msg );
+#endif
+
+	// check for overflow
+	if ( msg->overflowed )
+	{
+		Com_Logf(LOG_WARN, "msg overflowed for %s", client->name );
+		MSG_Clear( msg );
+
+		SV_DropClient( client, "Msg overflowed" );
+		return;
+	}
+
+	SV_SendMessageToClient( msg, client );
+
+	sv.bpsTotalBytes += msg->cursize; // NERVE - SMF - net debugging
+	sv.ubpsTotalBytes += msg->uncompsize / 8; // NERVE - SMF - net debugging
+}
+
 /*
 =======================
 SV_SendClientSnapshot
@@ -983,8 +1437,10 @@ Also called by SV_FinalCommand
 */
 void SV_SendClientSnapshot( client_t *client )
 {
-	byte  msg_buf[ MAX_MSGLEN ];
-	msg_t msg;
+	byte             msg_buf[ MAX_MSGLEN ];
+	msg_t            msg;
+	clientSnapshot_t *oldframe;
+	int              lastframe;
 
 	//bani
 	if ( client->state < CS_ACTIVE )
@@ -1008,40 +1464,197 @@ void SV_SendClientSnapshot( client_t *client )
 		return;
 	}
 
+	SV_SelectDeltaFrame( client, &oldframe, &lastframe );
+
 	MSG_Init( &msg, msg_buf, sizeof( msg_buf ) );
 	msg.allowoverflow = qtrue;
 
-	// NOTE, MRE: all server->client messages now acknowledge
-	// let the client know which reliable clientCommands we have received
-	MSG_WriteLong( &msg, client->lastClientCommand );
+	SV_WriteSnapshotMessage( client, oldframe, lastframe, &msg, sv_snapshotDeltaCache.Get() ? &mainDeltaCache : nullptr );
+	SV_FinishSnapshotMessage( client, &msg );
+}
 
-	// (re)send any reliable server commands
-	SV_UpdateServerCommandsToClient( client, &msg );
+/*
+=============================================================================
 
-	// send over all the relevant entityState_t
-	// and the playerState_t
-	SV_WriteSnapshotToClient( client, &msg );
+Parallel snapshot encoding
 
-	// Add any download data if the client is downloading
-	SV_WriteDownloadToClient( client, &msg );
-#ifdef USE_VOIP
-	SV_WriteVoipToClient( client, &msg );
-#endif
+Once the snapshots of a frame are built, nothing the delta encoding reads
+changes until the next game frame, so the messages of the clients can be
+encoded by a pool of worker threads. Building the snapshots (which may call
+into the game VM) and sending the messages stay on the main thread, in
+client order.
 
-	// check for overflow
-	if ( msg.overflowed )
+=============================================================================
+*/
+
+static Cvar::Range<Cvar::Cvar<int>> sv_snapshotThreads("sv_snapshotThreads", "number of worker threads encoding client snapshots, 0 to encode them on the main thread", Cvar::NONE, 0, 0, 32);
+
+typedef struct
+{
+	client_t         *client;
+	clientSnapshot_t *oldframe;
+	int              lastframe;
+	msg_t            msg;
+	byte             msgBuffer[ MAX_MSGLEN ];
+} snapshotJob_t;
+
+static std::vector<snapshotJob_t> snapshotJobs;
+
+class SnapshotWorkerPool
+{
+public:
+	SnapshotWorkerPool(): generation( 0 ), quit( false ), jobs( nullptr ), numJobs( 0 ), useCache( false ), pending( 0 ) {}
+
+	~SnapshotWorkerPool()
 	{
-		Com_Logf(LOG_WARN, "msg overflowed for %s", client->name );
-		MSG_Clear( &msg );
+		Resize( 0 );
+	}
 
-		SV_DropClient( client, "Msg overflowed" );
-		return;
+	// encodes the jobs with numThreads workers, the calling thread helping them
+	void Run( int numThreads, snapshotJob_t *jobs, int numJobs, bool useCache )
+	{
+		if ( numThreads != ( int ) threads.size() )
+		{
+			Resize( numThreads );
+		}
+
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			this->jobs = jobs;
+			this->numJobs = numJobs;
+			this->useCache = useCache;
+			nextJob = 0;
+			pending = threads.size();
+			generation++;
+		}
+
+		workCondition.notify_all();
+		EncodeJobs( &mainDeltaCache );
+
+		std::unique_lock<std::mutex> lock( mutex );
+		doneCondition.wait( lock, [this] { return pending == 0; } );
 	}
 
-	SV_SendMessageToClient( &msg, client );
+	// moves the counters of the worker caches to the given ones
+	void CollectCacheStats( int *hits, int *misses )
+	{
+		for ( auto& cache : caches )
+		{
+			*hits += cache->hits;
+			*misses += cache->misses;
+			cache->hits = cache->misses = 0;
+		}
+	}
 
-	sv.bpsTotalBytes += msg.cursize; // NERVE - SMF - net debugging
-	sv.ubpsTotalBytes += msg.uncompsize / 8; // NERVE - SMF - net debugging
+private:
+	void Resize( int numThreads )
+	{
+		{
+			std::lock_guard<std::mutex> lock( mutex );
+			quit = true;
+		}
+
+		workCondition.notify_all();
+
+		for ( std::thread& thread : threads )
+		{
+			thread.join();
+		}
+
+		threads.clear();
+		caches.clear();
+		quit = false;
+
+		for ( int i = 0; i < numThreads; i++ )
+		{
+			int              start = generation;
+			EntityDeltaCache *cache = new EntityDeltaCache;
+
+			caches.emplace_back( cache );
+			threads.emplace_back( [this, start, cache] { WorkerMain( start, cache ); } );
+		}
+	}
+
+	void WorkerMain( int seen, EntityDeltaCache *cache )
+	{
+		std::unique_lock<std::mutex> lock( mutex );
+
+		while ( true )
+		{
+			workCondition.wait( lock, [this, seen] { return quit || generation != seen; } );
+
+			if ( quit )
+			{
+				return;
+			}
+
+			seen = generation;
+
+			lock.unlock();
+			EncodeJobs( cache );
+			lock.lock();
+
+			if ( --pending == 0 )
+			{
+				doneCondition.notify_one();
+			}
+		}
+	}
+
+	void EncodeJobs( EntityDeltaCache *cache )
+	{
+		int i;
+
+		while ( ( i = nextJob++ ) < numJobs )
+		{
+			snapshotJob_t *job = &jobs[ i ];
+
+			SV_WriteSnapshotMessage( job->client, job->oldframe, job->lastframe, &job->msg, useCache ? cache : nullptr );
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<EntityDeltaCache>> caches;
+	std::mutex               mutex;
+	std::condition_variable  workCondition;
+	std::condition_variable  doneCondition;
+	int                      generation;
+	bool                     quit;
+
+	snapshotJob_t            *jobs;
+	int                      numJobs;
+	bool                     useCache;
+	std::atomic<int>         nextJob;
+	int                      pending;
+};
+
+static SnapshotWorkerPool snapshotWorkers;
+
+/*
+=======================
+SV_PrepareSnapshotJob
+
+Builds the snapshot of the client on the main thread and queues its encoding,
+returns false if the client was handled without needing a job
+=======================
+*/
+static bool SV_PrepareSnapshotJob( client_t *client, snapshotJob_t *job )
+{
+	if ( client->state < CS_ACTIVE && client->state != CS_ZOMBIE )
+	{
+		SV_SendClientIdle( client );
+		return false;
+	}
+
+	SV_BuildClientSnapshot( client );
+
+	job->client = client;
+	SV_SelectDeltaFrame( client, &job->oldframe, &job->lastframe );
+
+	MSG_Init( &job->msg, job->msgBuffer, sizeof( job->msgBuffer ) );
+	job->msg.allowoverflow = qtrue;
+
+	return true;
 }
 
 /*
@@ -1055,13 +1668,29 @@ void SV_SendClientMessages( void )
 	int      i;
 	client_t *c;
 	int      numclients = 0; // NERVE - SMF - net debugging
+	int      numThreads = sv_snapshotThreads.Get();
+	int      numJobs = 0;
+
+	if ( numThreads > 0 && ( int ) snapshotJobs.size() < sv_maxclients->integer )
+	{
+		snapshotJobs.resize( sv_maxclients->integer );
+	}
 
 	sv.bpsTotalBytes = 0; // NERVE - SMF - net debugging
 	sv.ubpsTotalBytes = 0; // NERVE - SMF - net debugging
 
+	// the game frame has moved entities since the index was built
+	entityIndex.valid = false;
+	Com_Memset( &snapshotStats, 0, sizeof( snapshotStats ) );
+	mainDeltaCache.hits = mainDeltaCache.misses = 0;
+	deltaCacheFrame++;
+
 	// Gordon: update any changed configstrings from this frame
 	SV_UpdateConfigStrings();
 
+	// split the download bandwidth between the clients which are downloading
+	SV_ScheduleDownloads();
+
 	// send a message to each connected client
 	for ( i = 0; i < sv_maxclients->integer; i++ )
 	{
@@ -1098,9 +1727,47 @@ void SV_SendClientMessages( void )
 		}
 
 		// generate and send a new message
+		if ( numThreads > 0 )
+		{
+			if ( SV_PrepareSnapshotJob( c, &snapshotJobs[ numJobs ] ) )
+			{
+				numJobs++;
+			}
+
+			continue;
+		}
+
 		SV_SendClientSnapshot( c );
 	}
 
+	if ( numJobs > 0 )
+	{
+		snapshotWorkers.Run( numThreads, snapshotJobs.data(), numJobs, sv_snapshotDeltaCache.Get() );
+
+		for ( i = 0; i < numJobs; i++ )
+		{
+			SV_FinishSnapshotMessage( snapshotJobs[ i ].client, &snapshotJobs[ i ].msg );
+		}
+	}
+
+	// snapshots built outside of this function must not see a stale index
+	entityIndex.valid = false;
+
+	snapshotStats.deltaCacheHits = mainDeltaCache.hits;
+	snapshotStats.deltaCacheMisses = mainDeltaCache.misses;
+	snapshotWorkers.CollectCacheStats( &snapshotStats.deltaCacheHits, &snapshotStats.deltaCacheMisses );
+
+	if ( sv_snapshotStats.Get() && snapshotStats.snapshots > 0 )
+	{
+		int deltas = snapshotStats.deltaCacheHits + snapshotStats.deltaCacheMisses;
+
+		Com_Printf( "snapshots: %i, entities examined: %i, sent: %i, indexed: %i, delta cache hits: %i/%i (%.0f%%)\n",
+		            snapshotStats.snapshots, snapshotStats.examined, snapshotStats.emitted,
+		            ( int ) ( entityIndex.clusterEntities.size() + entityIndex.otherEntities.size() ),
+		            snapshotStats.deltaCacheHits, deltas,
+		            deltas ? 100.0f * snapshotStats.deltaCacheHits / deltas : 0.0f );
+	}
+
 	// NERVE - SMF - net debugging
 	if ( sv_showAverageBPS->integer && numclients > 0 )
 	{
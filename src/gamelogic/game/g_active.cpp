@@ -509,6 +509,7 @@ void SpectatorThink( gentity_t *ent, usercmd_t *ucmd )
 	int       clientNum;
 	qboolean  attack1, following, queued, attackReleased;
 	team_t    team;
+	traceSource_t traceSource;
 
 	client = ent->client;
 
@@ -644,7 +645,9 @@ void SpectatorThink( gentity_t *ent, usercmd_t *ucmd )
 		pm.pointcontents = trap_PointContents;
 
 		// Perform a pmove
+		traceSource = trap_SetTraceSource( TRACE_SOURCE_PMOVE );
 		Pmove( &pm );
+		trap_SetTraceSource( traceSource );
 
 		// Save results of pmove
 		VectorCopy( client->ps.origin, ent->s.origin );
@@ -812,7 +815,10 @@ void ClientTimerActions( gentity_t *ent, int msec )
 
 	if( ent->r.svFlags & SVF_BOT )
 	{
+		traceSource_t traceSource = trap_SetTraceSource( TRACE_SOURCE_BOTS );
+
 		G_BotThink( ent );
+		trap_SetTraceSource( traceSource );
 	}
 
 	while ( client->time100 >= 100 )
@@ -1743,6 +1749,7 @@ void ClientThink_real( gentity_t *self )
 	int       oldEventSequence;
 	int       msec;
 	usercmd_t *ucmd;
+	traceSource_t traceSource;
 
 	client = self->client;
 
@@ -2019,7 +2026,9 @@ void ClientThink_real( gentity_t *self )
 	// moved from after Pmove -- potentially the cause of future triggering bugs
 	G_TouchTriggers( self );
 
+	traceSource = trap_SetTraceSource( TRACE_SOURCE_PMOVE );
 	Pmove( &pm );
+	trap_SetTraceSource( traceSource );
 
 	G_UnlaggedDetectCollisions( self );
 
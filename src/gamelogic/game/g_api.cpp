@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "g_local.h"
 #include "g_cm_world.h"
+#include "../../engine/botlib/bot_api.h"
 #include "../shared/VMMain.h"
 #include "../shared/CommonProxies.h"
 
@@ -52,6 +53,8 @@ static IPC::Channel GetRootChannel(int argc, char** argv)
 class ExitException{};
 
 void VM::Exit() {
+  // Don't lose the queued messages, such as the error message
+  VM::rootChannel.FlushBatch();
   throw ExitException();
 }
 
@@ -59,21 +62,36 @@ IPC::Channel VM::rootChannel;
 
 static IPC::SharedMemory shmRegion;
 
+// Strings mirrored by the engine after the clients in the shared memory region.
+// The mirror is stale from the time we change them until the engine processed
+// our messages, that is until the next synchronous message.
+static sharedStrings_t* sharedStrings;
+static bool sharedStringsStale = true;
+
+static void InitVM()
+{
+	// Send syscall ABI version, also acts as a sign that the module loaded
+	IPC::Writer writer;
+	writer.Write<uint32_t>(GAME_API_VERSION);
+	VM::rootChannel.SendMsg(writer);
+
+	// Queue the one-way messages, they go out with the next synchronous
+	// message or reply so that the engine sees them in order
+	VM::rootChannel.SetBatching(true);
+
+	// Allocate entities, clients and strings shared memory region
+	shmRegion = IPC::SharedMemory::Create(sizeof(gentity_t) * MAX_GENTITIES + sizeof(gclient_t) * MAX_CLIENTS + sizeof(sharedStrings_t));
+	char* shmBase = reinterpret_cast<char*>(shmRegion.GetBase());
+	g_entities = reinterpret_cast<gentity_t*>(shmBase);
+	g_clients = reinterpret_cast<gclient_t*>(shmBase + sizeof(gentity_t) * MAX_GENTITIES);
+	sharedStrings = reinterpret_cast<sharedStrings_t*>(shmBase + sizeof(gentity_t) * MAX_GENTITIES + sizeof(gclient_t) * MAX_CLIENTS);
+}
+
 DLLEXPORT int main(int argc, char** argv)
 {
 	try {
 		VM::rootChannel = GetRootChannel(argc, argv);
-
-		// Send syscall ABI version, also acts as a sign that the module loaded
-		IPC::Writer writer;
-		writer.Write<uint32_t>(GAME_API_VERSION);
-		VM::rootChannel.SendMsg(writer);
-
-		// Allocate entities and clients shared memory region
-		shmRegion = IPC::SharedMemory::Create(sizeof(gentity_t) * MAX_GENTITIES + sizeof(gclient_t) * MAX_CLIENTS);
-		char* shmBase = reinterpret_cast<char*>(shmRegion.GetBase());
-		g_entities = reinterpret_cast<gentity_t*>(shmBase);
-		g_clients = reinterpret_cast<gclient_t*>(shmBase + sizeof(gentity_t) * MAX_GENTITIES);
+		InitVM();
 
 		// Start main loop
 		while (true) {
@@ -86,6 +104,27 @@ DLLEXPORT int main(int argc, char** argv)
 	}
 }
 
+// Entry point of the direct native DLL mode, we run on the engine's thread and
+// handle its messages as they are sent instead of having a main loop
+extern "C" DLLEXPORT IPC::DirectPeer vmDirectMain(IPC::DirectPeer engine)
+{
+	VM::rootChannel = IPC::Channel();
+	VM::rootChannel.ConnectDirect(engine);
+	try {
+		InitVM();
+	} catch (ExitException e) {
+	}
+
+	// The engine gets an error when we don't reply after exiting
+	VM::rootChannel.SetDirectHandler([](uint32_t id, IPC::Reader reader) {
+		try {
+			VM::VMMain(id, std::move(reader));
+		} catch (ExitException e) {
+		}
+	});
+	return VM::rootChannel.GetDirectPeer();
+}
+
 //HACK: NaCl doesn't support messages bigger than 128k so for now
 //we send it by small chunks
 
@@ -107,6 +146,10 @@ void VM::VMMain(uint32_t id, IPC::Reader reader)
 {
 	int major = id >> 16;
 	int minor = id & 0xffff;
+
+	// The engine handled everything we sent before calling us
+	sharedStringsStale = false;
+
 	if (major == VM::QVM) {
 		switch (minor) {
 		case GAME_STATIC_INIT:
@@ -302,6 +345,7 @@ void trap_LocateGameData(gentity_t *, int numGEntities, int sizeofGEntity_t, pla
 	static bool firstTime = true;
 	if (firstTime) {
 		VM::SendMsg<LocateGameDataMsg1>(shmRegion, numGEntities, sizeofGEntity_t, sizeofGClient);
+		sharedStringsStale = true;
 		firstTime = false;
 	} else
 		VM::SendMsg<LocateGameDataMsg2>(numGEntities, sizeofGEntity_t, sizeofGClient);
@@ -340,6 +384,17 @@ void trap_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const
 	G_CM_Trace(results, start, mins, maxs, end, passEntityNum, contentmask, skipmask, TT_AABB);
 }
 
+void trap_TraceBatch( trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *mins, const vec3_t *maxs,
+                      const vec3_t *ends, int passEntityNum, int contentmask, int skipmask )
+{
+	G_CM_TraceBatch(results, numTraces, starts, mins, maxs, ends, passEntityNum, contentmask, skipmask, TT_AABB);
+}
+
+traceSource_t trap_SetTraceSource(traceSource_t source)
+{
+	return CM_SetTraceSource(source);
+}
+
 int trap_PointContents(const vec3_t point, int passEntityNum)
 {
 	return G_CM_PointContents( point, passEntityNum );
@@ -388,16 +443,45 @@ void trap_SendServerCommand(int clientNum, const char *text)
 	VM::SendMsg<SendServerCommandMsg>(clientNum, text);
 }
 
+// Copies a string from the mirror, returns false if it didn't fit in the slot
+static bool ReadSharedString(const sharedString_t& slot, char *buffer, int bufferSize)
+{
+	while (true) {
+		uint32_t generation = slot.generation.load(std::memory_order_acquire);
+		if (generation & 1)
+			continue;
+
+		size_t len = slot.length;
+		if (len >= sizeof(slot.data))
+			return false;
+		len = std::min<size_t>(len, bufferSize - 1);
+		memcpy(buffer, slot.data, len);
+		buffer[len] = '\0';
+
+		// Retry if the engine changed the slot while we were copying it
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.generation.load(std::memory_order_relaxed) == generation)
+			return true;
+	}
+}
+
 void trap_SetConfigstring(int num, const char *string)
 {
 	VM::SendMsg<SetConfigStringMsg>(num, string);
+	sharedStringsStale = true;
 }
 
 void trap_GetConfigstring(int num, char *buffer, int bufferSize)
 {
-	std::string res;
+	if (!sharedStringsStale && num >= 0 && num < MAX_CONFIGSTRINGS && bufferSize >= 1) {
+		if (ReadSharedString(sharedStrings->configstrings[num], buffer, bufferSize))
+			return;
+	}
+
+	Str::StringRef res;
 	VM::SendMsg<GetConfigStringMsg>(num, bufferSize, res);
 	Q_strncpyz(buffer, res.c_str(), bufferSize);
+	sharedStringsStale = false;
 }
 
 void trap_SetConfigstringRestrictions(int num, const clientList_t *clientList)
@@ -408,20 +492,60 @@ void trap_SetConfigstringRestrictions(int num, const clientList_t *clientList)
 void trap_SetUserinfo(int num, const char *buffer)
 {
 	VM::SendMsg<SetUserinfoMsg>(num, buffer);
+	sharedStringsStale = true;
 }
 
 void trap_GetUserinfo(int num, char *buffer, int bufferSize)
 {
-	std::string res;
+	if (!sharedStringsStale && num >= 0 && num < level.maxclients && bufferSize >= 1) {
+		if (ReadSharedString(sharedStrings->userinfos[num], buffer, bufferSize))
+			return;
+	}
+
+	Str::StringRef res;
 	VM::SendMsg<GetUserinfoMsg>(num, bufferSize, res);
 	Q_strncpyz(buffer, res.c_str(), bufferSize);
+	sharedStringsStale = false;
 }
 
 void trap_GetServerinfo(char *buffer, int bufferSize)
 {
-	std::string res;
+	if (!sharedStringsStale && bufferSize >= 1) {
+		if (ReadSharedString(sharedStrings->serverinfo, buffer, bufferSize))
+			return;
+	}
+
+	Str::StringRef res;
 	VM::SendMsg<GetServerinfoMsg>(bufferSize, res);
 	Q_strncpyz(buffer, res.c_str(), bufferSize);
+	sharedStringsStale = false;
+}
+
+// The generation of a mirrored string changes every time the engine updates it,
+// polling code compares it with the last value it saw instead of copying the
+// string. Our own changes are seen once the engine processed them.
+static int SharedStringGeneration(const sharedString_t& slot)
+{
+	return slot.generation.load(std::memory_order_acquire);
+}
+
+int trap_ConfigstringGeneration(int num)
+{
+	if (num < 0 || num >= MAX_CONFIGSTRINGS)
+		return 0;
+	return SharedStringGeneration(sharedStrings->configstrings[num]);
+}
+
+int trap_UserinfoGeneration(int num)
+{
+	if (num < 0 || num >= level.maxclients)
+		return 0;
+	return SharedStringGeneration(sharedStrings->userinfos[num]);
+}
+
+int trap_ServerinfoGeneration(void)
+{
+	return SharedStringGeneration(sharedStrings->serverinfo);
 }
 
 void trap_GetUsercmd(int clientNum, usercmd_t *cmd)
@@ -523,34 +647,78 @@ int trap_Parse_AddGlobalDefine(const char *define)
 	return res;
 }
 
+// The sources are preprocessed by the engine in one go, the tokens are then
+// read from the packed reply without further round trips
+#define MAX_PARSE_SOURCES 64
+
+struct parseSource_t {
+	bool inuse;
+	std::string filename;
+	int line;
+	int tokensLeft;
+	IPC::Reader tokens;
+};
+
+static parseSource_t parseSources[MAX_PARSE_SOURCES];
+
 int trap_Parse_LoadSource(const char *filename)
 {
-	int res;
-	VM::SendMsg<ParseLoadSourceMsg>(filename, res);
-	return res;
+	int handle;
+	for (handle = 1; handle < MAX_PARSE_SOURCES; handle++) {
+		if (!parseSources[handle].inuse)
+			break;
+	}
+	if (handle >= MAX_PARSE_SOURCES)
+		return 0;
+
+	parseSource_t& source = parseSources[handle];
+	source = parseSource_t();
+	bool res;
+	VM::SendMsg<ParseLoadTokensMsg>(filename, res, source.filename, source.tokensLeft, source.tokens.GetData());
+	if (!res)
+		return 0;
+
+	source.inuse = true;
+	source.line = source.tokens.Read<int>();
+	return handle;
 }
 
 int trap_Parse_FreeSource(int handle)
 {
-	int res;
-	VM::SendMsg<ParseFreeSourceMsg>(handle, res);
-	return res;
+	if (handle < 1 || handle >= MAX_PARSE_SOURCES || !parseSources[handle].inuse)
+		return qfalse;
+
+	parseSources[handle] = parseSource_t();
+	return qtrue;
 }
 
 int trap_Parse_ReadToken(int handle, pc_token_t *pc_token)
 {
-	int res;
-	VM::SendMsg<ParseReadTokenMsg>(handle, res, *pc_token);
-	return res;
+	if (handle < 1 || handle >= MAX_PARSE_SOURCES || !parseSources[handle].inuse)
+		return 0;
+
+	parseSource_t& source = parseSources[handle];
+	if (source.tokensLeft <= 0)
+		return 0;
+
+	pc_token->type = source.tokens.Read<int>();
+	pc_token->subtype = source.tokens.Read<int>();
+	pc_token->intvalue = source.tokens.Read<int>();
+	pc_token->floatvalue = source.tokens.Read<float>();
+	source.line = source.tokens.Read<int>();
+	Q_strncpyz(pc_token->string, source.tokens.Read<Str::StringRef>().c_str(), sizeof(pc_token->string));
+	source.tokensLeft--;
+	return 1;
 }
 
 int trap_Parse_SourceFileAndLine(int handle, char *filename, int *line)
 {
-	int res;
-	std::string filename2;
-	VM::SendMsg<ParseSourceFileAndLineMsg>(handle, res, filename2, *line);
-	Q_strncpyz(filename, filename2.c_str(), 128);
-	return res;
+	if (handle < 1 || handle >= MAX_PARSE_SOURCES || !parseSources[handle].inuse)
+		return qfalse;
+
+	Q_strncpyz(filename, parseSources[handle].filename.c_str(), 128);
+	*line = parseSources[handle].line;
+	return qtrue;
 }
 
 void trap_QuoteString(const char *str, char *buffer, int size)
@@ -579,8 +747,23 @@ int trap_BotGetServerCommand(int clientNum, char *message, int size)
 	return res;
 }
 
+// The navigation meshes are either loaded by the engine or, with
+// g_bot_localNav, directly in the game module so that the per-frame bot
+// queries don't need a round trip to the engine. The choice is made when the
+// first navigation mesh is set up so that all the queries go to the same side.
+static bool navSetup = false;
+static bool localNav = false;
+
 qboolean trap_BotSetupNav(const botClass_t *botClass, qhandle_t *navHandle)
 {
+	if (!navSetup) {
+		localNav = g_bot_localNav.integer != 0;
+		navSetup = true;
+	}
+
+	if (localNav)
+		return BotSetupNav(botClass, navHandle);
+
 	int res;
 	VM::SendMsg<BotNavSetupMsg>(*botClass, res, *navHandle);
 	return res;
@@ -588,16 +771,28 @@ qboolean trap_BotSetupNav(const botClass_t *botClass, qhandle_t *navHandle)
 
 void trap_BotShutdownNav(void)
 {
-	VM::SendMsg<BotNavShutdownMsg>();
+	if (localNav)
+		BotShutdownNav();
+	else
+		VM::SendMsg<BotNavShutdownMsg>();
+	navSetup = false;
+	localNav = false;
 }
 
 void trap_BotSetNavMesh(int botClientNum, qhandle_t navHandle)
 {
+	if (localNav) {
+		BotSetNavMesh(botClientNum, navHandle);
+		return;
+	}
 	VM::SendMsg<BotSetNavmeshMsg>(botClientNum, navHandle);
 }
 
 qboolean trap_BotFindRoute(int botClientNum, const botRouteTarget_t *target, qboolean allowPartial)
 {
+	if (localNav)
+		return BotFindRouteExt(botClientNum, target, allowPartial);
+
 	int res;
 	VM::SendMsg<BotFindRouteMsg>(botClientNum, *target, allowPartial, res);
 	return res;
@@ -605,12 +800,18 @@ qboolean trap_BotFindRoute(int botClientNum, const botRouteTarget_t *target, qbo
 
 qboolean trap_BotUpdatePath(int botClientNum, const botRouteTarget_t *target, botNavCmd_t *cmd)
 {
-	VM::SendMsg<BotUpdatePathMsg>(botClientNum, *target, *cmd);
+	if (localNav)
+		BotUpdateCorridor(botClientNum, target, cmd);
+	else
+		VM::SendMsg<BotUpdatePathMsg>(botClientNum, *target, *cmd);
 	return 0; // Amanieu: This always returns 0, but the value isn't used
 }
 
 qboolean trap_BotNavTrace(int botClientNum, botTrace_t *botTrace, const vec3_t start, const vec3_t end)
 {
+	if (localNav)
+		return BotNavTrace(botClientNum, botTrace, start, end);
+
 	std::array<float, 3> start2, end2;
 	VectorCopy(start, start2.data());
 	VectorCopy(end, end2.data());
@@ -621,6 +822,11 @@ qboolean trap_BotNavTrace(int botClientNum, botTrace_t *botTrace, const vec3_t s
 
 void trap_BotFindRandomPoint(int botClientNum, vec3_t point)
 {
+	if (localNav) {
+		BotFindRandomPoint(botClientNum, point);
+		return;
+	}
+
 	std::array<float, 3> point2;
 	VM::SendMsg<BotNavRandomPointMsg>(botClientNum, point2);
 	VectorCopy(point2.data(), point);
@@ -628,6 +834,9 @@ void trap_BotFindRandomPoint(int botClientNum, vec3_t point)
 
 qboolean trap_BotFindRandomPointInRadius(int botClientNum, const vec3_t origin, vec3_t point, float radius)
 {
+	if (localNav)
+		return BotFindRandomPointInRadius(botClientNum, origin, point, radius);
+
 	std::array<float, 3> point2, origin2;
 	VectorCopy(origin, origin2.data());
 	int res;
@@ -638,6 +847,11 @@ qboolean trap_BotFindRandomPointInRadius(int botClientNum, const vec3_t origin,
 
 void trap_BotEnableArea(const vec3_t origin, const vec3_t mins, const vec3_t maxs)
 {
+	if (localNav) {
+		BotEnableArea(origin, mins, maxs);
+		return;
+	}
+
 	std::array<float, 3> origin2, mins2, maxs2;
 	VectorCopy(origin, origin2.data());
 	VectorCopy(mins, mins2.data());
@@ -647,6 +861,11 @@ void trap_BotEnableArea(const vec3_t origin, const vec3_t mins, const vec3_t max
 
 void trap_BotDisableArea(const vec3_t origin, const vec3_t mins, const vec3_t maxs)
 {
+	if (localNav) {
+		BotDisableArea(origin, mins, maxs);
+		return;
+	}
+
 	std::array<float, 3> origin2, mins2, maxs2;
 	VectorCopy(origin, origin2.data());
 	VectorCopy(mins, mins2.data());
@@ -656,6 +875,11 @@ void trap_BotDisableArea(const vec3_t origin, const vec3_t mins, const vec3_t ma
 
 void trap_BotAddObstacle(const vec3_t mins, const vec3_t maxs, qhandle_t *handle)
 {
+	if (localNav) {
+		BotAddObstacle(mins, maxs, handle);
+		return;
+	}
+
 	std::array<float, 3> mins2, maxs2;
 	VectorCopy(mins, mins2.data());
 	VectorCopy(maxs, maxs2.data());
@@ -664,10 +888,29 @@ void trap_BotAddObstacle(const vec3_t mins, const vec3_t maxs, qhandle_t *handle
 
 void trap_BotRemoveObstacle(qhandle_t handle)
 {
+	if (localNav) {
+		BotRemoveObstacle(handle);
+		return;
+	}
 	VM::SendMsg<BotRemoveObstacleMsg>(handle);
 }
 
 void trap_BotUpdateObstacles(void)
 {
+	if (localNav) {
+		BotUpdateObstacles();
+		return;
+	}
 	VM::SendMsg<BotUpdateObstaclesMsg>();
 }
+
+// The entities and the time of the navigation code when it runs in the game
+sharedEntity_t *G_BotGentity(int num)
+{
+	return reinterpret_cast<sharedEntity_t*>(&g_entities[num]);
+}
+
+int G_BotNavTime(void)
+{
+	return level.time;
+}
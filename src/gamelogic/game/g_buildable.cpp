@@ -4159,6 +4159,7 @@ itemBuildError_t G_CanBuild( gentity_t *ent, buildable_t buildable, int distance
 	qboolean         invert;
 	int              contents;
 	playerState_t    *ps = &ent->client->ps;
+	traceSource_t    traceSource = trap_SetTraceSource( TRACE_SOURCE_BUILDABLES );
 
 	// Stop all buildables from interacting with traces
 	SetBuildableLinkState( qfalse );
@@ -4300,6 +4301,7 @@ itemBuildError_t G_CanBuild( gentity_t *ent, buildable_t buildable, int distance
 		level.numBuildablesForRemoval = 0;
 	}
 
+	trap_SetTraceSource( traceSource );
 	return reason;
 }
 
@@ -37,30 +37,19 @@ Maryland 20850 USA.
 #include "g_local.h"
 #include "g_cm_world.h"
 
-typedef struct worldEntity_s
-{
-	struct worldSector_s *worldSector;
-	struct worldEntity_s *nextEntityInWorldSector;
-} worldEntity_t;
-
-worldEntity_t wentities[ MAX_GENTITIES ];
-
-worldEntity_t *G_CM_WorldEntityForGentity( gentity_t *gEnt )
+/*
+================
+G_CM_EntityNum
+================
+*/
+static int G_CM_EntityNum( const gentity_t *gEnt )
 {
 	if ( !gEnt || gEnt->s.number < 0 || gEnt->s.number >= MAX_GENTITIES )
 	{
-		Com_Error( ERR_DROP, "G_CM_SvEntityForGentity: bad gEnt" );
+		Com_Error( ERR_DROP, "G_CM_EntityNum: bad gEnt" );
 	}
 
-	return &wentities[ gEnt->s.number ];
-}
-
-gentity_t *G_CM_GEntityForWorldEntity( worldEntity_t *ent )
-{
-	int num;
-
-	num = ent - wentities;
-	return &g_entities[ num ];
+	return gEnt->s.number;
 }
 
 /*
@@ -236,96 +225,695 @@ the world is carved up with an evenly spaced, axially aligned bsp tree.  Entitie
 are kept in chains either at the final leafs, or at the first node that splits
 them, which prevents having to deal with multiple fragments of a single entity.
 
+With g_entityTree, the linked entities are kept in a dynamic bounding volume
+hierarchy instead. Its leafs hold the entity boxes, fattened a little and
+stretched along the last move so that moving entities stay in them for a few
+frames, and each node holds the union of its two children. An entity goes next
+to the node that makes the tree grow the least, and the tree is rebalanced with
+rotations on the way back up, so that a base packed with buildables ends up in
+a subtree of its own instead of a single long chain.
+
+Both only hand out candidates, G_CM_AreaEntities does the exact box test.
+
 ===============================================================================
 */
 
-typedef struct worldSector_s
+static worldSectors_t worldSectors;
+static entityTree_t   entityTree;
+static qboolean       useEntityTree; // g_entityTree when the map was loaded
+
+/*
+===============
+G_CM_CreateWorldSector
+
+Builds a uniformly subdivided tree for the given world size
+===============
+*/
+static int G_CM_CreateWorldSector( worldSectors_t *ws, int depth, const vec3_t mins, const vec3_t maxs )
+{
+	int           index = ws->numSectors++;
+	worldSector_t *anode = &ws->sectors[ index ];
+	vec3_t        size;
+	vec3_t        mins1, maxs1, mins2, maxs2;
+
+	anode->entities = ENTITYNUM_NONE;
+
+	if ( depth == AREA_DEPTH )
+	{
+		anode->axis = -1;
+		anode->children[ 0 ] = anode->children[ 1 ] = -1;
+		return index;
+	}
+
+	VectorSubtract( maxs, mins, size );
+
+	if ( size[ 0 ] > size[ 1 ] )
+	{
+		anode->axis = 0;
+	}
+	else
+	{
+		anode->axis = 1;
+	}
+
+	anode->dist = 0.5 * ( maxs[ anode->axis ] + mins[ anode->axis ] );
+	VectorCopy( mins, mins1 );
+	VectorCopy( mins, mins2 );
+	VectorCopy( maxs, maxs1 );
+	VectorCopy( maxs, maxs2 );
+
+	maxs1[ anode->axis ] = mins2[ anode->axis ] = anode->dist;
+
+	anode->children[ 0 ] = G_CM_CreateWorldSector( ws, depth + 1, mins2, maxs2 );
+	anode->children[ 1 ] = G_CM_CreateWorldSector( ws, depth + 1, mins1, maxs1 );
+
+	return index;
+}
+
+/*
+===============
+G_CM_InitWorldSectors
+===============
+*/
+void G_CM_InitWorldSectors( worldSectors_t *ws, const vec3_t mins, const vec3_t maxs )
+{
+	int i;
+
+	ws->numSectors = 0;
+
+	for ( i = 0; i < MAX_GENTITIES; i++ )
+	{
+		ws->sectorOf[ i ] = -1;
+	}
+
+	memset( &ws->stats, 0, sizeof( ws->stats ) );
+
+	G_CM_CreateWorldSector( ws, 0, mins, maxs );
+}
+
+/*
+===============
+G_CM_UnlinkSectorEntity
+===============
+*/
+void G_CM_UnlinkSectorEntity( worldSectors_t *ws, int entityNum )
+{
+	int *scan;
+
+	if ( ws->sectorOf[ entityNum ] == -1 )
+	{
+		return; // not linked in anywhere
+	}
+
+	for ( scan = &ws->sectors[ ws->sectorOf[ entityNum ] ].entities; *scan != ENTITYNUM_NONE; scan = &ws->nextInSector[ *scan ] )
+	{
+		if ( *scan == entityNum )
+		{
+			*scan = ws->nextInSector[ entityNum ];
+			ws->sectorOf[ entityNum ] = -1;
+			return;
+		}
+	}
+
+	ws->sectorOf[ entityNum ] = -1;
+	Com_Printf( "WARNING: G_CM_UnlinkSectorEntity: not found in worldSector\n" );
+}
+
+/*
+===============
+G_CM_LinkSectorEntity
+
+Chains the entity at the first sector node its box crosses
+===============
+*/
+void G_CM_LinkSectorEntity( worldSectors_t *ws, int entityNum, const vec3_t absmin, const vec3_t absmax )
+{
+	worldSector_t *node;
+	int           index;
+
+	G_CM_UnlinkSectorEntity( ws, entityNum );
+
+	index = 0;
+
+	while ( 1 )
+	{
+		node = &ws->sectors[ index ];
+
+		if ( node->axis == -1 )
+		{
+			break;
+		}
+
+		if ( absmin[ node->axis ] > node->dist )
+		{
+			index = node->children[ 0 ];
+		}
+		else if ( absmax[ node->axis ] < node->dist )
+		{
+			index = node->children[ 1 ];
+		}
+		else
+		{
+			break; // crosses the node
+		}
+	}
+
+	ws->sectorOf[ entityNum ] = index;
+	ws->nextInSector[ entityNum ] = node->entities;
+	node->entities = entityNum;
+}
+
+/*
+===============
+G_CM_WorldSectorCandidates_r
+===============
+*/
+static int G_CM_WorldSectorCandidates_r( worldSectors_t *ws, int index, const vec3_t mins, const vec3_t maxs, int *list, int count )
 {
-	int                  axis; // -1 = leaf node
-	float                dist;
-	struct worldSector_s *children[ 2 ];
+	worldSector_t *node = &ws->sectors[ index ];
+	int           num;
+
+	ws->stats.sectorTests++;
+
+	for ( num = node->entities; num != ENTITYNUM_NONE; num = ws->nextInSector[ num ] )
+	{
+		list[ count++ ] = num;
+	}
+
+	if ( node->axis == -1 )
+	{
+		return count; // terminal node
+	}
+
+	// recurse down both sides
+	if ( maxs[ node->axis ] > node->dist )
+	{
+		count = G_CM_WorldSectorCandidates_r( ws, node->children[ 0 ], mins, maxs, list, count );
+	}
+
+	if ( mins[ node->axis ] < node->dist )
+	{
+		count = G_CM_WorldSectorCandidates_r( ws, node->children[ 1 ], mins, maxs, list, count );
+	}
+
+	return count;
+}
+
+/*
+===============
+G_CM_WorldSectorCandidates
+
+Lists the entities chained in the sectors the bounds touch, at most once each
+===============
+*/
+int G_CM_WorldSectorCandidates( worldSectors_t *ws, const vec3_t mins, const vec3_t maxs, int *list )
+{
+	int count = G_CM_WorldSectorCandidates_r( ws, 0, mins, maxs, list, 0 );
+
+	ws->stats.queries++;
+	ws->stats.candidates += count;
+
+	return count;
+}
+
+/*
+===============
+G_CM_InitEntityTree
+===============
+*/
+void G_CM_InitEntityTree( entityTree_t *tree )
+{
+	int i;
+
+	for ( i = 0; i < ENTITY_TREE_NODES; i++ )
+	{
+		tree->nodes[ i ].parent = i + 1 < ENTITY_TREE_NODES ? i + 1 : ENTITY_TREE_NULL;
+		tree->nodes[ i ].height = -1;
+	}
+
+	for ( i = 0; i < MAX_GENTITIES; i++ )
+	{
+		tree->leafs[ i ] = ENTITY_TREE_NULL;
+	}
+
+	tree->root = ENTITY_TREE_NULL;
+	tree->freeList = 0;
+	memset( &tree->stats, 0, sizeof( tree->stats ) );
+}
+
+/*
+===============
+G_CM_AllocEntityNode
+
+Can't run out, as there are at most MAX_GENTITIES leafs and one less node
+===============
+*/
+static int G_CM_AllocEntityNode( entityTree_t *tree )
+{
+	int          index = tree->freeList;
+	entityNode_t *node = &tree->nodes[ index ];
+
+	tree->freeList = node->parent;
+	node->parent = ENTITY_TREE_NULL;
+	node->children[ 0 ] = node->children[ 1 ] = ENTITY_TREE_NULL;
+	node->height = 0;
+	node->entityNum = ENTITYNUM_NONE;
+
+	return index;
+}
+
+/*
+===============
+G_CM_FreeEntityNode
+===============
+*/
+static void G_CM_FreeEntityNode( entityTree_t *tree, int index )
+{
+	tree->nodes[ index ].parent = tree->freeList;
+	tree->nodes[ index ].height = -1;
+	tree->freeList = index;
+}
+
+/*
+===============
+G_CM_BoxArea
+
+Half the surface area of a box, the cost of visiting a node
+===============
+*/
+static float G_CM_BoxArea( const vec3_t mins, const vec3_t maxs )
+{
+	float dx = maxs[ 0 ] - mins[ 0 ];
+	float dy = maxs[ 1 ] - mins[ 1 ];
+	float dz = maxs[ 2 ] - mins[ 2 ];
+
+	return dx * dy + dy * dz + dz * dx;
+}
+
+/*
+===============
+G_CM_UnionArea
+===============
+*/
+static float G_CM_UnionArea( const entityNode_t *a, const entityNode_t *b )
+{
+	vec3_t mins, maxs;
+	int    i;
+
+	for ( i = 0; i < 3; i++ )
+	{
+		mins[ i ] = MIN( a->mins[ i ], b->mins[ i ] );
+		maxs[ i ] = MAX( a->maxs[ i ], b->maxs[ i ] );
+	}
+
+	return G_CM_BoxArea( mins, maxs );
+}
+
+/*
+===============
+G_CM_RefitEntityNode
+
+Sets the box and height of a node from its children
+===============
+*/
+static void G_CM_RefitEntityNode( entityTree_t *tree, int index )
+{
+	entityNode_t *node = &tree->nodes[ index ];
+	entityNode_t *a = &tree->nodes[ node->children[ 0 ] ];
+	entityNode_t *b = &tree->nodes[ node->children[ 1 ] ];
+	int          i;
+
+	for ( i = 0; i < 3; i++ )
+	{
+		node->mins[ i ] = MIN( a->mins[ i ], b->mins[ i ] );
+		node->maxs[ i ] = MAX( a->maxs[ i ], b->maxs[ i ] );
+	}
+
+	node->height = 1 + MAX( a->height, b->height );
+}
+
+/*
+===============
+G_CM_RotateEntityNode
+
+Lifts the child c of node a in its place, when c's subtree is at least two
+levels deeper than its sibling's. Returns the index now at a's place
+===============
+*/
+static int G_CM_RotateEntityNode( entityTree_t *tree, int a, int side )
+{
+	entityNode_t *A = &tree->nodes[ a ];
+	int          c = A->children[ side ];
+	entityNode_t *C = &tree->nodes[ c ];
+	int          f = C->children[ 0 ];
+	int          g = C->children[ 1 ];
+
+	// c takes a's place
+	C->children[ 0 ] = a;
+	C->parent = A->parent;
+	A->parent = c;
+
+	if ( C->parent == ENTITY_TREE_NULL )
+	{
+		tree->root = c;
+	}
+	else if ( tree->nodes[ C->parent ].children[ 0 ] == a )
+	{
+		tree->nodes[ C->parent ].children[ 0 ] = c;
+	}
+	else
+	{
+		tree->nodes[ C->parent ].children[ 1 ] = c;
+	}
+
+	// the deeper grandchild stays under c, the other one goes to a
+	if ( tree->nodes[ f ].height < tree->nodes[ g ].height )
+	{
+		int t = f;
+
+		f = g;
+		g = t;
+	}
+
+	C->children[ 1 ] = f;
+	A->children[ side ] = g;
+	tree->nodes[ g ].parent = a;
+
+	G_CM_RefitEntityNode( tree, a );
+	G_CM_RefitEntityNode( tree, c );
+	tree->stats.rotations++;
+
+	return c;
+}
+
+/*
+===============
+G_CM_BalanceEntityNode
+===============
+*/
+static int G_CM_BalanceEntityNode( entityTree_t *tree, int index )
+{
+	entityNode_t *node = &tree->nodes[ index ];
+	int          balance;
+
+	if ( node->height < 2 )
+	{
+		return index;
+	}
+
+	balance = tree->nodes[ node->children[ 1 ] ].height - tree->nodes[ node->children[ 0 ] ].height;
+
+	if ( balance > 1 )
+	{
+		return G_CM_RotateEntityNode( tree, index, 1 );
+	}
+
+	if ( balance < -1 )
+	{
+		return G_CM_RotateEntityNode( tree, index, 0 );
+	}
+
+	return index;
+}
+
+/*
+===============
+G_CM_FixEntityTree
+
+Refits and rebalances the ancestors of a node that changed
+===============
+*/
+static void G_CM_FixEntityTree( entityTree_t *tree, int index )
+{
+	entityNode_t *node;
+	entityNode_t old;
+	int          balanced;
+
+	while ( index != ENTITY_TREE_NULL )
+	{
+		old = tree->nodes[ index ];
+		balanced = G_CM_BalanceEntityNode( tree, index );
+		node = &tree->nodes[ balanced ];
+		G_CM_RefitEntityNode( tree, balanced );
+
+		// nothing changes further up if this subtree still looks the same
+		if ( balanced == index && node->height == old.height &&
+		     VectorCompare( node->mins, old.mins ) && VectorCompare( node->maxs, old.maxs ) )
+		{
+			return;
+		}
+
+		index = node->parent;
+	}
+}
+
+/*
+===============
+G_CM_InsertEntityLeaf
+===============
+*/
+static void G_CM_InsertEntityLeaf( entityTree_t *tree, int leaf )
+{
+	entityNode_t *leafNode = &tree->nodes[ leaf ];
+	int          index, sibling, oldParent, newParent;
+	float        area, combinedArea, cost, inheritance, childCost[ 2 ];
+	int          i;
+
+	if ( tree->root == ENTITY_TREE_NULL )
+	{
+		tree->root = leaf;
+		leafNode->parent = ENTITY_TREE_NULL;
+		return;
+	}
+
+	// walk down towards the cheapest sibling: pairing the leaf with a node
+	// costs the area of their union, and every node above grows as well
+	index = tree->root;
+
+	while ( tree->nodes[ index ].height > 0 )
+	{
+		entityNode_t *node = &tree->nodes[ index ];
+
+		area = G_CM_BoxArea( node->mins, node->maxs );
+		combinedArea = G_CM_UnionArea( node, leafNode );
+		cost = 2.0f * combinedArea;
+		inheritance = 2.0f * ( combinedArea - area );
+
+		for ( i = 0; i < 2; i++ )
+		{
+			entityNode_t *child = &tree->nodes[ node->children[ i ] ];
+
+			childCost[ i ] = G_CM_UnionArea( child, leafNode ) + inheritance;
+
+			if ( child->height > 0 )
+			{
+				childCost[ i ] -= G_CM_BoxArea( child->mins, child->maxs );
+			}
+		}
+
+		if ( cost < childCost[ 0 ] && cost < childCost[ 1 ] )
+		{
+			break;
+		}
+
+		index = node->children[ childCost[ 0 ] < childCost[ 1 ] ? 0 : 1 ];
+	}
+
+	sibling = index;
+
+	// a new node takes the place of the sibling, with the sibling and the leaf under it
+	oldParent = tree->nodes[ sibling ].parent;
+	newParent = G_CM_AllocEntityNode( tree );
+	tree->nodes[ newParent ].parent = oldParent;
+	tree->nodes[ newParent ].children[ 0 ] = sibling;
+	tree->nodes[ newParent ].children[ 1 ] = leaf;
+	tree->nodes[ sibling ].parent = newParent;
+	leafNode->parent = newParent;
+
+	if ( oldParent == ENTITY_TREE_NULL )
+	{
+		tree->root = newParent;
+	}
+	else if ( tree->nodes[ oldParent ].children[ 0 ] == sibling )
+	{
+		tree->nodes[ oldParent ].children[ 0 ] = newParent;
+	}
+	else
+	{
+		tree->nodes[ oldParent ].children[ 1 ] = newParent;
+	}
+
+	G_CM_FixEntityTree( tree, newParent );
+}
+
+/*
+===============
+G_CM_RemoveEntityLeaf
+===============
+*/
+static void G_CM_RemoveEntityLeaf( entityTree_t *tree, int leaf )
+{
+	int parent, grandParent, sibling;
+
+	if ( leaf == tree->root )
+	{
+		tree->root = ENTITY_TREE_NULL;
+		return;
+	}
+
+	// the sibling takes the place of the parent
+	parent = tree->nodes[ leaf ].parent;
+	grandParent = tree->nodes[ parent ].parent;
+	sibling = tree->nodes[ parent ].children[ tree->nodes[ parent ].children[ 0 ] == leaf ? 1 : 0 ];
+
+	tree->nodes[ sibling ].parent = grandParent;
+	G_CM_FreeEntityNode( tree, parent );
 
-	worldEntity_t        *entities;
-} worldSector_t;
+	if ( grandParent == ENTITY_TREE_NULL )
+	{
+		tree->root = sibling;
+		return;
+	}
 
-#define AREA_DEPTH 4
-#define AREA_NODES 64
+	if ( tree->nodes[ grandParent ].children[ 0 ] == parent )
+	{
+		tree->nodes[ grandParent ].children[ 0 ] = sibling;
+	}
+	else
+	{
+		tree->nodes[ grandParent ].children[ 1 ] = sibling;
+	}
 
-worldSector_t sv_worldSectors[ AREA_NODES ];
-int           sv_numworldSectors;
+	G_CM_FixEntityTree( tree, grandParent );
+}
 
 /*
 ===============
-G_CM_SectorList_f
+G_CM_LinkTreeEntity
+
+Puts the entity box in the tree, unless it still fits in the entity's leaf
 ===============
 */
-void G_CM_SectorList_f( void )
+void G_CM_LinkTreeEntity( entityTree_t *tree, int entityNum, const vec3_t absmin, const vec3_t absmax )
 {
-	int           i, c;
-	worldSector_t *sec;
-	worldEntity_t    *ent;
+	int          leaf = tree->leafs[ entityNum ];
+	entityNode_t *node;
+	vec3_t       move;
+	int          i;
 
-	for ( i = 0; i < AREA_NODES; i++ )
+	if ( leaf != ENTITY_TREE_NULL )
 	{
-		sec = &sv_worldSectors[ i ];
+		node = &tree->nodes[ leaf ];
+
+		if ( node->mins[ 0 ] <= absmin[ 0 ] && node->mins[ 1 ] <= absmin[ 1 ] && node->mins[ 2 ] <= absmin[ 2 ] &&
+		     node->maxs[ 0 ] >= absmax[ 0 ] && node->maxs[ 1 ] >= absmax[ 1 ] && node->maxs[ 2 ] >= absmax[ 2 ] )
+		{
+			tree->stats.kept++;
+			return;
+		}
 
-		c = 0;
+		G_CM_RemoveEntityLeaf( tree, leaf );
+		tree->stats.removes++;
 
-		for ( ent = sec->entities; ent; ent = ent->nextEntityInWorldSector )
+		// moving entities are likely to keep going the same way
+		for ( i = 0; i < 3; i++ )
 		{
-			c++;
+			move[ i ] = Com_Clamp( -ENTITY_TREE_PREDICT, ENTITY_TREE_PREDICT, 2.0f * ( absmin[ i ] - tree->origins[ entityNum ][ i ] ) );
 		}
+	}
+	else
+	{
+		leaf = G_CM_AllocEntityNode( tree );
+		tree->nodes[ leaf ].entityNum = entityNum;
+		tree->leafs[ entityNum ] = leaf;
+		VectorClear( move );
+	}
+
+	node = &tree->nodes[ leaf ];
 
-		Com_Printf( "sector %i: %i entities\n", i, c );
+	for ( i = 0; i < 3; i++ )
+	{
+		node->mins[ i ] = absmin[ i ] - ENTITY_TREE_MARGIN + MIN( move[ i ], 0.0f );
+		node->maxs[ i ] = absmax[ i ] + ENTITY_TREE_MARGIN + MAX( move[ i ], 0.0f );
 	}
+
+	VectorCopy( absmin, tree->origins[ entityNum ] );
+
+	G_CM_InsertEntityLeaf( tree, leaf );
+	tree->stats.inserts++;
 }
 
 /*
 ===============
-G_CM_CreateworldSector
-
-Builds a uniformly subdivided tree for the given world size
+G_CM_UnlinkTreeEntity
 ===============
 */
-worldSector_t  *G_CM_CreateworldSector( int depth, vec3_t mins, vec3_t maxs )
+void G_CM_UnlinkTreeEntity( entityTree_t *tree, int entityNum )
 {
-	worldSector_t *anode;
-	vec3_t        size;
-	vec3_t        mins1, maxs1, mins2, maxs2;
+	int leaf = tree->leafs[ entityNum ];
 
-	anode = &sv_worldSectors[ sv_numworldSectors ];
-	sv_numworldSectors++;
-
-	if ( depth == AREA_DEPTH )
+	if ( leaf == ENTITY_TREE_NULL )
 	{
-		anode->axis = -1;
-		anode->children[ 0 ] = anode->children[ 1 ] = NULL;
-		return anode;
+		return;
 	}
 
-	VectorSubtract( maxs, mins, size );
+	G_CM_RemoveEntityLeaf( tree, leaf );
+	G_CM_FreeEntityNode( tree, leaf );
+	tree->leafs[ entityNum ] = ENTITY_TREE_NULL;
+	tree->stats.removes++;
+}
 
-	if ( size[ 0 ] > size[ 1 ] )
+/*
+===============
+G_CM_EntityTreeCandidates
+
+Lists the entities whose leaf box intersects the bounds, at most once each.
+They still have to be tested against their exact box
+===============
+*/
+int G_CM_EntityTreeCandidates( entityTree_t *tree, const vec3_t mins, const vec3_t maxs, int *list )
+{
+	int          stack[ ENTITY_TREE_STACK ];
+	int          depth, count, tests;
+	entityNode_t *node;
+
+	tree->stats.queries++;
+
+	if ( tree->root == ENTITY_TREE_NULL )
 	{
-		anode->axis = 0;
+		return 0;
 	}
-	else
+
+	stack[ 0 ] = tree->root;
+	depth = 1;
+	count = tests = 0;
+
+	while ( depth )
 	{
-		anode->axis = 1;
-	}
+		node = &tree->nodes[ stack[ --depth ] ];
+		tests++;
 
-	anode->dist = 0.5 * ( maxs[ anode->axis ] + mins[ anode->axis ] );
-	VectorCopy( mins, mins1 );
-	VectorCopy( mins, mins2 );
-	VectorCopy( maxs, maxs1 );
-	VectorCopy( maxs, maxs2 );
+		if ( node->mins[ 0 ] > maxs[ 0 ] || node->mins[ 1 ] > maxs[ 1 ] || node->mins[ 2 ] > maxs[ 2 ] ||
+		     node->maxs[ 0 ] < mins[ 0 ] || node->maxs[ 1 ] < mins[ 1 ] || node->maxs[ 2 ] < mins[ 2 ] )
+		{
+			continue;
+		}
 
-	maxs1[ anode->axis ] = mins2[ anode->axis ] = anode->dist;
+		if ( !node->height )
+		{
+			list[ count++ ] = node->entityNum;
+			continue;
+		}
+
+		// the tree is balanced, so its height can't get anywhere near the stack size
+		stack[ depth++ ] = node->children[ 1 ];
+		stack[ depth++ ] = node->children[ 0 ];
+	}
 
-	anode->children[ 0 ] = G_CM_CreateworldSector( depth + 1, mins2, maxs2 );
-	anode->children[ 1 ] = G_CM_CreateworldSector( depth + 1, mins1, maxs1 );
+	tree->stats.nodeTests += tests;
+	tree->stats.candidates += count;
 
-	return anode;
+	return count;
 }
 
 /*
@@ -336,17 +924,15 @@ G_CM_ClearWorld
 */
 void G_CM_ClearWorld( void )
 {
-	clipHandle_t h;
-	vec3_t       mins, maxs;
+	vec3_t mins, maxs;
 
-	memset( sv_worldSectors, 0, sizeof( sv_worldSectors ) );
-	memset( wentities, 0, sizeof( wentities ) );
-	sv_numworldSectors = 0;
+	// the cvars are registered after the map is loaded
+	useEntityTree = trap_Cvar_VariableIntegerValue( "g_entityTree" ) ? qtrue : qfalse;
 
 	// get world map bounds
-	h = CM_InlineModel( 0 );
-	CM_ModelBounds( h, mins, maxs );
-	G_CM_CreateworldSector( 0, mins, maxs );
+	CM_ModelBounds( CM_InlineModel( 0 ), mins, maxs );
+	G_CM_InitWorldSectors( &worldSectors, mins, maxs );
+	G_CM_InitEntityTree( &entityTree );
 }
 
 /*
@@ -357,38 +943,18 @@ G_CM_UnlinkEntity
 */
 void G_CM_UnlinkEntity( gentity_t *gEnt )
 {
-	worldEntity_t* scan;
-	worldSector_t* ws;
-
-	worldEntity_t* went = G_CM_WorldEntityForGentity( gEnt );
+	int num = G_CM_EntityNum( gEnt );
 
 	gEnt->r.linked = qfalse;
 
-	ws = went->worldSector;
-
-	if ( !ws )
-	{
-		return; // not linked in anywhere
-	}
-
-	went->worldSector = NULL;
-
-	if ( ws->entities == went )
+	if ( useEntityTree )
 	{
-		ws->entities = went->nextEntityInWorldSector;
-		return;
+		G_CM_UnlinkTreeEntity( &entityTree, num );
 	}
-
-	for ( scan = ws->entities; scan; scan = scan->nextEntityInWorldSector )
+	else
 	{
-		if ( scan->nextEntityInWorldSector == went )
-		{
-			scan->nextEntityInWorldSector = went->nextEntityInWorldSector;
-			return;
-		}
+		G_CM_UnlinkSectorEntity( &worldSectors, num );
 	}
-
-	Com_Printf( "WARNING: G_CM_UnlinkEntity: not found in worldSector\n" );
 }
 
 /*
@@ -400,21 +966,16 @@ G_CM_LinkEntity
 #define MAX_TOTAL_ENT_LEAFS 128
 void G_CM_LinkEntity( gentity_t *gEnt )
 {
-	worldSector_t *node;
 	int           leafs[ MAX_TOTAL_ENT_LEAFS ];
 	int           cluster;
 	int           num_leafs;
 	int           i, j, k;
 	int           area;
 	int           lastLeaf;
+	int           num;
 	float         *origin, *angles;
 
-	worldEntity_t* went = G_CM_WorldEntityForGentity( gEnt );
-
-	if ( went->worldSector )
-	{
-		G_CM_UnlinkEntity( gEnt );  // unlink from old position
-	}
+	num = G_CM_EntityNum( gEnt );
 
 	// encode the size into the entityState_t for client prediction
 	if ( gEnt->r.bmodel )
@@ -519,6 +1080,7 @@ void G_CM_LinkEntity( gentity_t *gEnt )
 	// entity is outside the world and can be considered unlinked
 	if ( !num_leafs )
 	{
+		G_CM_UnlinkEntity( gEnt );
 		return;
 	}
 
@@ -568,34 +1130,15 @@ void G_CM_LinkEntity( gentity_t *gEnt )
 
 	gEnt->r.linkcount++;
 
-	// find the first world sector node that the ent's box crosses
-	node = sv_worldSectors;
-
-	while ( 1 )
+	// link it in, the tree keeps it where it is if it moved only a little
+	if ( useEntityTree )
 	{
-		if ( node->axis == -1 )
-		{
-			break;
-		}
-
-		if ( gEnt->r.absmin[ node->axis ] > node->dist )
-		{
-			node = node->children[ 0 ];
-		}
-		else if ( gEnt->r.absmax[ node->axis ] < node->dist )
-		{
-			node = node->children[ 1 ];
-		}
-		else
-		{
-			break; // crosses the node
-		}
+		G_CM_LinkTreeEntity( &entityTree, num, gEnt->r.absmin, gEnt->r.absmax );
+	}
+	else
+	{
+		G_CM_LinkSectorEntity( &worldSectors, num, gEnt->r.absmin, gEnt->r.absmax );
 	}
-
-	// link it in
-	went->worldSector = node;
-	went->nextEntityInWorldSector = node->entities;
-	node->entities = went;
 
 	gEnt->r.linked = qtrue;
 }
@@ -610,92 +1153,63 @@ bounds.  This does NOT mean that they actually touch in the case of bmodels.
 ============================================================================
 */
 
-typedef struct
-{
-	const float *mins;
-	const float *maxs;
-	int         *list;
-	int         count, maxcount;
-} areaParms_t;
-
 /*
-====================
-G_CM_AreaEntities_r
-
-====================
+================
+G_CM_AreaEntities
+================
 */
-void G_CM_AreaEntities_r( worldSector_t *node, areaParms_t *ap )
+int G_CM_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount )
 {
-	worldEntity_t     *check, *next;
+	int       candidates[ MAX_GENTITIES ];
+	int       i, num, count;
 	gentity_t *gcheck;
-//	int             count;
 
-//	count = 0;
-
-	for ( check = node->entities; check; check = next )
+	if ( useEntityTree )
+	{
+		num = G_CM_EntityTreeCandidates( &entityTree, mins, maxs, candidates );
+	}
+	else
 	{
-		next = check->nextEntityInWorldSector;
+		num = G_CM_WorldSectorCandidates( &worldSectors, mins, maxs, candidates );
+	}
 
-		gcheck = G_CM_GEntityForWorldEntity( check );
+	for ( i = count = 0; i < num; i++ )
+	{
+		gcheck = &g_entities[ candidates[ i ] ];
 
 		if ( !gcheck->r.linked )
 		{
 			continue;
 		}
 
-		if ( gcheck->r.absmin[ 0 ] > ap->maxs[ 0 ]
-		     || gcheck->r.absmin[ 1 ] > ap->maxs[ 1 ]
-		     || gcheck->r.absmin[ 2 ] > ap->maxs[ 2 ]
-		     || gcheck->r.absmax[ 0 ] < ap->mins[ 0 ] || gcheck->r.absmax[ 1 ] < ap->mins[ 1 ] || gcheck->r.absmax[ 2 ] < ap->mins[ 2 ] )
+		// the partitions only know where the boxes roughly are
+		if ( gcheck->r.absmin[ 0 ] > maxs[ 0 ]
+		     || gcheck->r.absmin[ 1 ] > maxs[ 1 ]
+		     || gcheck->r.absmin[ 2 ] > maxs[ 2 ]
+		     || gcheck->r.absmax[ 0 ] < mins[ 0 ] || gcheck->r.absmax[ 1 ] < mins[ 1 ] || gcheck->r.absmax[ 2 ] < mins[ 2 ] )
 		{
 			continue;
 		}
 
-		if ( ap->count == ap->maxcount )
+		if ( count == maxcount )
 		{
 			Com_Printf( "G_CM_AreaEntities: MAXCOUNT\n" );
-			return;
+			break;
 		}
 
-		ap->list[ ap->count ] = check - wentities;
-		ap->count++;
-	}
-
-	if ( node->axis == -1 )
-	{
-		return; // terminal node
+		entityList[ count++ ] = candidates[ i ];
 	}
 
-	// recurse down both sides
-	if ( ap->maxs[ node->axis ] > node->dist )
+	if ( useEntityTree )
 	{
-		G_CM_AreaEntities_r( node->children[ 0 ], ap );
+		entityTree.stats.results += count;
 	}
-
-	if ( ap->mins[ node->axis ] < node->dist )
+	else
 	{
-		G_CM_AreaEntities_r( node->children[ 1 ], ap );
+		worldSectors.stats.results += count;
 	}
-}
-
-/*
-================
-G_CM_AreaEntities
-================
-*/
-int G_CM_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount )
-{
-	areaParms_t ap;
-
-	ap.mins = mins;
-	ap.maxs = maxs;
-	ap.list = entityList;
-	ap.count = 0;
-	ap.maxcount = maxcount;
-
-	G_CM_AreaEntities_r( sv_worldSectors, &ap );
 
-	return ap.count;
+	return count;
 }
 
 //===========================================================================
@@ -875,39 +1389,21 @@ void G_CM_ClipMoveToEntities( moveclip_t *clip )
 
 /*
 ==================
-G_CM_Trace
+G_CM_ClipTraceToEntities
 
-Moves the given mins/maxs volume through the world from start to end.
-passEntityNum and entities owned by passEntityNum are explicitly not checked.
+Finishes a trace that was already clipped to the world
 ==================
 */
-void G_CM_Trace( trace_t *results, const vec3_t start, const vec3_t mins2, const vec3_t maxs2,
-                 const vec3_t end, int passEntityNum, int contentmask, int skipmask,
-                 traceType_t type )
+static void G_CM_ClipTraceToEntities( trace_t *results, const trace_t *worldTrace, const vec3_t start,
+                                      const vec3_t mins, const vec3_t maxs, const vec3_t end,
+                                      int passEntityNum, int contentmask, int skipmask, traceType_t type )
 {
 	moveclip_t clip;
 	int        i;
 
-	if ( !mins2 )
-	{
-		mins2 = vec3_origin;
-	}
-
-	if ( !maxs2 )
-	{
-		maxs2 = vec3_origin;
-	}
-
-    vec3_t mins, maxs;
-    VectorCopy(mins2, mins);
-    VectorCopy(maxs2, maxs);
-
 	memset( &clip, 0, sizeof( moveclip_t ) );
 
-	// clip to world
-	// -------------
-
-	CM_BoxTrace( &clip.trace, start, end, mins, maxs, 0, contentmask, skipmask, type );
+	clip.trace = *worldTrace;
 	clip.trace.entityNum = clip.trace.fraction != 1.0 ? ENTITYNUM_WORLD : ENTITYNUM_NONE;
 
 	if ( clip.trace.fraction == 0 )
@@ -953,6 +1449,69 @@ void G_CM_Trace( trace_t *results, const vec3_t start, const vec3_t mins2, const
 	*results = clip.trace;
 }
 
+/*
+==================
+G_CM_Trace
+
+Moves the given mins/maxs volume through the world from start to end.
+passEntityNum and entities owned by passEntityNum are explicitly not checked.
+==================
+*/
+void G_CM_Trace( trace_t *results, const vec3_t start, const vec3_t mins2, const vec3_t maxs2,
+                 const vec3_t end, int passEntityNum, int contentmask, int skipmask,
+                 traceType_t type )
+{
+	trace_t trace;
+
+	if ( !mins2 )
+	{
+		mins2 = vec3_origin;
+	}
+
+	if ( !maxs2 )
+	{
+		maxs2 = vec3_origin;
+	}
+
+    vec3_t mins, maxs;
+    VectorCopy(mins2, mins);
+    VectorCopy(maxs2, maxs);
+
+	// clip to world
+	// -------------
+
+	CM_BoxTrace( &trace, start, end, mins, maxs, 0, contentmask, skipmask, type );
+
+	G_CM_ClipTraceToEntities( results, &trace, start, mins, maxs, end, passEntityNum, contentmask, skipmask, type );
+}
+
+/*
+==================
+G_CM_TraceBatch
+
+G_CM_Trace for numTraces moves at once, the world part is traced by
+CM_BoxTraceBatch. mins and maxs may be NULL for points.
+==================
+*/
+void G_CM_TraceBatch( trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *mins,
+                      const vec3_t *maxs, const vec3_t *ends, int passEntityNum, int contentmask,
+                      int skipmask, traceType_t type )
+{
+	int i;
+
+	// clip to world
+	// -------------
+
+	CM_BoxTraceBatch( results, numTraces, starts, ends, mins, maxs, contentmask, skipmask, type );
+
+	for ( i = 0; i < numTraces; i++ )
+	{
+		G_CM_ClipTraceToEntities( &results[ i ], &results[ i ], starts[ i ], mins ? mins[ i ] : vec3_origin,
+		                          maxs ? maxs[ i ] : vec3_origin, ends[ i ], passEntityNum, contentmask,
+		                          skipmask, type );
+	}
+}
+
 /*
 =============
 G_CM_PointContents
@@ -1006,3 +1565,88 @@ int G_CM_PointContents( const vec3_t p, int passEntityNum )
 
 	return contents;
 }
+
+/*
+===============
+G_CM_EntityTree_f
+===============
+*/
+void G_CM_EntityTree_f( void )
+{
+	char arg[ MAX_TOKEN_CHARS ];
+	int  i, linked;
+
+	trap_Argv( 1, arg, sizeof( arg ) );
+
+	if ( !Q_stricmp( arg, "reset" ) )
+	{
+		memset( &entityTree.stats, 0, sizeof( entityTree.stats ) );
+		memset( &worldSectors.stats, 0, sizeof( worldSectors.stats ) );
+		return;
+	}
+
+	if ( !Q_stricmp( arg, "bench" ) )
+	{
+		int buildables = 80, frames = 2000;
+
+		if ( trap_Argc() > 2 )
+		{
+			trap_Argv( 2, arg, sizeof( arg ) );
+			buildables = atoi( arg );
+		}
+
+		if ( trap_Argc() > 3 )
+		{
+			trap_Argv( 3, arg, sizeof( arg ) );
+			frames = atoi( arg );
+		}
+
+		G_CM_EntityBench( buildables, frames );
+		return;
+	}
+
+	if ( arg[ 0 ] )
+	{
+		G_Printf( "usage: entityTree [reset | bench [buildables per base] [frames]]\n" );
+		return;
+	}
+
+	if ( !useEntityTree )
+	{
+		worldSectorStats_t *stats = &worldSectors.stats;
+		double             queries = stats->queries ? stats->queries : 1;
+
+		for ( i = linked = 0; i < MAX_GENTITIES; i++ )
+		{
+			if ( worldSectors.sectorOf[ i ] != -1 )
+			{
+				linked++;
+			}
+		}
+
+		G_Printf( "%d linked entities in the sector list, set g_entityTree to use the tree from the next map\n", linked );
+		G_Printf( "%llu queries, %.1f sectors tested, %.1f candidates and %.1f results per query\n",
+		          ( unsigned long long ) stats->queries, stats->sectorTests / queries, stats->candidates / queries, stats->results / queries );
+	}
+	else
+	{
+		entityTreeStats_t *stats = &entityTree.stats;
+		double            queries = stats->queries ? stats->queries : 1;
+
+		for ( i = linked = 0; i < MAX_GENTITIES; i++ )
+		{
+			if ( entityTree.leafs[ i ] != ENTITY_TREE_NULL )
+			{
+				linked++;
+			}
+		}
+
+		G_Printf( "%d linked entities, tree height %d\n", linked,
+		          entityTree.root == ENTITY_TREE_NULL ? 0 : entityTree.nodes[ entityTree.root ].height );
+		G_Printf( "%llu queries, %.1f nodes tested, %.1f candidates and %.1f results per query\n",
+		          ( unsigned long long ) stats->queries, stats->nodeTests / queries, stats->candidates / queries, stats->results / queries );
+		G_Printf( "%llu inserts, %llu removes, %llu links kept in place, %llu rotations\n",
+		          ( unsigned long long ) stats->inserts, ( unsigned long long ) stats->removes,
+		          ( unsigned long long ) stats->kept, ( unsigned long long ) stats->rotations );
+	}
+}
@@ -58,8 +58,6 @@ void G_CM_LinkEntity( gentity_t *ent );
 
 clipHandle_t G_CM_ClipHandleForEntity( const sharedEntity_t *ent );
 
-void         G_CM_SectorList_f( void );
-
 int          G_CM_AreaEntities( const vec3_t mins, const vec3_t maxs, int *entityList, int maxcount );
 
 // fills in a table of entity numbers with entities that have bounding boxes
@@ -77,6 +75,10 @@ void G_CM_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const
                  const vec3_t end, int passEntityNum, int contentmask, int skipmask,
                  traceType_t type );
 
+void G_CM_TraceBatch( trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *mins,
+                      const vec3_t *maxs, const vec3_t *ends, int passEntityNum, int contentmask,
+                      int skipmask, traceType_t type );
+
 // mins and maxs are relative
 
 // if the entire move stays in a solid volume, trace.allsolid will be set,
@@ -99,4 +101,86 @@ qboolean G_CM_EntityContact( const vec3_t mins, const vec3_t maxs, const gentity
 
 void G_CM_SetBrushModel( gentity_t *ent, const char *name );
 
+// entity partitions behind G_CM_AreaEntities, they only hand out candidates
+// that still have to be tested against the exact boxes
+
+#define AREA_DEPTH 4
+#define AREA_NODES 64
+
+typedef struct
+{
+	int   axis; // -1 = leaf node
+	float dist;
+	int   children[ 2 ];
+	int   entities; // first of the chain, ENTITYNUM_NONE if empty
+} worldSector_t;
+
+typedef struct
+{
+	uint64_t queries;
+	uint64_t sectorTests;
+	uint64_t candidates; // chained entities, tested against the exact box
+	uint64_t results;
+} worldSectorStats_t;
+
+typedef struct
+{
+	worldSector_t      sectors[ AREA_NODES ];
+	int                numSectors;
+	int                sectorOf[ MAX_GENTITIES ]; // -1 when not linked
+	int                nextInSector[ MAX_GENTITIES ];
+	worldSectorStats_t stats;
+} worldSectors_t;
+
+void G_CM_InitWorldSectors( worldSectors_t *ws, const vec3_t mins, const vec3_t maxs );
+void G_CM_LinkSectorEntity( worldSectors_t *ws, int entityNum, const vec3_t absmin, const vec3_t absmax );
+void G_CM_UnlinkSectorEntity( worldSectors_t *ws, int entityNum );
+int  G_CM_WorldSectorCandidates( worldSectors_t *ws, const vec3_t mins, const vec3_t maxs, int *list );
+
+#define ENTITY_TREE_NULL    -1
+#define ENTITY_TREE_NODES   ( 2 * MAX_GENTITIES )
+#define ENTITY_TREE_MARGIN  8.0f // fattening of the leaf boxes on each side
+#define ENTITY_TREE_PREDICT 64.0f // longest stretch of the leaf boxes along the last move
+#define ENTITY_TREE_STACK   256
+
+typedef struct
+{
+	vec3_t mins, maxs;
+	int    parent; // next free node while free
+	int    children[ 2 ]; // ENTITY_TREE_NULL for leafs
+	int    height; // 0 for leafs, -1 while free
+	int    entityNum; // leafs only
+} entityNode_t;
+
+typedef struct
+{
+	uint64_t queries;
+	uint64_t nodeTests;
+	uint64_t candidates; // leafs reached, tested against the exact box
+	uint64_t results;
+	uint64_t inserts;
+	uint64_t removes;
+	uint64_t kept; // links that stayed in their leaf box
+	uint64_t rotations;
+} entityTreeStats_t;
+
+typedef struct
+{
+	entityNode_t      nodes[ ENTITY_TREE_NODES ];
+	int               root;
+	int               freeList;
+	int               leafs[ MAX_GENTITIES ]; // leaf of each linked entity
+	vec3_t            origins[ MAX_GENTITIES ]; // absmin when last inserted
+	entityTreeStats_t stats;
+} entityTree_t;
+
+void G_CM_InitEntityTree( entityTree_t *tree );
+void G_CM_LinkTreeEntity( entityTree_t *tree, int entityNum, const vec3_t absmin, const vec3_t absmax );
+void G_CM_UnlinkTreeEntity( entityTree_t *tree, int entityNum );
+int  G_CM_EntityTreeCandidates( entityTree_t *tree, const vec3_t mins, const vec3_t maxs, int *list );
+
+// g_cm_world_bench.cpp
+
+void G_CM_EntityBench( int buildables, int frames );
+
 #endif // G_CM_WORLD_H_
@@ -0,0 +1,387 @@
+/*
+===========================================================================
+
+Daemon GPL Source Code
+Copyright (C) 1999-2010 id Software LLC, a ZeniMax Media company.
+
+This file is part of the Daemon GPL Source Code (Daemon Source Code).
+
+Daemon Source Code is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Daemon Source Code is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Daemon Source Code.  If not, see <http://www.gnu.org/licenses/>.
+
+In addition, the Daemon Source Code is also subject to certain additional terms.
+You should have received a copy of these additional terms immediately following the
+terms and conditions of the GNU General Public License which accompanied the Daemon
+Source Code.  If not, please request a copy in writing from id Software at the address
+below.
+
+If you have questions concerning this license or the applicable additional terms, you
+may contact in writing id Software LLC, c/o ZeniMax Media Inc., Suite 120, Rockville,
+Maryland 20850 USA.
+
+===========================================================================
+*/
+
+// g_cm_world_bench.cpp -- synthetic benchmark of the entity partitions
+
+#include "g_local.h"
+#include "g_cm_world.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#define BENCH_PLAYERS   24
+#define BENCH_MISSILES  40
+#define BENCH_BASE_SIZE 300.0f // half extent of the area packed with buildables
+#define BENCH_RANGE     250.0f
+#define BENCH_QUERIES   ( 3 * BENCH_PLAYERS + BENCH_MISSILES )
+
+typedef struct
+{
+	worldSectors_t sectors;
+	entityTree_t   tree;
+
+	int            numEntities;
+	// the boxes are tested where they are in the game
+	gentity_t      entities[ MAX_GENTITIES ];
+} entityBench_t;
+
+typedef struct
+{
+	vec3_t mins, maxs;
+} benchBox_t;
+
+typedef struct
+{
+	uint64_t linkTime, queryTime; // nsec
+	uint64_t queries, results;
+} entityBenchResult_t;
+
+/*
+===============
+G_CM_BenchBoxesTouch
+===============
+*/
+static qboolean G_CM_BenchBoxesTouch( entityBench_t *bench, int num, const vec3_t mins, const vec3_t maxs )
+{
+	const gentity_t *check = &bench->entities[ num ];
+
+	return check->r.linked &&
+	       !( check->r.absmin[ 0 ] > maxs[ 0 ] || check->r.absmin[ 1 ] > maxs[ 1 ] || check->r.absmin[ 2 ] > maxs[ 2 ] ||
+	          check->r.absmax[ 0 ] < mins[ 0 ] || check->r.absmax[ 1 ] < mins[ 1 ] || check->r.absmax[ 2 ] < mins[ 2 ] );
+}
+
+/*
+===============
+G_CM_BenchLink
+===============
+*/
+static void G_CM_BenchLink( entityBench_t *bench, qboolean useTree, int num, const vec3_t origin, const vec3_t mins, const vec3_t maxs )
+{
+	VectorAdd( origin, mins, bench->entities[ num ].r.absmin );
+	VectorAdd( origin, maxs, bench->entities[ num ].r.absmax );
+	bench->entities[ num ].r.linked = qtrue;
+
+	if ( useTree )
+	{
+		G_CM_LinkTreeEntity( &bench->tree, num, bench->entities[ num ].r.absmin, bench->entities[ num ].r.absmax );
+	}
+	else
+	{
+		G_CM_LinkSectorEntity( &bench->sectors, num, bench->entities[ num ].r.absmin, bench->entities[ num ].r.absmax );
+	}
+}
+
+/*
+===============
+G_CM_BenchQuery
+===============
+*/
+static int G_CM_BenchQuery( entityBench_t *bench, qboolean useTree, const vec3_t mins, const vec3_t maxs, int *list )
+{
+	int i, num, count;
+
+	if ( useTree )
+	{
+		num = G_CM_EntityTreeCandidates( &bench->tree, mins, maxs, list );
+	}
+	else
+	{
+		num = G_CM_WorldSectorCandidates( &bench->sectors, mins, maxs, list );
+	}
+
+	for ( i = count = 0; i < num; i++ )
+	{
+		if ( G_CM_BenchBoxesTouch( bench, list[ i ], mins, maxs ) )
+		{
+			list[ count++ ] = list[ i ];
+		}
+	}
+
+	return count;
+}
+
+/*
+===============
+G_CM_BenchClock
+
+Nanoseconds from an arbitrary point in time
+===============
+*/
+static uint64_t G_CM_BenchClock( void )
+{
+#ifdef LIBSTDCXX_BROKEN_CXX11
+	auto now = std::chrono::monotonic_clock::now().time_since_epoch();
+#else
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+#endif
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( now ).count();
+}
+
+/*
+===============
+G_CM_BenchSweep
+
+Bounds of a box moving from start to end
+===============
+*/
+static void G_CM_BenchSweep( const vec3_t start, const vec3_t end, const vec3_t mins, const vec3_t maxs, benchBox_t *box )
+{
+	int i;
+
+	for ( i = 0; i < 3; i++ )
+	{
+		box->mins[ i ] = MIN( start[ i ], end[ i ] ) + mins[ i ] - 1;
+		box->maxs[ i ] = MAX( start[ i ], end[ i ] ) + maxs[ i ] + 1;
+	}
+}
+
+/*
+===============
+G_CM_RunEntityBench
+
+Plays the same synthetic match on one of the structures: two bases packed
+with buildables, players running around them, and missiles flying about.
+Every frame the players and missiles are linked at their new position, then
+their moves are clipped, the players shoot and look for things in range.
+Adds a hash of the sorted result of each query to hashes
+===============
+*/
+static void G_CM_RunEntityBench( entityBench_t *bench, qboolean useTree, int buildables, int frames,
+                                 std::vector<uint64_t> &hashes, entityBenchResult_t *result )
+{
+	static const vec3_t                   playerMins = { -15, -15, -24 }, playerMaxs = { 15, 15, 32 };
+	static const vec3_t                   missileMins = { -4, -4, -4 }, missileMaxs = { 4, 4, 4 };
+	std::mt19937                          rng( 0x5ec7 );
+	std::uniform_real_distribution<float> unit( -1.0f, 1.0f );
+	std::vector<int>                      found;
+	vec3_t                                worldMins, worldMaxs, bases[ 2 ];
+	vec3_t                                players[ BENCH_PLAYERS ], playerDirs[ BENCH_PLAYERS ];
+	vec3_t                                missiles[ BENCH_MISSILES ], missileDirs[ BENCH_MISSILES ];
+	int                                   missileLives[ BENCH_MISSILES ];
+	benchBox_t                            boxes[ BENCH_QUERIES ];
+	int                                   counts[ BENCH_QUERIES ];
+	int                                   list[ MAX_GENTITIES ];
+	vec3_t                                origin, end, mins, maxs;
+	int                                   firstPlayer, firstMissile;
+	int                                   i, j, frame, numBoxes;
+	uint64_t                              start, hash;
+
+	memset( bench, 0, sizeof( *bench ) );
+	memset( result, 0, sizeof( *result ) );
+
+	CM_ModelBounds( CM_InlineModel( 0 ), worldMins, worldMaxs );
+	G_CM_InitWorldSectors( &bench->sectors, worldMins, worldMaxs );
+	G_CM_InitEntityTree( &bench->tree );
+
+	// the bases sit at a quarter of the map from each side along its longest axis
+	j = worldMaxs[ 0 ] - worldMins[ 0 ] > worldMaxs[ 1 ] - worldMins[ 1 ] ? 0 : 1;
+
+	for ( i = 0; i < 2; i++ )
+	{
+		VectorAdd( worldMins, worldMaxs, bases[ i ] );
+		VectorScale( bases[ i ], 0.5f, bases[ i ] );
+		bases[ i ][ j ] = worldMins[ j ] + ( i ? 0.75f : 0.25f ) * ( worldMaxs[ j ] - worldMins[ j ] );
+	}
+
+	hashes.clear();
+
+	for ( i = 0; i < 2 * buildables; i++ )
+	{
+		float size = 16.0f + 24.0f * fabsf( unit( rng ) );
+
+		VectorSet( origin, unit( rng ), unit( rng ), 0.1f * unit( rng ) );
+		VectorMA( bases[ i & 1 ], BENCH_BASE_SIZE, origin, origin );
+		VectorSet( mins, -size, -size, -20 );
+		VectorSet( maxs, size, size, size );
+		G_CM_BenchLink( bench, useTree, i, origin, mins, maxs );
+	}
+
+	firstPlayer = 2 * buildables;
+	firstMissile = firstPlayer + BENCH_PLAYERS;
+	bench->numEntities = firstMissile + BENCH_MISSILES;
+
+	for ( i = 0; i < BENCH_PLAYERS; i++ )
+	{
+		VectorSet( origin, unit( rng ), unit( rng ), 0 );
+		VectorMA( bases[ i & 1 ], 2.0f * BENCH_BASE_SIZE, origin, players[ i ] );
+		VectorSet( playerDirs[ i ], unit( rng ), unit( rng ), 0 );
+		VectorNormalize( playerDirs[ i ] );
+		G_CM_BenchLink( bench, useTree, firstPlayer + i, players[ i ], playerMins, playerMaxs );
+	}
+
+	for ( i = 0; i < BENCH_MISSILES; i++ )
+	{
+		missileLives[ i ] = 0;
+	}
+
+	for ( frame = 0; frame < frames; frame++ )
+	{
+		numBoxes = 0;
+
+		for ( i = 0; i < BENCH_PLAYERS; i++ )
+		{
+			// wander about, turning back when too far from home
+			VectorSubtract( players[ i ], bases[ i & 1 ], origin );
+
+			if ( VectorLength( origin ) > 4.0f * BENCH_BASE_SIZE )
+			{
+				VectorNegate( origin, playerDirs[ i ] );
+				VectorNormalize( playerDirs[ i ] );
+			}
+			else if ( unit( rng ) > 0.9f )
+			{
+				VectorSet( playerDirs[ i ], unit( rng ), unit( rng ), 0 );
+				VectorNormalize( playerDirs[ i ] );
+			}
+
+			VectorMA( players[ i ], 10.0f, playerDirs[ i ], end );
+			G_CM_BenchSweep( players[ i ], end, playerMins, playerMaxs, &boxes[ numBoxes++ ] );
+			VectorCopy( end, players[ i ] );
+
+			// a hitscan shot
+			VectorSet( origin, unit( rng ), unit( rng ), 0.2f * unit( rng ) );
+			VectorNormalize( origin );
+			VectorMA( players[ i ], 1000.0f, origin, end );
+			G_CM_BenchSweep( players[ i ], end, vec3_origin, vec3_origin, &boxes[ numBoxes++ ] );
+
+			// looking for things in range
+			VectorSet( mins, -BENCH_RANGE, -BENCH_RANGE, -BENCH_RANGE );
+			VectorSet( maxs, BENCH_RANGE, BENCH_RANGE, BENCH_RANGE );
+			G_CM_BenchSweep( players[ i ], players[ i ], mins, maxs, &boxes[ numBoxes++ ] );
+		}
+
+		for ( i = 0; i < BENCH_MISSILES; i++ )
+		{
+			if ( !missileLives[ i ]-- )
+			{
+				VectorCopy( players[ ( i + frame ) % BENCH_PLAYERS ], missiles[ i ] );
+				VectorSet( missileDirs[ i ], unit( rng ), unit( rng ), 0.2f * unit( rng ) );
+				VectorNormalize( missileDirs[ i ] );
+				missileLives[ i ] = 60;
+			}
+
+			VectorMA( missiles[ i ], 40.0f, missileDirs[ i ], end );
+			G_CM_BenchSweep( missiles[ i ], end, missileMins, missileMaxs, &boxes[ numBoxes++ ] );
+			VectorCopy( end, missiles[ i ] );
+		}
+
+		start = G_CM_BenchClock();
+
+		for ( i = 0; i < BENCH_PLAYERS; i++ )
+		{
+			G_CM_BenchLink( bench, useTree, firstPlayer + i, players[ i ], playerMins, playerMaxs );
+		}
+
+		for ( i = 0; i < BENCH_MISSILES; i++ )
+		{
+			G_CM_BenchLink( bench, useTree, firstMissile + i, missiles[ i ], missileMins, missileMaxs );
+		}
+
+		result->linkTime += G_CM_BenchClock() - start;
+		found.clear();
+		start = G_CM_BenchClock();
+
+		for ( i = 0; i < numBoxes; i++ )
+		{
+			counts[ i ] = G_CM_BenchQuery( bench, useTree, boxes[ i ].mins, boxes[ i ].maxs, list );
+			found.insert( found.end(), list, list + counts[ i ] );
+		}
+
+		result->queryTime += G_CM_BenchClock() - start;
+		result->queries += numBoxes;
+		result->results += found.size();
+
+		for ( i = j = 0; i < numBoxes; j += counts[ i++ ] )
+		{
+			std::sort( found.begin() + j, found.begin() + j + counts[ i ] );
+
+			hash = 14695981039346656037ULL;
+
+			for ( int k = j; k < j + counts[ i ]; k++ )
+			{
+				hash = ( hash ^ found[ k ] ) * 1099511628211ULL;
+			}
+
+			hashes.push_back( hash );
+		}
+	}
+}
+
+/*
+===============
+G_CM_EntityBench
+
+Compares the sector list and the entity tree on private copies, the entities
+linked in the game are left alone
+===============
+*/
+void G_CM_EntityBench( int buildables, int frames )
+{
+	entityBench_t         *bench = new entityBench_t;
+	std::vector<uint64_t> sectorHashes, treeHashes;
+	entityBenchResult_t   sector, tree;
+	int                   i, mismatches;
+
+	buildables = Com_Clamp( 1, ( MAX_GENTITIES - BENCH_PLAYERS - BENCH_MISSILES ) / 2, buildables );
+	frames = MAX( frames, 1 );
+
+	G_CM_RunEntityBench( bench, qfalse, buildables, frames, sectorHashes, &sector );
+	G_Printf( "sectors: link %.2f ms, query %.2f ms, %.1f sectors and %.1f entities tested per query\n",
+	          sector.linkTime * 1e-6, sector.queryTime * 1e-6,
+	          ( double ) bench->sectors.stats.sectorTests / sector.queries, ( double ) bench->sectors.stats.candidates / sector.queries );
+
+	G_CM_RunEntityBench( bench, qtrue, buildables, frames, treeHashes, &tree );
+	G_Printf( "tree:    link %.2f ms, query %.2f ms, %.1f nodes and %.1f entities tested per query\n",
+	          tree.linkTime * 1e-6, tree.queryTime * 1e-6,
+	          ( double ) bench->tree.stats.nodeTests / tree.queries, ( double ) bench->tree.stats.candidates / tree.queries );
+	G_Printf( "tree height %d, %llu inserts, %llu links kept in place, %llu rotations\n",
+	          bench->tree.nodes[ bench->tree.root ].height, ( unsigned long long ) bench->tree.stats.inserts,
+	          ( unsigned long long ) bench->tree.stats.kept, ( unsigned long long ) bench->tree.stats.rotations );
+
+	for ( i = mismatches = 0; i < ( int ) treeHashes.size(); i++ )
+	{
+		if ( treeHashes[ i ] != sectorHashes[ i ] )
+		{
+			mismatches++;
+		}
+	}
+
+	G_Printf( "%d entities, %d frames, %llu queries, %.1f results per query, %d mismatched\n",
+	          bench->numEntities, frames, ( unsigned long long ) tree.queries,
+	          ( double ) tree.results / tree.queries, mismatches );
+
+	delete bench;
+}
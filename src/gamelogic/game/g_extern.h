@@ -169,6 +169,7 @@ extern  vmCvar_t g_censorship;
 
 extern  vmCvar_t g_showKillerHP;
 extern  vmCvar_t g_combatCooldown;
+extern  vmCvar_t g_entityTree;
 
 extern  vmCvar_t g_geoip;
 
@@ -210,5 +211,6 @@ extern vmCvar_t g_bot_numInGroup;
 extern vmCvar_t g_bot_persistent;
 extern vmCvar_t g_bot_buildLayout;
 extern vmCvar_t g_bot_debug;
+extern vmCvar_t g_bot_localNav;
 
 #endif // G_EXTERN_H_
@@ -190,6 +190,7 @@ vmCvar_t           g_tag;
 
 vmCvar_t           g_showKillerHP;
 vmCvar_t           g_combatCooldown;
+vmCvar_t           g_entityTree;
 
 vmCvar_t           g_geoip;
 
@@ -234,6 +235,7 @@ vmCvar_t g_bot_numInGroup;
 vmCvar_t g_bot_persistent;
 vmCvar_t g_bot_debug;
 vmCvar_t g_bot_buildLayout;
+vmCvar_t g_bot_localNav;
 
 //</bot stuff>
 
@@ -402,6 +404,7 @@ static cvarTable_t gameCvarTable[] =
 	{ &g_allowTeamOverlay,            "g_allowTeamOverlay",            "1",                                0,                                               0, qtrue            },
 	{ &g_showKillerHP,                "g_showKillerHP",                "0",                                0,                                               0, qfalse           },
 	{ &g_combatCooldown,              "g_combatCooldown",              "15",                               0,                                               0, qfalse           },
+	{ &g_entityTree,                  "g_entityTree",                  "0",                                0,                                               0, qfalse           },
 
 	// bots: buying
 	{ &g_bot_buy, "g_bot_buy", "1",  CVAR_NORESTART, 0, qfalse },
@@ -437,7 +440,8 @@ static cvarTable_t gameCvarTable[] =
 	{ &g_bot_infinite_funds, "g_bot_infinite_funds", "0",  CVAR_NORESTART, 0, qfalse },
 	{ &g_bot_numInGroup, "g_bot_numInGroup", "3",  CVAR_NORESTART, 0, qfalse },
 	{ &g_bot_debug, "g_bot_debug", "0",  CVAR_NORESTART, 0, qfalse },
-	{ &g_bot_buildLayout, "g_bot_buildLayout", "botbuild",  CVAR_NORESTART, 0, qfalse }
+	{ &g_bot_buildLayout, "g_bot_buildLayout", "botbuild",  CVAR_NORESTART, 0, qfalse },
+	{ &g_bot_localNav, "g_bot_localNav", "0", CVAR_LATCH, 0, qfalse }
 };
 
 static const size_t gameCvarTableSize = ARRAY_LEN( gameCvarTable );
@@ -2775,10 +2779,11 @@ Advances the non-player objects in the world
 */
 void G_RunFrame( int levelTime )
 {
-	int        i;
-	gentity_t  *ent;
-	int        msec;
-	static int ptime3000 = 0;
+	int           i;
+	gentity_t     *ent;
+	int           msec;
+	static int    ptime3000 = 0;
+	traceSource_t traceSource;
 
 	// if we are waiting for the level to restart, do nothing
 	if ( level.restarted )
@@ -2903,13 +2908,17 @@ void G_RunFrame( int levelTime )
 
 		if ( ent->s.eType == ET_MISSILE )
 		{
+			traceSource = trap_SetTraceSource( TRACE_SOURCE_WEAPONS );
 			G_RunMissile( ent );
+			trap_SetTraceSource( traceSource );
 			continue;
 		}
 
 		if ( ent->s.eType == ET_BUILDABLE )
 		{
+			traceSource = trap_SetTraceSource( TRACE_SOURCE_BUILDABLES );
 			G_BuildableThink( ent, msec );
+			trap_SetTraceSource( traceSource );
 			continue;
 		}
 
@@ -142,6 +142,9 @@ namespace BaseClustering {
 	void Debug();
 }
 
+// g_cm_world.c
+void              G_CM_EntityTree_f( void );
+
 // g_cmds.c
 void              G_StopFollowing( gentity_t *ent );
 void              G_StopFromFollowing( gentity_t *ent );
@@ -699,6 +699,7 @@ static const struct svcmd
 	{ "entityFire",         qfalse, Svcmd_EntityFire_f           },
 	{ "entityList",         qfalse, Svcmd_EntityList_f           },
 	{ "entityShow",         qfalse, Svcmd_EntityShow_f           },
+	{ "entityTree",         qfalse, G_CM_EntityTree_f            },
 	{ "evacuation",         qfalse, Svcmd_Evacuation_f           },
 	{ "forceTeam",          qfalse, Svcmd_ForceTeam_f            },
 	{ "game_memory",        qfalse, BG_MemoryInfo                },
@@ -52,6 +52,8 @@ int              trap_EntitiesInBox( const vec3_t mins, const vec3_t maxs, int *
 qboolean         trap_EntityContact( const vec3_t mins, const vec3_t maxs, const gentity_t *ent );
 qboolean         trap_EntityContactCapsule( const vec3_t mins, const vec3_t maxs, const gentity_t *ent );
 void             trap_Trace( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask , int skipmask);
+void             trap_TraceBatch( trace_t *results, int numTraces, const vec3_t *starts, const vec3_t *mins, const vec3_t *maxs, const vec3_t *ends, int passEntityNum, int contentmask, int skipmask );
+traceSource_t    trap_SetTraceSource( traceSource_t source );
 void             trap_TraceCapsule( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask );
 void             trap_TraceCapsuleNoEnts( trace_t *results, const vec3_t start, const vec3_t mins, const vec3_t maxs, const vec3_t end, int passEntityNum, int contentmask );
 int              trap_PointContents( const vec3_t point, int passEntityNum );
@@ -64,6 +66,9 @@ void             trap_SetConfigstringRestrictions( int num, const clientList_t *
 void             trap_SetUserinfo( int num, const char *buffer );
 void             trap_GetUserinfo( int num, char *buffer, int bufferSize );
 void             trap_GetServerinfo( char *buffer, int bufferSize );
+int              trap_ConfigstringGeneration( int num );
+int              trap_UserinfoGeneration( int num );
+int              trap_ServerinfoGeneration( void );
 void             trap_AdjustAreaPortalState( gentity_t *ent, qboolean open );
 qboolean         trap_AreasConnected( int area1, int area2 );
 int              trap_BotAllocateClient( void );
@@ -599,6 +599,30 @@ SHOTGUN
 ======================================================================
 */
 
+#define SHOTGUN_BATCH 16 // pellets traced at once
+
+/*
+================
+ShotgunDamaged
+
+Whether an earlier pellet of the batch damaged the entity
+================
+*/
+static qboolean ShotgunDamaged( const int *damaged, int numDamaged, int entityNum )
+{
+	int i;
+
+	for ( i = 0; i < numDamaged; i++ )
+	{
+		if ( damaged[ i ] == entityNum )
+		{
+			return qtrue;
+		}
+	}
+
+	return qfalse;
+}
+
 /*
 ================
 Keep this in sync with ShotgunPattern in CGAME!
@@ -606,11 +630,13 @@ Keep this in sync with ShotgunPattern in CGAME!
 */
 static void ShotgunPattern( vec3_t origin, vec3_t origin2, int seed, gentity_t *self )
 {
-	int       i;
+	int       i, j, numPellets;
+	int       damaged[ SHOTGUN_BATCH ], numDamaged;
 	float     r, u, a;
-	vec3_t    end;
+	vec3_t    starts[ SHOTGUN_BATCH ], ends[ SHOTGUN_BATCH ];
 	vec3_t    forward, right, up;
-	trace_t   tr;
+	trace_t   traces[ SHOTGUN_BATCH ];
+	trace_t   *tr;
 	gentity_t *traceEnt;
 
 	// derive the right and up vectors from the forward vector, because
@@ -619,28 +645,55 @@ static void ShotgunPattern( vec3_t origin, vec3_t origin2, int seed, gentity_t *
 	PerpendicularVector( right, forward );
 	CrossProduct( forward, right, up );
 
-	// generate the "random" spread pattern
-	for ( i = 0; i < SHOTGUN_PELLETS; i++ )
+	for ( i = 0; i < SHOTGUN_PELLETS; i += numPellets )
 	{
-		r = Q_crandom( &seed ) * M_PI;
-		a = Q_random( &seed ) * SHOTGUN_SPREAD * 16;
+		numPellets = std::min( SHOTGUN_PELLETS - i, SHOTGUN_BATCH );
+
+		// generate the "random" spread pattern
+		for ( j = 0; j < numPellets; j++ )
+		{
+			r = Q_crandom( &seed ) * M_PI;
+			a = Q_random( &seed ) * SHOTGUN_SPREAD * 16;
+
+			u = sin( r ) * a;
+			r = cos( r ) * a;
 
-		u = sin( r ) * a;
-		r = cos( r ) * a;
+			VectorCopy( origin, starts[ j ] );
+			VectorMA( origin, SHOTGUN_RANGE, forward, ends[ j ] );
+			VectorMA( ends[ j ], r, right, ends[ j ] );
+			VectorMA( ends[ j ], u, up, ends[ j ] );
+		}
 
-		VectorMA( origin, SHOTGUN_RANGE, forward, end );
-		VectorMA( end, r, right, end );
-		VectorMA( end, u, up, end );
+		// the pellets start together, so trace them together
+		trap_TraceBatch( traces, numPellets, starts, NULL, NULL, ends, self->s.number, MASK_SHOT, 0 );
 
-		trap_Trace( &tr, origin, NULL, NULL, end, self->s.number, MASK_SHOT, 0 );
-		traceEnt = &g_entities[ tr.entityNum ];
+		numDamaged = 0;
 
-		// do the damage
-		if ( !( tr.surfaceFlags & SURF_NOIMPACT ) )
+		for ( j = 0; j < numPellets; j++ )
 		{
-			if ( traceEnt->takedamage )
+			tr = &traces[ j ];
+
+			// an earlier pellet may have killed, moved or removed what this
+			// one hit, so trace it again the way it would have been alone
+			if ( ShotgunDamaged( damaged, numDamaged, tr->entityNum ) )
 			{
-				G_Damage( traceEnt, self, self, forward, tr.endpos, SHOTGUN_DMG, 0, MOD_SHOTGUN );
+				trap_Trace( tr, origin, NULL, NULL, ends[ j ], self->s.number, MASK_SHOT, 0 );
+			}
+
+			traceEnt = &g_entities[ tr->entityNum ];
+
+			// do the damage
+			if ( !( tr->surfaceFlags & SURF_NOIMPACT ) )
+			{
+				if ( traceEnt->takedamage )
+				{
+					G_Damage( traceEnt, self, self, forward, tr->endpos, SHOTGUN_DMG, 0, MOD_SHOTGUN );
+
+					if ( !ShotgunDamaged( damaged, numDamaged, tr->entityNum ) )
+					{
+						damaged[ numDamaged++ ] = tr->entityNum;
+					}
+				}
 			}
 		}
 	}
@@ -1796,6 +1849,8 @@ void G_CalcMuzzlePoint( gentity_t *self, vec3_t forward, vec3_t right, vec3_t up
 
 void G_FireWeapon( gentity_t *self, weapon_t weapon, weaponMode_t weaponMode )
 {
+	traceSource_t traceSource = trap_SetTraceSource( TRACE_SOURCE_WEAPONS );
+
 	// calculate muzzle
 	if ( self->client )
 	{
@@ -1959,6 +2014,7 @@ void G_FireWeapon( gentity_t *self, weapon_t weapon, weaponMode_t weaponMode )
 		}
 	}
 
+	trap_SetTraceSource( traceSource );
 }
 
 void G_FireUpgrade( gentity_t *self, upgrade_t upgrade )